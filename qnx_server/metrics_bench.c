@@ -0,0 +1,1500 @@
+/*
+ * metrics_bench - load and fan-out benchmark for metrics_server and metrics_json
+ *
+ * Opens WebSocket subscribers on /metrics, /full and /top, runs HTTP
+ * scrapers against metrics_json's / and /metrics, and samples the servers'
+ * RSS and thread count while it runs. Results are written as one JSON
+ * document so runs can be compared over time; a summary goes to stderr.
+ *
+ * Frame latency is fan-out latency: for each snapshot generation, how long
+ * after the first subscriber each other subscriber received it. The
+ * /metrics and /full subscribers use the delta stream so every frame
+ * carries its generation.
+ *
+ * With -F the servers started by -x run against fake shell commands
+ * (pidin, hogs, top, ...) written to a directory put first on their PATH,
+ * so runs are repeatable on a plain Linux box; combine with metrics_server
+ * -n to exercise the command path.
+ *
+ * With -W the benchmark also stands in for a remote-write receiver, so
+ * metrics_json -w can be pointed at it and its pushes checked and counted.
+ *
+ * -B N stands in for N ESP32 nodes on consecutive loopback ports, serving
+ * /metrics as the boards do; the last -S of them accept connections and
+ * never answer, like a board that has hung. Point metrics_json -g at them
+ * and scrape /fleet with -g to see what stalled nodes cost a scrape.
+ *
+ * -J N skips the load test and times JSON string escaping instead, on a
+ * generated pidin listing of N processes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "metrics_writer.h"
+
+#define DEFAULT_SERVER_PORT 9090
+#define DEFAULT_DURATION 10
+#define MAX_CLIENTS 1024
+#define MAX_TARGETS 2
+#define GEN_SLOTS 256
+#define READ_CHUNK 65536
+#define CONNECT_WAIT_MS 5000
+#define MAX_RECEIVER_CONNS 16
+#define RECEIVER_MAX_BODY (16 * 1024 * 1024)
+#define DEFAULT_NODE_PORT 9300
+#define MAX_NODES 64
+#define MAX_NODE_CONNS 128
+
+enum { STREAM_METRICS, STREAM_FULL, STREAM_TOP, STREAM_HTTP_ROOT, STREAM_HTTP_METRICS, STREAM_HTTP_FLEET, STREAM_COUNT };
+enum { CLIENT_CONNECTING, CLIENT_HANDSHAKE, CLIENT_OPEN, CLIENT_RESPONSE, CLIENT_DONE };
+
+static const char *stream_names[STREAM_COUNT] = {"/metrics", "/full", "/top", "/", "/metrics", "/fleet"};
+
+typedef struct {
+    double *values;
+    size_t count;
+    size_t cap;
+} Samples;
+
+/* First arrival of a generation, for fan-out latency */
+typedef struct {
+    unsigned long generation;
+    double first_ms;
+} GenSlot;
+
+typedef struct {
+    int clients;
+    long frames;
+    long long bytes;
+    long errors;
+    Samples latency;        /* WebSocket: fan-out latency; HTTP: request time */
+    GenSlot gens[GEN_SLOTS];
+} Stream;
+
+typedef struct {
+    int fd;
+    int stream;
+    int state;
+    char *buf;
+    size_t len;
+    size_t cap;
+    double started_ms;
+} Client;
+
+/* A server process sampled during the run */
+typedef struct {
+    const char *command;    /* NULL when attached with -k */
+    pid_t pid;
+    long rss_kb_start;
+    long rss_kb_max;
+    long rss_kb_end;
+    int threads_max;
+} Target;
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+} ReceiverConn;
+
+/* Remote-write stand-in */
+typedef struct {
+    int listen_fd;
+    int fail_percent;
+    long requests;
+    long failed;            /* Answered 503 on purpose */
+    long errors;            /* Could not be decoded */
+    long long series;
+    long long samples;
+    long long bytes;        /* Compressed request bodies */
+    long long newest_ms;    /* Newest sample timestamp of the current request */
+    Samples lag;            /* Wall time from newest sample to its delivery */
+    ReceiverConn conns[MAX_RECEIVER_CONNS];
+} Receiver;
+
+typedef struct {
+    int fd;
+    int node;
+    char buf[1024];
+    size_t len;
+} NodeConn;
+
+/* ESP32 node stand-ins */
+typedef struct {
+    int listen_fds[MAX_NODES];
+    int count;
+    int stalled;            /* The last this many never answer */
+    long answered;
+    long held;              /* Requests a stalled node sat on */
+    NodeConn conns[MAX_NODE_CONNS];
+} Nodes;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static void samples_add(Samples *s, double value) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        double *values = realloc(s->values, cap * sizeof(double));
+        
+        if (!values) return;
+        s->values = values;
+        s->cap = cap;
+    }
+    s->values[s->count++] = value;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double samples_quantile(const Samples *s, double q) {
+    if (s->count == 0) return 0.0;
+    return s->values[(size_t)((double)(s->count - 1) * q + 0.5)];
+}
+
+/* VmRSS and Threads from /proc/<pid>/status, -1 when unavailable */
+static void process_usage(pid_t pid, long *rss_kb, int *threads) {
+    char path[64], line[256];
+    FILE *fp;
+    
+    *rss_kb = -1;
+    *threads = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    fp = fopen(path, "r");
+    if (!fp) return;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) *rss_kb = atol(line + 6);
+        else if (strncmp(line, "Threads:", 8) == 0) *threads = atoi(line + 8);
+    }
+    fclose(fp);
+}
+
+static void target_sample(Target *target) {
+    long rss_kb;
+    int threads;
+    
+    process_usage(target->pid, &rss_kb, &threads);
+    if (rss_kb < 0) return;
+    if (target->rss_kb_start < 0) target->rss_kb_start = rss_kb;
+    if (rss_kb > target->rss_kb_max) target->rss_kb_max = rss_kb;
+    if (threads > target->threads_max) target->threads_max = threads;
+    target->rss_kb_end = rss_kb;
+}
+
+/* Processes created since boot (Linux /proc/stat), -1 when unavailable */
+static long long fork_count(void) {
+    char line[256];
+    long long count = -1;
+    FILE *fp = fopen("/proc/stat", "r");
+    
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "processes ", 10) == 0) {
+            count = atoll(line + 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+/*
+ * Fake command backend. Each script prints fixed output after an optional
+ * delay, so the servers' command path costs the same on every run.
+ */
+static const char *fake_scripts[][2] = {
+    {"pidin",
+     "case \"$1\" in\n"
+     "info) echo 'CPU:X86_64 Release:8.0.0 FreeMem:3500MB/4096MB BootTime:Jan 01 00:00:00 UTC 2025' ;;\n"
+     "*) echo '     pid tid name               prio STATE       Blocked'\n"
+     "   i=1; while [ $i -le 40 ]; do\n"
+     "     printf '%8d   1 proc/boot/fake%-6d 10r RECEIVE     1\\n' $i $i; i=$((i + 1)); done ;;\n"
+     "esac\n"},
+    {"hogs",
+     "echo '     PID           NAME  MSEC PIDS  SYS       MEMORY'\n"
+     "echo '       1        procnto   990  99%  99%   204k   1%'\n"},
+    {"top",
+     "while :; do\n"
+     "  echo '1 processes; 40 threads;'\n"
+     "  echo 'CPU states: 1.0% user, 1.0% kernel'\n"
+     "  echo '  PID   TID PRI STATE    HH:MM:SS    CPU  COMMAND'\n"
+     "  echo '    1     1  10 Run       0:00:01  1.00% procnto'\n"
+     "  sleep 1\n"
+     "done\n"},
+    {"showmem", "echo 'Total: 4096MB Used: 596MB Free: 3500MB'\n"},
+    {"df",
+     "echo 'Filesystem   Size  Used Avail Capacity  Mounted on'\n"
+     "echo '/dev/hd0t177 8.0G  1.2G  6.8G      15%  /'\n"},
+    {"netstat",
+     "echo 'Name  Mtu   Network       Address            Ipkts Ierrs    Opkts Oerrs Colls'\n"
+     "echo 'vtnet0 1500 <Link>       52:54:00:12:34:56  12345     0    23456     0     0'\n"},
+    {"ifconfig", "echo 'vtnet0: flags=8843<UP,BROADCAST,RUNNING,SIMPLEX,MULTICAST> mtu 1500'\n"},
+    {"uname", "echo 'QNX bench 8.0.0 2025/01/01-00:00:00EST x86_64'\n"},
+    {"uptime", "echo '12:00PM  up 1 day, 2:03, 1 user, load averages: 0.01, 0.02, 0.00'\n"},
+    {"mount", "echo '/dev/hd0t177 on / type qnx6'\n"},
+};
+
+static int write_fake_commands(const char *dir, int delay_ms) {
+    size_t i;
+    
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    for (i = 0; i < sizeof(fake_scripts) / sizeof(fake_scripts[0]); i++) {
+        char path[512];
+        FILE *fp;
+        
+        snprintf(path, sizeof(path), "%s/%s", dir, fake_scripts[i][0]);
+        fp = fopen(path, "w");
+        if (!fp) {
+            perror("fopen");
+            return -1;
+        }
+        fprintf(fp, "#!/bin/sh\n");
+        if (delay_ms > 0) fprintf(fp, "sleep %d.%03d\n", delay_ms / 1000, delay_ms % 1000);
+        fputs(fake_scripts[i][1], fp);
+        fclose(fp);
+        chmod(path, 0755);
+    }
+    return 0;
+}
+
+/* Run a server command in its own process group, with fake_dir first on PATH */
+static pid_t launch_server(const char *command, const char *fake_dir) {
+    pid_t pid = fork();
+    
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        char shell[1024];
+        
+        setpgid(0, 0);
+        if (fake_dir) {
+            char path[4096];
+            const char *old = getenv("PATH");
+            snprintf(path, sizeof(path), "%s:%s", fake_dir, old ? old : "/bin:/usr/bin");
+            setenv("PATH", path, 1);
+        }
+        /* Keep the server's logging off the results */
+        freopen("/dev/null", "w", stdout);
+        snprintf(shell, sizeof(shell), "exec %s", command);
+        execl("/bin/sh", "sh", "-c", shell, (char*)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    int i;
+    
+    kill(pid, SIGINT);
+    for (i = 0; i < 50; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) return;
+        usleep(100000);
+    }
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static int tcp_connect(const char *host, int port, int nonblocking) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    
+    if (fd == -1) return -1;
+    if (nonblocking) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Wait until something accepts connections on port */
+static int wait_for_port(const char *host, int port) {
+    double deadline = now_ms() + CONNECT_WAIT_MS;
+    
+    while (now_ms() < deadline && !interrupted) {
+        int fd = tcp_connect(host, port, 0);
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        usleep(50000);
+    }
+    return -1;
+}
+
+static int client_open(Client *c, const char *host, int port) {
+    c->fd = tcp_connect(host, port, 1);
+    c->state = c->fd >= 0 ? CLIENT_CONNECTING : CLIENT_DONE;
+    c->len = 0;
+    c->started_ms = now_ms();
+    return c->fd >= 0 ? 0 : -1;
+}
+
+static void client_send_request(Client *c, const char *host) {
+    char request[512];
+    int len;
+    
+    if (c->stream >= STREAM_HTTP_ROOT) {
+        len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                       stream_names[c->stream], host);
+        c->state = CLIENT_RESPONSE;
+    } else {
+        len = snprintf(request, sizeof(request),
+                       "GET %s%s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+                       stream_names[c->stream], c->stream == STREAM_TOP ? "" : "?delta=1", host);
+        c->state = CLIENT_HANDSHAKE;
+    }
+    if (send(c->fd, request, (size_t)len, 0) != len) c->state = CLIENT_DONE;
+}
+
+/* Generation of a key or delta frame, 0 if absent */
+static unsigned long frame_generation(const unsigned char *payload, size_t len) {
+    size_t i;
+    
+    for (i = 0; i + 6 < len && i < 128; i++) {
+        if (memcmp(payload + i, "\"gen\":", 6) == 0) return strtoul((const char*)payload + i + 6, NULL, 10);
+    }
+    return 0;
+}
+
+static void record_frame(Stream *stream, const unsigned char *payload, size_t len, double now) {
+    unsigned long generation = frame_generation(payload, len);
+    GenSlot *slot;
+    
+    stream->frames++;
+    stream->bytes += (long long)len;
+    if (generation == 0) return;
+    
+    slot = &stream->gens[generation % GEN_SLOTS];
+    if (slot->generation != generation) {
+        slot->generation = generation;
+        slot->first_ms = now;
+    }
+    samples_add(&stream->latency, now - slot->first_ms);
+}
+
+/* Consume complete WebSocket frames from the read buffer */
+static void parse_frames(Client *c, Stream *stream, double now) {
+    size_t offset = 0;
+    
+    if (c->state == CLIENT_HANDSHAKE) {
+        char *end = c->len >= 4 ? strstr(c->buf, "\r\n\r\n") : NULL;
+        
+        if (!end) return;
+        if (strncmp(c->buf, "HTTP/1.1 101", 12) != 0) {
+            stream->errors++;
+            c->state = CLIENT_DONE;
+            return;
+        }
+        c->state = CLIENT_OPEN;
+        offset = (size_t)(end + 4 - c->buf);
+    }
+    
+    for (;;) {
+        const unsigned char *p = (const unsigned char*)c->buf + offset;
+        size_t avail = c->len - offset, header = 2;
+        unsigned long long payload_len;
+        
+        if (avail < 2) break;
+        payload_len = p[1] & 0x7f;
+        if (payload_len == 126) {
+            if (avail < 4) break;
+            payload_len = ((unsigned long long)p[2] << 8) | p[3];
+            header = 4;
+        } else if (payload_len == 127) {
+            int i;
+            if (avail < 10) break;
+            payload_len = 0;
+            for (i = 0; i < 8; i++) payload_len = (payload_len << 8) | p[2 + i];
+            header = 10;
+        }
+        if (avail < header + payload_len) break;
+        
+        if ((p[0] & 0x0f) == 0x8) {
+            c->state = CLIENT_DONE;
+            break;
+        }
+        if ((p[0] & 0x0f) == 0x9) {
+            /* Answer the server's idle ping so long runs are not dropped (zero mask key) */
+            unsigned char pong[6 + 125] = {0x8A, 0x80, 0, 0, 0, 0};
+            
+            pong[1] |= (unsigned char)payload_len;
+            memcpy(pong + 6, p + header, (size_t)payload_len);
+            if (send(c->fd, pong, 6 + (size_t)payload_len, 0) < 0) c->state = CLIENT_DONE;
+        } else if ((p[0] & 0x0f) == 0x0) {
+            /* Rest of a fragmented message: the first fragment already counted it */
+            stream->bytes += (long long)payload_len;
+        } else if ((p[0] & 0x0f) != 0xA) {
+            record_frame(stream, p + header, (size_t)payload_len, now);
+        }
+        offset += header + (size_t)payload_len;
+    }
+    
+    memmove(c->buf, c->buf + offset, c->len - offset);
+    c->len -= offset;
+    c->buf[c->len] = '\0';
+}
+
+static int client_read(Client *c, Stream *stream) {
+    double now;
+    ssize_t n;
+    
+    if (c->cap - c->len < READ_CHUNK + 1) {
+        size_t cap = c->cap ? c->cap * 2 : READ_CHUNK * 2;
+        char *buf = realloc(c->buf, cap);
+        
+        if (!buf) return -1;
+        c->buf = buf;
+        c->cap = cap;
+    }
+    n = recv(c->fd, c->buf + c->len, READ_CHUNK, 0);
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    now = now_ms();
+    
+    if (c->state == CLIENT_RESPONSE) {
+        if (n == 0) {
+            /* Connection: close marks the end of the response */
+            if (c->len >= 12 && strncmp(c->buf, "HTTP/1.1 200", 12) == 0) {
+                stream->frames++;
+                stream->bytes += (long long)c->len;
+                samples_add(&stream->latency, now - c->started_ms);
+            } else {
+                stream->errors++;
+            }
+            return 1;
+        }
+        c->len += (size_t)n;
+        /* Only the status line is needed; drop the rest of the body */
+        if (c->len > 64) {
+            stream->bytes += (long long)c->len - 64;
+            c->len = 64;
+        }
+        return 0;
+    }
+    
+    if (n == 0) return -1;
+    c->len += (size_t)n;
+    c->buf[c->len] = '\0';
+    parse_frames(c, stream, now);
+    return c->state == CLIENT_DONE ? -1 : 0;
+}
+
+/*
+ * Remote-write stand-in receiver (-W). Decodes each snappy-compressed
+ * WriteRequest that metrics_json -w pushes, checks it is well formed and
+ * counts series and samples; -E answers a share of requests with 503 so
+ * the sender's retry path runs too.
+ */
+
+static double wall_ms(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static int receiver_listen(Receiver *r, int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    
+    r->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (r->listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(r->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(r->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(r->listen_fd, 16) == -1) {
+        perror("remote-write receiver");
+        close(r->listen_fd);
+        r->listen_fd = -1;
+        return -1;
+    }
+    fcntl(r->listen_fd, F_SETFL, fcntl(r->listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    return 0;
+}
+
+/* Snappy block format; returns the decoded length or -1 */
+static long snappy_decode(const unsigned char *in, size_t len, unsigned char **out) {
+    const unsigned char *end = in + len;
+    unsigned long long expected = 0;
+    unsigned char *buf;
+    size_t op = 0;
+    int shift = 0;
+    
+    *out = NULL;
+    while (in < end && shift < 35) {
+        expected |= (unsigned long long)(*in & 0x7f) << shift;
+        shift += 7;
+        if (!(*in++ & 0x80)) break;
+    }
+    if (expected > RECEIVER_MAX_BODY) return -1;
+    buf = malloc(expected ? (size_t)expected : 1);
+    if (!buf) return -1;
+    
+    while (in < end) {
+        unsigned int tag = *in++;
+        size_t n, offset, i;
+        
+        if ((tag & 3) == 0) {
+            n = tag >> 2;
+            if (n >= 60) {
+                size_t bytes = n - 59;
+                if ((size_t)(end - in) < bytes) goto bad;
+                for (n = 0, i = 0; i < bytes; i++) n |= (size_t)in[i] << (8 * i);
+                in += bytes;
+            }
+            n++;
+            if ((size_t)(end - in) < n || op + n > expected) goto bad;
+            memcpy(buf + op, in, n);
+            in += n;
+            op += n;
+            continue;
+        }
+        if ((tag & 3) == 1) {
+            if (in >= end) goto bad;
+            n = 4 + ((tag >> 2) & 7);
+            offset = (size_t)(tag >> 5) << 8 | *in++;
+        } else if ((tag & 3) == 2) {
+            if (end - in < 2) goto bad;
+            n = (tag >> 2) + 1;
+            offset = (size_t)in[0] | (size_t)in[1] << 8;
+            in += 2;
+        } else {
+            if (end - in < 4) goto bad;
+            n = (tag >> 2) + 1;
+            offset = (size_t)in[0] | (size_t)in[1] << 8 | (size_t)in[2] << 16 | (size_t)in[3] << 24;
+            in += 4;
+        }
+        if (offset == 0 || offset > op || op + n > expected) goto bad;
+        for (i = 0; i < n; i++, op++) buf[op] = buf[op - offset];
+    }
+    if (op != expected) goto bad;
+    *out = buf;
+    return (long)op;
+
+bad:
+    free(buf);
+    return -1;
+}
+
+static int pb_varint(const unsigned char **p, const unsigned char *end, unsigned long long *value) {
+    int shift = 0;
+    
+    *value = 0;
+    while (*p < end && shift < 64) {
+        unsigned char b = *(*p)++;
+        *value |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+        shift += 7;
+    }
+    return -1;
+}
+
+/* Next field of a message: its number, and for length-delimited ones the payload */
+static int pb_field(const unsigned char **p, const unsigned char *end, int *field,
+                    const unsigned char **data, size_t *len, unsigned long long *value) {
+    unsigned long long key;
+    
+    if (pb_varint(p, end, &key) != 0) return -1;
+    *field = (int)(key >> 3);
+    switch (key & 7) {
+    case 0:
+        return pb_varint(p, end, value);
+    case 1:
+        if (end - *p < 8) return -1;
+        *p += 8;
+        return 0;
+    case 2:
+        if (pb_varint(p, end, value) != 0 || (unsigned long long)(end - *p) < *value) return -1;
+        *data = *p;
+        *len = (size_t)*value;
+        *p += *len;
+        return 0;
+    case 5:
+        if (end - *p < 4) return -1;
+        *p += 4;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* One TimeSeries: labels sorted by name with a __name__, at least one sample */
+static int decode_series(Receiver *r, const unsigned char *p, size_t len) {
+    const unsigned char *end = p + len;
+    const unsigned char *prev_name = NULL;
+    size_t prev_len = 0;
+    int has_name = 0, samples = 0;
+    
+    while (p < end) {
+        const unsigned char *data = NULL, *q, *q_end;
+        size_t data_len = 0;
+        unsigned long long value;
+        int field;
+        
+        if (pb_field(&p, end, &field, &data, &data_len, &value) != 0) return -1;
+        if (!data) continue;
+        q = data;
+        q_end = data + data_len;
+        
+        if (field == 1) {
+            /* Label{name = 1, value = 2} */
+            while (q < q_end) {
+                const unsigned char *name = NULL;
+                size_t name_len = 0;
+                int label_field;
+                
+                if (pb_field(&q, q_end, &label_field, &name, &name_len, &value) != 0) return -1;
+                if (label_field != 1 || !name) continue;
+                if (prev_name) {
+                    size_t n = name_len < prev_len ? name_len : prev_len;
+                    int c = memcmp(prev_name, name, n);
+                    if (c > 0 || (c == 0 && prev_len >= name_len)) return -1;
+                }
+                if (name_len == 8 && memcmp(name, "__name__", 8) == 0) has_name = 1;
+                prev_name = name;
+                prev_len = name_len;
+            }
+        } else if (field == 2) {
+            /* Sample{value = 1 (double), timestamp = 2} */
+            while (q < q_end) {
+                const unsigned char *unused = NULL;
+                size_t unused_len;
+                int sample_field;
+                
+                if (pb_field(&q, q_end, &sample_field, &unused, &unused_len, &value) != 0) return -1;
+                if (sample_field == 2 && (long long)value > r->newest_ms) r->newest_ms = (long long)value;
+            }
+            samples++;
+        }
+    }
+    if (!has_name || samples == 0) return -1;
+    r->series++;
+    r->samples += samples;
+    return 0;
+}
+
+static int decode_write_request(Receiver *r, const unsigned char *body, size_t len) {
+    unsigned char *raw;
+    const unsigned char *p, *end;
+    long raw_len = snappy_decode(body, len, &raw);
+    
+    if (raw_len < 0) return -1;
+    r->newest_ms = 0;
+    for (p = raw, end = raw + raw_len; p < end;) {
+        const unsigned char *data = NULL;
+        size_t data_len = 0;
+        unsigned long long value;
+        int field;
+        
+        if (pb_field(&p, end, &field, &data, &data_len, &value) != 0 ||
+            (field == 1 && data && decode_series(r, data, data_len) != 0)) {
+            free(raw);
+            return -1;
+        }
+    }
+    free(raw);
+    if (r->newest_ms > 0) samples_add(&r->lag, wall_ms() - (double)r->newest_ms);
+    return 0;
+}
+
+/* Serve every complete request buffered on a connection; -1 closes it */
+static int receiver_handle(Receiver *r, ReceiverConn *c) {
+    for (;;) {
+        char *head_end, *length;
+        size_t head_len, body_len, total;
+        const char *reply;
+        
+        if (c->len == 0) return 0;
+        c->buf[c->len] = '\0';
+        head_end = strstr(c->buf, "\r\n\r\n");
+        if (!head_end) return c->len >= 8192 ? -1 : 0;
+        head_len = (size_t)(head_end + 4 - c->buf);
+        length = strstr(c->buf, "Content-Length:");
+        if (!length || length > head_end) return -1;
+        body_len = strtoul(length + 15, NULL, 10);
+        if (body_len > RECEIVER_MAX_BODY) return -1;
+        total = head_len + body_len;
+        if (c->len < total) return 0;
+        
+        r->requests++;
+        r->bytes += (long long)body_len;
+        if (r->fail_percent > 0 && rand() % 100 < r->fail_percent) {
+            r->failed++;
+            reply = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\n\r\n";
+        } else if (decode_write_request(r, (unsigned char*)c->buf + head_len, body_len) != 0) {
+            r->errors++;
+            reply = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        } else {
+            reply = "HTTP/1.1 204 No Content\r\n\r\n";
+        }
+        if (send(c->fd, reply, strlen(reply), 0) < 0) return -1;
+        
+        memmove(c->buf, c->buf + total, c->len - total);
+        c->len -= total;
+    }
+}
+
+static void receiver_poll(Receiver *r, struct pollfd *pfds) {
+    int i;
+    
+    if (pfds[0].revents & POLLIN) {
+        int fd;
+        
+        while ((fd = accept(r->listen_fd, NULL, NULL)) >= 0) {
+            for (i = 0; i < MAX_RECEIVER_CONNS && r->conns[i].fd >= 0; i++) {}
+            if (i == MAX_RECEIVER_CONNS) {
+                close(fd);
+                continue;
+            }
+            r->conns[i].fd = fd;
+            r->conns[i].len = 0;
+        }
+    }
+    
+    for (i = 0; i < MAX_RECEIVER_CONNS; i++) {
+        ReceiverConn *c = &r->conns[i];
+        ssize_t n;
+        
+        if (c->fd < 0 || !(pfds[1 + i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        if (c->cap - c->len < READ_CHUNK + 1) {
+            size_t cap = c->cap ? c->cap * 2 : 2 * READ_CHUNK;
+            char *buf = c->cap >= RECEIVER_MAX_BODY + 8192 ? NULL : realloc(c->buf, cap);
+            
+            if (!buf) {
+                close(c->fd);
+                c->fd = -1;
+                continue;
+            }
+            c->buf = buf;
+            c->cap = cap;
+        }
+        n = recv(c->fd, c->buf + c->len, c->cap - c->len - 1, 0);
+        if (n > 0) c->len += (size_t)n;
+        if (n <= 0 || receiver_handle(r, c) != 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+}
+
+/*
+ * ESP32 node stand-ins (-B). Each listens on its own loopback port and
+ * answers GET /metrics with the page Module_Async_Web_Server serves, then
+ * closes, as the boards do for HTTP/1.0. Stalled nodes read the request
+ * and hold the connection until the scraper gives up.
+ */
+
+static int nodes_listen(Nodes *n, int first_port) {
+    int i;
+    
+    for (i = 0; i < n->count; i++) {
+        struct sockaddr_in addr;
+        int one = 1;
+        
+        n->listen_fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (n->listen_fds[i] == -1) {
+            perror("socket");
+            return -1;
+        }
+        setsockopt(n->listen_fds[i], SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(first_port + i);
+        if (bind(n->listen_fds[i], (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+            listen(n->listen_fds[i], 16) == -1) {
+            perror("node stand-in");
+            return -1;
+        }
+        fcntl(n->listen_fds[i], F_SETFL, fcntl(n->listen_fds[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+    return 0;
+}
+
+static void node_answer(Nodes *n, NodeConn *c) {
+    char body[512], response[768];
+    double uptime = now_ms();
+    int body_len, len;
+    
+    body_len = snprintf(body, sizeof(body),
+                        "wifi_rssi_dbm %d\n"
+                        "heap_free_bytes %d\n"
+                        "heap_largest_block_bytes %d\n"
+                        "cpu_temperature_celsius %.2f\n"
+                        "uptime_seconds %.0f\n"
+                        "uptime_millis %.0f\n"
+                        "gpio_state %d\n"
+                        "reset_reason 1\n",
+                        -40 - c->node, 180000 - c->node * 512 - rand() % 4096, 110592 - c->node * 256,
+                        42.0 + c->node * 0.25 + (rand() % 100) / 100.0, uptime / 1000.0, uptime,
+                        (int)(n->answered & 1));
+    len = snprintf(response, sizeof(response),
+                   "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\n"
+                   "Content-Length: %d\r\nConnection: close\r\n\r\n%s", body_len, body);
+    send(c->fd, response, (size_t)len, 0);
+    n->answered++;
+}
+
+static void nodes_poll(Nodes *n, struct pollfd *pfds) {
+    int i, j;
+    
+    for (i = 0; i < n->count; i++) {
+        int fd;
+        
+        if (!(pfds[i].revents & POLLIN)) continue;
+        while ((fd = accept(n->listen_fds[i], NULL, NULL)) >= 0) {
+            for (j = 0; j < MAX_NODE_CONNS && n->conns[j].fd >= 0; j++) {}
+            if (j == MAX_NODE_CONNS) {
+                close(fd);
+                continue;
+            }
+            n->conns[j].fd = fd;
+            n->conns[j].node = i;
+            n->conns[j].len = 0;
+        }
+    }
+    
+    for (i = 0; i < MAX_NODE_CONNS; i++) {
+        NodeConn *c = &n->conns[i];
+        int stalled = c->node >= n->count - n->stalled;
+        ssize_t r;
+        
+        if (c->fd < 0 || !(pfds[n->count + i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        r = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1, 0);
+        if (r > 0) {
+            c->len += (size_t)r;
+            c->buf[c->len] = '\0';
+            if (!strstr(c->buf, "\r\n\r\n")) {
+                if (c->len < sizeof(c->buf) - 1) continue;
+            } else if (stalled) {
+                /* Keep reading (and discarding) until the scraper hangs up */
+                n->held++;
+                c->len = 0;
+                continue;
+            } else {
+                node_answer(n, c);
+            }
+        }
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/*
+ * Escape microbenchmark (-J). Escapes pidin-style process listings with
+ * the escaper generate_json used before the streaming writer (byte at a
+ * time into a scratch buffer, then copied into the body) and with the
+ * writer's scalar and vector scans.
+ */
+
+static char* pidin_text(int processes, size_t *len) {
+    static const char *names[] = {
+        "procnto-smp-instr", "devc-pty", "io-pkt-v6-hc", "devb-sdmmc-bcm2711", "qconn", "pipe",
+        "random", "slogger2", "dumper", "mqueue", "tracelogger", "metrics_json", "esh \"login\"", "fs\\cifs"
+    };
+    static const char *states[] = {"RECEIVE", "REPLY", "NANOSLEEP", "CONDVAR", "SIGWAITINFO", "RUNNING"};
+    size_t size = 128 + (size_t)processes * 4 * 96;
+    char *text = malloc(size);
+    int pid, tid;
+    
+    if (!text) return NULL;
+    *len = (size_t)snprintf(text, size, "     pid tid name               prio STATE       Blocked\n");
+    for (pid = 1; pid <= processes; pid++) {
+        for (tid = 1; tid <= 1 + pid % 4; tid++) {
+            *len += (size_t)snprintf(text + *len, size - *len, "%8d %3d /proc/boot/%-18s %3d%c %-11s %d\n",
+                                     pid * 4099, tid, names[pid % 14], 10 + tid, tid == 1 ? 'r' : 'f',
+                                     states[(pid + tid) % 6], pid % 7);
+        }
+    }
+    return text;
+}
+
+/* json_escape_string as it was */
+static void legacy_escape(const char *src, char *dest, size_t dest_size) {
+    size_t i, j = 0;
+    
+    for (i = 0; src[i] && j < dest_size - 2; i++) {
+        char c = src[i];
+        if (c == '"' || c == '\\') {
+            if (j < dest_size - 3) {
+                dest[j++] = '\\';
+                dest[j++] = c;
+            }
+        } else if (c == '\n') {
+            if (j < dest_size - 3) {
+                dest[j++] = '\\';
+                dest[j++] = 'n';
+            }
+        } else if (c == '\r') {
+            /* skip */
+        } else if (c == '\t') {
+            if (j < dest_size - 3) {
+                dest[j++] = '\\';
+                dest[j++] = 't';
+            }
+        } else if ((unsigned char)c >= 32) {
+            dest[j++] = c;
+        }
+    }
+    dest[j] = '\0';
+}
+
+/* Escape text repeatedly for about half a second; returns MB/s of input */
+static double escape_rate(int variant, const char *text, size_t len, char **result, size_t *result_len) {
+    size_t size = 2 * len + 64;
+    char *scratch = malloc(size);
+    char *body = malloc(size);
+    JsonWriter w;
+    double start = now_ms(), elapsed;
+    long rounds = 0;
+    
+    writer_init_memory(&w, size);
+    if (!scratch || !body || w.failed) {
+        free(scratch);
+        free(body);
+        free(writer_finish(&w, result_len));
+        *result = NULL;
+        return 0.0;
+    }
+    writer_force_scalar(variant == 1);
+    do {
+        if (variant == 0) {
+            /* Scratch escape, then the snprintf that copied it into the body */
+            legacy_escape(text, scratch, size);
+            *result_len = (size_t)snprintf(body, size, "\"%s\"", scratch);
+        } else {
+            w.len = 0;
+            writer_string(&w, text);
+        }
+        rounds++;
+        elapsed = now_ms() - start;
+    } while (elapsed < 500.0);
+    writer_force_scalar(0);
+    
+    if (variant == 0) {
+        *result = body;
+        free(writer_finish(&w, result_len));
+        *result_len = strlen(body);
+    } else {
+        *result = writer_finish(&w, result_len);
+        free(body);
+    }
+    free(scratch);
+    return (double)len * (double)rounds / (elapsed / 1000.0) / 1e6;
+}
+
+static int run_escape_bench(FILE *out, int processes) {
+    static const char *variants[] = {"legacy", "scalar", "vector"};
+    char *results[3];
+    size_t lengths[3];
+    double rates[3];
+    size_t len;
+    char *text = pidin_text(processes, &len);
+    int i, match;
+    
+    if (!text) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < 3; i++) rates[i] = escape_rate(i, text, len, &results[i], &lengths[i]);
+    match = results[0] && results[1] && results[2] && lengths[0] == lengths[1] && lengths[1] == lengths[2] &&
+            memcmp(results[0], results[1], lengths[0]) == 0 && memcmp(results[1], results[2], lengths[1]) == 0;
+    
+    fprintf(out, "{\"tool\":\"metrics_bench\",\"version\":1,\"time\":%llu,\"escape\":{\"processes\":%d,"
+            "\"input_bytes\":%zu,\"output_bytes\":%zu,\"vector\":\"%s\",\"outputs_match\":%s",
+            (unsigned long long)time(NULL), processes, len, lengths[2],
+#if defined(__SSE2__)
+            "sse2",
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+            "neon",
+#else
+            "none",
+#endif
+            match ? "true" : "false");
+    for (i = 0; i < 3; i++) fprintf(out, ",\"%s_mb_s\":%.1f", variants[i], rates[i]);
+    fprintf(out, "}}\n");
+    
+    fprintf(stderr, "escape %zu bytes of pidin output (%d processes): legacy %.1f MB/s, scalar %.1f MB/s, "
+            "vector %.1f MB/s%s\n", len, processes, rates[0], rates[1], rates[2], match ? "" : " (OUTPUTS DIFFER)");
+    for (i = 0; i < 3; i++) free(results[i]);
+    free(text);
+    return match ? 0 : 1;
+}
+
+static void print_latency(FILE *out, const Samples *s) {
+    fprintf(out, "{\"count\":%zu,\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+            s->count, samples_quantile(s, 0.5), samples_quantile(s, 0.99),
+            s->count ? s->values[s->count - 1] : 0.0);
+}
+
+static void print_results(FILE *out, Stream *streams, Target *targets, int num_targets, const Receiver *r,
+                          const Nodes *nodes, double elapsed_s, long long forks, const char *fake_dir, int fake_delay_ms) {
+    int i;
+    
+    fprintf(out, "{\"tool\":\"metrics_bench\",\"version\":1,\"time\":%llu,\"duration_s\":%.3f,",
+            (unsigned long long)time(NULL), elapsed_s);
+    fprintf(out, "\"fake_commands\":%s,\"fake_delay_ms\":%d,", fake_dir ? "true" : "false", fake_delay_ms);
+    
+    fprintf(out, "\"websocket\":{");
+    for (i = STREAM_METRICS; i <= STREAM_TOP; i++) {
+        Stream *s = &streams[i];
+        fprintf(out, "%s\"%s\":{\"clients\":%d,\"frames\":%ld,\"bytes\":%lld,\"errors\":%ld,"
+                "\"frames_per_s\":%.2f,\"fanout_latency_ms\":",
+                i > STREAM_METRICS ? "," : "", stream_names[i], s->clients, s->frames, s->bytes, s->errors,
+                elapsed_s > 0 ? (double)s->frames / elapsed_s : 0.0);
+        print_latency(out, &s->latency);
+        fprintf(out, "}");
+    }
+    
+    fprintf(out, "},\"http\":{");
+    for (i = STREAM_HTTP_ROOT; i <= STREAM_HTTP_FLEET; i++) {
+        Stream *s = &streams[i];
+        fprintf(out, "%s\"%s\":{\"clients\":%d,\"requests\":%ld,\"bytes\":%lld,\"errors\":%ld,"
+                "\"requests_per_s\":%.2f,\"latency_ms\":",
+                i > STREAM_HTTP_ROOT ? "," : "", stream_names[i], s->clients, s->frames, s->bytes, s->errors,
+                elapsed_s > 0 ? (double)s->frames / elapsed_s : 0.0);
+        print_latency(out, &s->latency);
+        fprintf(out, "}");
+    }
+    
+    fprintf(out, "},\"remote_write\":");
+    if (r->listen_fd >= 0) {
+        fprintf(out, "{\"requests\":%ld,\"injected_failures\":%ld,\"errors\":%ld,\"series\":%lld,"
+                "\"samples\":%lld,\"bytes\":%lld,\"samples_per_s\":%.2f,\"delivery_lag_ms\":",
+                r->requests, r->failed, r->errors, r->series, r->samples, r->bytes,
+                elapsed_s > 0 ? (double)r->samples / elapsed_s : 0.0);
+        print_latency(out, &r->lag);
+        fprintf(out, "}");
+    } else {
+        fprintf(out, "null");
+    }
+    
+    fprintf(out, ",\"nodes\":");
+    if (nodes->count > 0) {
+        fprintf(out, "{\"count\":%d,\"stalled\":%d,\"answered\":%ld,\"held\":%ld}",
+                nodes->count, nodes->stalled, nodes->answered, nodes->held);
+    } else {
+        fprintf(out, "null");
+    }
+    
+    fprintf(out, ",\"servers\":[");
+    for (i = 0; i < num_targets; i++) {
+        Target *t = &targets[i];
+        fprintf(out, "%s{\"pid\":%d,\"command\":", i ? "," : "", (int)t->pid);
+        if (t->command) {
+            const char *p;
+            fputc('"', out);
+            for (p = t->command; *p; p++) {
+                if (*p == '"' || *p == '\\') fputc('\\', out);
+                fputc(*p, out);
+            }
+            fputc('"', out);
+        } else {
+            fprintf(out, "null");
+        }
+        fprintf(out, ",\"rss_kb_start\":%ld,\"rss_kb_max\":%ld,\"rss_kb_end\":%ld,\"threads_max\":%d}",
+                t->rss_kb_start, t->rss_kb_max, t->rss_kb_end, t->threads_max);
+    }
+    fprintf(out, "],\"forks_per_s\":%.2f}\n", forks >= 0 && elapsed_s > 0 ? (double)forks / elapsed_s : -1.0);
+}
+
+static void print_summary(Stream *streams, Target *targets, int num_targets, const Receiver *r,
+                          const Nodes *nodes, double elapsed_s, long long forks) {
+    int i;
+    
+    fprintf(stderr, "%-10s %-9s %7s %9s %11s %9s %9s %9s\n",
+            "kind", "path", "clients", "frames", "bytes", "errors", "p50_ms", "p99_ms");
+    for (i = 0; i < STREAM_COUNT; i++) {
+        Stream *s = &streams[i];
+        if (s->clients == 0) continue;
+        fprintf(stderr, "%-10s %-9s %7d %9ld %11lld %9ld %9.2f %9.2f\n",
+                i <= STREAM_TOP ? "websocket" : "http", stream_names[i], s->clients, s->frames,
+                s->bytes, s->errors, samples_quantile(&s->latency, 0.5), samples_quantile(&s->latency, 0.99));
+    }
+    if (r->listen_fd >= 0) {
+        fprintf(stderr, "remote write: %ld requests (%ld failed on purpose, %ld bad), %lld series, "
+                "%lld samples, %lld bytes, lag p50 %.0f ms\n", r->requests, r->failed, r->errors,
+                r->series, r->samples, r->bytes, samples_quantile(&r->lag, 0.5));
+    }
+    if (nodes->count > 0) {
+        fprintf(stderr, "nodes: %d (%d stalled), %ld scrapes answered, %ld held\n",
+                nodes->count, nodes->stalled, nodes->answered, nodes->held);
+    }
+    for (i = 0; i < num_targets; i++) {
+        fprintf(stderr, "server pid %d: rss %ld -> %ld KB (max %ld), threads max %d\n",
+                (int)targets[i].pid, targets[i].rss_kb_start, targets[i].rss_kb_end,
+                targets[i].rss_kb_max, targets[i].threads_max);
+    }
+    if (forks >= 0) fprintf(stderr, "forks: %.2f/s\n", (double)forks / elapsed_s);
+}
+
+static void usage(const char *prog) {
+    printf("Load and fan-out benchmark for metrics_server and metrics_json\n\n");
+    printf("Usage: %s [options]\n\n", prog);
+    printf("  -H HOST   Server address (default 127.0.0.1)\n");
+    printf("  -p PORT   metrics_server port (default %d)\n", DEFAULT_SERVER_PORT);
+    printf("  -m N      WebSocket subscribers on /metrics\n");
+    printf("  -f N      WebSocket subscribers on /full\n");
+    printf("  -t N      WebSocket subscribers on /top\n");
+    printf("  -q PORT   metrics_json port for the HTTP scrapers\n");
+    printf("  -s N      HTTP scrapers, split between / and /metrics\n");
+    printf("  -g N      HTTP scrapers on /fleet\n");
+    printf("  -d SEC    Duration (default %d)\n", DEFAULT_DURATION);
+    printf("  -x CMD    Start a server with CMD and sample it (up to %d)\n", MAX_TARGETS);
+    printf("  -k PID    Sample an already running server\n");
+    printf("  -F DIR    Write fake QNX commands to DIR and put it first on -x servers' PATH\n");
+    printf("  -L MS     Delay of each fake command (default 0)\n");
+    printf("  -W PORT   Receive remote-write pushes on 127.0.0.1:PORT\n");
+    printf("  -E PCT    Answer PCT%% of pushes with 503 (default 0)\n");
+    printf("  -B N      Stand in for N ESP32 nodes on 127.0.0.1, consecutive ports from -P\n");
+    printf("  -P PORT   First stand-in node port (default %d)\n", DEFAULT_NODE_PORT);
+    printf("  -S N      The last N stand-in nodes never answer\n");
+    printf("  -J N      Only benchmark JSON escaping on pidin output for N processes\n");
+    printf("  -o FILE   Write the JSON results to FILE (default stdout)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    const char *output_path = NULL;
+    const char *fake_dir = NULL;
+    int server_port = DEFAULT_SERVER_PORT, json_port = 0;
+    int counts[STREAM_COUNT] = {0};
+    int scrapers = 0, duration = DEFAULT_DURATION, fake_delay_ms = 0;
+    Target targets[MAX_TARGETS];
+    int num_targets = 0;
+    Stream streams[STREAM_COUNT];
+    Client *clients;
+    struct pollfd *pfds;
+    int num_clients = 0, num_pfds, nodes_base;
+    int receiver_port = 0;
+    int escape_processes = 0;
+    int node_port = DEFAULT_NODE_PORT;
+    int fleet_scrapers = 0;
+    Receiver receiver;
+    Nodes nodes;
+    long long forks_start, forks_end;
+    double start, end, next_sample;
+    FILE *out = stdout;
+    int i;
+    
+    memset(streams, 0, sizeof(streams));
+    memset(targets, 0, sizeof(targets));
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.listen_fd = -1;
+    for (i = 0; i < MAX_RECEIVER_CONNS; i++) receiver.conns[i].fd = -1;
+    memset(&nodes, 0, sizeof(nodes));
+    for (i = 0; i < MAX_NODE_CONNS; i++) nodes.conns[i].fd = -1;
+    
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            counts[STREAM_METRICS] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            counts[STREAM_FULL] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            counts[STREAM_TOP] = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            json_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            scrapers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            duration = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "-k") == 0) && i + 1 < argc) {
+            if (num_targets == MAX_TARGETS) {
+                fprintf(stderr, "At most %d servers\n", MAX_TARGETS);
+                return 1;
+            }
+            if (argv[i][1] == 'x') targets[num_targets].command = argv[++i];
+            else targets[num_targets].pid = (pid_t)atoi(argv[++i]);
+            num_targets++;
+        } else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+            fake_dir = argv[++i];
+        } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+            fake_delay_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc) {
+            receiver_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc) {
+            receiver.fail_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            fleet_scrapers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            nodes.count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            node_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            nodes.stalled = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-J") == 0 && i + 1 < argc) {
+            escape_processes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else {
+            usage(argv[0]);
+            return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+    
+    if (escape_processes > 0) {
+        int rc;
+        
+        if (output_path) {
+            out = fopen(output_path, "w");
+            if (!out) {
+                perror("fopen");
+                return 1;
+            }
+        }
+        rc = run_escape_bench(out, escape_processes);
+        if (out != stdout) fclose(out);
+        return rc;
+    }
+    
+    if (json_port > 0) {
+        counts[STREAM_HTTP_ROOT] = (scrapers + 1) / 2;
+        counts[STREAM_HTTP_METRICS] = scrapers / 2;
+        counts[STREAM_HTTP_FLEET] = fleet_scrapers;
+    }
+    if (nodes.count < 0 || nodes.count > MAX_NODES) {
+        fprintf(stderr, "At most %d stand-in nodes\n", MAX_NODES);
+        return 1;
+    }
+    if (nodes.stalled < 0) nodes.stalled = 0;
+    if (nodes.stalled > nodes.count) nodes.stalled = nodes.count;
+    for (i = 0; i < STREAM_COUNT; i++) {
+        if (counts[i] < 0) counts[i] = 0;
+        num_clients += counts[i];
+    }
+    if ((num_clients == 0 && receiver_port <= 0 && nodes.count == 0) || num_clients > MAX_CLIENTS || duration <= 0) {
+        fprintf(stderr, "Need between 1 and %d clients (or -W or -B) and a positive duration\n", MAX_CLIENTS);
+        usage(argv[0]);
+        return 1;
+    }
+    
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (fake_dir && write_fake_commands(fake_dir, fake_delay_ms) != 0) return 1;
+    /* Listen before starting servers so their first push finds us */
+    if (receiver_port > 0 && receiver_listen(&receiver, receiver_port) != 0) return 1;
+    if (nodes.count > 0 && nodes_listen(&nodes, node_port) != 0) return 1;
+    
+    for (i = 0; i < num_targets; i++) {
+        targets[i].rss_kb_start = -1;
+        targets[i].rss_kb_max = -1;
+        targets[i].rss_kb_end = -1;
+        targets[i].threads_max = -1;
+        if (targets[i].command) {
+            targets[i].pid = launch_server(targets[i].command, fake_dir);
+            if (targets[i].pid < 0) return 1;
+        }
+    }
+    if ((counts[STREAM_METRICS] + counts[STREAM_FULL] + counts[STREAM_TOP] > 0 &&
+         wait_for_port(host, server_port) != 0) ||
+        (counts[STREAM_HTTP_ROOT] + counts[STREAM_HTTP_METRICS] + counts[STREAM_HTTP_FLEET] > 0 &&
+         wait_for_port(host, json_port) != 0)) {
+        fprintf(stderr, "Server not reachable\n");
+        for (i = 0; i < num_targets; i++) {
+            if (targets[i].command) stop_server(targets[i].pid);
+        }
+        return 1;
+    }
+    
+    clients = calloc((size_t)num_clients + 1, sizeof(Client));
+    pfds = calloc((size_t)num_clients + 1 + MAX_RECEIVER_CONNS + MAX_NODES + MAX_NODE_CONNS, sizeof(struct pollfd));
+    if (!clients || !pfds) {
+        perror("calloc");
+        return 1;
+    }
+    
+    forks_start = fork_count();
+    for (i = 0; i < num_targets; i++) target_sample(&targets[i]);
+    start = now_ms();
+    end = start + duration * 1000.0;
+    next_sample = start + 1000.0;
+    
+    num_clients = 0;
+    for (i = 0; i < STREAM_COUNT; i++) {
+        int n;
+        
+        streams[i].clients = counts[i];
+        for (n = 0; n < counts[i]; n++) {
+            Client *c = &clients[num_clients++];
+            c->stream = i;
+            if (client_open(c, host, i >= STREAM_HTTP_ROOT ? json_port : server_port) != 0) streams[i].errors++;
+        }
+    }
+    
+    while (!interrupted) {
+        double now = now_ms();
+        int ready;
+        
+        if (now >= end) break;
+        if (now >= next_sample) {
+            for (i = 0; i < num_targets; i++) target_sample(&targets[i]);
+            next_sample += 1000.0;
+        }
+        
+        for (i = 0; i < num_clients; i++) {
+            pfds[i].fd = clients[i].state == CLIENT_DONE ? -1 : clients[i].fd;
+            pfds[i].events = clients[i].state == CLIENT_CONNECTING ? POLLOUT : POLLIN;
+            pfds[i].revents = 0;
+        }
+        num_pfds = num_clients;
+        if (receiver.listen_fd >= 0) {
+            pfds[num_pfds].fd = receiver.listen_fd;
+            pfds[num_pfds].events = POLLIN;
+            pfds[num_pfds++].revents = 0;
+            for (i = 0; i < MAX_RECEIVER_CONNS; i++, num_pfds++) {
+                pfds[num_pfds].fd = receiver.conns[i].fd;
+                pfds[num_pfds].events = POLLIN;
+                pfds[num_pfds].revents = 0;
+            }
+        }
+        nodes_base = num_pfds;
+        if (nodes.count > 0) {
+            for (i = 0; i < nodes.count; i++, num_pfds++) {
+                pfds[num_pfds].fd = nodes.listen_fds[i];
+                pfds[num_pfds].events = POLLIN;
+                pfds[num_pfds].revents = 0;
+            }
+            for (i = 0; i < MAX_NODE_CONNS; i++, num_pfds++) {
+                pfds[num_pfds].fd = nodes.conns[i].fd;
+                pfds[num_pfds].events = POLLIN;
+                pfds[num_pfds].revents = 0;
+            }
+        }
+        ready = poll(pfds, (nfds_t)num_pfds, 100);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (ready <= 0) continue;
+        
+        if (receiver.listen_fd >= 0) receiver_poll(&receiver, pfds + num_clients);
+        if (nodes.count > 0) nodes_poll(&nodes, pfds + nodes_base);
+        for (i = 0; i < num_clients; i++) {
+            Client *c = &clients[i];
+            Stream *stream = &streams[c->stream];
+            int rc;
+            
+            if (pfds[i].fd < 0 || !pfds[i].revents) continue;
+            
+            if (c->state == CLIENT_CONNECTING) {
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+                if (err == 0) {
+                    client_send_request(c, host);
+                    continue;
+                }
+                rc = -1;
+            } else {
+                rc = client_read(c, stream);
+            }
+            if (rc == 0) continue;
+            
+            /* Scrapers loop; a WebSocket that fails or closes is finished */
+            if (rc < 0) stream->errors++;
+            close(c->fd);
+            c->fd = -1;
+            c->state = CLIENT_DONE;
+            if (c->stream >= STREAM_HTTP_ROOT && client_open(c, host, json_port) != 0) stream->errors++;
+        }
+    }
+    
+    end = now_ms();
+    forks_end = fork_count();
+    for (i = 0; i < num_targets; i++) target_sample(&targets[i]);
+    
+    for (i = 0; i < num_clients; i++) {
+        if (clients[i].fd >= 0) close(clients[i].fd);
+        free(clients[i].buf);
+    }
+    for (i = 0; i < num_targets; i++) {
+        if (targets[i].command) stop_server(targets[i].pid);
+    }
+    for (i = 0; i < STREAM_COUNT; i++) {
+        qsort(streams[i].latency.values, streams[i].latency.count, sizeof(double), compare_double);
+    }
+    qsort(receiver.lag.values, receiver.lag.count, sizeof(double), compare_double);
+    
+    if (output_path) {
+        out = fopen(output_path, "w");
+        if (!out) {
+            perror("fopen");
+            out = stdout;
+        }
+    }
+    print_results(out, streams, targets, num_targets, &receiver, &nodes, (end - start) / 1000.0,
+                  forks_start >= 0 && forks_end >= 0 ? forks_end - forks_start : -1, fake_dir, fake_delay_ms);
+    if (out != stdout) fclose(out);
+    print_summary(streams, targets, num_targets, &receiver, &nodes, (end - start) / 1000.0,
+                  forks_start >= 0 && forks_end >= 0 ? forks_end - forks_start : -1);
+    
+    for (i = 0; i < STREAM_COUNT; i++) free(streams[i].latency.values);
+    free(receiver.lag.values);
+    for (i = 0; i < MAX_RECEIVER_CONNS; i++) {
+        if (receiver.conns[i].fd >= 0) close(receiver.conns[i].fd);
+        free(receiver.conns[i].buf);
+    }
+    if (receiver.listen_fd >= 0) close(receiver.listen_fd);
+    for (i = 0; i < MAX_NODE_CONNS; i++) {
+        if (nodes.conns[i].fd >= 0) close(nodes.conns[i].fd);
+    }
+    for (i = 0; i < nodes.count; i++) close(nodes.listen_fds[i]);
+    free(pfds);
+    free(clients);
+    return 0;
+}
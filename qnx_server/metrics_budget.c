@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "metrics_budget.h"
+#include "metrics_time.h"
+#include "metrics_stats.h"
+
+#define BUDGET_SMOOTHING 0.3
+#define BUDGET_SHRINK 0.8
+#define BUDGET_GROW_MAX 2.0
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static double budget = 0;               /* Share of one core, 0 = unlimited */
+static int budget_base_ms = 1000;
+static double stretch = 1.0;
+static double usage = -1;               /* Smoothed share of one core, -1 before the first window */
+static int shedding = 0;
+static unsigned long long window_cpu_us = 0;
+static unsigned long long window_wall_us = 0;
+static StatsFamily *stat_interval;
+static StatsFamily *stat_used;
+static StatsFamily *stat_budget;
+static StatsFamily *stat_shedding;
+
+static unsigned long long timeval_us(const struct timeval *tv) {
+    return (unsigned long long)tv->tv_sec * 1000000ULL + (unsigned long long)tv->tv_usec;
+}
+
+/* User and system time of every thread, plus the commands run and reaped so far */
+static unsigned long long process_cpu_us(void) {
+    struct rusage self, children;
+    unsigned long long total = 0;
+    
+    if (getrusage(RUSAGE_SELF, &self) == 0) total += timeval_us(&self.ru_utime) + timeval_us(&self.ru_stime);
+    if (getrusage(RUSAGE_CHILDREN, &children) == 0) {
+        total += timeval_us(&children.ru_utime) + timeval_us(&children.ru_stime);
+    }
+    return total;
+}
+
+void budget_init(double budget_percent, int base_ms) {
+    budget = budget_percent > 0 ? budget_percent / 100.0 : 0;
+    budget_base_ms = base_ms > 0 ? base_ms : 1000;
+    window_cpu_us = process_cpu_us();
+    window_wall_us = monotonic_us();
+    
+    stat_interval = stats_family(STATS_GAUGE, "qnx_exporter_refresh_interval_milliseconds",
+        "Refresh interval in effect, stretched by the CPU budget governor", NULL, 0);
+    stat_used = stats_family(STATS_GAUGE, "qnx_exporter_cpu_used_permille",
+        "Smoothed CPU time of the exporter and the commands it runs, in 0.1% of one core", NULL, 0);
+    stat_budget = stats_family(STATS_GAUGE, "qnx_exporter_cpu_budget_permille",
+        "CPU budget (-B) in 0.1% of one core, 0 = unlimited", NULL, 0);
+    stat_shedding = stats_family(STATS_GAUGE, "qnx_exporter_cpu_budget_shedding",
+        "1 while optional sections are skipped to stay within the CPU budget", NULL, 0);
+    stats_set(stat_interval, NULL, budget_base_ms);
+    stats_set(stat_budget, NULL, (long long)(budget * 1000.0 + 0.5));
+}
+
+void budget_update(void) {
+    unsigned long long now, cpu;
+    double window, ratio;
+    
+    pthread_mutex_lock(&budget_lock);
+    now = monotonic_us();
+    if (now - window_wall_us < BUDGET_WINDOW_MS * 1000ULL) {
+        pthread_mutex_unlock(&budget_lock);
+        return;
+    }
+    cpu = process_cpu_us();
+    window = (double)(cpu - window_cpu_us) / (double)(now - window_wall_us);
+    window_cpu_us = cpu;
+    window_wall_us = now;
+    usage = usage < 0 ? window : usage * (1.0 - BUDGET_SMOOTHING) + window * BUDGET_SMOOTHING;
+    
+    if (budget > 0) {
+        ratio = usage / budget;
+        if (ratio > 1.0) {
+            /* Already as slow as allowed and still over: drop optional work */
+            if (stretch >= BUDGET_MAX_STRETCH) shedding = 1;
+            stretch *= ratio < BUDGET_GROW_MAX ? ratio : BUDGET_GROW_MAX;
+            if (stretch > BUDGET_MAX_STRETCH) stretch = BUDGET_MAX_STRETCH;
+        } else if (shedding) {
+            if (ratio < 0.5) shedding = 0;
+        } else if (ratio < 0.7) {
+            stretch *= BUDGET_SHRINK;
+            if (stretch < 1.0) stretch = 1.0;
+        }
+    }
+    
+    stats_set(stat_interval, NULL, (long long)(budget_base_ms * stretch));
+    stats_set(stat_used, NULL, (long long)(usage * 1000.0 + 0.5));
+    stats_set(stat_shedding, NULL, shedding);
+    pthread_mutex_unlock(&budget_lock);
+}
+
+int budget_interval_ms(int interval_ms) {
+    double factor;
+    
+    pthread_mutex_lock(&budget_lock);
+    factor = stretch;
+    pthread_mutex_unlock(&budget_lock);
+    return (int)(interval_ms * factor);
+}
+
+int budget_shedding(void) {
+    return __atomic_load_n(&shedding, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,34 @@
+#ifndef METRICS_BUDGET_H
+#define METRICS_BUDGET_H
+
+/*
+ * CPU budget governor.
+ *
+ * Keeps the exporter from becoming one of the CPU hogs it reports. After
+ * each collection budget_update() measures the CPU time the process used
+ * since the last window (its own threads plus the commands it ran,
+ * through getrusage) against the wall time, smoothed. While that is over
+ * the budget the refresh interval is stretched, up to BUDGET_MAX_STRETCH
+ * times the configured one; if it is still over at the longest interval,
+ * optional work is shed until usage drops to half the budget. Under 70%
+ * of the budget the interval shrinks back step by step.
+ *
+ * The usage is always measured and exported; a budget of 0 only measures.
+ */
+
+#define BUDGET_MAX_STRETCH 16
+#define BUDGET_WINDOW_MS 1000
+
+/* budget_percent of one core (1 = 1%), 0 = unlimited; base_ms is the configured refresh interval */
+void budget_init(double budget_percent, int base_ms);
+
+/* Account the CPU used since the last window and adapt; call after each collection */
+void budget_update(void);
+
+/* interval_ms stretched by the governor */
+int budget_interval_ms(int interval_ms);
+
+/* Non-zero while optional work should be skipped */
+int budget_shedding(void);
+
+#endif
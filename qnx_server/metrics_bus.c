@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics_bus.h"
+#include "metrics_time.h"
+#include "metrics_stats.h"
+
+#define BUS_NAME_MAX 64
+#define BUS_READ_TRIES 3
+#define BUS_REMAP_MS 2000
+#define BUS_STALE_INTERVALS 3
+
+typedef int (*BusCopy)(const BusSnapshot *snap, void *out, int max);
+
+/* Publisher */
+static BusSegment *publish_segment = NULL;
+static char publish_name[BUS_NAME_MAX];
+static int publish_interval_ms = BUS_DEFAULT_INTERVAL_MS;
+static int publish_running = 0;
+static pthread_t publish_thread;
+static StatsFamily *stat_publish_seconds;
+
+/* Reader */
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static BusSegment *reader_segment = NULL;
+static char reader_name[BUS_NAME_MAX];
+static dev_t reader_dev;
+static ino_t reader_ino;
+static unsigned long long reader_next_map_ms = 0;
+static StatsFamily *stat_reads;
+
+/* Collect into the slot readers are not directed to, then make it the latest */
+static void bus_publish(BusSegment *seg) {
+    unsigned int seq = seg->seq;
+    BusSnapshot *snap = &seg->slots[(seq + 1) & 1];
+    struct timespec start, end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    __atomic_store_n(&snap->lock, snap->lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
+    snap->generation = (unsigned long long)seq + 1;
+    snap->have_system = collect_local_system(&snap->system) == 0;
+    snap->have_memory = collect_local_memory(&snap->memory) == 0;
+    snap->process_count = collect_local_processes(snap->processes, BUS_MAX_PROCS);
+    snap->disk_count = collect_local_disks(snap->disks, BUS_MAX_DISKS);
+    snap->iface_count = collect_local_interfaces(snap->ifaces, BUS_MAX_IFACES);
+    snap->taken_ms = monotonic_ms();
+    
+    __atomic_store_n(&snap->lock, snap->lock + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELEASE);
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_observe(stat_publish_seconds, NULL,
+                  (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static void* publish_loop(void *arg) {
+    struct timespec delay;
+    
+    (void)arg;
+    delay.tv_sec = publish_interval_ms / 1000;
+    delay.tv_nsec = (long)(publish_interval_ms % 1000) * 1000000L;
+    while (__atomic_load_n(&publish_running, __ATOMIC_RELAXED)) {
+        bus_publish(publish_segment);
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+int bus_publish_start(const char *name, int interval_ms) {
+    BusSegment *seg;
+    int fd;
+    
+    if (strlen(name) >= BUS_NAME_MAX) {
+        fprintf(stderr, "Bus name too long: %s\n", name);
+        return -1;
+    }
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(name);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(BusSegment)) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    seg = mmap(NULL, sizeof(BusSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    
+    /* A segment left by a previous publisher is reset; readers skip it until magic is back */
+    __atomic_store_n(&seg->magic, 0, __ATOMIC_RELEASE);
+    memset(&seg->version, 0, sizeof(BusSegment) - sizeof(seg->magic));
+    seg->version = BUS_VERSION;
+    seg->size = sizeof(BusSegment);
+    seg->publisher_pid = (int)getpid();
+    seg->interval_ms = interval_ms > 0 ? interval_ms : BUS_DEFAULT_INTERVAL_MS;
+    __atomic_store_n(&seg->magic, BUS_MAGIC, __ATOMIC_RELEASE);
+    
+    snprintf(publish_name, sizeof(publish_name), "%s", name);
+    publish_interval_ms = seg->interval_ms;
+    publish_segment = seg;
+    stat_publish_seconds = stats_histogram("qnx_exporter_bus_publish_seconds",
+        "Time to collect and publish one snapshot to the shared-memory bus", NULL, 0,
+        stats_seconds_buckets, stats_seconds_buckets_count);
+    
+    /* The first snapshot is there before anyone is told about the bus */
+    bus_publish(seg);
+    publish_running = 1;
+    if (pthread_create(&publish_thread, NULL, publish_loop, NULL) != 0) {
+        perror("pthread_create");
+        publish_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void bus_publish_stop(void) {
+    if (!publish_segment) return;
+    if (__atomic_exchange_n(&publish_running, 0, __ATOMIC_RELAXED)) pthread_join(publish_thread, NULL);
+    shm_unlink(publish_name);
+}
+
+static int segment_usable(const BusSegment *seg) {
+    return __atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) == BUS_MAGIC &&
+           seg->version == BUS_VERSION && seg->size == sizeof(BusSegment) && seg->interval_ms > 0;
+}
+
+static int segment_fresh(const BusSegment *seg) {
+    unsigned int seq;
+    unsigned long long taken;
+    
+    if (!segment_usable(seg)) return 0;
+    seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0) return 0;
+    taken = seg->slots[seq & 1].taken_ms;
+    return (unsigned long long)monotonic_ms() <= taken + (unsigned long long)seg->interval_ms * BUS_STALE_INTERVALS;
+}
+
+/* Map the named segment unless it is the one already mapped; caller holds reader_lock */
+static void segment_map(void) {
+    struct stat st;
+    BusSegment *seg;
+    int fd;
+    
+    fd = shm_open(reader_name, O_RDONLY, 0);
+    if (fd < 0) return;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BusSegment) ||
+        (reader_segment && st.st_dev == reader_dev && st.st_ino == reader_ino)) {
+        close(fd);
+        return;
+    }
+    seg = mmap(NULL, sizeof(BusSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) return;
+    
+    /* The old mapping is left in place: another thread may still be reading it */
+    reader_dev = st.st_dev;
+    reader_ino = st.st_ino;
+    __atomic_store_n(&reader_segment, seg, __ATOMIC_RELEASE);
+}
+
+/* The mapped segment if it is fresh, after trying to (re)map it every BUS_REMAP_MS */
+static BusSegment* bus_segment(void) {
+    BusSegment *seg = __atomic_load_n(&reader_segment, __ATOMIC_ACQUIRE);
+    unsigned long long now;
+    
+    if (seg && segment_fresh(seg)) return seg;
+    
+    now = monotonic_ms();
+    pthread_mutex_lock(&reader_lock);
+    if (now >= reader_next_map_ms) {
+        reader_next_map_ms = now + BUS_REMAP_MS;
+        segment_map();
+    }
+    seg = reader_segment;
+    pthread_mutex_unlock(&reader_lock);
+    return seg && segment_fresh(seg) ? seg : NULL;
+}
+
+int bus_attach(const char *name) {
+    if (strlen(name) >= BUS_NAME_MAX) {
+        fprintf(stderr, "Bus name too long: %s\n", name);
+        return -1;
+    }
+    snprintf(reader_name, sizeof(reader_name), "%s", name);
+    stat_reads = stats_family(STATS_COUNTER, "qnx_exporter_bus_reads_total",
+        "Collector reads served from the shared-memory bus (hit), retried after a concurrent publish "
+        "(retry), or collected locally because no fresh snapshot was published (miss)", "result", 3);
+    
+    pthread_mutex_lock(&reader_lock);
+    segment_map();
+    reader_next_map_ms = monotonic_ms() + BUS_REMAP_MS;
+    pthread_mutex_unlock(&reader_lock);
+    return 0;
+}
+
+int bus_attached(void) {
+    return reader_name[0] != '\0';
+}
+
+const BusSnapshot* bus_begin(int previous, unsigned int *token) {
+    BusSegment *seg;
+    const BusSnapshot *snap;
+    unsigned int seq;
+    
+    if (!reader_name[0] || !(seg = bus_segment())) return NULL;
+    seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+    if (previous && seq < 2) return NULL;
+    snap = &seg->slots[(seq - (previous ? 1 : 0)) & 1];
+    *token = __atomic_load_n(&snap->lock, __ATOMIC_ACQUIRE);
+    return *token & 1 ? NULL : snap;
+}
+
+int bus_valid(const BusSnapshot *snap, unsigned int token) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&snap->lock, __ATOMIC_RELAXED) == token;
+}
+
+/* Read one section through copy, retrying while the publisher overwrites the slot */
+static int bus_read(BusCopy copy, void *out, int max) {
+    int tries;
+    
+    if (!reader_name[0]) return -1;
+    for (tries = 0; tries < BUS_READ_TRIES; tries++) {
+        unsigned int token;
+        const BusSnapshot *snap = bus_begin(0, &token);
+        int result;
+        
+        if (!snap) break;
+        result = copy(snap, out, max);
+        if (bus_valid(snap, token)) {
+            stats_add(stat_reads, result >= 0 ? "hit" : "miss", 1);
+            return result;
+        }
+        stats_add(stat_reads, "retry", 1);
+    }
+    stats_add(stat_reads, "miss", 1);
+    return -1;
+}
+
+/* A count read from a slot being overwritten can be anything; bus_valid() catches it later */
+static int clamp_count(int count, int max, int capacity) {
+    if (count < 0) return -1;
+    if (count > capacity) count = capacity;
+    return count < max ? count : max;
+}
+
+static int copy_processes(const BusSnapshot *snap, void *out, int max) {
+    int count = clamp_count(snap->process_count, max, BUS_MAX_PROCS);
+    
+    if (count > 0) memcpy(out, snap->processes, sizeof(ProcInfo) * (size_t)count);
+    return count;
+}
+
+static int copy_process_count(const BusSnapshot *snap, void *out, int max) {
+    (void)out; (void)max;
+    return snap->process_count;
+}
+
+static int copy_memory(const BusSnapshot *snap, void *out, int max) {
+    (void)max;
+    if (!snap->have_memory) return -1;
+    memcpy(out, &snap->memory, sizeof(MemInfo));
+    return 0;
+}
+
+static int copy_disks(const BusSnapshot *snap, void *out, int max) {
+    int count = clamp_count(snap->disk_count, max, BUS_MAX_DISKS);
+    
+    if (count > 0) memcpy(out, snap->disks, sizeof(DiskInfo) * (size_t)count);
+    return count;
+}
+
+static int copy_interfaces(const BusSnapshot *snap, void *out, int max) {
+    int count = clamp_count(snap->iface_count, max, BUS_MAX_IFACES);
+    
+    if (count > 0) memcpy(out, snap->ifaces, sizeof(IfaceInfo) * (size_t)count);
+    return count;
+}
+
+static int copy_system(const BusSnapshot *snap, void *out, int max) {
+    (void)max;
+    if (!snap->have_system) return -1;
+    memcpy(out, &snap->system, sizeof(SysInfo));
+    return 0;
+}
+
+int bus_processes(ProcInfo *procs, int max) {
+    return bus_read(copy_processes, procs, max);
+}
+
+int bus_process_count(void) {
+    return bus_read(copy_process_count, NULL, 0);
+}
+
+int bus_memory(MemInfo *mem) {
+    return bus_read(copy_memory, mem, 1);
+}
+
+int bus_disks(DiskInfo *disks, int max) {
+    return bus_read(copy_disks, disks, max);
+}
+
+int bus_interfaces(IfaceInfo *ifaces, int max) {
+    return bus_read(copy_interfaces, ifaces, max);
+}
+
+int bus_system(SysInfo *sys) {
+    return bus_read(copy_system, sys, 1);
+}
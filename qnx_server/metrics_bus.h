@@ -0,0 +1,86 @@
+#ifndef METRICS_BUS_H
+#define METRICS_BUS_H
+
+#include "metrics_collect.h"
+
+/*
+ * Shared-memory snapshot bus.
+ *
+ * One process collects processes, memory, disks, interfaces and system
+ * info once per interval and publishes them into a POSIX shared memory
+ * segment (metrics_server -P NAME); any exporter on the node maps it
+ * read-only (metrics_json -s NAME) and its collectors return the latest
+ * snapshot instead of walking /proc again.
+ *
+ * The segment is a versioned header and two snapshot slots. Each publish
+ * fills the slot that is not the latest, in place, then makes it the
+ * latest, so a reader always has one full interval to use a slot. Every
+ * slot is a seqlock: its lock is odd while the publisher writes into it,
+ * and a reader checks that the lock is unchanged after reading, retrying
+ * otherwise. Readers never write to the segment and never block the
+ * publisher. Each snapshot carries its generation, so a reader that has
+ * already built on it can skip it.
+ *
+ * A snapshot older than three intervals (the publisher died or stalled)
+ * is ignored and the collectors fall back to reading the system; a
+ * segment from another layout version is ignored the same way.
+ */
+
+#define BUS_MAGIC 0x53554251u       /* "QBUS" */
+#define BUS_VERSION 1
+#define BUS_MAX_PROCS 2048
+#define BUS_MAX_DISKS 32
+#define BUS_MAX_IFACES 32
+#define BUS_DEFAULT_INTERVAL_MS 1000
+
+typedef struct {
+    unsigned int lock;              /* Seqlock: odd while the publisher writes */
+    unsigned long long generation;  /* Publish number, 1 for the first */
+    unsigned long long taken_ms;    /* CLOCK_MONOTONIC, the same in every process */
+    int have_system;
+    int have_memory;
+    int process_count;              /* -1 when the collector failed */
+    int disk_count;
+    int iface_count;
+    SysInfo system;
+    MemInfo memory;
+    ProcInfo processes[BUS_MAX_PROCS];
+    DiskInfo disks[BUS_MAX_DISKS];
+    IfaceInfo ifaces[BUS_MAX_IFACES];
+} BusSnapshot;
+
+typedef struct {
+    unsigned int magic;             /* BUS_MAGIC once the header is complete */
+    unsigned int version;           /* BUS_VERSION: the layout of everything here */
+    unsigned int size;              /* sizeof(BusSegment) of the publisher */
+    int publisher_pid;
+    int interval_ms;
+    unsigned int seq;               /* Publishes so far; slots[seq & 1] is the latest */
+    BusSnapshot slots[2];
+} BusSegment;
+
+/* Create the segment (a name like /qnx-metrics) and publish into it every interval_ms */
+int bus_publish_start(const char *name, int interval_ms);
+void bus_publish_stop(void);
+
+/* Read from the segment; it may appear later, and is mapped again if its publisher restarts */
+int bus_attach(const char *name);
+int bus_attached(void);
+
+/*
+ * The latest fresh snapshot, or the one before it if previous is set; NULL
+ * if there is none. Use it in place, then check bus_valid(): 0 means the
+ * publisher overwrote it meanwhile and what was read must be discarded.
+ */
+const BusSnapshot* bus_begin(int previous, unsigned int *token);
+int bus_valid(const BusSnapshot *snap, unsigned int token);
+
+/* The collectors' bus side: the same results, or -1 with no fresh snapshot */
+int bus_processes(ProcInfo *procs, int max);
+int bus_process_count(void);
+int bus_memory(MemInfo *mem);
+int bus_disks(DiskInfo *disks, int max);
+int bus_interfaces(IfaceInfo *ifaces, int max);
+int bus_system(SysInfo *sys);
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "metrics_cache.h"
+#include "metrics_time.h"
+#include "metrics_budget.h"
+
+#define GZIP_LEVEL 6
+#define GZIP_PIECE 16384
+
+typedef struct {
+    BodyCache **caches;
+    int count;
+    int interval_ms;
+    int idle_ms;
+} Refresher;
+
+int body_cache_init(BodyCache *cache, const char *name, int (*build)(char *out, size_t size), size_t build_size) {
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->build = build;
+    cache->build_size = build_size;
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) return -1;
+    if (pthread_cond_init(&cache->built, NULL) != 0) {
+        pthread_mutex_destroy(&cache->lock);
+        return -1;
+    }
+    return 0;
+}
+
+int body_cache_init_alloc(BodyCache *cache, const char *name, char* (*build)(size_t *len)) {
+    if (body_cache_init(cache, name, NULL, 0) != 0) return -1;
+    cache->build_alloc = build;
+    return 0;
+}
+
+void body_release(CachedBody *body) {
+    if (!body || __atomic_sub_fetch(&body->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (body->gzip) {
+        free(body->gzip->data);
+        free(body->gzip);
+    }
+    free(body->data);
+    free(body);
+}
+
+/* Run the generator into a new body; called without the cache lock */
+static CachedBody* body_build(BodyCache *cache) {
+    CachedBody *body = calloc(1, sizeof(CachedBody));
+    unsigned long long hash = 1469598103934665603ULL;
+    char *shrunk;
+    size_t i;
+    int len;
+    
+    if (!body) return NULL;
+    body->built_wall_ms = wall_ms();
+    if (cache->build_alloc) {
+        body->data = cache->build_alloc(&body->len);
+        if (!body->data) {
+            free(body);
+            return NULL;
+        }
+    } else {
+        body->data = malloc(cache->build_size);
+        if (!body->data) {
+            free(body);
+            return NULL;
+        }
+        
+        len = cache->build(body->data, cache->build_size);
+        if (len < 0) {
+            free(body->data);
+            free(body);
+            return NULL;
+        }
+        /* Generators report what snprintf wanted; keep what actually fit */
+        body->len = (size_t)len < cache->build_size ? (size_t)len : cache->build_size - 1;
+        shrunk = realloc(body->data, body->len + 1);
+        if (shrunk) body->data = shrunk;
+    }
+    
+    /* FNV-1a over the body; equal bodies get equal ETags across rebuilds */
+    for (i = 0; i < body->len; i++) {
+        hash ^= (unsigned char)body->data[i];
+        hash *= 1099511628211ULL;
+    }
+    snprintf(body->etag, sizeof(body->etag), "\"%016llx\"", hash);
+    snprintf(body->gzip_etag, sizeof(body->gzip_etag), "\"%016llx-gz\"", hash);
+    
+    body->refcount = 1;
+    body->built_ms = monotonic_ms();
+    return body;
+}
+
+/* Build and publish; called with the lock held and building set, drops the lock while building */
+static void cache_build_locked(BodyCache *cache) {
+    CachedBody *body;
+    
+    pthread_mutex_unlock(&cache->lock);
+    body = body_build(cache);
+    /* Every build is accounted, whether the refresher or a request ran it */
+    budget_update();
+    pthread_mutex_lock(&cache->lock);
+    
+    if (body) {
+        body->generation = ++cache->generation;
+        body_release(cache->current);
+        cache->current = body;
+    }
+    cache->building = 0;
+    cache->builds++;
+    pthread_cond_broadcast(&cache->built);
+}
+
+static void* rebuild_thread(void *arg) {
+    BodyCache *cache = arg;
+    
+    pthread_mutex_lock(&cache->lock);
+    cache_build_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+/* Start a background rebuild; called with the lock held and no build in flight */
+static void cache_rebuild_async_locked(BodyCache *cache) {
+    pthread_t thread;
+    
+    cache->building = 1;
+    if (pthread_create(&thread, NULL, rebuild_thread, cache) != 0) {
+        /* No thread to spare: build on this one instead */
+        cache_build_locked(cache);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static CachedBody* cache_get(BodyCache *cache, int max_age_ms, int *result, int wait) {
+    unsigned long long now = monotonic_ms();
+    CachedBody *body;
+    int stale;
+    
+    pthread_mutex_lock(&cache->lock);
+    cache->requested_ms = now;
+    *result = CACHE_HIT;
+    stale = !cache->current || max_age_ms <= 0 || now - cache->current->built_ms > (unsigned long long)max_age_ms;
+    
+    if (stale && cache->current && max_age_ms > 0 && !wait) {
+        /* Serve what there is and let the rebuild run behind it */
+        *result = CACHE_STALE;
+        if (!cache->building) cache_rebuild_async_locked(cache);
+    } else if (stale) {
+        if (cache->building) {
+            /* Coalesce onto the build in flight */
+            unsigned long builds = cache->builds;
+            
+            *result = CACHE_WAITED;
+            while (cache->building && cache->builds == builds) {
+                pthread_cond_wait(&cache->built, &cache->lock);
+            }
+        } else {
+            *result = CACHE_BUILT;
+            cache->building = 1;
+            cache_build_locked(cache);
+        }
+    }
+    
+    body = cache->current;
+    if (body) __atomic_add_fetch(&body->refcount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache->lock);
+    return body;
+}
+
+CachedBody* body_cache_get(BodyCache *cache, int max_age_ms, int *result) {
+    return cache_get(cache, max_age_ms, result, 0);
+}
+
+CachedBody* body_cache_get_fresh(BodyCache *cache, int max_age_ms) {
+    int result;
+    
+    return cache_get(cache, max_age_ms, &result, 1);
+}
+
+int body_gzip(CachedBody *body, BodySink sink, void *ctx) {
+    GzipBody *gzip = __atomic_load_n(&body->gzip, __ATOMIC_ACQUIRE);
+    GzipBody *expected = NULL;
+    z_stream zs;
+    size_t bound, in = 0;
+    int status = Z_OK;
+    
+    if (gzip) return sink ? (sink(ctx, gzip->data, gzip->len) == 0 ? 0 : -1) : 0;
+    
+    gzip = malloc(sizeof(GzipBody));
+    if (!gzip) return -1;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(gzip);
+        return -1;
+    }
+    bound = deflateBound(&zs, body->len);
+    gzip->data = malloc(bound);
+    if (!gzip->data) {
+        deflateEnd(&zs);
+        free(gzip);
+        return -1;
+    }
+    gzip->len = 0;
+    
+    /* Feed the body in pieces so a sink can send while the rest compresses */
+    while (status == Z_OK) {
+        size_t piece = body->len - in < GZIP_PIECE ? body->len - in : GZIP_PIECE;
+        size_t before = gzip->len;
+        
+        zs.next_in = (unsigned char*)body->data + in;
+        zs.avail_in = (uInt)piece;
+        zs.next_out = gzip->data + gzip->len;
+        zs.avail_out = (uInt)(bound - gzip->len);
+        in += piece;
+        status = deflate(&zs, in == body->len ? Z_FINISH : Z_NO_FLUSH);
+        gzip->len = (size_t)(zs.next_out - gzip->data);
+        
+        if (status == Z_BUF_ERROR || status == Z_STREAM_ERROR) break;
+        if (sink && gzip->len > before && sink(ctx, gzip->data + before, gzip->len - before) != 0) {
+            status = Z_STREAM_ERROR;
+            break;
+        }
+    }
+    deflateEnd(&zs);
+    
+    if (status != Z_STREAM_END) {
+        free(gzip->data);
+        free(gzip);
+        return -1;
+    }
+    /* Another request may have finished first; either copy is the same bytes */
+    if (!__atomic_compare_exchange_n(&body->gzip, &expected, gzip, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(gzip->data);
+        free(gzip);
+    }
+    return 0;
+}
+
+void body_cache_refresh(BodyCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    if (!cache->building) {
+        cache->building = 1;
+        cache_build_locked(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void* refresher_thread(void *arg) {
+    Refresher *refresher = arg;
+    struct timespec delay;
+    int i;
+    
+    for (;;) {
+        /* The CPU budget governor stretches the interval while the exporter is over budget */
+        int interval_ms = budget_interval_ms(refresher->interval_ms);
+        
+        delay.tv_sec = interval_ms / 1000;
+        delay.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+        nanosleep(&delay, NULL);
+        
+        for (i = 0; i < refresher->count; i++) {
+            BodyCache *cache = refresher->caches[i];
+            unsigned long long requested;
+            
+            pthread_mutex_lock(&cache->lock);
+            requested = cache->requested_ms;
+            pthread_mutex_unlock(&cache->lock);
+            
+            /* Nobody asked lately: let it go stale, the next request starts a rebuild */
+            if (requested == 0 || monotonic_ms() - requested > (unsigned long long)refresher->idle_ms) continue;
+            body_cache_refresh(cache);
+        }
+    }
+    return NULL;
+}
+
+int body_cache_refresher_start(BodyCache **caches, int count, int interval_ms, int idle_ms) {
+    Refresher *refresher;
+    pthread_t thread;
+    
+    if (interval_ms <= 0) return 0;
+    refresher = malloc(sizeof(Refresher));
+    if (!refresher) return -1;
+    refresher->caches = caches;
+    refresher->count = count;
+    refresher->interval_ms = interval_ms;
+    refresher->idle_ms = idle_ms;
+    
+    if (pthread_create(&thread, NULL, refresher_thread, refresher) != 0) {
+        free(refresher);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
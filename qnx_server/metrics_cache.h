@@ -0,0 +1,96 @@
+#ifndef METRICS_CACHE_H
+#define METRICS_CACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Response body cache.
+ *
+ * A BodyCache holds the latest body built by one generator function as an
+ * immutable, refcounted CachedBody with its length and ETag worked out at
+ * build time. A refresher thread rebuilds every recently requested cache
+ * in the background, off to the side, and swaps the new body in; requests
+ * only take a reference to whatever is current, and a reader still sending
+ * the old body keeps it alive until it is done.
+ *
+ * A request finds the body too old only when the refresher is not keeping
+ * up (or has gone idle). It is still served the old body at once, and a
+ * rebuild is started in the background unless one is already running;
+ * only a request that finds no body at all (or asks for max age 0, build
+ * on request) waits, joining the build in flight if there is one, so
+ * concurrent requests cost one build.
+ *
+ * The gzip form of a body is made by the first request that asks for it
+ * and kept with the body, so each body is compressed at most once.
+ */
+
+enum { CACHE_HIT, CACHE_WAITED, CACHE_BUILT, CACHE_STALE };
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+} GzipBody;
+
+typedef struct {
+    int refcount;
+    char *data;
+    size_t len;
+    char etag[24];                  /* Quoted strong validator */
+    char gzip_etag[28];             /* Same, for the gzip representation */
+    GzipBody *gzip;                 /* NULL until first compressed */
+    unsigned long generation;
+    unsigned long long built_ms;    /* Monotonic time the build finished */
+    long long built_wall_ms;        /* Unix time in ms the build started, the time its samples were taken */
+} CachedBody;
+
+typedef struct {
+    const char *name;
+    int (*build)(char *out, size_t size);
+    size_t build_size;
+    char* (*build_alloc)(size_t *len);  /* Instead of build: sizes its own body */
+    pthread_mutex_t lock;
+    pthread_cond_t built;
+    CachedBody *current;
+    int building;
+    unsigned long builds;               /* Finished builds, failed ones included */
+    unsigned long generation;
+    unsigned long long requested_ms;    /* Last body_cache_get(), for the refresher */
+} BodyCache;
+
+int body_cache_init(BodyCache *cache, const char *name, int (*build)(char *out, size_t size), size_t build_size);
+
+/* For generators with no size limit: build returns a malloc'd body (NULL on failure) */
+int body_cache_init_alloc(BodyCache *cache, const char *name, char* (*build)(size_t *len));
+
+/*
+ * Current body; when it is older than max_age_ms a rebuild is started in
+ * the background and the old body returned (CACHE_STALE). With no body yet,
+ * or max_age_ms 0, waits for a build, joining the one in flight if any.
+ * *result says how it was obtained. Returns NULL only if no body could
+ * ever be built; release with body_release().
+ */
+CachedBody* body_cache_get(BodyCache *cache, int max_age_ms, int *result);
+
+/* Same, but always waits for a body no older than max_age_ms; for background samplers */
+CachedBody* body_cache_get_fresh(BodyCache *cache, int max_age_ms);
+void body_release(CachedBody *body);
+
+/* Receives compressed output as it is produced; non-zero stops compression */
+typedef int (*BodySink)(void *ctx, const unsigned char *data, size_t len);
+
+/*
+ * Make sure body->gzip is set, compressing it if no one has yet. With a
+ * sink, the output is also handed over piece by piece while compressing
+ * (or in one piece when it was already compressed). Returns 0, or -1 if
+ * compression failed or the sink stopped it.
+ */
+int body_gzip(CachedBody *body, BodySink sink, void *ctx);
+
+/* Rebuild now unless a build is already in flight */
+void body_cache_refresh(BodyCache *cache);
+
+/* Refresh caches requested within idle_ms every interval_ms, on a detached thread */
+int body_cache_refresher_start(BodyCache **caches, int count, int interval_ms, int idle_ms);
+
+#endif
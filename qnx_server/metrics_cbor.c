@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics_collect.h"
+#include "metrics_procs.h"
+#include "metrics_cbor.h"
+
+#define CBOR_MAX_DISKS 32
+#define CBOR_MAX_IFACES 32
+#define CBOR_PROCS_MAX_AGE_MS 1000
+
+enum { CBOR_UINT = 0, CBOR_NEGINT = 1, CBOR_TEXT = 3, CBOR_ARRAY = 4, CBOR_MAP = 5, CBOR_SIMPLE = 7 };
+
+void cbor_init(CborWriter *w, unsigned char *buf, size_t cap) {
+    w->buf = buf;
+    w->cap = cap;
+    w->len = 0;
+    w->overflow = 0;
+}
+
+static void cbor_put(CborWriter *w, const void *data, size_t len) {
+    if (w->overflow || w->len + len > w->cap) {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+/* Initial byte plus the shortest argument that holds value */
+static void cbor_head(CborWriter *w, int major, unsigned long long value) {
+    unsigned char head[9];
+    size_t len, i;
+    
+    if (value < 24) {
+        head[0] = (unsigned char)(major << 5 | value);
+        len = 1;
+    } else if (value <= 0xff) {
+        head[0] = (unsigned char)(major << 5 | 24);
+        len = 2;
+    } else if (value <= 0xffff) {
+        head[0] = (unsigned char)(major << 5 | 25);
+        len = 3;
+    } else if (value <= 0xffffffffULL) {
+        head[0] = (unsigned char)(major << 5 | 26);
+        len = 5;
+    } else {
+        head[0] = (unsigned char)(major << 5 | 27);
+        len = 9;
+    }
+    for (i = len - 1; i > 0; i--) {
+        head[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+    cbor_put(w, head, len);
+}
+
+void cbor_uint(CborWriter *w, unsigned long long value) {
+    cbor_head(w, CBOR_UINT, value);
+}
+
+void cbor_int(CborWriter *w, long long value) {
+    if (value >= 0) cbor_head(w, CBOR_UINT, (unsigned long long)value);
+    else cbor_head(w, CBOR_NEGINT, (unsigned long long)(-1 - value));
+}
+
+void cbor_text(CborWriter *w, const char *text) {
+    size_t len = strlen(text);
+    
+    cbor_head(w, CBOR_TEXT, len);
+    cbor_put(w, text, len);
+}
+
+void cbor_array(CborWriter *w, size_t count) {
+    cbor_head(w, CBOR_ARRAY, count);
+}
+
+void cbor_map(CborWriter *w, size_t count) {
+    cbor_head(w, CBOR_MAP, count);
+}
+
+void cbor_null(CborWriter *w) {
+    cbor_head(w, CBOR_SIMPLE, 22);
+}
+
+static void encode_host(CborWriter *w) {
+    SysInfo sys;
+    
+    if (collect_system(&sys) != 0) {
+        cbor_null(w);
+        return;
+    }
+    cbor_map(w, 5);
+    cbor_text(w, "name");
+    cbor_text(w, sys.hostname);
+    cbor_text(w, "release");
+    cbor_text(w, sys.release);
+    cbor_text(w, "machine");
+    cbor_text(w, sys.machine);
+    cbor_text(w, "cpus");
+    cbor_uint(w, (unsigned long long)sys.num_cpus);
+    cbor_text(w, "uptime_s");
+    cbor_uint(w, sys.uptime_sec);
+}
+
+static void encode_memory(CborWriter *w) {
+    MemInfo mem;
+    
+    if (collect_memory(&mem) != 0) {
+        cbor_null(w);
+        return;
+    }
+    cbor_map(w, 2);
+    cbor_text(w, "total_kb");
+    cbor_uint(w, mem.total_kb);
+    cbor_text(w, "free_kb");
+    cbor_uint(w, mem.free_kb);
+}
+
+/* One int column of the process snapshot */
+static void encode_int_column(CborWriter *w, const char *key, const int *column, int count) {
+    int i;
+    
+    cbor_text(w, key);
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_int(w, column[i]);
+}
+
+static void encode_u64_column(CborWriter *w, const char *key, const unsigned long long *column, int count) {
+    int i;
+    
+    cbor_text(w, key);
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, column[i]);
+}
+
+static void encode_processes(CborWriter *w) {
+    ProcSnapshot *snap = procs_acquire(CBOR_PROCS_MAX_AGE_MS);
+    int i;
+    
+    if (!snap) {
+        cbor_null(w);
+        return;
+    }
+    
+    cbor_map(w, 10);
+    cbor_text(w, "interval_ms");
+    cbor_uint(w, snap->interval_ms);
+    encode_int_column(w, "pid", snap->pid, snap->count);
+    encode_int_column(w, "ppid", snap->ppid, snap->count);
+    cbor_text(w, "name");
+    cbor_array(w, (size_t)snap->count);
+    for (i = 0; i < snap->count; i++) cbor_text(w, proc_name(snap, i));
+    cbor_text(w, "state");
+    cbor_array(w, (size_t)snap->count);
+    for (i = 0; i < snap->count; i++) cbor_text(w, proc_state(snap, i));
+    encode_int_column(w, "prio", snap->priority, snap->count);
+    encode_int_column(w, "threads", snap->threads, snap->count);
+    encode_u64_column(w, "cpu_ms", snap->cpu_ms, snap->count);
+    cbor_text(w, "cpu_pm");
+    if (snap->has_cpu) {
+        cbor_array(w, (size_t)snap->count);
+        for (i = 0; i < snap->count; i++) cbor_uint(w, snap->cpu_permille[i]);
+    } else {
+        cbor_null(w);
+    }
+    encode_u64_column(w, "mem_kb", snap->mem_kb, snap->count);
+    
+    procs_release(snap);
+}
+
+static void encode_disks(CborWriter *w) {
+    DiskInfo disks[CBOR_MAX_DISKS];
+    int count = collect_disks(disks, CBOR_MAX_DISKS);
+    int i;
+    
+    if (count < 0) {
+        cbor_null(w);
+        return;
+    }
+    
+    cbor_map(w, 5);
+    cbor_text(w, "mount");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_text(w, disks[i].mount);
+    cbor_text(w, "fstype");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_text(w, disks[i].fstype);
+    cbor_text(w, "total_kb");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, disks[i].total_kb);
+    cbor_text(w, "used_kb");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, disks[i].used_kb);
+    cbor_text(w, "avail_kb");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, disks[i].avail_kb);
+}
+
+static void encode_interfaces(CborWriter *w) {
+    IfaceInfo ifaces[CBOR_MAX_IFACES];
+    int count = collect_interfaces(ifaces, CBOR_MAX_IFACES);
+    int i;
+    
+    if (count < 0) {
+        cbor_null(w);
+        return;
+    }
+    
+    cbor_map(w, 7);
+    cbor_text(w, "name");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_text(w, ifaces[i].name);
+    cbor_text(w, "rx_bytes");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, ifaces[i].rx_bytes);
+    cbor_text(w, "tx_bytes");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, ifaces[i].tx_bytes);
+    cbor_text(w, "rx_packets");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, ifaces[i].rx_packets);
+    cbor_text(w, "tx_packets");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, ifaces[i].tx_packets);
+    cbor_text(w, "rx_errors");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, ifaces[i].rx_errors);
+    cbor_text(w, "tx_errors");
+    cbor_array(w, (size_t)count);
+    for (i = 0; i < count; i++) cbor_uint(w, ifaces[i].tx_errors);
+}
+
+int cbor_encode_snapshot(CborWriter *w, unsigned long generation, int view_mode) {
+    cbor_map(w, 9);
+    cbor_text(w, "v");
+    cbor_uint(w, CBOR_SCHEMA_VERSION);
+    cbor_text(w, "gen");
+    cbor_uint(w, generation);
+    cbor_text(w, "ts");
+    cbor_uint(w, (unsigned long long)time(NULL));
+    cbor_text(w, "view");
+    cbor_text(w, view_mode ? "full" : "metrics");
+    cbor_text(w, "host");
+    encode_host(w);
+    cbor_text(w, "mem");
+    encode_memory(w);
+    cbor_text(w, "procs");
+    encode_processes(w);
+    cbor_text(w, "disks");
+    encode_disks(w);
+    cbor_text(w, "ifaces");
+    encode_interfaces(w);
+    
+    return w->overflow ? -1 : (int)w->len;
+}
@@ -0,0 +1,53 @@
+#ifndef METRICS_CBOR_H
+#define METRICS_CBOR_H
+
+#include <stddef.h>
+
+/*
+ * Binary snapshot protocol.
+ *
+ * WebSocket clients that offer the CBOR_PROTOCOL subprotocol receive each
+ * snapshot as one CBOR (RFC 8949) binary message instead of text tables.
+ * Integers use the shortest CBOR form and tables are sent as columns, so a
+ * snapshot is mostly packed numbers. The writer encodes into a caller-owned
+ * buffer and never allocates.
+ *
+ * Schema version 1, a map with text keys:
+ *   "v"      1
+ *   "gen"    snapshot generation
+ *   "ts"     unix time
+ *   "view"   "metrics" or "full"
+ *   "host"   {"name", "release", "machine", "cpus", "uptime_s"}
+ *   "mem"    {"total_kb", "free_kb"}
+ *   "procs"  {"interval_ms", "pid": [...], "ppid", "name", "state", "prio",
+ *             "threads", "cpu_ms", "cpu_pm" (0.1% of all CPUs), "mem_kb"}
+ *   "disks"  {"mount": [...], "fstype", "total_kb", "used_kb", "avail_kb"}
+ *   "ifaces" {"name": [...], "rx_bytes", "tx_bytes", "rx_packets",
+ *             "tx_packets", "rx_errors", "tx_errors"}
+ * A group whose collector is unavailable is null. Fields are only ever
+ * added within a version; decoders should ignore keys they do not know.
+ */
+
+#define CBOR_PROTOCOL "qnx-metrics.cbor.v1"
+#define CBOR_SCHEMA_VERSION 1
+
+typedef struct {
+    unsigned char *buf;
+    size_t cap;
+    size_t len;
+    int overflow;           /* Set once a write did not fit; len stops growing */
+} CborWriter;
+
+void cbor_init(CborWriter *w, unsigned char *buf, size_t cap);
+
+void cbor_uint(CborWriter *w, unsigned long long value);
+void cbor_int(CborWriter *w, long long value);
+void cbor_text(CborWriter *w, const char *text);
+void cbor_array(CborWriter *w, size_t count);
+void cbor_map(CborWriter *w, size_t count);
+void cbor_null(CborWriter *w);
+
+/* Encode one schema version 1 snapshot; returns its length, or -1 if the buffer is too small */
+int cbor_encode_snapshot(CborWriter *w, unsigned long generation, int view_mode);
+
+#endif
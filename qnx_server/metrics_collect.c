@@ -0,0 +1,788 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/utsname.h>
+
+#include "metrics_collect.h"
+#include "metrics_bus.h"
+
+#define COLLECT_MAX_PROCS 2048
+#define COLLECT_MAX_DISKS 32
+#define COLLECT_MAX_IFACES 32
+
+/* Append formatted text, never running past the buffer */
+static void appendf(char *out, size_t size, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    
+    if (*len >= size - 1) return;
+    va_start(ap, fmt);
+    n = vsnprintf(out + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    *len += (size_t)n;
+    if (*len >= size) *len = size - 1;
+}
+
+static int is_pid_name(const char *name) {
+    if (!*name) return 0;
+    for (; *name; name++) {
+        if (!isdigit((unsigned char)*name)) return 0;
+    }
+    return 1;
+}
+
+/* Count processes by listing the numeric entries of /proc */
+int collect_local_process_count(void) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    int count = 0;
+    
+    if (!dir) return -1;
+    while ((entry = readdir(dir)) != NULL) {
+        if (is_pid_name(entry->d_name)) count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+#if defined(__QNXNTO__)
+
+/* QNX Neutrino backend: /proc/<pid> devctl()s, syspage and getifaddrs() */
+
+#include <devctl.h>
+#include <sys/neutrino.h>
+#include <sys/procfs.h>
+#include <sys/syspage.h>
+#include <sys/states.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+
+static const char *qnx_states[] = {
+    "DEAD", "RUNNING", "READY", "STOPPED", "SEND", "RECEIVE", "REPLY",
+    "STACK", "WAITTHREAD", "WAITPAGE", "SIGSUSPEND", "SIGWAITINFO",
+    "NANOSLEEP", "MUTEX", "CONDVAR", "JOIN", "INTR", "SEM", "WAITCTX",
+    "NET_SEND", "NET_REPLY"
+};
+
+const char* collect_backend_name(void) {
+    return "qnx-procfs";
+}
+
+static const char* qnx_state_name(int state) {
+    if (state >= 0 && state < (int)(sizeof(qnx_states) / sizeof(qnx_states[0]))) {
+        return qnx_states[state];
+    }
+    return "UNKNOWN";
+}
+
+static int qnx_open_proc(int pid) {
+    char path[64];
+    int fd;
+    
+    snprintf(path, sizeof(path), "/proc/%d/ctl", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(path, sizeof(path), "/proc/%d/as", pid);
+        fd = open(path, O_RDONLY);
+    }
+    return fd;
+}
+
+/* Executable basename from /proc/<pid>/exefile */
+static void qnx_process_name(int pid, char *name, size_t size) {
+    char path[64];
+    char exe[256];
+    const char *base;
+    ssize_t n;
+    int fd;
+    
+    snprintf(name, size, "%d", pid);
+    snprintf(path, sizeof(path), "/proc/%d/exefile", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    n = read(fd, exe, sizeof(exe) - 1);
+    close(fd);
+    if (n <= 0) return;
+    
+    exe[n] = '\0';
+    exe[strcspn(exe, "\r\n")] = '\0';
+    base = strrchr(exe, '/');
+    snprintf(name, size, "%s", base ? base + 1 : exe);
+}
+
+/* Private (anonymous and stack) mappings, which is what pidin reports as data */
+static unsigned long long qnx_private_kb(int fd) {
+    procfs_mapinfo *maps;
+    unsigned long long total = 0;
+    int count = 0, i;
+    
+    if (devctl(fd, DCMD_PROC_MAPINFO, NULL, 0, &count) != EOK || count <= 0) return 0;
+    maps = malloc(sizeof(procfs_mapinfo) * count);
+    if (!maps) return 0;
+    if (devctl(fd, DCMD_PROC_MAPINFO, maps, sizeof(procfs_mapinfo) * count, &count) == EOK) {
+        for (i = 0; i < count; i++) {
+            if (maps[i].flags & (MAP_ANON | MAP_STACK)) total += maps[i].size;
+        }
+    }
+    free(maps);
+    return total / 1024;
+}
+
+static int qnx_read_process(int pid, ProcInfo *proc) {
+    procfs_info info;
+    procfs_status status;
+    int fd = qnx_open_proc(pid);
+    
+    if (fd < 0) return -1;
+    if (devctl(fd, DCMD_PROC_INFO, &info, sizeof(info), NULL) != EOK) {
+        close(fd);
+        return -1;
+    }
+    
+    memset(proc, 0, sizeof(*proc));
+    proc->pid = pid;
+    proc->ppid = info.parent;
+    proc->threads = info.num_threads;
+    proc->cpu_ms = (info.utime + info.stime) / 1000000ULL;
+    qnx_process_name(pid, proc->name, sizeof(proc->name));
+    
+    /* Report the first thread's state and priority, as pidin does per row */
+    memset(&status, 0, sizeof(status));
+    status.tid = 1;
+    if (devctl(fd, DCMD_PROC_TIDSTATUS, &status, sizeof(status), NULL) == EOK) {
+        snprintf(proc->state, sizeof(proc->state), "%s", qnx_state_name(status.state));
+        proc->priority = status.priority;
+    } else {
+        snprintf(proc->state, sizeof(proc->state), "?");
+    }
+    
+    proc->mem_kb = qnx_private_kb(fd);
+    close(fd);
+    return 0;
+}
+
+int collect_local_processes(ProcInfo *procs, int max) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    int count = 0;
+    
+    if (!dir) return -1;
+    while (count < max && (entry = readdir(dir)) != NULL) {
+        if (!is_pid_name(entry->d_name)) continue;
+        if (qnx_read_process(atoi(entry->d_name), &procs[count]) == 0) count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+int collect_threads(ThreadInfo *threads, int max) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    int count = 0;
+    
+    if (!dir) return -1;
+    while (count < max && (entry = readdir(dir)) != NULL) {
+        char name[COLLECT_NAME_MAX];
+        procfs_status status;
+        int pid, fd, tid;
+        
+        if (!is_pid_name(entry->d_name)) continue;
+        pid = atoi(entry->d_name);
+        fd = qnx_open_proc(pid);
+        if (fd < 0) continue;
+        qnx_process_name(pid, name, sizeof(name));
+        
+        for (tid = 1; count < max; tid = status.tid + 1) {
+            memset(&status, 0, sizeof(status));
+            status.tid = tid;
+            if (devctl(fd, DCMD_PROC_TIDSTATUS, &status, sizeof(status), NULL) != EOK) break;
+            if ((int)status.tid < tid) break;
+            
+            threads[count].pid = pid;
+            threads[count].tid = status.tid;
+            snprintf(threads[count].name, sizeof(threads[count].name), "%s", name);
+            snprintf(threads[count].state, sizeof(threads[count].state), "%s", qnx_state_name(status.state));
+            threads[count].priority = status.priority;
+            threads[count].cpu_ms = status.sutime / 1000000ULL;
+            count++;
+        }
+        close(fd);
+    }
+    closedir(dir);
+    return count;
+}
+
+int collect_local_memory(MemInfo *mem) {
+    struct asinfo_entry *as = SYSPAGE_ENTRY(asinfo);
+    const char *strings = SYSPAGE_ENTRY(strings)->data;
+    unsigned count = _syspage_ptr->asinfo.entry_size / sizeof(*as);
+    unsigned long long total = 0;
+    struct stat st;
+    unsigned i;
+    
+    for (i = 0; i < count; i++) {
+        if (strcmp(strings + as[i].name, "ram") == 0) {
+            total += as[i].end - as[i].start + 1;
+        }
+    }
+    
+    /* The size of /proc is the amount of free memory */
+    if (stat("/proc", &st) != 0) return -1;
+    
+    mem->total_kb = total / 1024;
+    mem->free_kb = (unsigned long long)st.st_size / 1024;
+    return 0;
+}
+
+/* QNX has no mount table file; stat the root and its top-level mountpoints */
+int collect_local_disks(DiskInfo *disks, int max) {
+    unsigned long seen[COLLECT_MAX_DISKS];
+    DIR *dir = opendir("/");
+    struct dirent *entry;
+    int count = 0, nseen = 0;
+    const char *path = "/";
+    char buf[128];
+    
+    if (!dir) return -1;
+    while (count < max) {
+        struct statvfs vfs;
+        int i, dup = 0;
+        
+        if (statvfs(path, &vfs) == 0 && vfs.f_blocks > 0) {
+            for (i = 0; i < nseen; i++) {
+                if (seen[i] == (unsigned long)vfs.f_fsid) dup = 1;
+            }
+            if (!dup && nseen < COLLECT_MAX_DISKS) {
+                unsigned long long frsize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+                
+                seen[nseen++] = (unsigned long)vfs.f_fsid;
+                snprintf(disks[count].mount, sizeof(disks[count].mount), "%s", path);
+                snprintf(disks[count].fstype, sizeof(disks[count].fstype), "%s", vfs.f_basetype);
+                disks[count].total_kb = vfs.f_blocks * frsize / 1024;
+                disks[count].used_kb = (vfs.f_blocks - vfs.f_bfree) * frsize / 1024;
+                disks[count].avail_kb = vfs.f_bavail * frsize / 1024;
+                count++;
+            }
+        }
+        
+        do {
+            entry = readdir(dir);
+        } while (entry && (entry->d_name[0] == '.' || strcmp(entry->d_name, "proc") == 0));
+        if (!entry) break;
+        snprintf(buf, sizeof(buf), "/%s", entry->d_name);
+        path = buf;
+    }
+    closedir(dir);
+    return count;
+}
+
+int collect_local_interfaces(IfaceInfo *ifaces, int max) {
+    struct ifaddrs *list, *ifa;
+    int count = 0;
+    
+    if (getifaddrs(&list) != 0) return -1;
+    for (ifa = list; ifa && count < max; ifa = ifa->ifa_next) {
+        struct if_data *data;
+        
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_LINK || !ifa->ifa_data) continue;
+        data = ifa->ifa_data;
+        snprintf(ifaces[count].name, sizeof(ifaces[count].name), "%s", ifa->ifa_name);
+        ifaces[count].rx_bytes = data->ifi_ibytes;
+        ifaces[count].tx_bytes = data->ifi_obytes;
+        ifaces[count].rx_packets = data->ifi_ipackets;
+        ifaces[count].tx_packets = data->ifi_opackets;
+        ifaces[count].rx_errors = data->ifi_ierrors;
+        ifaces[count].tx_errors = data->ifi_oerrors;
+        count++;
+    }
+    freeifaddrs(list);
+    return count;
+}
+
+static int num_cpus(void) {
+    return _syspage_ptr->num_cpu;
+}
+
+/* Every CPU's time since boot, less what procnto's idle threads (priority 0) ran */
+static int local_cpu_busy_ms(unsigned long long *busy_ms) {
+    unsigned long long idle_ns = 0, total_ns;
+    procfs_status status;
+    struct timespec ts;
+    int fd = qnx_open_proc(1), tid;
+    
+    if (fd < 0) return -1;
+    for (tid = 1; ; tid = status.tid + 1) {
+        memset(&status, 0, sizeof(status));
+        status.tid = tid;
+        if (devctl(fd, DCMD_PROC_TIDSTATUS, &status, sizeof(status), NULL) != EOK) break;
+        if ((int)status.tid < tid) break;
+        if (status.priority == 0) idle_ns += status.sutime;
+    }
+    close(fd);
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return -1;
+    total_ns = ((unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec) *
+               (unsigned long long)num_cpus();
+    *busy_ms = total_ns > idle_ns ? (total_ns - idle_ns) / 1000000ULL : 0;
+    return 0;
+}
+
+#elif defined(__linux__)
+
+/* Linux backend: /proc and sysfs, for building and testing off-target */
+
+const char* collect_backend_name(void) {
+    return "linux-procfs";
+}
+
+static const char* linux_state_name(char state) {
+    switch (state) {
+    case 'R': return "RUNNING";
+    case 'S': return "SLEEP";
+    case 'D': return "DISK";
+    case 'Z': return "ZOMBIE";
+    case 'T': return "STOPPED";
+    case 't': return "TRACED";
+    case 'I': return "IDLE";
+    case 'X': return "DEAD";
+    default: return "UNKNOWN";
+    }
+}
+
+/* Parse /proc/<pid>/stat or /proc/<pid>/task/<tid>/stat */
+static int linux_read_stat(const char *path, ProcInfo *proc) {
+    static long hz = 0;
+    static long page_kb = 0;
+    char buf[1024];
+    char *open_paren, *close_paren;
+    char state;
+    unsigned long long utime, stime;
+    long long rss;
+    ssize_t n;
+    int fd;
+    
+    if (!hz) {
+        hz = sysconf(_SC_CLK_TCK);
+        page_kb = sysconf(_SC_PAGESIZE) / 1024;
+        if (hz <= 0) hz = 100;
+        if (page_kb <= 0) page_kb = 4;
+    }
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    
+    /* The command name may contain spaces and parentheses */
+    open_paren = strchr(buf, '(');
+    close_paren = strrchr(buf, ')');
+    if (!open_paren || !close_paren || close_paren < open_paren) return -1;
+    
+    memset(proc, 0, sizeof(*proc));
+    proc->pid = atoi(buf);
+    *close_paren = '\0';
+    snprintf(proc->name, sizeof(proc->name), "%s", open_paren + 1);
+    
+    if (sscanf(close_paren + 1,
+               " %c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %d %*d %d %*d %*u %*u %lld",
+               &state, &proc->ppid, &utime, &stime, &proc->priority, &proc->threads, &rss) != 7) {
+        return -1;
+    }
+    
+    snprintf(proc->state, sizeof(proc->state), "%s", linux_state_name(state));
+    proc->cpu_ms = (utime + stime) * 1000ULL / (unsigned long long)hz;
+    proc->mem_kb = rss > 0 ? (unsigned long long)rss * (unsigned long long)page_kb : 0;
+    return 0;
+}
+
+int collect_local_processes(ProcInfo *procs, int max) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    char path[64];
+    int count = 0;
+    
+    if (!dir) return -1;
+    while (count < max && (entry = readdir(dir)) != NULL) {
+        if (!is_pid_name(entry->d_name)) continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", atoi(entry->d_name));
+        if (linux_read_stat(path, &procs[count]) == 0) count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+int collect_threads(ThreadInfo *threads, int max) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    int count = 0;
+    
+    if (!dir) return -1;
+    while (count < max && (entry = readdir(dir)) != NULL) {
+        char path[96];
+        DIR *tasks;
+        struct dirent *task;
+        
+        if (!is_pid_name(entry->d_name)) continue;
+        snprintf(path, sizeof(path), "/proc/%d/task", atoi(entry->d_name));
+        tasks = opendir(path);
+        if (!tasks) continue;
+        
+        while (count < max && (task = readdir(tasks)) != NULL) {
+            ProcInfo info;
+            
+            if (!is_pid_name(task->d_name)) continue;
+            snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", atoi(entry->d_name), atoi(task->d_name));
+            if (linux_read_stat(path, &info) != 0) continue;
+            
+            threads[count].pid = atoi(entry->d_name);
+            threads[count].tid = info.pid;
+            memcpy(threads[count].name, info.name, sizeof(threads[count].name));
+            memcpy(threads[count].state, info.state, sizeof(threads[count].state));
+            threads[count].priority = info.priority;
+            threads[count].cpu_ms = info.cpu_ms;
+            count++;
+        }
+        closedir(tasks);
+    }
+    closedir(dir);
+    return count;
+}
+
+int collect_local_memory(MemInfo *mem) {
+    FILE *fp = fopen("/proc/meminfo", "r");
+    char line[256];
+    unsigned long long value, mem_free = 0, mem_available = 0;
+    int have_available = 0;
+    
+    if (!fp) return -1;
+    mem->total_kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "MemTotal: %llu", &value) == 1) mem->total_kb = value;
+        else if (sscanf(line, "MemFree: %llu", &value) == 1) mem_free = value;
+        else if (sscanf(line, "MemAvailable: %llu", &value) == 1) {
+            mem_available = value;
+            have_available = 1;
+        }
+    }
+    fclose(fp);
+    
+    if (!mem->total_kb) return -1;
+    mem->free_kb = have_available ? mem_available : mem_free;
+    return 0;
+}
+
+int collect_local_disks(DiskInfo *disks, int max) {
+    FILE *fp = fopen("/proc/mounts", "r");
+    char line[512];
+    int count = 0;
+    
+    if (!fp) return -1;
+    while (count < max && fgets(line, sizeof(line), fp)) {
+        char device[128], mount[128], fstype[32];
+        struct statvfs vfs;
+        unsigned long long frsize;
+        
+        if (sscanf(line, "%127s %127s %31s", device, mount, fstype) != 3) continue;
+        if (statvfs(mount, &vfs) != 0 || vfs.f_blocks == 0) continue;
+        
+        frsize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+        snprintf(disks[count].mount, sizeof(disks[count].mount), "%s", mount);
+        snprintf(disks[count].fstype, sizeof(disks[count].fstype), "%s", fstype);
+        disks[count].total_kb = vfs.f_blocks * frsize / 1024;
+        disks[count].used_kb = (vfs.f_blocks - vfs.f_bfree) * frsize / 1024;
+        disks[count].avail_kb = vfs.f_bavail * frsize / 1024;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+int collect_local_interfaces(IfaceInfo *ifaces, int max) {
+    FILE *fp = fopen("/proc/net/dev", "r");
+    char line[512];
+    int count = 0;
+    
+    if (!fp) return -1;
+    while (count < max && fgets(line, sizeof(line), fp)) {
+        char *colon = strchr(line, ':');
+        char *name = line;
+        IfaceInfo *ifc = &ifaces[count];
+        
+        if (!colon) continue;   /* Header lines */
+        *colon = '\0';
+        while (*name == ' ') name++;
+        snprintf(ifc->name, sizeof(ifc->name), "%.31s", name);
+        if (sscanf(colon + 1, "%llu %llu %llu %*u %*u %*u %*u %*u %llu %llu %llu",
+                   &ifc->rx_bytes, &ifc->rx_packets, &ifc->rx_errors,
+                   &ifc->tx_bytes, &ifc->tx_packets, &ifc->tx_errors) == 6) {
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static int num_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* user + nice + system + irq + softirq + steal of the summary line; guest time is within user */
+static int local_cpu_busy_ms(unsigned long long *busy_ms) {
+    FILE *fp = fopen("/proc/stat", "r");
+    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal = 0;
+    long hz = sysconf(_SC_CLK_TCK);
+    int fields;
+    
+    if (!fp) return -1;
+    fields = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                    &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+    fclose(fp);
+    if (fields < 7 || hz <= 0) return -1;
+    *busy_ms = (user + nice + system + irq + softirq + steal) * 1000ULL / (unsigned long long)hz;
+    return 0;
+}
+
+#else
+
+/* No native backend: every caller falls back to its shell command */
+
+const char* collect_backend_name(void) {
+    return "none";
+}
+
+int collect_local_processes(ProcInfo *procs, int max) {
+    (void)procs; (void)max;
+    return -1;
+}
+
+int collect_threads(ThreadInfo *threads, int max) {
+    (void)threads; (void)max;
+    return -1;
+}
+
+int collect_local_memory(MemInfo *mem) {
+    (void)mem;
+    return -1;
+}
+
+int collect_local_disks(DiskInfo *disks, int max) {
+    (void)disks; (void)max;
+    return -1;
+}
+
+int collect_local_interfaces(IfaceInfo *ifaces, int max) {
+    (void)ifaces; (void)max;
+    return -1;
+}
+
+static int num_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static int local_cpu_busy_ms(unsigned long long *busy_ms) {
+    (void)busy_ms;
+    return -1;
+}
+
+#endif
+
+/* Never report less than before: the sources are sampled at slightly different moments */
+int collect_cpu_busy_ms(unsigned long long *busy_ms) {
+    static unsigned long long highest = 0;
+    unsigned long long value, seen;
+    
+    if (local_cpu_busy_ms(&value) != 0) return -1;
+    seen = __atomic_load_n(&highest, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(&highest, &seen, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    *busy_ms = value > seen ? value : seen;
+    return 0;
+}
+
+int collect_local_system(SysInfo *sys) {
+    struct utsname uts;
+    struct timespec ts;
+    
+    memset(sys, 0, sizeof(*sys));
+    if (uname(&uts) != 0) return -1;
+    
+    snprintf(sys->sysname, sizeof(sys->sysname), "%.63s", uts.sysname);
+    snprintf(sys->release, sizeof(sys->release), "%.63s", uts.release);
+    snprintf(sys->version, sizeof(sys->version), "%.127s", uts.version);
+    snprintf(sys->machine, sizeof(sys->machine), "%.63s", uts.machine);
+    if (gethostname(sys->hostname, sizeof(sys->hostname) - 1) != 0) {
+        snprintf(sys->hostname, sizeof(sys->hostname), "%.63s", uts.nodename);
+    }
+    sys->num_cpus = num_cpus();
+    
+    /* CLOCK_MONOTONIC starts at boot on both QNX and Linux */
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        sys->uptime_sec = (unsigned long long)ts.tv_sec;
+    }
+    return 0;
+}
+
+/* Each collector takes the bus snapshot when one is attached and fresh */
+
+int collect_process_count(void) {
+    int count = bus_process_count();
+    return count >= 0 ? count : collect_local_process_count();
+}
+
+int collect_processes(ProcInfo *procs, int max) {
+    int count = bus_processes(procs, max);
+    return count >= 0 ? count : collect_local_processes(procs, max);
+}
+
+int collect_memory(MemInfo *mem) {
+    return bus_memory(mem) == 0 ? 0 : collect_local_memory(mem);
+}
+
+int collect_disks(DiskInfo *disks, int max) {
+    int count = bus_disks(disks, max);
+    return count >= 0 ? count : collect_local_disks(disks, max);
+}
+
+int collect_interfaces(IfaceInfo *ifaces, int max) {
+    int count = bus_interfaces(ifaces, max);
+    return count >= 0 ? count : collect_local_interfaces(ifaces, max);
+}
+
+int collect_system(SysInfo *sys) {
+    return bus_system(sys) == 0 ? 0 : collect_local_system(sys);
+}
+
+/* Human readable size from KiB, df -h style */
+static void format_kb(unsigned long long kb, char *buf, size_t size) {
+    const char *units = "KMGT";
+    double value = (double)kb;
+    int unit = 0;
+    
+    while (value >= 1024.0 && unit < 3) {
+        value /= 1024.0;
+        unit++;
+    }
+    snprintf(buf, size, value < 10.0 ? "%.1f%c" : "%.0f%c", value, units[unit]);
+}
+
+static ProcInfo* alloc_processes(int *count) {
+    ProcInfo *procs = malloc(sizeof(ProcInfo) * COLLECT_MAX_PROCS);
+    
+    if (!procs) return NULL;
+    *count = collect_processes(procs, COLLECT_MAX_PROCS);
+    if (*count < 0) {
+        free(procs);
+        return NULL;
+    }
+    return procs;
+}
+
+static int compare_mem_desc(const void *a, const void *b) {
+    const ProcInfo *pa = a, *pb = b;
+    if (pa->mem_kb != pb->mem_kb) return pa->mem_kb < pb->mem_kb ? 1 : -1;
+    return pa->pid - pb->pid;
+}
+
+int native_memory_overview(char *out, size_t size) {
+    MemInfo mem;
+    SysInfo sys;
+    size_t len = 0;
+    int procs;
+    
+    if (collect_memory(&mem) != 0 || collect_system(&sys) != 0) return -1;
+    procs = collect_process_count();
+    
+    appendf(out, size, &len, "CPUs:      %d (%s)\n", sys.num_cpus, sys.machine);
+    appendf(out, size, &len, "Memory:    %lluK total, %lluK used, %lluK free\n",
+            mem.total_kb, mem.total_kb - mem.free_kb, mem.free_kb);
+    appendf(out, size, &len, "Processes: %d\n", procs);
+    appendf(out, size, &len, "Uptime:    %llus\n", sys.uptime_sec);
+    return (int)len;
+}
+
+int native_memory_detailed(char *out, size_t size) {
+    size_t len = 0;
+    int count, i;
+    ProcInfo *procs = alloc_processes(&count);
+    
+    if (!procs) return -1;
+    qsort(procs, count, sizeof(ProcInfo), compare_mem_desc);
+    
+    appendf(out, size, &len, "%8s %-24s %10s %5s\n", "pid", "name", "mem_kb", "thr");
+    for (i = 0; i < count; i++) {
+        appendf(out, size, &len, "%8d %-24.24s %10llu %5d\n",
+                procs[i].pid, procs[i].name, procs[i].mem_kb, procs[i].threads);
+    }
+    free(procs);
+    return (int)len;
+}
+
+int native_system_info(char *out, size_t size) {
+    SysInfo sys;
+    size_t len = 0;
+    
+    if (collect_system(&sys) != 0) return -1;
+    appendf(out, size, &len, "Hostname:  %s\n", sys.hostname);
+    appendf(out, size, &len, "System:    %s %s\n", sys.sysname, sys.release);
+    appendf(out, size, &len, "Version:   %s\n", sys.version);
+    appendf(out, size, &len, "Machine:   %s, %d cpus\n", sys.machine, sys.num_cpus);
+    appendf(out, size, &len, "Uptime:    %llus\n", sys.uptime_sec);
+    return (int)len;
+}
+
+int native_network_stats(char *out, size_t size) {
+    IfaceInfo ifaces[COLLECT_MAX_IFACES];
+    size_t len = 0;
+    int count = collect_interfaces(ifaces, COLLECT_MAX_IFACES);
+    int i;
+    
+    if (count < 0) return -1;
+    appendf(out, size, &len, "%-12s %14s %12s %8s %14s %12s %8s\n",
+            "Name", "Ibytes", "Ipkts", "Ierrs", "Obytes", "Opkts", "Oerrs");
+    for (i = 0; i < count; i++) {
+        appendf(out, size, &len, "%-12s %14llu %12llu %8llu %14llu %12llu %8llu\n",
+                ifaces[i].name, ifaces[i].rx_bytes, ifaces[i].rx_packets, ifaces[i].rx_errors,
+                ifaces[i].tx_bytes, ifaces[i].tx_packets, ifaces[i].tx_errors);
+    }
+    return (int)len;
+}
+
+int native_disk_usage(char *out, size_t size) {
+    DiskInfo disks[COLLECT_MAX_DISKS];
+    size_t len = 0;
+    int count = collect_disks(disks, COLLECT_MAX_DISKS);
+    int i;
+    
+    if (count < 0) return -1;
+    appendf(out, size, &len, "%-24s %-10s %8s %8s %8s %5s\n", "Mounted on", "Type", "Size", "Used", "Avail", "Use%");
+    for (i = 0; i < count; i++) {
+        char total[16], used[16], avail[16];
+        unsigned long long usable = disks[i].used_kb + disks[i].avail_kb;
+        unsigned long long pct = usable ? (disks[i].used_kb * 100 + usable - 1) / usable : 0;
+        
+        format_kb(disks[i].total_kb, total, sizeof(total));
+        format_kb(disks[i].used_kb, used, sizeof(used));
+        format_kb(disks[i].avail_kb, avail, sizeof(avail));
+        appendf(out, size, &len, "%-24.24s %-10s %8s %8s %8s %4llu%%\n",
+                disks[i].mount, disks[i].fstype, total, used, avail, pct);
+    }
+    return (int)len;
+}
@@ -0,0 +1,104 @@
+#ifndef METRICS_COLLECT_H
+#define METRICS_COLLECT_H
+
+#include <stddef.h>
+
+/*
+ * Native in-process metrics collectors.
+ *
+ * Reads process, thread, memory, disk and interface data straight from
+ * system APIs instead of forking pidin/showmem/df/netstat:
+ *   QNX    /proc/<pid> plus devctl(), syspage, getifaddrs()
+ *   Linux  /proc and sysfs, so everything can be built and tested off-target
+ * Every collector returns -1 when the data is unavailable so callers can
+ * fall back to running the equivalent shell command.
+ *
+ * When a snapshot bus is attached (metrics_bus.h) the collectors return
+ * its latest snapshot instead; the collect_local_ variants always read the
+ * system, for the bus publisher.
+ */
+
+#define COLLECT_NAME_MAX 64
+#define COLLECT_STATE_MAX 12
+
+typedef struct {
+    int pid;
+    int ppid;
+    char name[COLLECT_NAME_MAX];
+    char state[COLLECT_STATE_MAX];
+    int threads;
+    int priority;
+    unsigned long long cpu_ms;      /* user + system time */
+    unsigned long long mem_kb;      /* resident / private memory */
+} ProcInfo;
+
+typedef struct {
+    int pid;
+    int tid;
+    char name[COLLECT_NAME_MAX];
+    char state[COLLECT_STATE_MAX];
+    int priority;
+    unsigned long long cpu_ms;
+} ThreadInfo;
+
+typedef struct {
+    unsigned long long total_kb;
+    unsigned long long free_kb;
+} MemInfo;
+
+typedef struct {
+    char mount[128];
+    char fstype[32];
+    unsigned long long total_kb;
+    unsigned long long used_kb;
+    unsigned long long avail_kb;
+} DiskInfo;
+
+typedef struct {
+    char name[32];
+    unsigned long long rx_bytes;
+    unsigned long long tx_bytes;
+    unsigned long long rx_packets;
+    unsigned long long tx_packets;
+    unsigned long long rx_errors;
+    unsigned long long tx_errors;
+} IfaceInfo;
+
+typedef struct {
+    char hostname[64];
+    char sysname[64];
+    char release[64];
+    char version[128];
+    char machine[64];
+    int num_cpus;
+    unsigned long long uptime_sec;
+} SysInfo;
+
+const char* collect_backend_name(void);
+
+int collect_process_count(void);
+int collect_processes(ProcInfo *procs, int max);
+int collect_threads(ThreadInfo *threads, int max);
+int collect_memory(MemInfo *mem);
+int collect_disks(DiskInfo *disks, int max);
+int collect_interfaces(IfaceInfo *ifaces, int max);
+int collect_system(SysInfo *sys);
+
+/* CPU time all CPUs spent outside the idle loop since boot; never decreases */
+int collect_cpu_busy_ms(unsigned long long *busy_ms);
+
+int collect_local_process_count(void);
+int collect_local_processes(ProcInfo *procs, int max);
+int collect_local_memory(MemInfo *mem);
+int collect_local_disks(DiskInfo *disks, int max);
+int collect_local_interfaces(IfaceInfo *ifaces, int max);
+int collect_local_system(SysInfo *sys);
+
+/* Text renderers for the section table, returning length or -1 */
+int native_memory_overview(char *out, size_t size);
+int native_memory_detailed(char *out, size_t size);
+int native_system_info(char *out, size_t size);
+int native_network_stats(char *out, size_t size);
+int native_disk_usage(char *out, size_t size);
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "metrics_event.h"
+
+#if defined(__linux__) && !defined(EV_USE_POLL)
+
+#include <sys/epoll.h>
+
+/* epoll backend */
+struct EventLoop {
+    int epfd;
+    struct epoll_event *events;
+    int capacity;
+};
+
+static unsigned int to_epoll(int events) {
+    unsigned int e = 0;
+    if (events & EV_READ) e |= EPOLLIN;
+    if (events & EV_WRITE) e |= EPOLLOUT;
+    return e;
+}
+
+EventLoop* ev_create(void) {
+    EventLoop *loop = calloc(1, sizeof(EventLoop));
+    
+    if (!loop) return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void ev_destroy(EventLoop *loop) {
+    if (!loop) return;
+    close(loop->epfd);
+    free(loop->events);
+    free(loop);
+}
+
+int ev_add(EventLoop *loop, int fd, int events, void *ptr) {
+    struct epoll_event ev;
+    
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.ptr = ptr;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int ev_modify(EventLoop *loop, int fd, int events, void *ptr) {
+    struct epoll_event ev;
+    
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.ptr = ptr;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int ev_remove(EventLoop *loop, int fd) {
+    struct epoll_event ev;
+    
+    memset(&ev, 0, sizeof(ev));
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int ev_wait(EventLoop *loop, EventResult *results, int max_results, int timeout_ms) {
+    int n, i;
+    
+    if (loop->capacity < max_results) {
+        struct epoll_event *events = realloc(loop->events, sizeof(struct epoll_event) * max_results);
+        if (!events) return -1;
+        loop->events = events;
+        loop->capacity = max_results;
+    }
+    
+    n = epoll_wait(loop->epfd, loop->events, max_results, timeout_ms);
+    if (n < 0) return (errno == EINTR) ? 0 : -1;
+    
+    for (i = 0; i < n; i++) {
+        unsigned int e = loop->events[i].events;
+        results[i].ptr = loop->events[i].data.ptr;
+        results[i].events = 0;
+        if (e & EPOLLIN) results[i].events |= EV_READ;
+        if (e & EPOLLOUT) results[i].events |= EV_WRITE;
+        if (e & (EPOLLERR | EPOLLHUP)) results[i].events |= EV_ERROR | EV_READ;
+    }
+    return n;
+}
+
+const char* ev_backend_name(void) {
+    return "epoll";
+}
+
+#else
+
+#include <poll.h>
+
+/* Portable poll() backend: dense pollfd array plus an fd -> slot index */
+struct EventLoop {
+    struct pollfd *fds;
+    void **ptrs;
+    int count;
+    int capacity;
+    int *slot_of_fd;
+    int slot_capacity;
+};
+
+static short to_poll(int events) {
+    short e = 0;
+    if (events & EV_READ) e |= POLLIN;
+    if (events & EV_WRITE) e |= POLLOUT;
+    return e;
+}
+
+EventLoop* ev_create(void) {
+    return calloc(1, sizeof(EventLoop));
+}
+
+void ev_destroy(EventLoop *loop) {
+    if (!loop) return;
+    free(loop->fds);
+    free(loop->ptrs);
+    free(loop->slot_of_fd);
+    free(loop);
+}
+
+int ev_add(EventLoop *loop, int fd, int events, void *ptr) {
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    
+    if (fd >= loop->slot_capacity) {
+        int new_capacity = loop->slot_capacity ? loop->slot_capacity : 64;
+        int *slots;
+        int i;
+        
+        while (new_capacity <= fd) new_capacity *= 2;
+        slots = realloc(loop->slot_of_fd, sizeof(int) * new_capacity);
+        if (!slots) return -1;
+        for (i = loop->slot_capacity; i < new_capacity; i++) slots[i] = -1;
+        loop->slot_of_fd = slots;
+        loop->slot_capacity = new_capacity;
+    }
+    if (loop->slot_of_fd[fd] >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    
+    if (loop->count == loop->capacity) {
+        int new_capacity = loop->capacity ? loop->capacity * 2 : 64;
+        struct pollfd *fds = realloc(loop->fds, sizeof(struct pollfd) * new_capacity);
+        void **ptrs;
+        
+        if (!fds) return -1;
+        loop->fds = fds;
+        ptrs = realloc(loop->ptrs, sizeof(void*) * new_capacity);
+        if (!ptrs) return -1;
+        loop->ptrs = ptrs;
+        loop->capacity = new_capacity;
+    }
+    
+    loop->fds[loop->count].fd = fd;
+    loop->fds[loop->count].events = to_poll(events);
+    loop->fds[loop->count].revents = 0;
+    loop->ptrs[loop->count] = ptr;
+    loop->slot_of_fd[fd] = loop->count;
+    loop->count++;
+    return 0;
+}
+
+int ev_modify(EventLoop *loop, int fd, int events, void *ptr) {
+    int slot;
+    
+    if (fd < 0 || fd >= loop->slot_capacity || (slot = loop->slot_of_fd[fd]) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    loop->fds[slot].events = to_poll(events);
+    loop->ptrs[slot] = ptr;
+    return 0;
+}
+
+int ev_remove(EventLoop *loop, int fd) {
+    int slot, last;
+    
+    if (fd < 0 || fd >= loop->slot_capacity || (slot = loop->slot_of_fd[fd]) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    /* Move the last entry into the freed slot to keep the array dense */
+    last = loop->count - 1;
+    if (slot != last) {
+        loop->fds[slot] = loop->fds[last];
+        loop->ptrs[slot] = loop->ptrs[last];
+        loop->slot_of_fd[loop->fds[slot].fd] = slot;
+    }
+    loop->slot_of_fd[fd] = -1;
+    loop->count--;
+    return 0;
+}
+
+int ev_wait(EventLoop *loop, EventResult *results, int max_results, int timeout_ms) {
+    int ready, i, n = 0;
+    
+    ready = poll(loop->fds, (nfds_t)loop->count, timeout_ms);
+    if (ready < 0) return (errno == EINTR) ? 0 : -1;
+    
+    for (i = 0; i < loop->count && n < ready && n < max_results; i++) {
+        short e = loop->fds[i].revents;
+        if (!e) continue;
+        results[n].ptr = loop->ptrs[i];
+        results[n].events = 0;
+        if (e & POLLIN) results[n].events |= EV_READ;
+        if (e & POLLOUT) results[n].events |= EV_WRITE;
+        if (e & (POLLERR | POLLHUP | POLLNVAL)) results[n].events |= EV_ERROR | EV_READ;
+        n++;
+    }
+    return n;
+}
+
+const char* ev_backend_name(void) {
+    return "poll";
+}
+
+#endif
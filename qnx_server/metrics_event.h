@@ -0,0 +1,30 @@
+#ifndef METRICS_EVENT_H
+#define METRICS_EVENT_H
+
+/*
+ * Readiness-based event loop backend.
+ *
+ * Uses epoll on Linux and a portable poll() backend everywhere else
+ * (QNX included). Define EV_USE_POLL to force the poll() backend.
+ */
+
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4
+
+typedef struct EventLoop EventLoop;
+
+typedef struct {
+    void *ptr;
+    int events;
+} EventResult;
+
+EventLoop* ev_create(void);
+void ev_destroy(EventLoop *loop);
+int ev_add(EventLoop *loop, int fd, int events, void *ptr);
+int ev_modify(EventLoop *loop, int fd, int events, void *ptr);
+int ev_remove(EventLoop *loop, int fd);
+int ev_wait(EventLoop *loop, EventResult *results, int max_results, int timeout_ms);
+const char* ev_backend_name(void);
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "metrics_exec.h"
+#include "metrics_time.h"
+
+extern char **environ;
+
+/* One exec_pool_run() call; lives on the caller's stack */
+typedef struct ExecBatch {
+    ExecJob *jobs;
+    int count;
+    int next;               /* Next job to hand out */
+    int done;
+    pthread_cond_t finished;
+    struct ExecBatch *link;
+} ExecBatch;
+
+struct ExecPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    ExecBatch *head;        /* Batches with jobs not yet handed out, oldest first */
+    ExecBatch *tail;
+    int stopping;
+    int workers;
+    pthread_t *threads;
+};
+
+static void* exec_worker(void *arg) {
+    ExecPool *pool = arg;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        ExecBatch *batch;
+        ExecJob *job;
+        
+        while (!pool->stopping && !pool->head) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stopping) break;
+        
+        batch = pool->head;
+        job = &batch->jobs[batch->next++];
+        if (batch->next == batch->count) {
+            pool->head = batch->link;
+            if (!pool->head) pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        
+        job->run(job->arg);
+        
+        pthread_mutex_lock(&pool->lock);
+        if (++batch->done == batch->count) pthread_cond_signal(&batch->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ExecPool* exec_pool_create(int workers) {
+    ExecPool *pool = calloc(1, sizeof(ExecPool));
+    int i;
+    
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    if (workers <= 0) return pool;
+    
+    pool->threads = calloc((size_t)workers, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, exec_worker, pool) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    pool->workers = i;
+    return pool;
+}
+
+void exec_pool_destroy(ExecPool *pool) {
+    int i;
+    
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (i = 0; i < pool->workers; i++) pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    free(pool);
+}
+
+void exec_pool_run(ExecPool *pool, ExecJob *jobs, int count) {
+    ExecBatch batch;
+    int i;
+    
+    if (count <= 0) return;
+    if (!pool || pool->workers == 0) {
+        for (i = 0; i < count; i++) jobs[i].run(jobs[i].arg);
+        return;
+    }
+    
+    memset(&batch, 0, sizeof(batch));
+    batch.jobs = jobs;
+    batch.count = count;
+    pthread_cond_init(&batch.finished, NULL);
+    
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) pool->tail->link = &batch;
+    else pool->head = &batch;
+    pool->tail = &batch;
+    pthread_cond_broadcast(&pool->work);
+    while (batch.done < batch.count) {
+        pthread_cond_wait(&batch.finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    pthread_cond_destroy(&batch.finished);
+}
+
+int exec_command(const char *cmd, char *output, size_t output_size, int timeout_ms, int *timed_out) {
+    char *argv[] = {"sh", "-c", (char*)cmd, NULL};
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    long long deadline = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+    size_t total_read = 0;
+    int pipefd[2];
+    pid_t pid;
+    int rc;
+    
+    *timed_out = 0;
+    output[0] = '\0';
+    
+    if (pipe(pipefd) == -1) {
+        snprintf(output, output_size, "[Command failed: %s]\n", cmd);
+        return -1;
+    }
+    /* Other workers spawn concurrently; keep our pipe out of their children */
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    
+    /* Own process group so a timeout kills the whole pipeline */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    
+    rc = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pipefd[1]);
+    
+    if (rc != 0) {
+        close(pipefd[0]);
+        snprintf(output, output_size, "[Command failed: %s]\n", cmd);
+        return -1;
+    }
+    
+    for (;;) {
+        struct pollfd pfd;
+        char discard[4096];
+        int wait_ms = -1;
+        ssize_t n;
+        
+        if (deadline) {
+            long long left = deadline - monotonic_ms();
+            if (left <= 0) {
+                *timed_out = 1;
+                break;
+            }
+            wait_ms = (int)left;
+        }
+        
+        pfd.fd = pipefd[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        rc = poll(&pfd, 1, wait_ms);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc < 0) break;
+        if (rc == 0) continue;
+        
+        /* Past the buffer keep draining so the command is never blocked on us */
+        if (total_read < output_size - 1) {
+            n = read(pipefd[0], output + total_read, output_size - 1 - total_read);
+            if (n > 0) total_read += (size_t)n;
+        } else {
+            n = read(pipefd[0], discard, sizeof(discard));
+        }
+        if (n == 0) break;
+        if (n < 0 && errno != EINTR && errno != EAGAIN) break;
+    }
+    close(pipefd[0]);
+    
+    if (*timed_out) kill(-pid, SIGKILL);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    
+    output[total_read] = '\0';
+    if (*timed_out) {
+        int n = snprintf(output + total_read, output_size - total_read,
+                         "%s[Timed out after %d ms]\n",
+                         total_read > 0 && output[total_read - 1] != '\n' ? "\n" : "", timeout_ms);
+        if (n > 0) total_read += (size_t)n < output_size - total_read ? (size_t)n : output_size - total_read - 1;
+    }
+    return (int)total_read;
+}
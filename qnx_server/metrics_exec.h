@@ -0,0 +1,35 @@
+#ifndef METRICS_EXEC_H
+#define METRICS_EXEC_H
+
+#include <stddef.h>
+
+/*
+ * Section command execution.
+ *
+ * exec_command() runs a shell command in its own process group and kills
+ * the whole group when it overruns its deadline. ExecPool is a fixed set of
+ * worker threads that runs a batch of jobs and returns when all are done;
+ * several callers may run batches on the same pool concurrently.
+ */
+
+typedef struct ExecPool ExecPool;
+
+typedef struct {
+    void (*run)(void *arg);
+    void *arg;
+} ExecJob;
+
+/* workers <= 0 gives a pool that runs every batch on the calling thread */
+ExecPool* exec_pool_create(int workers);
+void exec_pool_destroy(ExecPool *pool);
+void exec_pool_run(ExecPool *pool, ExecJob *jobs, int count);
+
+/*
+ * Run cmd through /bin/sh -c and capture its stdout into output. Returns
+ * the captured length, or -1 if the command could not be started. When the
+ * command is killed for exceeding timeout_ms (<= 0: no limit), *timed_out
+ * is set and a note is appended to the output.
+ */
+int exec_command(const char *cmd, char *output, size_t output_size, int timeout_ms, int *timed_out);
+
+#endif
@@ -0,0 +1,738 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics_fleet.h"
+#include "metrics_time.h"
+#include "metrics_stats.h"
+#include "metrics_log.h"
+
+#define FLEET_BODY_MAX (256 * 1024)
+#define FLEET_READ_CHUNK 4096
+#define FLEET_DISCOVER_INTERVAL 60
+#define FLEET_MDNS_WAIT_MS 1000
+#define MDNS_GROUP "224.0.0.251"
+#define MDNS_PORT 5353
+
+enum { SCRAPE_CONNECTING, SCRAPE_SENDING, SCRAPE_READING, SCRAPE_DONE };
+
+typedef struct {
+    char instance[72];          /* host:port, the instance label */
+    char host[64];              /* Sent as the Host header */
+    char path[128];
+    struct sockaddr_in addr;
+} FleetNode;
+
+/* One node's part of a round */
+typedef struct {
+    FleetNode node;
+    int fd;
+    int state;
+    char request[256];
+    size_t request_len;
+    size_t sent;
+    char *buf;
+    size_t len;
+    size_t cap;
+    unsigned long long deadline_ms;
+    double duration;
+    const char *result;         /* ok, timeout, error or http (a non-200 answer) */
+    const char *body;           /* Within buf once the answer is complete */
+    size_t body_len;
+    int samples;
+} Scrape;
+
+/* HELP and TYPE of one family, as the first node to describe it had them */
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *help;
+    size_t help_len;
+    const char *type;
+    size_t type_len;
+} FleetFamily;
+
+typedef struct {
+    const char *family;
+    size_t family_len;
+    const char *line;
+    size_t len;
+    int node;
+    int order;
+} FleetSample;
+
+static FleetNode nodes[FLEET_MAX_NODES];
+static int node_count = 0;
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static int scrape_timeout_ms = FLEET_DEFAULT_TIMEOUT_MS;
+static StatsFamily *stat_fleet_scrapes;
+
+/* Series the gateway writes itself; node samples of the same name are dropped */
+static const char *own_families[] = {"up", "scrape_duration_seconds", "scrape_samples_scraped"};
+
+/* Add addr unless a node already has it; returns 1 if added, 0 if known, -1 when the table is full */
+static int node_insert(const char *instance, const char *host, const char *path, const struct sockaddr_in *addr) {
+    int i, result = 0;
+    
+    pthread_mutex_lock(&nodes_lock);
+    for (i = 0; i < node_count; i++) {
+        if (nodes[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && nodes[i].addr.sin_port == addr->sin_port &&
+            strcmp(nodes[i].path, path) == 0) break;
+    }
+    if (i == node_count) {
+        if (node_count == FLEET_MAX_NODES) {
+            result = -1;
+        } else {
+            FleetNode *node = &nodes[node_count];
+            snprintf(node->instance, sizeof(node->instance), "%s", instance);
+            snprintf(node->host, sizeof(node->host), "%s", host);
+            snprintf(node->path, sizeof(node->path), "%s", path);
+            node->addr = *addr;
+            __atomic_store_n(&node_count, node_count + 1, __ATOMIC_RELEASE);
+            result = 1;
+        }
+    }
+    pthread_mutex_unlock(&nodes_lock);
+    return result;
+}
+
+int fleet_add_node(const char *spec) {
+    struct addrinfo hints, *res;
+    char host[64], port[8] = "80", instance[72];
+    const char *path, *host_end;
+    size_t host_len;
+    struct sockaddr_in addr;
+    
+    if (strncmp(spec, "http://", 7) == 0) spec += 7;
+    path = strchr(spec, '/');
+    if (!path) path = spec + strlen(spec);
+    host_end = memchr(spec, ':', (size_t)(path - spec));
+    if (!host_end) host_end = path;
+    
+    host_len = (size_t)(host_end - spec);
+    if (host_len == 0 || host_len >= sizeof(host) || strlen(path) >= sizeof(nodes[0].path)) return -1;
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+    if (host_end < path) {
+        size_t port_len = (size_t)(path - host_end - 1);
+        if (port_len == 0 || port_len >= sizeof(port)) return -1;
+        memcpy(port, host_end + 1, port_len);
+        port[port_len] = '\0';
+    }
+    
+    /* Resolved once: boards are expected to keep their DHCP leases */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    freeaddrinfo(res);
+    
+    snprintf(instance, sizeof(instance), "%s:%s", host, port);
+    return node_insert(instance, host, *path ? path : "/metrics", &addr) < 0 ? -1 : 0;
+}
+
+int fleet_node_count(void) {
+    return __atomic_load_n(&node_count, __ATOMIC_ACQUIRE);
+}
+
+static long long stats_fleet_nodes(void) {
+    return fleet_node_count();
+}
+
+/*
+ * mDNS discovery (RFC 6762). The query goes to the multicast group from
+ * an ordinary port, which makes it a one-shot query: every responder for
+ * the name answers straight back to that port, so no 5353 socket (and no
+ * conflict with a system responder) is needed.
+ */
+
+/* Read a possibly compressed name at *pos into out, dotted; advances *pos past it */
+static int dns_name(const unsigned char *msg, size_t len, size_t *pos, char *out, size_t size) {
+    size_t p = *pos, out_len = 0;
+    int jumps = 0, jumped = 0;
+    
+    for (;;) {
+        unsigned int label;
+        
+        if (p >= len) return -1;
+        label = msg[p];
+        if (label == 0) {
+            if (!jumped) *pos = p + 1;
+            break;
+        }
+        if ((label & 0xc0) == 0xc0) {
+            if (p + 1 >= len || ++jumps > 16) return -1;
+            if (!jumped) *pos = p + 2;
+            jumped = 1;
+            p = ((label & 0x3f) << 8) | msg[p + 1];
+            continue;
+        }
+        if (label > 63 || p + 1 + label > len || out_len + label + 2 > size) return -1;
+        if (out_len > 0) out[out_len++] = '.';
+        memcpy(out + out_len, msg + p + 1, label);
+        out_len += label;
+        p += 1 + label;
+    }
+    out[out_len] = '\0';
+    return 0;
+}
+
+/* Add a node for every A record for name in one response */
+static int mdns_parse(const unsigned char *msg, size_t len, const char *name) {
+    size_t pos = 12;
+    int questions, records, i, found = 0;
+    char rr_name[256];
+    
+    if (len < 12 || !(msg[2] & 0x80)) return 0;
+    questions = (msg[4] << 8) | msg[5];
+    records = ((msg[6] << 8) | msg[7]) + ((msg[8] << 8) | msg[9]) + ((msg[10] << 8) | msg[11]);
+    
+    for (i = 0; i < questions; i++) {
+        if (dns_name(msg, len, &pos, rr_name, sizeof(rr_name)) != 0 || pos + 4 > len) return found;
+        pos += 4;
+    }
+    for (i = 0; i < records; i++) {
+        unsigned int type, rdlen;
+        
+        if (dns_name(msg, len, &pos, rr_name, sizeof(rr_name)) != 0 || pos + 10 > len) return found;
+        type = (msg[pos] << 8) | msg[pos + 1];
+        rdlen = (msg[pos + 8] << 8) | msg[pos + 9];
+        pos += 10;
+        if (pos + rdlen > len) return found;
+        
+        if (type == 1 && rdlen == 4 && strcasecmp(rr_name, name) == 0) {
+            struct sockaddr_in addr;
+            char address[INET_ADDRSTRLEN], instance[72];
+            
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(80);
+            memcpy(&addr.sin_addr, msg + pos, 4);
+            inet_ntop(AF_INET, &addr.sin_addr, address, sizeof(address));
+            snprintf(instance, sizeof(instance), "%s:80", address);
+            if (node_insert(instance, name, "/metrics", &addr) > 0) found++;
+        }
+        pos += rdlen;
+    }
+    return found;
+}
+
+static int mdns_discover(const char *name) {
+    unsigned char packet[512];
+    size_t len = 12;
+    const char *label = name;
+    struct sockaddr_in group;
+    unsigned char ttl = 255;
+    unsigned long long deadline;
+    int fd, found = 0;
+    
+    /* Header: id 0, standard query, one question */
+    memset(packet, 0, len);
+    packet[5] = 1;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+        
+        if (label_len == 0 || label_len > 63 || len + label_len + 6 > sizeof(packet)) return -1;
+        packet[len++] = (unsigned char)label_len;
+        memcpy(packet + len, label, label_len);
+        len += label_len;
+        label += label_len + (dot ? 1 : 0);
+    }
+    packet[len++] = 0;
+    packet[len++] = 0;
+    packet[len++] = 1;              /* A */
+    packet[len++] = 0;
+    packet[len++] = 1;              /* IN */
+    
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(MDNS_PORT);
+    inet_pton(AF_INET, MDNS_GROUP, &group.sin_addr);
+    if (sendto(fd, packet, len, 0, (struct sockaddr*)&group, sizeof(group)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    /* Every board answers; collect for a while */
+    deadline = monotonic_ms() + FLEET_MDNS_WAIT_MS;
+    for (;;) {
+        unsigned char reply[1500];
+        struct pollfd pfd;
+        unsigned long long now = monotonic_ms();
+        ssize_t n;
+        
+        if (now >= deadline) break;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, (int)(deadline - now)) <= 0) continue;
+        n = recv(fd, reply, sizeof(reply), 0);
+        if (n > 0) found += mdns_parse(reply, (size_t)n, name);
+    }
+    close(fd);
+    return found;
+}
+
+static void* fleet_discover_thread(void *arg) {
+    const char *name = arg;
+    
+    for (;;) {
+        int found = mdns_discover(name);
+        
+        if (found > 0) log_message(LOG_INFO, "Fleet: %d new node(s) for %s, %d in all", found, name, fleet_node_count());
+        sleep(FLEET_DISCOVER_INTERVAL);
+    }
+    return NULL;
+}
+
+int fleet_start(int timeout_ms, const char *mdns_name) {
+    scrape_timeout_ms = timeout_ms > 0 ? timeout_ms : FLEET_DEFAULT_TIMEOUT_MS;
+    stat_fleet_scrapes = stats_family(STATS_COUNTER, "qnx_exporter_fleet_scrapes_total",
+        "Node scrapes by outcome: ok, timeout, error (connect or read) or http (not 200)", "result", 4);
+    stats_gauge_func("qnx_exporter_fleet_nodes", "Nodes in the fleet, listed or discovered", stats_fleet_nodes);
+    
+    if (mdns_name) {
+        pthread_t thread;
+        
+        if (pthread_create(&thread, NULL, fleet_discover_thread, (void*)mdns_name) != 0) return -1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+/*
+ * Scrape round. Every node gets its own connection and deadline; one
+ * poll() loop drives them all and the round ends when the last one has
+ * answered or run out of time.
+ */
+
+static void scrape_finish(Scrape *s, const char *result, unsigned long long started_ms) {
+    if (s->fd >= 0) close(s->fd);
+    s->fd = -1;
+    s->state = SCRAPE_DONE;
+    s->result = result;
+    s->duration = (double)(monotonic_ms() - started_ms) / 1000.0;
+    stats_add(stat_fleet_scrapes, result, 1);
+}
+
+static void scrape_open(Scrape *s, unsigned long long started_ms) {
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    s->deadline_ms = started_ms + (unsigned long long)scrape_timeout_ms;
+    s->request_len = (size_t)snprintf(s->request, sizeof(s->request),
+        "GET %s HTTP/1.0\r\nHost: %s\r\nAccept: text/plain\r\nUser-Agent: qnx-metrics-fleet\r\n\r\n",
+        s->node.path, s->node.host);
+    if (s->fd < 0 || s->request_len >= sizeof(s->request)) {
+        scrape_finish(s, "error", started_ms);
+        return;
+    }
+    fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(s->fd, (struct sockaddr*)&s->node.addr, sizeof(s->node.addr)) == 0) {
+        s->state = SCRAPE_SENDING;
+    } else if (errno == EINPROGRESS) {
+        s->state = SCRAPE_CONNECTING;
+    } else {
+        scrape_finish(s, "error", started_ms);
+    }
+}
+
+/* The node closed the connection: check the status line and find the body */
+static const char* scrape_parse(Scrape *s) {
+    char *head_end, *length;
+    int status = 0;
+    
+    if (!s->buf) return "error";
+    s->buf[s->len] = '\0';
+    if (sscanf(s->buf, "HTTP/1.%*d %d", &status) != 1) return "error";
+    head_end = strstr(s->buf, "\r\n\r\n");
+    if (!head_end) return "error";
+    if (status != 200) return "http";
+    
+    s->body = head_end + 4;
+    s->body_len = s->len - (size_t)(s->body - s->buf);
+    
+    /* Headers are case-insensitive; a short body means the node went away mid-answer */
+    *head_end = '\0';
+    for (length = s->buf; (length = strchr(length, '\n')) != NULL; length++) {
+        if (strncasecmp(length + 1, "Content-Length:", 15) == 0) {
+            if (strtoul(length + 16, NULL, 10) > s->body_len) return "error";
+            break;
+        }
+    }
+    return "ok";
+}
+
+static void scrape_step(Scrape *s, short revents, unsigned long long started_ms) {
+    if (s->state == SCRAPE_CONNECTING) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err) {
+            scrape_finish(s, "error", started_ms);
+            return;
+        }
+        s->state = SCRAPE_SENDING;
+    }
+    
+    if (s->state == SCRAPE_SENDING) {
+        ssize_t n = send(s->fd, s->request + s->sent, s->request_len - s->sent, 0);
+        
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) scrape_finish(s, "error", started_ms);
+            return;
+        }
+        s->sent += (size_t)n;
+        if (s->sent == s->request_len) s->state = SCRAPE_READING;
+        return;
+    }
+    
+    if (s->state == SCRAPE_READING && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        ssize_t n;
+        
+        if (s->cap - s->len < FLEET_READ_CHUNK + 1) {
+            size_t cap = s->cap ? s->cap * 2 : 4 * FLEET_READ_CHUNK;
+            char *buf = cap > FLEET_BODY_MAX + FLEET_READ_CHUNK ? NULL : realloc(s->buf, cap);
+            
+            if (!buf) {
+                scrape_finish(s, "error", started_ms);
+                return;
+            }
+            s->buf = buf;
+            s->cap = cap;
+        }
+        n = recv(s->fd, s->buf + s->len, s->cap - s->len - 1, 0);
+        if (n > 0) {
+            s->len += (size_t)n;
+        } else if (n == 0) {
+            scrape_finish(s, scrape_parse(s), started_ms);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            scrape_finish(s, "error", started_ms);
+        }
+    }
+}
+
+static void scrape_round(Scrape *scrapes, int count) {
+    struct pollfd pfds[FLEET_MAX_NODES];
+    int index[FLEET_MAX_NODES];
+    unsigned long long started_ms = monotonic_ms();
+    int i;
+    
+    for (i = 0; i < count; i++) scrape_open(&scrapes[i], started_ms);
+    
+    for (;;) {
+        unsigned long long now = monotonic_ms();
+        int waiting = 0, timeout = -1;
+        
+        for (i = 0; i < count; i++) {
+            Scrape *s = &scrapes[i];
+            
+            if (s->state == SCRAPE_DONE) continue;
+            if (now >= s->deadline_ms) {
+                scrape_finish(s, "timeout", started_ms);
+                continue;
+            }
+            if (timeout < 0 || (int)(s->deadline_ms - now) < timeout) timeout = (int)(s->deadline_ms - now);
+            pfds[waiting].fd = s->fd;
+            pfds[waiting].events = s->state == SCRAPE_READING ? POLLIN : POLLOUT;
+            pfds[waiting].revents = 0;
+            index[waiting++] = i;
+        }
+        if (waiting == 0) break;
+        
+        if (poll(pfds, (nfds_t)waiting, timeout) < 0 && errno != EINTR) {
+            for (i = 0; i < waiting; i++) scrape_finish(&scrapes[index[i]], "error", started_ms);
+            break;
+        }
+        for (i = 0; i < waiting; i++) {
+            if (pfds[i].revents) scrape_step(&scrapes[index[i]], pfds[i].revents, started_ms);
+        }
+    }
+}
+
+/*
+ * Merging. Samples from all nodes are sorted by family, then node, then
+ * position, so each family is one block with a single HELP and TYPE.
+ */
+
+static size_t metric_name_length(const char *p, const char *end) {
+    const char *start = p;
+    
+    while (p < end && (*p == '_' || *p == ':' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                       (p > start && *p >= '0' && *p <= '9'))) {
+        p++;
+    }
+    return (size_t)(p - start);
+}
+
+/* "# HELP name text" or "# TYPE name type": remember it for name unless a node already did */
+static int family_describe(FleetFamily *families, int count, const char *line, const char *end) {
+    const char *name, *text;
+    size_t name_len;
+    int help, i;
+    
+    if (end - line < 7 || (strncmp(line, "# HELP ", 7) != 0 && strncmp(line, "# TYPE ", 7) != 0)) return count;
+    help = line[2] == 'H';
+    name = line + 7;
+    name_len = metric_name_length(name, end);
+    if (name_len == 0 || name + name_len >= end || name[name_len] != ' ') return count;
+    text = name + name_len + 1;
+    
+    for (i = 0; i < count; i++) {
+        if (families[i].name_len == name_len && memcmp(families[i].name, name, name_len) == 0) break;
+    }
+    if (i == count) {
+        if (count == FLEET_MAX_NODES * 16) return count;
+        memset(&families[count], 0, sizeof(FleetFamily));
+        families[count].name = name;
+        families[count].name_len = name_len;
+        count++;
+    }
+    if (help && !families[i].help) {
+        families[i].help = text;
+        families[i].help_len = (size_t)(end - text);
+    } else if (!help && !families[i].type) {
+        families[i].type = text;
+        families[i].type_len = (size_t)(end - text);
+    }
+    return count;
+}
+
+/* The typed family a sample belongs to (histogram buckets, counter _total, ...), or NULL */
+static const FleetFamily* family_of(const FleetFamily *families, int count, const char *name, size_t name_len) {
+    static const char *suffixes[] = {"", "_bucket", "_count", "_sum", "_total", "_created", "_info"};
+    int i, j;
+    
+    for (i = 0; i < count; i++) {
+        const FleetFamily *f = &families[i];
+        
+        if (!f->type || f->name_len > name_len || memcmp(f->name, name, f->name_len) != 0) continue;
+        for (j = 0; j < (int)(sizeof(suffixes) / sizeof(suffixes[0])); j++) {
+            size_t suffix_len = strlen(suffixes[j]);
+            if (f->name_len + suffix_len == name_len &&
+                memcmp(name + f->name_len, suffixes[j], suffix_len) == 0) return f;
+        }
+    }
+    return NULL;
+}
+
+static int sample_compare(const void *a, const void *b) {
+    const FleetSample *x = a, *y = b;
+    size_t len = x->family_len < y->family_len ? x->family_len : y->family_len;
+    int c = memcmp(x->family, y->family, len);
+    
+    if (c) return c;
+    if (x->family_len != y->family_len) return x->family_len < y->family_len ? -1 : 1;
+    if (x->node != y->node) return x->node - y->node;
+    return x->order - y->order;
+}
+
+/* A sample line with instance added first to its labels; -1 (nothing written) if malformed */
+static int write_sample(JsonWriter *w, const char *line, size_t len, size_t name_len, const char *instance) {
+    const char *end = line + len, *p = line + name_len;
+    const char *labels = NULL, *labels_end = NULL;
+    
+    if (p < end && *p == '{') {
+        /* Check the label set before writing any of it */
+        labels = ++p;
+        while (p < end && *p != '}') {
+            size_t label_len = metric_name_length(p, end);
+            
+            if (label_len == 0 || p + label_len + 1 >= end || p[label_len] != '=' || p[label_len + 1] != '"') {
+                return -1;
+            }
+            for (p += label_len + 2; p < end && *p != '"'; p++) {
+                if (*p == '\\') p++;
+            }
+            if (p >= end) return -1;
+            p++;
+            if (p < end && *p == ',') p++;
+        }
+        if (p >= end) return -1;
+        labels_end = p++;
+    }
+    if (p >= end || (*p != ' ' && *p != '\t')) return -1;
+    
+    writer_write(w, line, name_len);
+    writer_printf(w, "{instance=\"%s\"", instance);
+    while (labels && labels < labels_end) {
+        const char *label = labels;
+        size_t label_len = metric_name_length(label, labels_end);
+        int renamed = label_len == 8 && memcmp(label, "instance", 8) == 0;
+        
+        /* The node's own instance label is kept as exported_instance, as Prometheus does */
+        writer_write(w, renamed ? ",exported_" : ",", renamed ? 10 : 1);
+        for (labels = label + label_len + 2; *labels != '"'; labels++) {
+            if (*labels == '\\') labels++;
+        }
+        labels++;
+        writer_write(w, label, (size_t)(labels - label));
+        if (labels < labels_end && *labels == ',') labels++;
+    }
+    writer_write(w, "}", 1);
+    writer_write(w, p, (size_t)(end - p));
+    writer_write(w, "\n", 1);
+    return 0;
+}
+
+static int is_own_family(const char *name, size_t len) {
+    int i;
+    
+    for (i = 0; i < (int)(sizeof(own_families) / sizeof(own_families[0])); i++) {
+        if (strlen(own_families[i]) == len && memcmp(own_families[i], name, len) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Next non-empty line of a body, without its line ending; returns 0 at the end */
+static int next_line(const char **cursor, const char *stop, const char **line, const char **end) {
+    while (*cursor < stop) {
+        const char *eol = memchr(*cursor, '\n', (size_t)(stop - *cursor));
+        
+        *line = *cursor;
+        *end = eol ? eol : stop;
+        *cursor = *end + 1;
+        if (*end > *line && (*end)[-1] == '\r') (*end)--;
+        if (*end > *line) return 1;
+    }
+    return 0;
+}
+
+static void merge_samples(JsonWriter *w, Scrape *scrapes, int count) {
+    FleetFamily *families = calloc(FLEET_MAX_NODES * 16, sizeof(FleetFamily));
+    FleetSample *samples = NULL;
+    size_t num_samples = 0, cap = 0, i;
+    int num_families = 0, node, order = 0;
+    const char *line, *end;
+    const char *last_family = NULL;
+    size_t last_family_len = 0;
+    
+    if (!families) {
+        w->failed = 1;
+        return;
+    }
+    
+    /* Descriptions first: a node may list a family's samples before its TYPE */
+    for (node = 0; node < count; node++) {
+        const char *cursor = scrapes[node].body, *stop = cursor + scrapes[node].body_len;
+        
+        if (!cursor) continue;
+        while (next_line(&cursor, stop, &line, &end)) {
+            if (*line == '#') num_families = family_describe(families, num_families, line, end);
+        }
+    }
+    
+    for (node = 0; node < count && !w->failed; node++) {
+        const char *cursor = scrapes[node].body, *stop = cursor + scrapes[node].body_len;
+        
+        if (!cursor) continue;
+        while (next_line(&cursor, stop, &line, &end)) {
+            size_t name_len = *line == '#' ? 0 : metric_name_length(line, end);
+            const FleetFamily *family;
+            
+            if (name_len == 0 || is_own_family(line, name_len)) continue;
+            if (num_samples == cap) {
+                FleetSample *grown = realloc(samples, (cap ? cap * 2 : 256) * sizeof(FleetSample));
+                if (!grown) {
+                    w->failed = 1;
+                    break;
+                }
+                samples = grown;
+                cap = cap ? cap * 2 : 256;
+            }
+            family = family_of(families, num_families, line, name_len);
+            samples[num_samples].family = family ? family->name : line;
+            samples[num_samples].family_len = family ? family->name_len : name_len;
+            samples[num_samples].line = line;
+            samples[num_samples].len = (size_t)(end - line);
+            samples[num_samples].node = node;
+            samples[num_samples].order = order++;
+            num_samples++;
+        }
+    }
+    
+    if (num_samples > 0) qsort(samples, num_samples, sizeof(FleetSample), sample_compare);
+    for (i = 0; i < num_samples && !w->failed; i++) {
+        FleetSample *s = &samples[i];
+        
+        if (!last_family || s->family_len != last_family_len || memcmp(s->family, last_family, last_family_len) != 0) {
+            const FleetFamily *family = NULL;
+            int f;
+            
+            for (f = 0; f < num_families; f++) {
+                if (families[f].name_len == s->family_len && memcmp(families[f].name, s->family, s->family_len) == 0) {
+                    family = &families[f];
+                    break;
+                }
+            }
+            if (family && family->help) {
+                writer_printf(w, "# HELP %.*s %.*s\n", (int)family->name_len, family->name,
+                              (int)family->help_len, family->help);
+            }
+            if (family && family->type) {
+                writer_printf(w, "# TYPE %.*s %.*s\n", (int)family->name_len, family->name,
+                              (int)family->type_len, family->type);
+            }
+            last_family = s->family;
+            last_family_len = s->family_len;
+        }
+        if (write_sample(w, s->line, s->len, metric_name_length(s->line, s->line + s->len),
+                         scrapes[s->node].node.instance) == 0) {
+            scrapes[s->node].samples++;
+        }
+    }
+    
+    free(samples);
+    free(families);
+}
+
+int fleet_write(JsonWriter *w) {
+    Scrape *scrapes;
+    int count, i;
+    
+    pthread_mutex_lock(&nodes_lock);
+    count = node_count;
+    scrapes = calloc(count > 0 ? (size_t)count : 1, sizeof(Scrape));
+    for (i = 0; scrapes && i < count; i++) {
+        scrapes[i].node = nodes[i];
+        scrapes[i].fd = -1;
+    }
+    pthread_mutex_unlock(&nodes_lock);
+    if (!scrapes) return -1;
+    
+    scrape_round(scrapes, count);
+    merge_samples(w, scrapes, count);
+    
+    writer_printf(w, "# HELP up Whether the node answered the last scrape\n# TYPE up gauge\n");
+    for (i = 0; i < count; i++) {
+        writer_printf(w, "up{instance=\"%s\"} %d\n", scrapes[i].node.instance, strcmp(scrapes[i].result, "ok") == 0);
+    }
+    writer_printf(w, "# HELP scrape_duration_seconds Time the node took to answer, or to run out of time\n"
+                     "# TYPE scrape_duration_seconds gauge\n");
+    for (i = 0; i < count; i++) {
+        writer_printf(w, "scrape_duration_seconds{instance=\"%s\"} %.6f\n", scrapes[i].node.instance,
+                      scrapes[i].duration);
+    }
+    writer_printf(w, "# HELP scrape_samples_scraped Samples the node returned\n# TYPE scrape_samples_scraped gauge\n");
+    for (i = 0; i < count; i++) {
+        writer_printf(w, "scrape_samples_scraped{instance=\"%s\"} %d\n", scrapes[i].node.instance, scrapes[i].samples);
+    }
+    
+    for (i = 0; i < count; i++) free(scrapes[i].buf);
+    free(scrapes);
+    return w->failed ? -1 : 0;
+}
@@ -0,0 +1,40 @@
+#ifndef METRICS_FLEET_H
+#define METRICS_FLEET_H
+
+#include "metrics_writer.h"
+
+/*
+ * Fleet gateway.
+ *
+ * Scrapes the /metrics page of every ESP32 node in one round: all
+ * connections are opened at once on non-blocking sockets and driven by a
+ * single poll() loop, and each node has its own deadline, so a slow or
+ * dead board costs the round at most that deadline and never delays the
+ * others. Nodes are listed with fleet_add_node() or discovered over mDNS:
+ * every board answers for qubernetes.local, so one query finds them all.
+ * The query is repeated every minute and nodes are never forgotten, so a
+ * board that goes away is reported as down rather than disappearing.
+ *
+ * fleet_write() renders a round as Prometheus text: each node's samples
+ * with an instance label naming it (an instance label of its own becomes
+ * exported_instance), grouped by family across nodes, then up,
+ * scrape_duration_seconds and scrape_samples_scraped for every node.
+ * Rounds are expected one at a time (the body cache serializes builds).
+ */
+
+#define FLEET_MAX_NODES 64
+#define FLEET_DEFAULT_TIMEOUT_MS 2000
+#define FLEET_MDNS_NAME "qubernetes.local"
+
+/* host[:port][/path], default port 80 and path /metrics; -1 if malformed, unresolvable or too many */
+int fleet_add_node(const char *spec);
+
+/* Per-node deadline for a round; mdns_name (or NULL) is looked up now and every minute after */
+int fleet_start(int timeout_ms, const char *mdns_name);
+
+int fleet_node_count(void);
+
+/* Scrape every node once and write the result; returns 0, or -1 if the writer failed */
+int fleet_write(JsonWriter *w);
+
+#endif
@@ -9,26 +9,108 @@
 #include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <strings.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/tcp.h>
+
+#include "metrics_collect.h"
+#include "metrics_procs.h"
+#include "metrics_stats.h"
+#include "metrics_cache.h"
+#include "metrics_remote.h"
+#include "metrics_tsdb.h"
+#include "metrics_writer.h"
+#include "metrics_fleet.h"
+#include "metrics_listen.h"
+#include "metrics_bus.h"
+#include "metrics_log.h"
+#include "metrics_budget.h"
 
 #define PORT 9090
 #define BUFFER_SIZE 16384
+#define PROCS_MAX_AGE_MS 1000
+#define MAX_IFACES 32
+#define REQUEST_MAX 8192
+#define REQUEST_TIMEOUT 10
+#define SEND_TIMEOUT 30
+#define DEFAULT_KEEPALIVE_TIMEOUT 60
+#define DEFAULT_REFRESH_INTERVAL 5
+#define CACHE_IDLE_MS 300000
+#define DEFAULT_QUEUE_DEPTH 32
+#define MAX_ACCEPTORS 16
+#define IDLE_POLL_MS 250            /* How often an idle keep-alive connection checks for queued ones */
+#define EXPOSITION_BUFFER_SIZE 65536
+#define WRITE_CHUNK_SIZE 4096       /* Writer buffer for bodies streamed straight to the socket */
+#define GZIP_MIN_SIZE 1024          /* Smaller bodies go out uncompressed */
+#define GZIP_STREAM_MIN 65536       /* First gzip of a body this large is sent as it compresses */
+#define PROMETHEUS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+#define OPENMETRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
 
 volatile sig_atomic_t running = 1;
+int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;     /* Seconds an idle connection stays open, 0 = close after each response */
+int refresh_interval = DEFAULT_REFRESH_INTERVAL;       /* Seconds between background rebuilds, 0 = build per request */
+
+/* Bodies for / and both /metrics formats (and /fleet when enabled), rebuilt in the background */
+BodyCache json_cache;
+BodyCache prometheus_cache;
+BodyCache openmetrics_cache;
+BodyCache fleet_cache;
+BodyCache *caches[] = {&json_cache, &prometheus_cache, &openmetrics_cache, &fleet_cache};
+int fleet_enabled = 0;
+
+/* Self-instrumentation, served at /internal/metrics */
+StatsFamily *stat_command_seconds;
+StatsFamily *stat_build_seconds;
+StatsFamily *stat_requests;
+StatsFamily *stat_request_seconds;
+StatsFamily *stat_bytes_sent;
+StatsFamily *stat_accepted;
+StatsFamily *stat_reused;
+StatsFamily *stat_closed;
+StatsFamily *stat_cache;
+int active_clients = 0;
+
+/* TCP listening sockets (one per acceptor when the kernel balances them), then the Unix one */
+int listen_fds[MAX_ACCEPTORS + 1];
+int num_listen_fds = 0;
+const char *unix_path = NULL;
+
+/* Reply to a connection the queue has no room for; sent without reading the request */
+const char overload_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 23\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "{\"error\": \"overloaded\"}";
 
 void signal_handler(int sig) {
+    int i;
+    
     (void)sig;
     running = 0;
+    /* The signal may land on any thread: wake every acceptor blocked in accept() */
+    for (i = 0; i < num_listen_fds; i++) shutdown(listen_fds[i], SHUT_RDWR);
 }
 
-/* Safe command execution */
-int run_command(const char *cmd, char *output, size_t size) {
+double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Safe command execution; name is the short label its time is recorded under */
+int run_command(const char *name, const char *cmd, char *output, size_t size) {
     FILE *fp;
     size_t len = 0;
     char line[512];
+    struct timespec start, end;
     
     if (!cmd || !output || size < 2) return -1;
     output[0] = '\0';
     
+    clock_gettime(CLOCK_MONOTONIC, &start);
     fp = popen(cmd, "r");
     if (!fp) return -1;
     
@@ -40,319 +122,1417 @@ int run_command(const char *cmd, char *output, size_t size) {
     output[len] = '\0';
     
     pclose(fp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_observe(stat_command_seconds, name, elapsed_seconds(&start, &end));
     return (int)len;
 }
 
-/* Escape string for JSON */
-void json_escape_string(const char *src, char *dest, size_t dest_size) {
-    size_t i, j = 0;
-    
-    if (!dest || dest_size == 0) return;
-    if (!src) {
-        dest[0] = '\0';
-        return;
-    }
-    
-    for (i = 0; src[i] && j < dest_size - 2; i++) {
-        char c = src[i];
-        if (c == '"' || c == '\\') {
-            if (j < dest_size - 3) {
-                dest[j++] = '\\';
-                dest[j++] = c;
-            }
-        } else if (c == '\n') {
-            if (j < dest_size - 3) {
-                dest[j++] = '\\';
-                dest[j++] = 'n';
-            }
-        } else if (c == '\r') {
-            /* skip */
-        } else if (c == '\t') {
-            if (j < dest_size - 3) {
-                dest[j++] = '\\';
-                dest[j++] = 't';
-            }
-        } else if ((unsigned char)c >= 32) {
-            dest[j++] = c;
-        }
-    }
-    dest[j] = '\0';
+/* prefix as is, text escaped, then suffix */
+void write_field(JsonWriter *w, const char *prefix, const char *text, const char *suffix) {
+    writer_write(w, prefix, strlen(prefix));
+    writer_escaped(w, text, strlen(text));
+    writer_write(w, suffix, strlen(suffix));
 }
 
 /* Generate comprehensive JSON metrics */
-int generate_json(char *out, size_t size) {
+void generate_json(JsonWriter *w) {
     char hostname[64] = "unknown";
     char kernel[64] = "unknown";
     char cpu_info[128] = "unknown";
     char uptime_str[128] = "";
     char mem_raw[1024] = "";
-    char proc_raw[8192] = "";
     char disk_raw[2048] = "";
     char net_raw[2048] = "";
     char proc_count[32] = "0";
-    char escaped[4096];
-    size_t len = 0;
     unsigned long long timestamp;
+    SysInfo sys;
+    int count;
+    /* Over the CPU budget even at the longest interval: leave out the process list, disks and interfaces */
+    int shedding = budget_shedding();
     
     /* Gather system info */
-    gethostname(hostname, sizeof(hostname) - 1);
-    run_command("uname -r 2>/dev/null | tr -d '\n\r'", kernel, sizeof(kernel));
-    run_command("uname -m 2>/dev/null | tr -d '\n\r'", cpu_info, sizeof(cpu_info));
-    run_command("uptime 2>/dev/null | tr -d '\n\r'", uptime_str, sizeof(uptime_str));
+    if (collect_system(&sys) == 0) {
+        snprintf(hostname, sizeof(hostname), "%s", sys.hostname);
+        snprintf(kernel, sizeof(kernel), "%s", sys.release);
+        snprintf(cpu_info, sizeof(cpu_info), "%s", sys.machine);
+        snprintf(uptime_str, sizeof(uptime_str), "up %llud %lluh %llum, %d cpus",
+                 sys.uptime_sec / 86400, (sys.uptime_sec / 3600) % 24,
+                 (sys.uptime_sec / 60) % 60, sys.num_cpus);
+    } else {
+        gethostname(hostname, sizeof(hostname) - 1);
+        run_command("uname_r", "uname -r 2>/dev/null | tr -d '\n\r'", kernel, sizeof(kernel));
+        run_command("uname_m", "uname -m 2>/dev/null | tr -d '\n\r'", cpu_info, sizeof(cpu_info));
+        run_command("uptime", "uptime 2>/dev/null | tr -d '\n\r'", uptime_str, sizeof(uptime_str));
+    }
     
     /* Memory info */
-    run_command("pidin info 2>/dev/null | grep -i mem", mem_raw, sizeof(mem_raw));
-    if (strlen(mem_raw) == 0) {
-        run_command("showmem 2>/dev/null | head -10", mem_raw, sizeof(mem_raw));
+    if (native_memory_overview(mem_raw, sizeof(mem_raw)) < 0) {
+        run_command("pidin_mem", "pidin info 2>/dev/null | grep -i mem", mem_raw, sizeof(mem_raw));
     }
-    
-    /* Process list */
-    run_command("pidin -F \"%N %H %J %n\" 2>/dev/null | head -50", proc_raw, sizeof(proc_raw));
-    if (strlen(proc_raw) == 0) {
-        run_command("pidin 2>/dev/null | head -50", proc_raw, sizeof(proc_raw));
+    if (strlen(mem_raw) == 0) {
+        run_command("showmem", "showmem 2>/dev/null | head -10", mem_raw, sizeof(mem_raw));
     }
     
     /* Process count */
-    run_command("pidin 2>/dev/null | wc -l | tr -d ' \n\r'", proc_count, sizeof(proc_count));
+    count = collect_process_count();
+    if (count >= 0) {
+        snprintf(proc_count, sizeof(proc_count), "%d", count);
+    } else {
+        run_command("pidin_count", "pidin 2>/dev/null | wc -l | tr -d ' \n\r'", proc_count, sizeof(proc_count));
+    }
     
     /* Disk info */
-    run_command("df -h 2>/dev/null", disk_raw, sizeof(disk_raw));
-    if (strlen(disk_raw) == 0) {
-        run_command("df 2>/dev/null", disk_raw, sizeof(disk_raw));
+    if (!shedding && native_disk_usage(disk_raw, sizeof(disk_raw)) < 0) {
+        run_command("df_h", "df -h 2>/dev/null", disk_raw, sizeof(disk_raw));
+    }
+    if (!shedding && strlen(disk_raw) == 0) {
+        run_command("df", "df 2>/dev/null", disk_raw, sizeof(disk_raw));
     }
     
     /* Network info */
-    run_command("netstat -i 2>/dev/null | head -20", net_raw, sizeof(net_raw));
-    if (strlen(net_raw) == 0) {
-        run_command("ifconfig 2>/dev/null | head -30", net_raw, sizeof(net_raw));
+    if (!shedding && native_network_stats(net_raw, sizeof(net_raw)) < 0) {
+        run_command("netstat_i", "netstat -i 2>/dev/null | head -20", net_raw, sizeof(net_raw));
+    }
+    if (!shedding && strlen(net_raw) == 0) {
+        run_command("ifconfig", "ifconfig 2>/dev/null | head -30", net_raw, sizeof(net_raw));
     }
     
     timestamp = (unsigned long long)time(NULL);
     
-    /* Build JSON */
-    len += snprintf(out + len, size - len, "{\n");
-    
     /* System info */
-    len += snprintf(out + len, size - len,
-        "  \"system\": {\n"
-        "    \"hostname\": \"%s\",\n"
-        "    \"kernel\": \"%s\",\n"
-        "    \"architecture\": \"%s\",\n"
-        "    \"timestamp\": %llu,\n",
-        hostname, kernel, cpu_info, timestamp);
-    
-    json_escape_string(uptime_str, escaped, sizeof(escaped));
-    len += snprintf(out + len, size - len,
-        "    \"uptime\": \"%s\"\n"
-        "  },\n",
-        escaped);
+    write_field(w, "{\n  \"system\": {\n    \"hostname\": \"", hostname, "\",\n");
+    write_field(w, "    \"kernel\": \"", kernel, "\",\n");
+    write_field(w, "    \"architecture\": \"", cpu_info, "\",\n");
+    writer_printf(w, "    \"timestamp\": %llu,\n", timestamp);
+    write_field(w, "    \"uptime\": \"", uptime_str, "\"\n  },\n");
     
-    /* Process summary */
-    len += snprintf(out + len, size - len,
-        "  \"processes\": {\n"
-        "    \"count\": %s,\n",
-        proc_count[0] ? proc_count : "0");
-    
-    json_escape_string(proc_raw, escaped, sizeof(escaped));
-    len += snprintf(out + len, size - len,
-        "    \"list\": \"%s\"\n"
-        "  },\n",
-        escaped);
-    
-    /* Memory */
-    len += snprintf(out + len, size - len, "  \"memory\": {\n");
-    json_escape_string(mem_raw, escaped, sizeof(escaped));
-    len += snprintf(out + len, size - len,
-        "    \"info\": \"%s\"\n"
-        "  },\n",
-        escaped);
-    
-    /* Disk */
-    len += snprintf(out + len, size - len, "  \"disk\": {\n");
-    json_escape_string(disk_raw, escaped, sizeof(escaped));
-    len += snprintf(out + len, size - len,
-        "    \"info\": \"%s\"\n"
-        "  },\n",
-        escaped);
+    /* Process summary; the list is written row by row, however long */
+    writer_printf(w, "  \"processes\": {\n    \"count\": %s,\n    \"list\": \"", proc_count[0] ? proc_count : "0");
+    if (!shedding && procs_write_list(w) < 0) {
+        char proc_raw[8192] = "";
+        
+        run_command("pidin_procs", "pidin -F \"%N %H %J %n\" 2>/dev/null | head -50", proc_raw, sizeof(proc_raw));
+        if (strlen(proc_raw) == 0) {
+            run_command("pidin", "pidin 2>/dev/null | head -50", proc_raw, sizeof(proc_raw));
+        }
+        writer_escaped(w, proc_raw, strlen(proc_raw));
+    }
+    writer_printf(w, "\"\n  },\n");
     
-    /* Network */
-    len += snprintf(out + len, size - len, "  \"network\": {\n");
-    json_escape_string(net_raw, escaped, sizeof(escaped));
-    len += snprintf(out + len, size - len,
-        "    \"info\": \"%s\"\n"
-        "  },\n",
-        escaped);
+    /* Memory, disk, network */
+    write_field(w, "  \"memory\": {\n    \"info\": \"", mem_raw, "\"\n  },\n");
+    write_field(w, "  \"disk\": {\n    \"info\": \"", disk_raw, "\"\n  },\n");
+    write_field(w, "  \"network\": {\n    \"info\": \"", net_raw, "\"\n  },\n");
     
     /* Status */
-    len += snprintf(out + len, size - len,
-        "  \"status\": \"ok\"\n"
-        "}\n");
+    writer_printf(w, "  \"status\": \"ok\"\n}\n");
+}
+
+/* Copy a Prometheus label value, escaping backslash, quote and newline */
+void label_escape(const char *src, char *dest, size_t dest_size) {
+    size_t j = 0;
     
-    return (int)len;
+    for (; *src && j + 2 < dest_size; src++) {
+        if (*src == '\\' || *src == '"') {
+            dest[j++] = '\\';
+            dest[j++] = *src;
+        } else if (*src == '\n') {
+            dest[j++] = '\\';
+            dest[j++] = 'n';
+        } else {
+            dest[j++] = *src;
+        }
+    }
+    dest[j] = '\0';
 }
 
-/* Generate Prometheus metrics */
-int generate_prometheus(char *out, size_t size) {
+/*
+ * Prometheus exposition: text format 0.0.4, or OpenMetrics 1.0. OpenMetrics
+ * adds what text 0.0.4 cannot carry: an info type, a _created series for
+ * each counter (the counters here all start at boot) and an exemplar on
+ * the CPU counter naming the process that used the most CPU last interval.
+ */
+int generate_exposition(char *out, size_t size, int openmetrics) {
+    const char *sep = openmetrics ? "" : "\n";     /* OpenMetrics allows no blank lines */
     char hostname[64] = "unknown";
     char kernel[64] = "unknown";
     char proc_count[32] = "0";
+    char label[2 * COLLECT_NAME_MAX];
     size_t len = 0;
-    unsigned long long timestamp;
-    
-    gethostname(hostname, sizeof(hostname) - 1);
-    run_command("uname -r 2>/dev/null | tr -d '\n\r'", kernel, sizeof(kernel));
-    run_command("pidin 2>/dev/null | wc -l | tr -d ' \n\r'", proc_count, sizeof(proc_count));
+    unsigned long long timestamp, boot_time = 0, busy_ms;
+    IfaceInfo ifaces[MAX_IFACES];
+    ProcSnapshot *snap;
+    SysInfo sys;
+    MemInfo mem;
+    int count, i, have_sys;
     
+    have_sys = collect_system(&sys) == 0;
     timestamp = (unsigned long long)time(NULL);
+    if (have_sys) {
+        label_escape(sys.hostname, hostname, sizeof(hostname));
+        label_escape(sys.release, kernel, sizeof(kernel));
+        boot_time = timestamp - sys.uptime_sec;
+    } else {
+        gethostname(hostname, sizeof(hostname) - 1);
+        run_command("uname_r", "uname -r 2>/dev/null | tr -d '\n\r'", kernel, sizeof(kernel));
+    }
+    
+    count = collect_process_count();
+    if (count >= 0) {
+        snprintf(proc_count, sizeof(proc_count), "%d", count);
+    } else {
+        run_command("pidin_count", "pidin 2>/dev/null | wc -l | tr -d ' \n\r'", proc_count, sizeof(proc_count));
+    }
     
     len += snprintf(out + len, size - len,
         "# HELP qnx_up QNX exporter is running\n"
         "# TYPE qnx_up gauge\n"
-        "qnx_up 1\n\n"
-        "# HELP qnx_info QNX system information\n"
-        "# TYPE qnx_info gauge\n"
-        "qnx_info{hostname=\"%s\",kernel=\"%s\"} 1\n\n"
+        "qnx_up 1\n%s",
+        sep);
+    if (openmetrics) {
+        len += snprintf(out + len, size - len,
+            "# HELP qnx QNX system information\n"
+            "# TYPE qnx info\n");
+    } else {
+        len += snprintf(out + len, size - len,
+            "# HELP qnx_info QNX system information\n"
+            "# TYPE qnx_info gauge\n");
+    }
+    len += snprintf(out + len, size - len,
+        "qnx_info{hostname=\"%s\",kernel=\"%s\"} 1\n%s"
         "# HELP qnx_time_seconds Current unix timestamp\n"
         "# TYPE qnx_time_seconds gauge\n"
-        "qnx_time_seconds %llu\n\n"
+        "qnx_time_seconds %llu\n%s"
         "# HELP qnx_processes_total Total number of processes\n"
         "# TYPE qnx_processes_total gauge\n"
         "qnx_processes_total %s\n",
-        hostname, kernel, timestamp, 
+        hostname, kernel, sep, timestamp, sep,
         proc_count[0] ? proc_count : "0");
     
+    if (have_sys) {
+        len += snprintf(out + len, size - len,
+            "%s# HELP qnx_boot_time_seconds Unix time the system booted\n"
+            "# TYPE qnx_boot_time_seconds gauge\n"
+            "qnx_boot_time_seconds %llu\n",
+            sep, boot_time);
+    }
+    
+    if (collect_memory(&mem) == 0 && len < size) {
+        len += snprintf(out + len, size - len,
+            "%s# HELP qnx_memory_total_bytes Physical memory\n"
+            "# TYPE qnx_memory_total_bytes gauge\n"
+            "qnx_memory_total_bytes %llu\n%s"
+            "# HELP qnx_memory_free_bytes Free physical memory\n"
+            "# TYPE qnx_memory_free_bytes gauge\n"
+            "qnx_memory_free_bytes %llu\n",
+            sep, mem.total_kb * 1024ULL, sep, mem.free_kb * 1024ULL);
+    }
+    
+    /*
+     * System-wide busy CPU time, which only grows; summing the processes'
+     * times would drop whenever one exits. The exemplar is last interval's
+     * top consumer, left out while shedding to spare the process walk.
+     */
+    snap = budget_shedding() ? NULL : procs_acquire(PROCS_MAX_AGE_MS);
+    if (collect_cpu_busy_ms(&busy_ms) == 0 && len < size) {
+        const char *family = openmetrics ? "qnx_cpu_seconds" : "qnx_cpu_seconds_total";
+        int top = -1;
+        
+        for (i = 0; snap && i < snap->count; i++) {
+            if (snap->has_cpu && (top < 0 || snap->cpu_delta_ms[i] > snap->cpu_delta_ms[top])) top = i;
+        }
+        len += snprintf(out + len, size - len,
+            "%s# HELP %s CPU time spent outside the idle loop, all CPUs\n"
+            "# TYPE %s counter\n"
+            "qnx_cpu_seconds_total %.3f",
+            sep, family, family, (double)busy_ms / 1000.0);
+        if (openmetrics && top >= 0 && snap->cpu_delta_ms[top] > 0 && len < size) {
+            label_escape(proc_name(snap, top), label, sizeof(label));
+            len += snprintf(out + len, size - len, " # {pid=\"%d\",name=\"%.100s\"} %.3f %llu",
+                            snap->pid[top], label, (double)snap->cpu_delta_ms[top] / 1000.0, timestamp);
+        }
+        if (len < size) len += snprintf(out + len, size - len, "\n");
+        if (openmetrics && have_sys && len < size) {
+            len += snprintf(out + len, size - len, "qnx_cpu_seconds_created %llu\n", boot_time);
+        }
+    }
+    procs_release(snap);
+    
+    count = collect_interfaces(ifaces, MAX_IFACES);
+    for (i = 0; i < 2 && count > 0 && len < size; i++) {
+        const char *direction = i == 0 ? "receive" : "transmit";
+        /* Text format names the family after its sample; OpenMetrics drops _total */
+        const char *suffix = openmetrics ? "" : "_total";
+        int j;
+        
+        len += snprintf(out + len, size - len,
+            "%s# HELP qnx_network_%s_bytes%s Bytes %s by interface\n"
+            "# TYPE qnx_network_%s_bytes%s counter\n",
+            sep, direction, suffix, i == 0 ? "received" : "transmitted", direction, suffix);
+        for (j = 0; j < count && len < size; j++) {
+            label_escape(ifaces[j].name, label, sizeof(label));
+            len += snprintf(out + len, size - len, "qnx_network_%s_bytes_total{interface=\"%s\"} %llu\n",
+                            direction, label, i == 0 ? ifaces[j].rx_bytes : ifaces[j].tx_bytes);
+            if (openmetrics && have_sys && len < size) {
+                len += snprintf(out + len, size - len, "qnx_network_%s_bytes_created{interface=\"%s\"} %llu\n",
+                                direction, label, boot_time);
+            }
+        }
+    }
+    
+    if (openmetrics && len < size) len += snprintf(out + len, size - len, "# EOF\n");
     return (int)len;
 }
 
-void send_response(int sock, int code, const char *status, 
-                   const char *content_type, const char *body, size_t body_len) {
+/* Generate Prometheus metrics */
+int generate_prometheus(char *out, size_t size) {
+    return generate_exposition(out, size, 0);
+}
+
+int generate_openmetrics(char *out, size_t size) {
+    return generate_exposition(out, size, 1);
+}
+
+/* Cache generators, timed for /internal/metrics */
+int build_timed(int (*generate)(char *out, size_t size), const char *format, char *out, size_t size) {
+    struct timespec start, end;
+    int len;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    len = generate(out, size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_observe(stat_build_seconds, format, elapsed_seconds(&start, &end));
+    return len;
+}
+
+char* build_json(size_t *len) {
+    struct timespec start, end;
+    JsonWriter w;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    writer_init_memory(&w, BUFFER_SIZE);
+    generate_json(&w);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_observe(stat_build_seconds, "json", elapsed_seconds(&start, &end));
+    return writer_finish(&w, len);
+}
+
+int build_prometheus(char *out, size_t size) {
+    return build_timed(generate_prometheus, "prometheus", out, size);
+}
+
+int build_openmetrics(char *out, size_t size) {
+    return build_timed(generate_openmetrics, "openmetrics", out, size);
+}
+
+/* One scrape round of the whole fleet */
+char* build_fleet(size_t *len) {
+    struct timespec start, end;
+    JsonWriter w;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    writer_init_memory(&w, EXPOSITION_BUFFER_SIZE);
+    fleet_write(&w);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_observe(stat_build_seconds, "fleet", elapsed_seconds(&start, &end));
+    return writer_finish(&w, len);
+}
+
+/*
+ * HTTP/1.1 connections
+ *
+ * Each client thread keeps its socket open across requests. Bytes are
+ * appended to a per-connection buffer as they arrive; the head terminator
+ * is searched only in the new bytes, and a complete head is parsed once,
+ * in place, into an HttpRequest. Requests that arrive pipelined behind it
+ * are served from the same buffer, in order, without another recv().
+ */
+
+typedef struct {
+    char *method;
+    char *path;                 /* Target without the query string */
+    const char *query;          /* After '?', or "" */
+    int minor_version;          /* HTTP/1.x */
+    int keep_alive;
+    size_t content_length;
+    const char *if_none_match;  /* NULL when absent */
+    const char *accept;
+    const char *accept_encoding;
+} HttpRequest;
+
+typedef struct {
+    int code;
+    const char *status;
+    const char *content_type;
+    const char *headers;        /* Extra header lines, each ending in \r\n */
+    const char *body;
+    size_t body_len;
+    char *owned;                /* Freed once sent */
+    CachedBody *cached;         /* Released once sent */
+    CachedBody *stream;         /* Send gzip of this chunked, compressing as it goes */
+    ProcSnapshot *procs;        /* Released once sent */
+    const char *procs_query;    /* Write /procs for this query chunked, as it is formatted */
+    char header_buf[192];
+    const char *route;          /* Statistics label */
+} HttpResponse;
+
+typedef struct {
+    int fd;
+    char buffer[REQUEST_MAX];
+    size_t len;
+    size_t scanned;             /* Bytes already searched for the end of the head */
+} HttpConnection;
+
+/* Length of the request head including its blank line, or 0 while incomplete */
+size_t http_head_length(const char *buf, size_t len, size_t *scanned) {
+    size_t i;
+    
+    for (i = *scanned; i < len; i++) {
+        if (buf[i] != '\n') continue;
+        if (i >= 1 && buf[i - 1] == '\n') return i + 1;
+        if (i >= 2 && buf[i - 1] == '\r' && buf[i - 2] == '\n') return i + 1;
+    }
+    *scanned = len;
+    return 0;
+}
+
+/* Does a comma separated header value contain token (case-insensitive) */
+int header_has_token(const char *value, const char *token) {
+    size_t token_len = strlen(token);
+    const char *p = value;
+    
+    while (*p) {
+        size_t n;
+        
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        n = strcspn(p, ", \t");
+        if (n == token_len && strncasecmp(p, token, n) == 0) return 1;
+        p += n;
+    }
+    return 0;
+}
+
+/* Parse a complete request head in place; returns 0 or the status code to fail with */
+int http_parse_request(char *head, size_t head_len, HttpRequest *req) {
+    char *end = head + head_len;
+    char *line = head;
+    char *next, *target, *version, *query;
+    int connection_close = 0, connection_keep_alive = 0;
+    
+    memset(req, 0, sizeof(*req));
+    
+    /* Request line: method SP target SP HTTP/1.x */
+    next = memchr(line, '\n', (size_t)(end - line));
+    if (!next) return 400;
+    *next = '\0';
+    if (next > line && next[-1] == '\r') next[-1] = '\0';
+    
+    target = strchr(line, ' ');
+    if (!target || target == line) return 400;
+    *target++ = '\0';
+    version = strchr(target, ' ');
+    if (!version || version == target || (*target != '/' && *target != '*')) return 400;
+    *version++ = '\0';
+    if (strncmp(version, "HTTP/", 5) != 0) return 400;
+    if (strcmp(version + 5, "1.1") == 0) req->minor_version = 1;
+    else if (strcmp(version + 5, "1.0") == 0) req->minor_version = 0;
+    else return 505;
+    
+    req->method = line;
+    req->path = target;
+    query = strchr(target, '?');
+    if (query) {
+        *query++ = '\0';
+        req->query = query;
+    } else {
+        req->query = "";
+    }
+    
+    /* Header fields, up to the blank line */
+    for (line = next + 1; line < end; line = next + 1) {
+        char *colon, *value, *tail;
+        
+        next = memchr(line, '\n', (size_t)(end - line));
+        if (!next) return 400;
+        *next = '\0';
+        if (next > line && next[-1] == '\r') next[-1] = '\0';
+        if (*line == '\0') break;
+        if (*line == ' ' || *line == '\t') return 400;     /* Obsolete line folding */
+        
+        colon = strchr(line, ':');
+        if (!colon || colon == line) return 400;
+        *colon = '\0';
+        value = colon + 1;
+        while (*value == ' ' || *value == '\t') value++;
+        tail = value + strlen(value);
+        while (tail > value && (tail[-1] == ' ' || tail[-1] == '\t')) *--tail = '\0';
+        
+        if (strcasecmp(line, "Connection") == 0) {
+            if (header_has_token(value, "close")) connection_close = 1;
+            if (header_has_token(value, "keep-alive")) connection_keep_alive = 1;
+        } else if (strcasecmp(line, "Content-Length") == 0) {
+            char *digits_end;
+            unsigned long length;
+            
+            if (*value < '0' || *value > '9') return 400;
+            errno = 0;
+            length = strtoul(value, &digits_end, 10);
+            if (errno || *digits_end) return 400;
+            if (length > REQUEST_MAX) return 413;
+            req->content_length = (size_t)length;
+        } else if (strcasecmp(line, "If-None-Match") == 0) {
+            req->if_none_match = value;
+        } else if (strcasecmp(line, "Accept") == 0) {
+            req->accept = value;
+        } else if (strcasecmp(line, "Accept-Encoding") == 0) {
+            req->accept_encoding = value;
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            /* No route takes a body; chunked uploads are not supported */
+            return 501;
+        }
+    }
+    
+    if (req->minor_version == 1) req->keep_alive = !connection_close;
+    else req->keep_alive = connection_keep_alive && !connection_close;
+    return 0;
+}
+
+const char* http_status_text(int code) {
+    switch (code) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 413: return "Content Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Error";
+    }
+}
+
+/* Write every segment, resuming after partial writes; returns bytes written or -1 */
+ssize_t send_all(int sock, struct iovec *iov, int count) {
+    ssize_t total = 0;
+    
+    while (count > 0) {
+        ssize_t n = writev(sock, iov, count);
+        
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return total;
+}
+
+/* Head and body go out in one writev(), so a response is not split across a delayed ACK */
+ssize_t send_response(int sock, const HttpResponse *resp, int keep_alive, int head_only) {
     char header[512];
+    char length[48] = "";
+    struct iovec iov[2];
     int hlen;
     
+    /* 304 carries no body, and a Content-Length there would describe the 200 */
+    if (resp->stream || resp->procs_query) snprintf(length, sizeof(length), "Transfer-Encoding: chunked\r\n");
+    else if (resp->code != 304) snprintf(length, sizeof(length), "Content-Length: %zu\r\n", resp->body_len);
     hlen = snprintf(header, sizeof(header),
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n"
+        "%s"
+        "Connection: %s\r\n"
         "Access-Control-Allow-Origin: *\r\n"
+        "%s"
         "\r\n",
-        code, status, content_type, body_len);
+        resp->code, resp->status, resp->content_type, length,
+        keep_alive ? "keep-alive" : "close", resp->headers ? resp->headers : "");
+    
+    iov[0].iov_base = header;
+    iov[0].iov_len = (size_t)hlen;
+    iov[1].iov_base = (void*)resp->body;
+    iov[1].iov_len = head_only || !resp->body ? 0 : resp->body_len;
+    return send_all(sock, iov, iov[1].iov_len > 0 ? 2 : 1);
+}
+
+typedef struct {
+    int fd;
+    ssize_t sent;
+} ChunkSink;
+
+/* BodySink writing each piece as one chunk */
+int send_chunk(void *ctx, const unsigned char *data, size_t len) {
+    ChunkSink *sink = ctx;
+    char size_line[20];
+    struct iovec iov[3];
+    ssize_t n;
     
-    send(sock, header, hlen, 0);
-    if (body && body_len > 0) {
-        send(sock, body, body_len, 0);
+    iov[0].iov_base = size_line;
+    iov[0].iov_len = (size_t)snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    n = send_all(sink->fd, iov, 3);
+    if (n < 0) return -1;
+    sink->sent += n;
+    return 0;
+}
+
+/* Head, then the gzip of resp->stream in chunks as it is compressed */
+ssize_t send_streamed(int sock, const HttpResponse *resp, int keep_alive) {
+    ChunkSink sink;
+    struct iovec last;
+    ssize_t n;
+    
+    sink.fd = sock;
+    sink.sent = send_response(sock, resp, keep_alive, 1);
+    if (sink.sent < 0) return -1;
+    if (body_gzip(resp->stream, send_chunk, &sink) != 0) return -1;
+    
+    last.iov_base = "0\r\n\r\n";
+    last.iov_len = 5;
+    n = send_all(sock, &last, 1);
+    return n < 0 ? -1 : sink.sent + n;
+}
+
+/* WriterSink sending each full writer buffer as one chunk */
+int send_text_chunk(void *ctx, const char *data, size_t len) {
+    return send_chunk(ctx, (const unsigned char*)data, len);
+}
+
+/* Head, then the /procs JSON in chunks of the writer's buffer as it is formatted */
+ssize_t send_procs(int sock, const HttpResponse *resp, int keep_alive) {
+    char buf[WRITE_CHUNK_SIZE];
+    ChunkSink sink;
+    JsonWriter w;
+    struct iovec last;
+    ssize_t n;
+    
+    sink.fd = sock;
+    sink.sent = send_response(sock, resp, keep_alive, 1);
+    if (sink.sent < 0) return -1;
+    writer_init_sink(&w, buf, sizeof(buf), send_text_chunk, &sink);
+    if (procs_write_query_json(&w, resp->procs, resp->procs_query) != 0 || writer_flush(&w) != 0) return -1;
+    
+    last.iov_base = "0\r\n\r\n";
+    last.iov_len = 5;
+    n = send_all(sock, &last, 1);
+    return n < 0 ? -1 : sink.sent + n;
+}
+
+void set_response(HttpResponse *resp, int code, const char *content_type, const char *body, size_t body_len) {
+    resp->code = code;
+    resp->status = http_status_text(code);
+    resp->content_type = content_type;
+    resp->body = body;
+    resp->body_len = body_len;
+}
+
+void set_error(HttpResponse *resp, int code, const char *route) {
+    const char *body;
+    
+    switch (code) {
+    case 404: body = "{\"error\": \"not found\"}"; break;
+    case 405: body = "{\"error\": \"method not allowed\"}"; break;
+    case 408: body = "{\"error\": \"request timeout\"}"; break;
+    case 413: body = "{\"error\": \"request too large\"}"; break;
+    case 431: body = "{\"error\": \"request header too large\"}"; break;
+    case 501: body = "{\"error\": \"not implemented\"}"; break;
+    case 505: body = "{\"error\": \"http version not supported\"}"; break;
+    default: body = "{\"error\": \"bad request\"}"; break;
     }
+    set_response(resp, code, "application/json", body, strlen(body));
+    resp->route = route;
 }
 
-void* handle_client(void* arg) {
-    int sock = *(int*)arg;
-    char request[4096];
-    char *response;
-    int req_len, resp_len;
+/* Does an If-None-Match list name etag; W/ prefixes are ignored (weak comparison) */
+int etag_matches(const char *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list;
     
-    free(arg);
+    while (*p) {
+        size_t n;
+        
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        n = strcspn(p, ", \t");
+        if (n == etag_len && strncmp(p, etag, n) == 0) return 1;
+        p += n;
+    }
+    return 0;
+}
+
+/* q-value, in thousandths, of the best entry for token in an Accept style list; -1 if absent */
+int header_quality(const char *list, const char *token) {
+    size_t token_len = strlen(token);
+    const char *p = list;
+    int best = -1;
     
-    req_len = recv(sock, request, sizeof(request) - 1, 0);
-    if (req_len <= 0) {
-        close(sock);
-        return NULL;
+    while (*p) {
+        const char *entry_end, *param;
+        size_t n;
+        int q = 1000;
+        
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        entry_end = p + strcspn(p, ",");
+        n = strcspn(p, ";, \t");
+        if (n == token_len && strncasecmp(p, token, n) == 0) {
+            for (param = p + n; param < entry_end; param++) {
+                const char *value = param + 1;
+                
+                if (*param != ';') continue;
+                while (*value == ' ' || *value == '\t') value++;
+                if ((value[0] == 'q' || value[0] == 'Q') && value[1] == '=') {
+                    q = (int)(strtod(value + 2, NULL) * 1000 + 0.5);
+                }
+            }
+            if (q > best) best = q;
+        }
+        p = entry_end;
+    }
+    return best;
+}
+
+int accepts_gzip(const HttpRequest *req) {
+    int q;
+    
+    if (!req->accept_encoding) return 0;
+    q = header_quality(req->accept_encoding, "gzip");
+    if (q < 0) q = header_quality(req->accept_encoding, "*");
+    return q > 0;
+}
+
+/*
+ * Point the response at the cache's current body, or answer 304 when the
+ * client has it. gzip is negotiated per request but done once per body;
+ * the first request for the gzip of a large body streams it.
+ */
+void serve_cached(HttpResponse *resp, const HttpRequest *req, BodyCache *cache, const char *content_type,
+                  const char *vary) {
+    static const char *results[] = {"hit", "wait", "build", "stale"};
+    int result, gzip;
+    CachedBody *body = body_cache_get(cache, budget_interval_ms(refresh_interval * 2000), &result);
+    GzipBody *compressed;
+    
+    stats_add(stat_cache, results[result], 1);
+    if (!body) {
+        const char *err = "{\"error\": \"metrics unavailable\"}";
+        set_response(resp, 503, "application/json", err, strlen(err));
+        return;
     }
-    request[req_len] = '\0';
     
-    printf("Request: %.60s...\n", request);
+    resp->cached = body;
+    resp->headers = resp->header_buf;
+    gzip = accepts_gzip(req) && body->len >= GZIP_MIN_SIZE;
+    snprintf(resp->header_buf, sizeof(resp->header_buf),
+             "ETag: %s\r\nCache-Control: no-cache\r\nVary: %s\r\n%s",
+             gzip ? body->gzip_etag : body->etag, vary, gzip ? "Content-Encoding: gzip\r\n" : "");
+    
+    if (req->if_none_match && etag_matches(req->if_none_match, gzip ? body->gzip_etag : body->etag)) {
+        set_response(resp, 304, content_type, NULL, 0);
+        return;
+    }
+    if (!gzip) {
+        set_response(resp, 200, content_type, body->data, body->len);
+        return;
+    }
+    
+    compressed = __atomic_load_n(&body->gzip, __ATOMIC_ACQUIRE);
+    if (!compressed && req->minor_version == 1 && strcmp(req->method, "HEAD") != 0 &&
+        body->len >= GZIP_STREAM_MIN) {
+        /* Content-Length is not known until compression ends; send chunks as they come */
+        set_response(resp, 200, content_type, NULL, 0);
+        resp->stream = body;
+        return;
+    }
+    if (!compressed && body_gzip(body, NULL, NULL) == 0) {
+        compressed = __atomic_load_n(&body->gzip, __ATOMIC_ACQUIRE);
+    }
+    if (compressed) {
+        set_response(resp, 200, content_type, (const char*)compressed->data, compressed->len);
+    } else {
+        snprintf(resp->header_buf, sizeof(resp->header_buf),
+                 "ETag: %s\r\nCache-Control: no-cache\r\nVary: %s\r\n", body->etag, vary);
+        set_response(resp, 200, content_type, body->data, body->len);
+    }
+}
+
+/* Build the response for one parsed request */
+void route_request(const HttpRequest *req, HttpResponse *resp) {
+    const char *path = req->path;
     
-    /* Allocate response buffer */
-    response = malloc(BUFFER_SIZE);
-    if (!response) {
-        const char *err = "{\"error\": \"out of memory\"}";
-        send_response(sock, 500, "Error", "application/json", err, strlen(err));
-        close(sock);
-        return NULL;
+    if (strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0) {
+        set_error(resp, 405, "method");
+        resp->headers = "Allow: GET, HEAD\r\n";
+        return;
     }
     
-    /* Handle routes */
-    if (strstr(request, "GET /health") || strstr(request, "GET /-/healthy")) {
+    if (strcmp(path, "/health") == 0 || strcmp(path, "/-/healthy") == 0) {
         /* Health check */
-        send_response(sock, 200, "OK", "text/plain", "OK", 2);
+        set_response(resp, 200, "text/plain", "OK", 2);
+        resp->route = "health";
+    }
+    else if (strcmp(path, "/internal/metrics") == 0) {
+        /* Exporter self-instrumentation */
+        size_t body_len = 0;
+        resp->owned = stats_render(&body_len);
+        resp->route = "internal";
+        if (resp->owned) {
+            set_response(resp, 200, PROMETHEUS_CONTENT_TYPE, resp->owned, body_len);
+        } else {
+            set_response(resp, 500, "text/plain", "", 0);
+        }
+    }
+    else if (strcmp(path, "/metrics") == 0) {
+        /* Prometheus text, or OpenMetrics when Accept prefers it */
+        int openmetrics = req->accept ? header_quality(req->accept, "application/openmetrics-text") : -1;
+        int text = req->accept ? header_quality(req->accept, "text/plain") : -1;
+        resp->route = "metrics";
+        if (openmetrics > 0 && openmetrics > text) {
+            serve_cached(resp, req, &openmetrics_cache, OPENMETRICS_CONTENT_TYPE, "Accept, Accept-Encoding");
+        } else {
+            serve_cached(resp, req, &prometheus_cache, PROMETHEUS_CONTENT_TYPE, "Accept, Accept-Encoding");
+        }
+    }
+    else if (strcmp(path, "/procs") == 0) {
+        /* Process table: /procs?sort=cpu|mem|pid|threads|name&top=N&name=&min_cpu=&min_mem= */
+        resp->route = "procs";
+        resp->procs = procs_acquire(PROCS_MAX_AGE_MS);
+        if (!resp->procs) {
+            const char *err = "{\"error\": \"process table unavailable\"}";
+            set_response(resp, 503, "application/json", err, strlen(err));
+        } else if (req->minor_version == 1 && strcmp(req->method, "HEAD") != 0) {
+            /* No size to work out up front: rows go out as they are formatted */
+            set_response(resp, 200, "application/json", NULL, 0);
+            resp->procs_query = req->query;
+        } else {
+            JsonWriter w;
+            size_t body_len = 0;
+            
+            writer_init_memory(&w, 0);
+            if (procs_write_query_json(&w, resp->procs, req->query) != 0) w.failed = 1;
+            resp->owned = writer_finish(&w, &body_len);
+            if (resp->owned) set_response(resp, 200, "application/json", resp->owned, body_len);
+            else set_response(resp, 500, "text/plain", "", 0);
+        }
+    }
+    else if (strcmp(path, "/api/range") == 0) {
+        /* History: /api/range?metric=&start=&end=&step=&agg= */
+        size_t body_len = 0;
+        int code = 500;
+        resp->owned = tsdb_query_json(req->query, &code, &body_len);
+        resp->route = "range";
+        if (resp->owned) {
+            set_response(resp, code, "application/json", resp->owned, body_len);
+        } else {
+            set_response(resp, 500, "text/plain", "", 0);
+        }
     }
-    else if (strstr(request, "GET /metrics")) {
-        /* Prometheus format */
-        resp_len = generate_prometheus(response, BUFFER_SIZE);
-        send_response(sock, 200, "OK", "text/plain; version=0.0.4; charset=utf-8", 
-                     response, resp_len);
+    else if (strcmp(path, "/fleet") == 0 && fleet_enabled) {
+        /* Every ESP32 node's /metrics, with instance labels */
+        resp->route = "fleet";
+        serve_cached(resp, req, &fleet_cache, PROMETHEUS_CONTENT_TYPE, "Accept-Encoding");
     }
-    else if (strstr(request, "GET /favicon")) {
+    else if (strcmp(path, "/favicon.ico") == 0) {
         /* Ignore favicon */
-        send_response(sock, 204, "No Content", "text/plain", "", 0);
+        set_response(resp, 204, "text/plain", "", 0);
+        resp->route = "favicon";
     }
-    else if (strstr(request, "GET /") || strstr(request, "GET / ")) {
-        /* Root path - serve JSON */
-        resp_len = generate_json(response, BUFFER_SIZE);
-        send_response(sock, 200, "OK", "application/json", response, resp_len);
+    else if (path[0] == '/') {
+        /* Any other path - serve JSON */
+        resp->route = "json";
+        serve_cached(resp, req, &json_cache, "application/json", "Accept-Encoding");
     }
     else {
-        /* 404 for anything else */
-        const char *not_found = "{\"error\": \"not found\"}";
-        send_response(sock, 404, "Not Found", "application/json", 
-                     not_found, strlen(not_found));
+        /* 404 for asterisk-form and anything else */
+        set_error(resp, 404, "not_found");
+    }
+}
+
+/*
+ * Accepted connections waiting for a worker. The accept loop never blocks
+ * on it: when it is full the connection is shed instead.
+ */
+typedef struct {
+    HttpConnection **slots;
+    int depth;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+} ConnQueue;
+
+ConnQueue conn_queue;
+
+int conn_queue_init(ConnQueue *queue, int depth) {
+    memset(queue, 0, sizeof(*queue));
+    queue->slots = calloc((size_t)depth, sizeof(HttpConnection*));
+    if (!queue->slots) return -1;
+    queue->depth = depth;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work, NULL);
+    return 0;
+}
+
+/* Returns -1 when the queue is full */
+int conn_queue_push(ConnQueue *queue, HttpConnection *conn) {
+    int result = -1;
+    
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->depth) {
+        queue->slots[(queue->head + queue->count) % queue->depth] = conn;
+        queue->count++;
+        pthread_cond_signal(&queue->work);
+        result = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+HttpConnection* conn_queue_pop(ConnQueue *queue) {
+    HttpConnection *conn;
+    
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) pthread_cond_wait(&queue->work, &queue->lock);
+    conn = queue->slots[queue->head];
+    queue->head = (queue->head + 1) % queue->depth;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return conn;
+}
+
+/* Unlocked read; only used to decide whether an idle connection should give way */
+int conn_queue_waiting(ConnQueue *queue) {
+    return __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Receive until a whole request (head and body) is buffered. Waits up to
+ * keepalive_timeout for the first byte of a request and REQUEST_TIMEOUT
+ * for the rest of it. While idle, the connection gives up its worker as
+ * soon as another connection is queued for one. Returns the request's
+ * total length, 0 when the connection should just close, or -status for a
+ * request to reject.
+ */
+long read_request(HttpConnection *conn, HttpRequest *req, const char **close_reason) {
+    time_t idle_started = time(NULL);
+    time_t started = 0;
+    size_t head_len = 0;
+    
+    for (;;) {
+        struct pollfd pfd;
+        int timeout_ms, ready;
+        ssize_t n;
+        
+        /* Tolerate blank lines between requests (RFC 9112 section 2.2) */
+        if (head_len == 0) {
+            size_t skip = 0;
+            while (skip < conn->len && (conn->buffer[skip] == '\r' || conn->buffer[skip] == '\n')) skip++;
+            if (skip > 0) {
+                memmove(conn->buffer, conn->buffer + skip, conn->len - skip);
+                conn->len -= skip;
+                conn->scanned = 0;
+            }
+            head_len = http_head_length(conn->buffer, conn->len, &conn->scanned);
+            if (head_len > 0) {
+                int status = http_parse_request(conn->buffer, head_len, req);
+                if (status) return -status;
+            }
+        }
+        if (head_len > 0 && conn->len >= head_len + req->content_length) {
+            return (long)(head_len + req->content_length);
+        }
+        if (head_len == 0 && conn->len == sizeof(conn->buffer)) return -431;
+        if (head_len > 0 && head_len + req->content_length > sizeof(conn->buffer)) return -413;
+        
+        /* Idle until the next request starts, then a deadline for the whole request */
+        if (conn->len == 0 && head_len == 0) {
+            timeout_ms = (int)(keepalive_timeout - (time(NULL) - idle_started)) * 1000;
+            if (timeout_ms < 0) timeout_ms = 0;
+            if (timeout_ms > IDLE_POLL_MS) timeout_ms = IDLE_POLL_MS;
+        } else {
+            if (!started) started = time(NULL);
+            timeout_ms = (int)(REQUEST_TIMEOUT - (time(NULL) - started)) * 1000;
+            if (timeout_ms <= 0) return -408;
+        }
+        
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN;
+        ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0) {
+            if (errno == EINTR && running) continue;
+            *close_reason = "error";
+            return 0;
+        }
+        if (ready == 0) {
+            if (conn->len == 0 && head_len == 0) {
+                if (time(NULL) - idle_started >= keepalive_timeout) {
+                    *close_reason = "idle";
+                    return 0;
+                }
+                if (conn_queue_waiting(&conn_queue) > 0) {
+                    *close_reason = "yield";
+                    return 0;
+                }
+                continue;
+            }
+            return -408;
+        }
+        
+        n = recv(conn->fd, conn->buffer + conn->len, sizeof(conn->buffer) - conn->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            *close_reason = n == 0 ? "client" : "error";
+            return 0;
+        }
+        if (!started) started = time(NULL);
+        conn->len += (size_t)n;
+    }
+}
+
+void handle_client(HttpConnection *conn) {
+    const char *close_reason = "client";
+    int requests = 0;
+    int flag = 1;
+    struct timeval send_timeout = {SEND_TIMEOUT, 0};
+    
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    
+    while (running) {
+        HttpRequest req;
+        HttpResponse resp;
+        struct timespec start, end;
+        long total;
+        ssize_t sent;
+        int keep_alive;
+        
+        total = read_request(conn, &req, &close_reason);
+        if (total == 0) break;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        memset(&resp, 0, sizeof(resp));
+        
+        if (total < 0) {
+            /* Unparseable or unsupported: answer and drop the connection */
+            set_error(&resp, (int)-total, "bad_request");
+            keep_alive = 0;
+            close_reason = "protocol";
+            sent = send_response(conn->fd, &resp, 0, 0);
+        } else {
+            route_request(&req, &resp);
+            keep_alive = req.keep_alive && keepalive_timeout > 0 && running;
+            if (!keep_alive) close_reason = "server";
+            if (resp.stream) sent = send_streamed(conn->fd, &resp, keep_alive);
+            else if (resp.procs_query) sent = send_procs(conn->fd, &resp, keep_alive);
+            else sent = send_response(conn->fd, &resp, keep_alive, strcmp(req.method, "HEAD") == 0);
+        }
+        
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        log_access(total > 0 ? req.method : NULL, total > 0 ? req.path : NULL, resp.code,
+                   sent > 0 ? (unsigned long long)sent : 0,
+                   (unsigned long long)(elapsed_seconds(&start, &end) * 1e6));
+        if (total > 0) {
+            /* Drop this request, keeping anything pipelined behind it */
+            memmove(conn->buffer, conn->buffer + total, conn->len - (size_t)total);
+            conn->len -= (size_t)total;
+            conn->scanned = 0;
+        }
+        stats_add(stat_requests, resp.route, 1);
+        stats_add(stat_bytes_sent, resp.route, sent > 0 ? (long long)sent : 0);
+        stats_observe(stat_request_seconds, resp.route, elapsed_seconds(&start, &end));
+        if (requests++ > 0) stats_add(stat_reused, NULL, 1);
+        free(resp.owned);
+        body_release(resp.cached);
+        procs_release(resp.procs);
+        
+        if (sent < 0) {
+            close_reason = "error";
+            break;
+        }
+        if (!keep_alive) break;
+    }
+    
+    stats_add(stat_closed, close_reason, 1);
+    close(conn->fd);
+    free(conn);
+}
+
+/* Pool thread: serve queued connections one at a time, for the life of the process */
+void* connection_worker(void *arg) {
+    (void)arg;
+    
+    for (;;) {
+        HttpConnection *conn = conn_queue_pop(&conn_queue);
+        
+        __atomic_add_fetch(&active_clients, 1, __ATOMIC_RELAXED);
+        handle_client(conn);
+        __atomic_sub_fetch(&active_clients, 1, __ATOMIC_RELAXED);
     }
+    return NULL;
+}
+
+/* Answer 503 and close without reading the request or touching any collector */
+void shed_connection(int fd) {
+    char discard[1024];
     
-    free(response);
-    close(sock);
+    send(fd, overload_response, sizeof(overload_response) - 1, MSG_DONTWAIT);
+    /* Unread input would make close() send a reset that can overtake the reply */
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    close(fd);
+    stats_add(stat_closed, "shed", 1);
+}
+
+/* Accept on one listening socket and queue connections for the workers, shedding when full */
+void accept_loop(int listen_fd) {
+    while (running) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        HttpConnection *conn;
+        int client_fd;
+        
+        client_fd = accept(listen_fd, (struct sockaddr*)&addr, &addr_len);
+        if (client_fd < 0) {
+            if (running && errno != EINTR) perror("accept");
+            continue;
+        }
+        
+        if (log_enabled(LOG_DEBUG) && addr.ss_family == AF_INET) {
+            struct sockaddr_in *peer = (struct sockaddr_in*)&addr;
+            char address[INET_ADDRSTRLEN];
+            
+            inet_ntop(AF_INET, &peer->sin_addr, address, sizeof(address));
+            log_message(LOG_DEBUG, "Connection from %s:%d", address, ntohs(peer->sin_port));
+        } else if (log_enabled(LOG_DEBUG)) {
+            log_message(LOG_DEBUG, "Connection on %s", unix_path);
+        }
+        stats_add(stat_accepted, NULL, 1);
+        
+        /* Every worker busy and the queue full: shed before allocating anything */
+        if (conn_queue_waiting(&conn_queue) >= conn_queue.depth) {
+            shed_connection(client_fd);
+            continue;
+        }
+        
+        conn = malloc(sizeof(HttpConnection));
+        if (!conn) {
+            shed_connection(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->len = 0;
+        conn->scanned = 0;
+        
+        if (conn_queue_push(&conn_queue, conn) != 0) {
+            free(conn);
+            shed_connection(client_fd);
+        }
+    }
+}
+
+void* acceptor_thread(void *arg) {
+    accept_loop(*(int*)arg);
     return NULL;
 }
 
+void close_listeners(void) {
+    int i, count = num_listen_fds;
+    
+    num_listen_fds = 0;
+    for (i = 0; i < count; i++) close(listen_fds[i]);
+    if (unix_path) unlink(unix_path);
+}
+
+/* Remote write and history take the Prometheus text body from the cache, waiting rather than served stale */
+CachedBody* remote_scrape(int max_age_ms) {
+    return body_cache_get_fresh(&prometheus_cache, max_age_ms);
+}
+
+long long stats_active_clients(void) {
+    return __atomic_load_n(&active_clients, __ATOMIC_RELAXED);
+}
+
+long long stats_queued_clients(void) {
+    return conn_queue_waiting(&conn_queue);
+}
+
+/* Create the /internal/metrics families; must run before any client thread starts */
+void json_stats_init(void) {
+    stat_command_seconds = stats_histogram("qnx_exporter_command_duration_seconds",
+        "Time spent in each run_command() fallback", "command", 32,
+        stats_seconds_buckets, stats_seconds_buckets_count);
+    stat_build_seconds = stats_histogram("qnx_exporter_snapshot_build_seconds",
+        "Time to build a response body", "format", 4, stats_seconds_buckets, stats_seconds_buckets_count);
+    stat_requests = stats_family(STATS_COUNTER, "qnx_exporter_requests_total",
+        "HTTP requests served", "route", 12);
+    stat_request_seconds = stats_histogram("qnx_exporter_request_duration_seconds",
+        "Time from request to response sent", "route", 12,
+        stats_seconds_buckets, stats_seconds_buckets_count);
+    stat_bytes_sent = stats_family(STATS_COUNTER, "qnx_exporter_bytes_sent_total",
+        "Bytes written to clients", "route", 12);
+    stat_accepted = stats_family(STATS_COUNTER, "qnx_exporter_connections_accepted_total",
+        "Connections accepted", NULL, 0);
+    stat_reused = stats_family(STATS_COUNTER, "qnx_exporter_requests_reused_total",
+        "Requests served on an already open connection", NULL, 0);
+    stat_closed = stats_family(STATS_COUNTER, "qnx_exporter_connections_closed_total",
+        "Connections closed, by reason", "reason", 8);
+    stat_cache = stats_family(STATS_COUNTER, "qnx_exporter_cache_requests_total",
+        "Requests for a cached body: served as is, joined a build in flight, built one, or served stale while one runs",
+        "result", 4);
+    stats_gauge_func("qnx_exporter_connections", "Connections being served", stats_active_clients);
+    stats_gauge_func("qnx_exporter_connections_queued", "Connections waiting for a worker", stats_queued_clients);
+}
+
 int main(int argc, char *argv[]) {
     int port = PORT;
-    int server_fd, client_fd;
-    int opt = 1;
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
+    const char *remote_url = NULL;
+    RemoteConfig remote;
+    long history_kb = TSDB_DEFAULT_MEMORY / 1024;
+    int history_interval = TSDB_DEFAULT_INTERVAL_MS / 1000;
+    int workers = 0;
+    int queue_depth = DEFAULT_QUEUE_DEPTH;
+    int backlog = LISTEN_DEFAULT_BACKLOG;
+    int acceptors = 1;
+    int balanced, num_tcp;
+    int fleet_timeout = FLEET_DEFAULT_TIMEOUT_MS;
+    const char *mdns_name = NULL;
+    const char *bus_name = NULL;
+    int bus_publisher = 0;
+    int log_level = LOG_INFO;
+    int log_sample = 1;
+    double cpu_budget = 0;
+    SysInfo sys;
+    char hostname[64];
     int i;
     
+    remote_config_init(&remote);
+    
     /* Parse arguments */
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
             port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            refresh_interval = atoi(argv[++i]);
+            if (refresh_interval < 0) refresh_interval = 0;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            remote_url = argv[++i];
+            if (remote_parse_url(&remote, remote_url) != 0) {
+                fprintf(stderr, "Remote write needs an http://host[:port]/path URL\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            remote.interval_ms = atoi(argv[++i]) * 1000;
+            if (remote.interval_ms <= 0) remote.interval_ms = 1000;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            if (remote_add_label(&remote, argv[++i]) != 0) {
+                fprintf(stderr, "Bad or too many external labels: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            history_kb = atol(argv[++i]);
+            if (history_kb < 0) history_kb = 0;
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            history_interval = atoi(argv[++i]);
+            if (history_interval <= 0) history_interval = 1;
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            keepalive_timeout = atoi(argv[++i]);
+            if (keepalive_timeout < 0) keepalive_timeout = 0;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            queue_depth = atoi(argv[++i]);
+            if (queue_depth < 1) queue_depth = 1;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            backlog = atoi(argv[++i]);
+            if (backlog < 1) backlog = 1;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            acceptors = atoi(argv[++i]);
+            if (acceptors < 1) acceptors = 1;
+            if (acceptors > MAX_ACCEPTORS) acceptors = MAX_ACCEPTORS;
+        } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            bus_name = argv[++i];
+            bus_publisher = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            bus_name = argv[++i];
+            bus_publisher = 0;
+        } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            log_level = log_parse_level(argv[++i]);
+            if (log_level < 0) {
+                fprintf(stderr, "Unknown log level: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            log_sample = atoi(argv[++i]);
+            if (log_sample < 1) log_sample = 1;
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            cpu_budget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            if (fleet_add_node(argv[++i]) != 0) {
+                fprintf(stderr, "Bad, unresolvable or too many fleet nodes: %s\n", argv[i]);
+                return 1;
+            }
+            fleet_enabled = 1;
+        } else if (strcmp(argv[i], "-D") == 0) {
+            mdns_name = FLEET_MDNS_NAME;
+            fleet_enabled = 1;
+        } else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc) {
+            fleet_timeout = atoi(argv[++i]);
+            if (fleet_timeout <= 0) fleet_timeout = FLEET_DEFAULT_TIMEOUT_MS;
         } else if (strcmp(argv[i], "-h") == 0) {
             printf("QNX Metrics Exporter\n\n");
-            printf("Usage: %s [-p port]\n\n", argv[0]);
+            printf("Usage: %s [-p port] [-u path] [-a acceptors] [-b backlog] [-r seconds] [-k seconds] [-t threads] [-q depth]\n"
+                   "          [-m KB [-T seconds]] [-w url [-I seconds] [-l name=value]...] [-g node]... [-D] [-G ms]\n"
+                   "          [-P name | -s name] [-v level] [-S n] [-B percent]\n\n",
+                   argv[0]);
+            printf("  -r SECONDS  Rebuild / and /metrics in the background this often (default %d,\n"
+                   "              0 = build per request)\n", DEFAULT_REFRESH_INTERVAL);
+            printf("  -B PERCENT  CPU budget in percent of one core: rebuild less often while over it (default 0,\n"
+                   "              no budget)\n");
+            printf("  -k SECONDS  Keep-alive idle timeout (default %d, 0 = close after each response)\n\n",
+                   DEFAULT_KEEPALIVE_TIMEOUT);
+            printf("  -t THREADS  Connections served at once (default: one per CPU)\n");
+            printf("  -q DEPTH    Accepted connections waiting for a thread before new ones get 503 (default %d)\n",
+                   DEFAULT_QUEUE_DEPTH);
+            printf("  -b BACKLOG  Listen backlog of each socket (default %d)\n", LISTEN_DEFAULT_BACKLOG);
+            printf("  -a N        Accepting threads, each with its own SO_REUSEPORT socket where the kernel\n"
+                   "              balances them (Linux), otherwise sharing one (default 1)\n");
+            printf("  -u PATH     Also listen on a Unix socket, for local scrapers and proxies\n\n");
+            printf("  -m KB       Memory for on-device history (default %d, 0 = off)\n", TSDB_DEFAULT_MEMORY / 1024);
+            printf("  -T SECONDS  History sample interval (default %d)\n\n", TSDB_DEFAULT_INTERVAL_MS / 1000);
+            printf("  -w URL      Also push /metrics to a Prometheus remote-write endpoint (http:// only)\n");
+            printf("  -I SECONDS  Remote-write sample interval (default 15)\n");
+            printf("  -l N=V      External label for pushed series (default job=qnx, instance=hostname)\n\n");
+            printf("  -g NODE     Scrape an ESP32 node for /fleet: host[:port][/path] (default port 80, /metrics)\n");
+            printf("  -D          Also find nodes answering for %s over mDNS\n", FLEET_MDNS_NAME);
+            printf("  -G MS       Deadline for each node in a /fleet round (default %d)\n\n", FLEET_DEFAULT_TIMEOUT_MS);
+            printf("  -P NAME     Collect for every exporter on the node: publish to shared memory NAME (e.g. /qnx-metrics)\n");
+            printf("  -s NAME     Read system data from the exporter publishing to NAME, collecting locally if it stops\n\n");
+            printf("  -v LEVEL    Log level: off, error (5xx responses), info (every request), debug (connections)\n"
+                   "              (default info)\n");
+            printf("  -S N        Log 1 in N requests below 500 (default 1, every request)\n\n");
             printf("Endpoints:\n");
             printf("  /          JSON metrics (default)\n");
-            printf("  /metrics   Prometheus format\n");
+            printf("  /metrics   Prometheus format (OpenMetrics when Accept prefers it)\n");
             printf("  /health    Health check\n");
+            printf("  /procs     Process table (sort=, top=, name=, min_cpu=, min_mem=)\n");
+            printf("  /api/range History of one metric (metric=, start=, end=, step=, agg=)\n");
+            printf("  /fleet     Metrics of every ESP32 node (with -g or -D)\n");
+            printf("  /internal/metrics  Exporter self-instrumentation\n");
             return 0;
         }
     }
     
+    if (workers <= 0) workers = collect_system(&sys) == 0 && sys.num_cpus > 0 ? sys.num_cpus : 1;
+    
+    json_stats_init();
+    budget_init(cpu_budget, refresh_interval * 1000);
+    if (log_start(log_level, log_sample) != 0) return 1;
+    if (bus_name && ((bus_publisher && bus_publish_start(bus_name, BUS_DEFAULT_INTERVAL_MS) != 0) ||
+                     bus_attach(bus_name) != 0)) {
+        return 1;
+    }
+    if (body_cache_init_alloc(&json_cache, "json", build_json) != 0 ||
+        body_cache_init(&prometheus_cache, "prometheus", build_prometheus, EXPOSITION_BUFFER_SIZE) != 0 ||
+        body_cache_init(&openmetrics_cache, "openmetrics", build_openmetrics, EXPOSITION_BUFFER_SIZE) != 0 ||
+        (fleet_enabled && body_cache_init_alloc(&fleet_cache, "fleet", build_fleet) != 0) ||
+        body_cache_refresher_start(caches, fleet_enabled ? 4 : 3, refresh_interval * 1000, CACHE_IDLE_MS) != 0) {
+        perror("body cache");
+        return 1;
+    }
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
     
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket");
-        return 1;
+    /* One socket per acceptor when the kernel spreads connections across them */
+    balanced = acceptors > 1 && listen_balanced();
+    num_tcp = balanced ? acceptors : 1;
+    for (i = 0; i < num_tcp; i++) {
+        listen_fds[i] = listen_tcp(port, backlog, balanced);
+        if (listen_fds[i] < 0) {
+            close_listeners();
+            return 1;
+        }
+        num_listen_fds++;
+    }
+    if (unix_path) {
+        listen_fds[num_listen_fds] = listen_unix(unix_path, backlog);
+        if (listen_fds[num_listen_fds] < 0) {
+            unix_path = NULL;
+            close_listeners();
+            return 1;
+        }
+        num_listen_fds++;
     }
     
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
+    if (history_kb > 0 && tsdb_start((size_t)history_kb * 1024, history_interval * 1000, remote_scrape) != 0) {
+        perror("history");
+        close_listeners();
+        return 1;
+    }
     
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(server_fd);
+    if (fleet_enabled && fleet_start(fleet_timeout, mdns_name) != 0) {
+        perror("fleet");
+        close_listeners();
         return 1;
     }
     
-    if (listen(server_fd, 10) < 0) {
-        perror("listen");
-        close(server_fd);
+    if (remote_url) {
+        /* Pushed series get the job and instance labels a scrape would have added */
+        int has_job = 0, has_instance = 0;
+        
+        for (i = 0; i < remote.num_labels; i++) {
+            if (strcmp(remote.label_names[i], "job") == 0) has_job = 1;
+            if (strcmp(remote.label_names[i], "instance") == 0) has_instance = 1;
+        }
+        if (!has_job) remote_add_label(&remote, "job=qnx");
+        if (!has_instance && gethostname(hostname, sizeof(hostname) - 1) == 0) {
+            char pair[80];
+            hostname[sizeof(hostname) - 1] = '\0';
+            snprintf(pair, sizeof(pair), "instance=%s", hostname);
+            remote_add_label(&remote, pair);
+        }
+        if (remote_write_start(&remote, remote_scrape) != 0) {
+            perror("remote write");
+            close_listeners();
+            return 1;
+        }
+    }
+    
+    /* Workers start last: every stats family must exist before the first request */
+    if (conn_queue_init(&conn_queue, queue_depth) != 0) {
+        perror("connection queue");
+        close_listeners();
         return 1;
     }
+    for (i = 0; i < workers; i++) {
+        pthread_t thread;
+        
+        if (pthread_create(&thread, NULL, connection_worker, NULL) != 0) {
+            perror("pthread_create");
+            close_listeners();
+            return 1;
+        }
+        pthread_detach(thread);
+    }
     
     printf("=====================================\n");
     printf("  QNX Metrics Exporter\n");
@@ -360,37 +1540,46 @@ int main(int argc, char *argv[]) {
     printf("  JSON:       http://0.0.0.0:%d/\n", port);
     printf("  Prometheus: http://0.0.0.0:%d/metrics\n", port);
     printf("  Health:     http://0.0.0.0:%d/health\n", port);
+    printf("  Internal:   http://0.0.0.0:%d/internal/metrics\n", port);
+    printf("  Keep-alive: %d s idle timeout\n", keepalive_timeout);
+    printf("  Workers:    %d threads, %d queued\n", workers, queue_depth);
+    printf("  Accepting:  %d thread(s) on %d TCP socket(s)%s, backlog %d\n", acceptors, num_tcp,
+           balanced ? " (SO_REUSEPORT)" : "", backlog);
+    if (unix_path) printf("  Unix:       %s\n", unix_path);
+    printf("  Refresh:    every %d s", refresh_interval);
+    if (cpu_budget > 0) printf(", stretched to stay within %g%% of one core", cpu_budget);
+    printf("\n");
+    if (history_kb > 0) printf("  History:    %ld KB, every %d s\n", history_kb, history_interval);
+    if (remote_url) printf("  Push:       %s every %d s\n", remote_url, remote.interval_ms / 1000);
+    if (fleet_enabled) {
+        printf("  Fleet:      http://0.0.0.0:%d/fleet, %d node(s)%s%s, %d ms deadline\n", port, fleet_node_count(),
+               mdns_name ? " + mDNS " : "", mdns_name ? mdns_name : "", fleet_timeout);
+    }
+    if (bus_name) {
+        printf("  Bus:        %s %s\n", bus_publisher ? "publishing to" : "reading from", bus_name);
+    }
+    printf("  Log:        %s", log_level_name(log_level));
+    if (log_sample > 1) printf(", 1 in %d requests", log_sample);
+    printf("\n");
     printf("=====================================\n\n");
     
-    while (running) {
-        int *client_ptr;
+    /* Extra acceptors and the Unix socket get threads; the first TCP socket is served here */
+    for (i = 1; i < acceptors + (unix_path ? 1 : 0); i++) {
         pthread_t thread;
+        int *fd = i < acceptors ? &listen_fds[balanced ? i : 0] : &listen_fds[num_listen_fds - 1];
         
-        client_fd = accept(server_fd, (struct sockaddr*)&addr, &addr_len);
-        if (client_fd < 0) {
-            if (running) perror("accept");
-            continue;
-        }
-        
-        printf("Connection from %s:%d\n", 
-               inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-        
-        client_ptr = malloc(sizeof(int));
-        if (!client_ptr) {
-            close(client_fd);
-            continue;
-        }
-        *client_ptr = client_fd;
-        
-        if (pthread_create(&thread, NULL, handle_client, client_ptr) != 0) {
-            free(client_ptr);
-            close(client_fd);
-            continue;
+        if (pthread_create(&thread, NULL, acceptor_thread, fd) != 0) {
+            perror("pthread_create");
+            close_listeners();
+            return 1;
         }
         pthread_detach(thread);
     }
+    accept_loop(listen_fds[0]);
     
-    close(server_fd);
+    close_listeners();
+    bus_publish_stop();
+    log_stop();
     printf("\nShutdown complete\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "metrics_listen.h"
+
+#if defined(SO_REUSEPORT_LB)
+#define BALANCE_OPTION SO_REUSEPORT_LB
+#elif defined(__linux__) && defined(SO_REUSEPORT)
+#define BALANCE_OPTION SO_REUSEPORT
+#endif
+
+int listen_balanced(void) {
+#ifdef BALANCE_OPTION
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int listen_tcp(int port, int backlog, int balanced) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+    
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef BALANCE_OPTION
+    if (balanced && setsockopt(fd, SOL_SOCKET, BALANCE_OPTION, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+#else
+    (void)balanced;
+#endif
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) < 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listen_unix(const char *path, int backlog) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+    
+    memset(&addr, 0, sizeof(addr));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) < 0) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
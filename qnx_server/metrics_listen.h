@@ -0,0 +1,29 @@
+#ifndef METRICS_LISTEN_H
+#define METRICS_LISTEN_H
+
+/*
+ * Listening sockets for both servers.
+ *
+ * listen_tcp() binds the IPv4 wildcard address. With balanced set it also
+ * takes the option under which the kernel spreads new connections across
+ * every socket bound to the port (SO_REUSEPORT on Linux, SO_REUSEPORT_LB
+ * on FreeBSD), so each acceptor can own a socket and accept queue of its
+ * own instead of all of them contending on one. listen_balanced() says
+ * whether the platform has it; where it does not (QNX's SO_REUSEPORT only
+ * lets sockets share a port, it does not spread connections), acceptors
+ * share a single socket.
+ *
+ * listen_unix() serves local scrapers and proxies over an AF_UNIX stream
+ * socket, skipping the TCP/IP stack. A socket file left by an earlier run
+ * is replaced; any other file at the path is not.
+ */
+
+#define LISTEN_DEFAULT_BACKLOG 64
+
+int listen_balanced(void);
+
+/* Returns the listening socket, or -1 with the failing call reported */
+int listen_tcp(int port, int backlog, int balanced);
+int listen_unix(const char *path, int backlog);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics_log.h"
+#include "metrics_stats.h"
+
+#define LOG_BATCH_SIZE 16384
+#define LOG_IDLE_MS 50
+#define LOG_PATH_MAX 96
+
+typedef struct {
+    size_t seq;                 /* == position: free; position + 1: holds a line */
+    unsigned long long time_ms; /* Wall clock, formatted by the writer */
+    int len;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+static LogSlot log_ring[LOG_RING_SLOTS];
+static size_t log_tail = 0;     /* Next position to claim, shared by producers */
+static size_t log_head = 0;     /* Next position to write out, writer only */
+static int log_level = LOG_OFF;
+static int log_sample = 1;
+static unsigned long log_sample_count = 0;
+static int log_running = 0;
+static pthread_t log_thread;
+static StatsFamily *stat_lines;
+
+static const char *level_names[] = {"off", "error", "info", "debug"};
+
+int log_parse_level(const char *name) {
+    int i;
+    
+    for (i = LOG_OFF; i <= LOG_DEBUG; i++) {
+        if (strcmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char* log_level_name(int level) {
+    return level >= LOG_OFF && level <= LOG_DEBUG ? level_names[level] : "?";
+}
+
+int log_enabled(int level) {
+    return level != LOG_OFF && level <= log_level;
+}
+
+/* Claim a slot for one line; NULL (counted) when the ring is full */
+static LogSlot* log_claim(void) {
+    size_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    
+    for (;;) {
+        LogSlot *slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+        
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            /* The writer has not caught up with a full ring */
+            stats_add(stat_lines, "dropped", 1);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Hand a filled slot to the writer */
+static void log_publish(LogSlot *slot, int len) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    slot->time_ms = (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL;
+    slot->len = len < 0 ? 0 : len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len;
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+void log_access(const char *method, const char *path, int status, unsigned long long bytes,
+                unsigned long long micros) {
+    char route[LOG_PATH_MAX];
+    LogSlot *slot;
+    size_t i, n = 0;
+    
+    if (!log_enabled(status >= 500 ? LOG_ERROR : LOG_INFO)) return;
+    if (status < 500 && log_sample > 1 &&
+        __atomic_fetch_add(&log_sample_count, 1, __ATOMIC_RELAXED) % (unsigned long)log_sample != 0) {
+        stats_add(stat_lines, "sampled", 1);
+        return;
+    }
+    
+    /* Keep the record one line of space-separated fields, whatever the client sent */
+    for (i = 0; path && path[i] && n < sizeof(route) - 1; i++) {
+        unsigned char c = (unsigned char)path[i];
+        route[n++] = c > ' ' && c < 0x7f && c != '"' ? (char)c : '?';
+    }
+    if (n == 0) route[n++] = '-';
+    route[n] = '\0';
+    
+    slot = log_claim();
+    if (!slot) return;
+    log_publish(slot, snprintf(slot->text, LOG_LINE_MAX, "method=%.8s route=%s status=%d bytes=%llu us=%llu\n",
+                               method && *method ? method : "-", route, status, bytes, micros));
+}
+
+void log_message(int level, const char *format, ...) {
+    LogSlot *slot;
+    va_list args;
+    int len;
+    
+    if (!log_enabled(level)) return;
+    slot = log_claim();
+    if (!slot) return;
+    
+    len = snprintf(slot->text, LOG_LINE_MAX, "level=%s msg=\"", level_names[level]);
+    va_start(args, format);
+    len += vsnprintf(slot->text + len, LOG_LINE_MAX - (size_t)len, format, args);
+    va_end(args);
+    if (len > LOG_LINE_MAX - 3) len = LOG_LINE_MAX - 3;
+    memcpy(slot->text + len, "\"\n", 3);
+    log_publish(slot, len + 2);
+}
+
+/* Move the next queued line into batch as ts=... <text>; 0 when there is none */
+static int log_take(char *batch, size_t *len, char *stamp, time_t *stamp_sec) {
+    LogSlot *slot = &log_ring[log_head & (LOG_RING_SLOTS - 1)];
+    time_t sec;
+    
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1) return 0;
+    
+    /* Lines mostly arrive within the same second: format its date once */
+    sec = (time_t)(slot->time_ms / 1000);
+    if (sec != *stamp_sec) {
+        struct tm tm;
+        
+        gmtime_r(&sec, &tm);
+        strftime(stamp, 24, "%Y-%m-%dT%H:%M:%S", &tm);
+        *stamp_sec = sec;
+    }
+    *len += (size_t)sprintf(batch + *len, "ts=%s.%03dZ ", stamp, (int)(slot->time_ms % 1000));
+    memcpy(batch + *len, slot->text, (size_t)slot->len);
+    *len += (size_t)slot->len;
+    
+    __atomic_store_n(&slot->seq, log_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    log_head++;
+    return 1;
+}
+
+static void* log_writer(void *arg) {
+    char *batch = malloc(LOG_BATCH_SIZE);
+    char stamp[24] = "";
+    time_t stamp_sec = (time_t)-1;
+    struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+    
+    (void)arg;
+    if (!batch) return NULL;
+    for (;;) {
+        int stopping = !__atomic_load_n(&log_running, __ATOMIC_ACQUIRE);
+        size_t len = 0;
+        int lines = 0;
+        
+        while (len + LOG_LINE_MAX + 32 <= LOG_BATCH_SIZE && log_take(batch, &len, stamp, &stamp_sec)) lines++;
+        if (lines > 0) {
+            fwrite(batch, 1, len, stdout);
+            fflush(stdout);
+            stats_add(stat_lines, "written", lines);
+            continue;
+        }
+        if (stopping) break;
+        nanosleep(&idle, NULL);
+    }
+    free(batch);
+    return NULL;
+}
+
+int log_start(int level, int sample) {
+    size_t i;
+    
+    for (i = 0; i < LOG_RING_SLOTS; i++) log_ring[i].seq = i;
+    log_level = level;
+    log_sample = sample > 0 ? sample : 1;
+    stat_lines = stats_family(STATS_COUNTER, "qnx_exporter_log_lines_total",
+        "Log lines written, dropped because the ring was full, or skipped by access log sampling",
+        "result", 3);
+    if (level == LOG_OFF) return 0;
+    
+    log_running = 1;
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        perror("pthread_create");
+        log_running = 0;
+        log_level = LOG_OFF;
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void) {
+    if (__atomic_exchange_n(&log_running, 0, __ATOMIC_ACQ_REL)) pthread_join(log_thread, NULL);
+    log_level = LOG_OFF;
+}
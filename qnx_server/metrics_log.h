@@ -0,0 +1,46 @@
+#ifndef METRICS_LOG_H
+#define METRICS_LOG_H
+
+#include <stddef.h>
+
+/*
+ * Asynchronous access log.
+ *
+ * Request threads never write to stdout themselves: each log line is
+ * formatted into a slot of a fixed ring and a background thread writes
+ * the lines out in batches, so a slow console or pipe only ever delays
+ * that thread. The ring is a bounded multi-producer queue (a sequence
+ * number per slot, claimed with one compare-and-swap); when it is full
+ * the line is dropped and counted, never waited for.
+ *
+ * Access lines are one compact logfmt record per request:
+ *   ts=2026-10-16T23:50:01.123Z method=GET route=/metrics status=200 bytes=5321 us=812
+ * Responses with a 5xx status are logged at error level, everything else
+ * at info level, 1 in every N (-S N) when sampled. Connection events are
+ * debug messages.
+ */
+
+enum { LOG_OFF, LOG_ERROR, LOG_INFO, LOG_DEBUG };
+
+#define LOG_RING_SLOTS 1024     /* Power of two */
+#define LOG_LINE_MAX 240
+
+/* "off", "error", "info" or "debug"; -1 if none of them */
+int log_parse_level(const char *name);
+const char* log_level_name(int level);
+
+/* Start the writer thread; lines go to stdout. Call before any thread logs */
+int log_start(int level, int sample);
+
+/* Write out what is queued and stop the writer */
+void log_stop(void);
+
+int log_enabled(int level);
+
+/* path is the request target, up to its query string; NULL or "" is logged as - */
+void log_access(const char *method, const char *path, int status, unsigned long long bytes,
+                unsigned long long micros);
+
+void log_message(int level, const char *format, ...);
+
+#endif
@@ -0,0 +1,808 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics_collect.h"
+#include "metrics_exec.h"
+#include "metrics_time.h"
+#include "metrics_bus.h"
+#include "metrics_procs.h"
+#include "metrics_writer.h"
+
+#define PROCS_MAX 2048
+#define PROCS_MAX_THREADS 8192
+#define PROCS_PIDIN_OUTPUT (1024 * 1024)
+#define PROCS_PIDIN_TIMEOUT_MS 5000
+#define PROCS_SECTION_MAX_AGE_MS 1000
+#define PROCS_HOGS_ROWS 20
+#define PROCS_BUS_TRIES 3
+
+static pthread_mutex_t procs_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProcSnapshot *procs_current = NULL;
+static unsigned long procs_generation = 0;
+
+/* Append formatted text, never running past the buffer */
+static void appendf(char *out, size_t size, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    
+    if (*len >= size - 1) return;
+    va_start(ap, fmt);
+    n = vsnprintf(out + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    *len += (size_t)n;
+    if (*len >= size) *len = size - 1;
+}
+
+void procs_release(ProcSnapshot *snap) {
+    if (!snap || __atomic_sub_fetch(&snap->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    free(snap->pid);
+    free(snap->ppid);
+    free(snap->name);
+    free(snap->state);
+    free(snap->threads);
+    free(snap->priority);
+    free(snap->cpu_ms);
+    free(snap->cpu_delta_ms);
+    free(snap->cpu_permille);
+    free(snap->mem_kb);
+    free(snap->thread_pid);
+    free(snap->thread_tid);
+    free(snap->thread_name);
+    free(snap->thread_state);
+    free(snap->thread_priority);
+    free(snap->thread_cpu_ms);
+    free(snap->by_pid);
+    free(snap->strings);
+    free(snap->intern);
+    free(snap);
+}
+
+static ProcSnapshot* snapshot_alloc(int capacity, int thread_capacity) {
+    ProcSnapshot *snap = calloc(1, sizeof(ProcSnapshot));
+    size_t n = capacity > 0 ? (size_t)capacity : 1;
+    size_t t = thread_capacity > 0 ? (size_t)thread_capacity : 1;
+    
+    if (!snap) return NULL;
+    snap->refcount = 1;
+    
+    snap->pid = malloc(n * sizeof(int));
+    snap->ppid = malloc(n * sizeof(int));
+    snap->name = malloc(n * sizeof(int));
+    snap->state = malloc(n * sizeof(int));
+    snap->threads = malloc(n * sizeof(int));
+    snap->priority = malloc(n * sizeof(int));
+    snap->cpu_ms = malloc(n * sizeof(unsigned long long));
+    snap->cpu_delta_ms = calloc(n, sizeof(unsigned long long));
+    snap->cpu_permille = calloc(n, sizeof(unsigned int));
+    snap->mem_kb = malloc(n * sizeof(unsigned long long));
+    snap->by_pid = malloc(n * sizeof(int));
+    snap->thread_pid = malloc(t * sizeof(int));
+    snap->thread_tid = malloc(t * sizeof(int));
+    snap->thread_name = malloc(t * sizeof(int));
+    snap->thread_state = malloc(t * sizeof(int));
+    snap->thread_priority = malloc(t * sizeof(int));
+    snap->thread_cpu_ms = malloc(t * sizeof(unsigned long long));
+    
+    /* Room for every name and state at under half load */
+    snap->intern_size = 64;
+    while (snap->intern_size < (int)(n + t) * 4) snap->intern_size *= 2;
+    snap->intern = calloc((size_t)snap->intern_size, sizeof(int));
+    
+    /* Offset 0 is the empty string, used when interning fails */
+    snap->strings_cap = 4096;
+    snap->strings = malloc(snap->strings_cap);
+    
+    if (!snap->pid || !snap->ppid || !snap->name || !snap->state || !snap->threads ||
+        !snap->priority || !snap->cpu_ms || !snap->cpu_delta_ms || !snap->cpu_permille ||
+        !snap->mem_kb || !snap->by_pid || !snap->thread_pid || !snap->thread_tid ||
+        !snap->thread_name || !snap->thread_state || !snap->thread_priority ||
+        !snap->thread_cpu_ms || !snap->intern || !snap->strings) {
+        procs_release(snap);
+        return NULL;
+    }
+    snap->strings[0] = '\0';
+    snap->strings_len = 1;
+    return snap;
+}
+
+/* Offset of text in the string pool, adding it on first use */
+static int snapshot_intern(ProcSnapshot *snap, const char *text) {
+    unsigned int hash = 2166136261u;
+    unsigned int mask = (unsigned int)snap->intern_size - 1;
+    size_t len = strlen(text);
+    const char *p;
+    unsigned int i;
+    int offset;
+    
+    for (p = text; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+    for (i = hash & mask; snap->intern[i]; i = (i + 1) & mask) {
+        if (strcmp(snap->strings + snap->intern[i] - 1, text) == 0) return snap->intern[i] - 1;
+    }
+    
+    if (snap->strings_len + len + 1 > snap->strings_cap) {
+        size_t cap = snap->strings_cap * 2;
+        char *strings;
+        
+        while (cap < snap->strings_len + len + 1) cap *= 2;
+        strings = realloc(snap->strings, cap);
+        if (!strings) return 0;
+        snap->strings = strings;
+        snap->strings_cap = cap;
+    }
+    offset = (int)snap->strings_len;
+    memcpy(snap->strings + offset, text, len + 1);
+    snap->strings_len += len + 1;
+    snap->intern[i] = offset + 1;
+    return offset;
+}
+
+static void snapshot_add(ProcSnapshot *snap, const ProcInfo *proc) {
+    int row = snap->count++;
+    
+    snap->pid[row] = proc->pid;
+    snap->ppid[row] = proc->ppid;
+    snap->name[row] = snapshot_intern(snap, proc->name);
+    snap->state[row] = snapshot_intern(snap, proc->state);
+    snap->threads[row] = proc->threads;
+    snap->priority[row] = proc->priority;
+    snap->cpu_ms[row] = proc->cpu_ms;
+    snap->mem_kb[row] = proc->mem_kb;
+}
+
+static void snapshot_add_thread(ProcSnapshot *snap, const ThreadInfo *thread) {
+    int row = snap->thread_count++;
+    
+    snap->thread_pid[row] = thread->pid;
+    snap->thread_tid[row] = thread->tid;
+    snap->thread_name[row] = snapshot_intern(snap, thread->name);
+    snap->thread_state[row] = snapshot_intern(snap, thread->state);
+    snap->thread_priority[row] = thread->priority;
+    snap->thread_cpu_ms[row] = thread->cpu_ms;
+}
+
+static ProcSnapshot* snapshot_from_native(void) {
+    ProcInfo *procs = malloc(sizeof(ProcInfo) * PROCS_MAX);
+    ThreadInfo *threads = malloc(sizeof(ThreadInfo) * PROCS_MAX_THREADS);
+    ProcSnapshot *snap = NULL;
+    int count = -1, thread_count = -1, i;
+    
+    if (procs && threads) {
+        count = collect_processes(procs, PROCS_MAX);
+        if (count >= 0) thread_count = collect_threads(threads, PROCS_MAX_THREADS);
+    }
+    if (count >= 0) snap = snapshot_alloc(count, thread_count);
+    if (snap) {
+        snap->has_cpu = 1;
+        snap->has_threads = thread_count >= 0;
+        for (i = 0; i < count; i++) snapshot_add(snap, &procs[i]);
+        for (i = 0; i < thread_count; i++) snapshot_add_thread(snap, &threads[i]);
+    }
+    free(threads);
+    free(procs);
+    return snap;
+}
+
+/*
+ * Build straight from a bus slot (the previous one for a baseline), with
+ * no intermediate array. Rows are taken one at a time and their strings
+ * terminated, since a row being overwritten may have lost its NUL; such a
+ * snapshot fails bus_valid() and is built again.
+ */
+static ProcSnapshot* snapshot_from_bus(int previous) {
+    int tries;
+    
+    for (tries = 0; tries < PROCS_BUS_TRIES; tries++) {
+        unsigned int token;
+        const BusSnapshot *slot = bus_begin(previous, &token);
+        ProcSnapshot *snap;
+        int count, i;
+        
+        if (!slot) return NULL;
+        count = slot->process_count;
+        if (count < 0 || count > BUS_MAX_PROCS) {
+            if (bus_valid(slot, token)) return NULL;
+            continue;
+        }
+        snap = snapshot_alloc(count, 0);
+        if (!snap) return NULL;
+        snap->has_cpu = 1;
+        for (i = 0; i < count; i++) {
+            ProcInfo proc = slot->processes[i];
+            
+            proc.name[sizeof(proc.name) - 1] = '\0';
+            proc.state[sizeof(proc.state) - 1] = '\0';
+            snapshot_add(snap, &proc);
+        }
+        snap->taken_ms = slot->taken_ms;
+        snap->bus_generation = slot->generation;
+        if (bus_valid(slot, token)) return snap;
+        procs_release(snap);
+    }
+    return NULL;
+}
+
+/* pidin priorities are a number and a scheduling policy letter, e.g. 10r */
+static int pidin_priority(const char *text) {
+    const char *p = text;
+    
+    while (*p >= '0' && *p <= '9') p++;
+    return p > text && *p >= 'a' && *p <= 'z' && p[1] == '\0';
+}
+
+/*
+ * Parse default pidin output, one row per thread:
+ *      pid tid name               prio STATE       Blocked
+ *        1   1 proc/boot/procnto    0f READY
+ * Rows of a process are consecutive; continuation rows may omit the name.
+ * pidin runs through exec_command(), so a hung pidin is killed at the
+ * deadline instead of holding up procs_acquire(); partial output is dropped.
+ */
+static ProcSnapshot* snapshot_from_pidin(void) {
+    ProcInfo *procs = malloc(sizeof(ProcInfo) * PROCS_MAX);
+    ThreadInfo *threads = malloc(sizeof(ThreadInfo) * PROCS_MAX_THREADS);
+    char *output = malloc(PROCS_PIDIN_OUTPUT);
+    ProcSnapshot *snap = NULL;
+    int count = 0, thread_count = 0, timed_out = 0, len = -1, i;
+    char *line, *next;
+    
+    if (procs && threads && output) {
+        len = exec_command("pidin 2>/dev/null", output, PROCS_PIDIN_OUTPUT, PROCS_PIDIN_TIMEOUT_MS, &timed_out);
+    }
+    if (len <= 0 || timed_out) {
+        free(output);
+        free(threads);
+        free(procs);
+        return NULL;
+    }
+    
+    for (line = output; line < output + len; line = next) {
+        char name[COLLECT_NAME_MAX], prio[16], state[COLLECT_STATE_MAX];
+        const char *row_name = name, *row_prio = prio, *row_state = state, *base;
+        int pid, tid, fields;
+        ThreadInfo *thread;
+        
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        else next = output + len;
+        
+        fields = sscanf(line, "%d %d %63s %15s %11s", &pid, &tid, name, prio, state);
+        if (fields < 4) continue;
+        if (pidin_priority(name)) {
+            /* Continuation row: pid tid prio STATE */
+            if (count == 0 || procs[count - 1].pid != pid) continue;
+            row_name = procs[count - 1].name;
+            row_prio = name;
+            row_state = prio;
+        } else if (fields < 5) {
+            continue;
+        } else if ((base = strrchr(name, '/')) != NULL) {
+            row_name = base + 1;
+        }
+        
+        if (count == 0 || procs[count - 1].pid != pid) {
+            if (count == PROCS_MAX) continue;
+            memset(&procs[count], 0, sizeof(ProcInfo));
+            procs[count].pid = pid;
+            procs[count].priority = atoi(row_prio);
+            snprintf(procs[count].name, sizeof(procs[count].name), "%s", row_name);
+            snprintf(procs[count].state, sizeof(procs[count].state), "%.*s", (int)sizeof(procs[count].state) - 1, row_state);
+            count++;
+        }
+        procs[count - 1].threads++;
+        
+        if (thread_count == PROCS_MAX_THREADS) continue;
+        thread = &threads[thread_count++];
+        memset(thread, 0, sizeof(ThreadInfo));
+        thread->pid = pid;
+        thread->tid = tid;
+        thread->priority = atoi(row_prio);
+        snprintf(thread->name, sizeof(thread->name), "%s", row_name);
+        snprintf(thread->state, sizeof(thread->state), "%.*s", (int)sizeof(thread->state) - 1, row_state);
+    }
+    free(output);
+    
+    if (count > 0) snap = snapshot_alloc(count, thread_count);
+    if (snap) {
+        snap->has_threads = 1;
+        for (i = 0; i < count; i++) snapshot_add(snap, &procs[i]);
+        for (i = 0; i < thread_count; i++) snapshot_add_thread(snap, &threads[i]);
+    }
+    free(threads);
+    free(procs);
+    return snap;
+}
+
+typedef struct {
+    int pid;
+    int row;
+} PidRow;
+
+static int compare_pid_row(const void *a, const void *b) {
+    return ((const PidRow*)a)->pid - ((const PidRow*)b)->pid;
+}
+
+static void snapshot_index(ProcSnapshot *snap) {
+    PidRow *order = malloc(sizeof(PidRow) * (snap->count ? snap->count : 1));
+    int i;
+    
+    if (!order) {
+        for (i = 0; i < snap->count; i++) snap->by_pid[i] = i;
+        return;
+    }
+    for (i = 0; i < snap->count; i++) {
+        order[i].pid = snap->pid[i];
+        order[i].row = i;
+    }
+    qsort(order, snap->count, sizeof(PidRow), compare_pid_row);
+    for (i = 0; i < snap->count; i++) snap->by_pid[i] = order[i].row;
+    free(order);
+}
+
+static int snapshot_find(const ProcSnapshot *snap, int pid) {
+    int lo = 0, hi = snap->count - 1;
+    
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int row = snap->by_pid[mid];
+        
+        if (snap->pid[row] == pid) return row;
+        if (snap->pid[row] < pid) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+/* CPU used by each process since the previous snapshot */
+static void snapshot_rates(ProcSnapshot *snap, const ProcSnapshot *prev) {
+    int i;
+    
+    if (!prev || !snap->has_cpu || !prev->has_cpu || snap->taken_ms <= prev->taken_ms) return;
+    snap->interval_ms = snap->taken_ms - prev->taken_ms;
+    
+    for (i = 0; i < snap->count; i++) {
+        int row = snapshot_find(prev, snap->pid[i]);
+        unsigned long long delta, permille;
+        
+        if (row < 0 || snap->cpu_ms[i] < prev->cpu_ms[row]) continue;
+        delta = snap->cpu_ms[i] - prev->cpu_ms[row];
+        permille = delta * 1000ULL / (snap->interval_ms * (unsigned long long)snap->num_cpus);
+        snap->cpu_delta_ms[i] = delta;
+        snap->cpu_permille[i] = permille > 1000 ? 1000 : (unsigned int)permille;
+    }
+}
+
+static void snapshot_finish(ProcSnapshot *snap, const ProcSnapshot *prev) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    snap->num_cpus = cpus > 0 ? (int)cpus : 1;
+    snap->generation = ++procs_generation;
+    snapshot_index(snap);
+    snapshot_rates(snap, prev);
+}
+
+static ProcSnapshot* snapshot_take(const ProcSnapshot *prev) {
+    ProcSnapshot *snap = snapshot_from_native();
+    
+    if (!snap) snap = snapshot_from_pidin();
+    if (!snap) return NULL;
+    
+    snap->taken_ms = monotonic_ms();
+    snapshot_finish(snap, prev);
+    return snap;
+}
+
+/* Follow the bus: nothing to build while its generation is unchanged; -1 without a fresh snapshot */
+static int procs_follow_bus(void) {
+    unsigned int token;
+    const BusSnapshot *slot = bus_begin(0, &token);
+    unsigned long long generation;
+    ProcSnapshot *next;
+    
+    if (!slot) return -1;
+    generation = slot->generation;
+    if (!bus_valid(slot, token)) return -1;
+    if (procs_current && procs_current->bus_generation == generation) return 0;
+    
+    if (!procs_current || !procs_current->bus_generation) {
+        /* The slot before is a ready-made baseline for CPU rates */
+        ProcSnapshot *baseline = snapshot_from_bus(1);
+        
+        if (baseline) {
+            snapshot_finish(baseline, NULL);
+            procs_release(procs_current);
+            procs_current = baseline;
+        }
+    }
+    next = snapshot_from_bus(0);
+    if (!next) return -1;
+    snapshot_finish(next, procs_current);
+    procs_release(procs_current);
+    procs_current = next;
+    return 0;
+}
+
+ProcSnapshot* procs_acquire(int max_age_ms) {
+    ProcSnapshot *snap;
+    
+    pthread_mutex_lock(&procs_lock);
+    if ((!procs_current || monotonic_ms() - procs_current->taken_ms > (unsigned long long)max_age_ms) &&
+        !(bus_attached() && procs_follow_bus() == 0)) {
+        ProcSnapshot *next = NULL;
+        int cold = !procs_current;
+        
+        if (cold) {
+            /* Cold start: take a baseline so the first snapshot has CPU rates */
+            procs_current = snapshot_take(NULL);
+            if (procs_current && procs_current->has_cpu) usleep(100000);
+        }
+        /* A baseline without CPU times needs no second run; a failed one is retried next call */
+        if (procs_current && (!cold || procs_current->has_cpu)) next = snapshot_take(procs_current);
+        if (next) {
+            procs_release(procs_current);
+            procs_current = next;
+        }
+    }
+    snap = procs_current;
+    if (snap) __atomic_add_fetch(&snap->refcount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&procs_lock);
+    return snap;
+}
+
+const char* proc_name(const ProcSnapshot *snap, int row) {
+    return snap->strings + snap->name[row];
+}
+
+const char* proc_state(const ProcSnapshot *snap, int row) {
+    return snap->strings + snap->state[row];
+}
+
+const char* thread_name(const ProcSnapshot *snap, int row) {
+    return snap->strings + snap->thread_name[row];
+}
+
+const char* thread_state(const ProcSnapshot *snap, int row) {
+    return snap->strings + snap->thread_state[row];
+}
+
+void proc_query_init(ProcQuery *query) {
+    memset(query, 0, sizeof(*query));
+    query->sort = PROC_SORT_CPU;
+}
+
+/* Copy a URL-encoded value, decoding %XX and '+' */
+static void url_decode(char *out, size_t size, const char *in, size_t len) {
+    size_t i, j = 0;
+    
+    for (i = 0; i < len && j < size - 1; i++) {
+        if (in[i] == '%' && i + 2 < len) {
+            char hex[3] = {in[i + 1], in[i + 2], '\0'};
+            out[j++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            out[j++] = in[i] == '+' ? ' ' : in[i];
+        }
+    }
+    out[j] = '\0';
+}
+
+void proc_query_parse(ProcQuery *query, const char *params) {
+    const char *p = params;
+    
+    while (p && *p && *p != ' ' && *p != '#' && *p != '\r' && *p != '\n') {
+        size_t key_len = strcspn(p, "=& #\r\n");
+        char key[16], value[64];
+        
+        url_decode(key, sizeof(key), p, key_len);
+        p += key_len;
+        value[0] = '\0';
+        if (*p == '=') {
+            size_t value_len = strcspn(++p, "& #\r\n");
+            url_decode(value, sizeof(value), p, value_len);
+            p += value_len;
+        }
+        if (*p == '&') p++;
+        
+        if (strcmp(key, "sort") == 0) {
+            if (strcmp(value, "cpu") == 0) query->sort = PROC_SORT_CPU;
+            else if (strcmp(value, "mem") == 0) query->sort = PROC_SORT_MEM;
+            else if (strcmp(value, "pid") == 0) query->sort = PROC_SORT_PID;
+            else if (strcmp(value, "threads") == 0) query->sort = PROC_SORT_THREADS;
+            else if (strcmp(value, "name") == 0) query->sort = PROC_SORT_NAME;
+        } else if (strcmp(key, "top") == 0) {
+            query->limit = atoi(value) > 0 ? atoi(value) : 0;
+        } else if (strcmp(key, "name") == 0) {
+            snprintf(query->name, sizeof(query->name), "%s", value);
+        } else if (strcmp(key, "min_cpu") == 0) {
+            double percent = atof(value);
+            query->min_cpu_permille = percent > 0 ? (unsigned int)(percent * 10.0 + 0.5) : 0;
+        } else if (strcmp(key, "min_mem") == 0) {
+            query->min_mem_kb = strtoull(value, NULL, 10);
+        }
+    }
+}
+
+/* Nonzero when row a sorts before row b */
+static int proc_before(const ProcSnapshot *snap, int sort, int a, int b) {
+    switch (sort) {
+    case PROC_SORT_CPU:
+        if (snap->cpu_permille[a] != snap->cpu_permille[b]) return snap->cpu_permille[a] > snap->cpu_permille[b];
+        if (snap->cpu_delta_ms[a] != snap->cpu_delta_ms[b]) return snap->cpu_delta_ms[a] > snap->cpu_delta_ms[b];
+        if (snap->cpu_ms[a] != snap->cpu_ms[b]) return snap->cpu_ms[a] > snap->cpu_ms[b];
+        break;
+    case PROC_SORT_MEM:
+        if (snap->mem_kb[a] != snap->mem_kb[b]) return snap->mem_kb[a] > snap->mem_kb[b];
+        break;
+    case PROC_SORT_THREADS:
+        if (snap->threads[a] != snap->threads[b]) return snap->threads[a] > snap->threads[b];
+        break;
+    case PROC_SORT_NAME:
+        if (snap->name[a] != snap->name[b]) {
+            int cmp = strcmp(proc_name(snap, a), proc_name(snap, b));
+            if (cmp != 0) return cmp < 0;
+        }
+        break;
+    }
+    return snap->pid[a] < snap->pid[b];
+}
+
+static int proc_matches(const ProcSnapshot *snap, const ProcQuery *query, int row) {
+    if (snap->cpu_permille[row] < query->min_cpu_permille) return 0;
+    if (snap->mem_kb[row] < query->min_mem_kb) return 0;
+    if (query->name[0] && !strstr(proc_name(snap, row), query->name)) return 0;
+    return 1;
+}
+
+/* The heap keeps the row that sorts last at its root */
+static void heap_sift_up(const ProcSnapshot *snap, int sort, int *heap, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        int tmp;
+        
+        if (!proc_before(snap, sort, heap[parent], heap[i])) break;
+        tmp = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = tmp;
+        i = parent;
+    }
+}
+
+static void heap_sift_down(const ProcSnapshot *snap, int sort, int *heap, int n, int i) {
+    for (;;) {
+        int last = i, left = 2 * i + 1, right = left + 1;
+        int tmp;
+        
+        if (left < n && proc_before(snap, sort, heap[last], heap[left])) last = left;
+        if (right < n && proc_before(snap, sort, heap[last], heap[right])) last = right;
+        if (last == i) return;
+        tmp = heap[last];
+        heap[last] = heap[i];
+        heap[i] = tmp;
+        i = last;
+    }
+}
+
+/* Top-N through a bounded heap: O(n log N), then heapsort the survivors */
+int proc_select(const ProcSnapshot *snap, const ProcQuery *query, int *rows) {
+    int limit = query->limit > 0 && query->limit < snap->count ? query->limit : snap->count;
+    int n = 0, i;
+    
+    for (i = 0; i < snap->count; i++) {
+        if (!proc_matches(snap, query, i)) continue;
+        if (n < limit) {
+            rows[n++] = i;
+            heap_sift_up(snap, query->sort, rows, n - 1);
+        } else if (n > 0 && proc_before(snap, query->sort, i, rows[0])) {
+            rows[0] = i;
+            heap_sift_down(snap, query->sort, rows, n, 0);
+        }
+    }
+    
+    for (i = n - 1; i > 0; i--) {
+        int tmp = rows[0];
+        rows[0] = rows[i];
+        rows[i] = tmp;
+        heap_sift_down(snap, query->sort, rows, i, 0);
+    }
+    return n;
+}
+
+/* One line of the text table; row -1 is the header */
+static int proc_text_line(const ProcSnapshot *snap, int row, char *line, size_t size) {
+    int n;
+    
+    if (row < 0) {
+        n = snprintf(line, size, "%8s %8s %-24s %-10s %4s %5s %6s %12s %10s\n",
+                     "pid", "ppid", "name", "state", "prio", "thr", "cpu%", "cpu_ms", "mem_kb");
+    } else {
+        n = snprintf(line, size, "%8d %8d %-24.24s %-10s %4d %5d %4u.%u %12llu %10llu\n",
+                     snap->pid[row], snap->ppid[row], proc_name(snap, row), proc_state(snap, row),
+                     snap->priority[row], snap->threads[row],
+                     snap->cpu_permille[row] / 10, snap->cpu_permille[row] % 10,
+                     snap->cpu_ms[row], snap->mem_kb[row]);
+    }
+    if (n < 0) return 0;
+    return (size_t)n < size ? n : (int)size - 1;
+}
+
+int proc_render_text(const ProcSnapshot *snap, const int *rows, int count, char *out, size_t size) {
+    char line[256];
+    size_t len = 0;
+    int i;
+    
+    out[0] = '\0';
+    for (i = -1; i < count; i++) {
+        proc_text_line(snap, i < 0 ? -1 : rows[i], line, sizeof(line));
+        appendf(out, size, &len, "%s", line);
+    }
+    if (count == snap->count) appendf(out, size, &len, "%d processes\n", count);
+    else appendf(out, size, &len, "%d of %d processes\n", count, snap->count);
+    return (int)len;
+}
+
+/* The same table, escaped as the inside of a JSON string, without a size limit */
+void proc_write_text_escaped(JsonWriter *w, const ProcSnapshot *snap, const int *rows, int count) {
+    char line[256];
+    int i, n;
+    
+    for (i = -1; i < count; i++) {
+        n = proc_text_line(snap, i < 0 ? -1 : rows[i], line, sizeof(line));
+        writer_escaped(w, line, (size_t)n);
+    }
+    if (count == snap->count) n = snprintf(line, sizeof(line), "%d processes\n", count);
+    else n = snprintf(line, sizeof(line), "%d of %d processes\n", count, snap->count);
+    writer_escaped(w, line, (size_t)n);
+}
+
+/*
+ * {"generation":G,"time":T,"interval_ms":I,"cpus":C,"total":N,"count":n,
+ *  "columns":["pid",...],"rows":[[1,0,"procnto","READY",...],...]}
+ * cpu is a percentage of all CPUs, null when the source has no CPU times.
+ */
+void proc_write_json(JsonWriter *w, const ProcSnapshot *snap, const int *rows, int count) {
+    int i;
+    
+    writer_printf(w,
+            "{\"generation\":%lu,\"time\":%llu,\"interval_ms\":%llu,\"cpus\":%d,\"total\":%d,\"count\":%d,"
+            "\"columns\":[\"pid\",\"ppid\",\"name\",\"state\",\"priority\",\"threads\",\"cpu\",\"cpu_ms\",\"mem_kb\"],"
+            "\"rows\":[",
+            snap->generation, (unsigned long long)time(NULL), snap->interval_ms, snap->num_cpus,
+            snap->count, count);
+    for (i = 0; i < count; i++) {
+        int row = rows[i];
+        
+        writer_printf(w, "%s[%d,%d,", i ? "," : "", snap->pid[row], snap->ppid[row]);
+        writer_string(w, proc_name(snap, row));
+        writer_write(w, ",", 1);
+        writer_string(w, proc_state(snap, row));
+        writer_printf(w, ",%d,%d,", snap->priority[row], snap->threads[row]);
+        if (snap->has_cpu) {
+            writer_printf(w, "%u.%u", snap->cpu_permille[row] / 10, snap->cpu_permille[row] % 10);
+        } else {
+            writer_write(w, "null", 4);
+        }
+        writer_printf(w, ",%llu,%llu]", snap->cpu_ms[row], snap->mem_kb[row]);
+    }
+    writer_write(w, "]}\n", 3);
+}
+
+int procs_write_query_json(JsonWriter *w, const ProcSnapshot *snap, const char *params) {
+    ProcQuery query;
+    int *rows = malloc(sizeof(int) * (snap->count ? snap->count : 1));
+    
+    if (!rows) return -1;
+    proc_query_init(&query);
+    proc_query_parse(&query, params);
+    proc_write_json(w, snap, rows, proc_select(snap, &query, rows));
+    free(rows);
+    return 0;
+}
+
+char* procs_query_json(const char *params, int max_age_ms, size_t *len) {
+    ProcSnapshot *snap = procs_acquire(max_age_ms);
+    JsonWriter w;
+    
+    if (!snap) return NULL;
+    writer_init_memory(&w, 512 + (size_t)snap->count * 96);
+    if (procs_write_query_json(&w, snap, params) != 0) w.failed = 1;
+    procs_release(snap);
+    return writer_finish(&w, len);
+}
+
+int procs_write_list(JsonWriter *w) {
+    ProcSnapshot *snap = procs_acquire(PROCS_SECTION_MAX_AGE_MS);
+    ProcQuery query;
+    int *rows;
+    
+    if (!snap) return -1;
+    rows = malloc(sizeof(int) * (snap->count ? snap->count : 1));
+    if (!rows) {
+        procs_release(snap);
+        return -1;
+    }
+    proc_query_init(&query);
+    query.sort = PROC_SORT_PID;
+    proc_write_text_escaped(w, snap, rows, proc_select(snap, &query, rows));
+    free(rows);
+    procs_release(snap);
+    return 0;
+}
+
+int procs_render_list(char *out, size_t size) {
+    ProcSnapshot *snap = procs_acquire(PROCS_SECTION_MAX_AGE_MS);
+    ProcQuery query;
+    int *rows;
+    int len = -1;
+    
+    if (!snap) return -1;
+    rows = malloc(sizeof(int) * (snap->count ? snap->count : 1));
+    if (rows) {
+        proc_query_init(&query);
+        query.sort = PROC_SORT_PID;
+        len = proc_render_text(snap, rows, proc_select(snap, &query, rows), out, size);
+        free(rows);
+    }
+    procs_release(snap);
+    return len;
+}
+
+int procs_render_hogs(char *out, size_t size) {
+    ProcSnapshot *snap = procs_acquire(PROCS_SECTION_MAX_AGE_MS);
+    int rows[PROCS_HOGS_ROWS];
+    ProcQuery query;
+    size_t len = 0;
+    int count, i;
+    
+    if (!snap) return -1;
+    if (!snap->has_cpu || snap->interval_ms == 0) {
+        procs_release(snap);
+        return -1;
+    }
+    
+    proc_query_init(&query);
+    query.limit = PROCS_HOGS_ROWS;
+    query.min_cpu_permille = 1;
+    count = proc_select(snap, &query, rows);
+    
+    out[0] = '\0';
+    appendf(out, size, &len, "%8s %-24s %10s %8s %10s\n", "pid", "name", "msec", "cpu%", "mem_kb");
+    for (i = 0; i < count; i++) {
+        int row = rows[i];
+        appendf(out, size, &len, "%8d %-24.24s %10llu %5u.%u%% %10llu\n",
+                snap->pid[row], proc_name(snap, row), snap->cpu_delta_ms[row],
+                snap->cpu_permille[row] / 10, snap->cpu_permille[row] % 10, snap->mem_kb[row]);
+    }
+    appendf(out, size, &len, "sample interval %llu ms, %d cpus\n", snap->interval_ms, snap->num_cpus);
+    
+    procs_release(snap);
+    return (int)len;
+}
+
+int procs_render_threads(char *out, size_t size) {
+    ProcSnapshot *snap = procs_acquire(PROCS_SECTION_MAX_AGE_MS);
+    size_t len = 0;
+    int i;
+    
+    if (!snap) return -1;
+    if (!snap->has_threads) {
+        procs_release(snap);
+        return -1;
+    }
+    
+    out[0] = '\0';
+    appendf(out, size, &len, "%8s %8s %-24s %-10s %4s %12s\n", "pid", "tid", "name", "state", "prio", "cpu_ms");
+    for (i = 0; i < snap->thread_count; i++) {
+        appendf(out, size, &len, "%8d %8d %-24.24s %-10s %4d %12llu\n",
+                snap->thread_pid[i], snap->thread_tid[i], thread_name(snap, i), thread_state(snap, i),
+                snap->thread_priority[i], snap->thread_cpu_ms[i]);
+    }
+    appendf(out, size, &len, "%d threads\n", snap->thread_count);
+    
+    procs_release(snap);
+    return (int)len;
+}
@@ -0,0 +1,113 @@
+#ifndef METRICS_PROCS_H
+#define METRICS_PROCS_H
+
+#include <stddef.h>
+
+#include "metrics_writer.h"
+
+/*
+ * Columnar process snapshot.
+ *
+ * One row per process, stored as parallel arrays (struct of arrays) so
+ * sorting and filtering touch only the columns they need. Names and states
+ * are interned: each distinct string is stored once and rows hold offsets
+ * into the snapshot's string pool.
+ *
+ * Each snapshot also carries a thread table in the same layout, one row per
+ * thread keyed by pid. Snapshots come from the native collectors, or from
+ * parsing default pidin output (run with a deadline) when those are
+ * unavailable. Bus slots hold no threads, so snapshots built from the bus
+ * have has_threads = 0. Published snapshots are immutable and
+ * refcounted, so any thread can read one without locking; procs_acquire()
+ * takes a fresh one only when the current one is older than asked for.
+ * With a snapshot bus attached, snapshots are built from its slots and
+ * only when it has published a new generation.
+ */
+
+typedef struct {
+    int refcount;
+    int count;
+    int has_cpu;                    /* 0 when parsed from text without CPU times */
+    int has_threads;                /* 0 when the thread table could not be read */
+    int num_cpus;
+    unsigned long generation;
+    unsigned long long bus_generation; /* Bus snapshot it was built from, 0 if collected here */
+    unsigned long long taken_ms;    /* Monotonic time of the sample */
+    unsigned long long interval_ms; /* Since the previous snapshot, 0 for the first */
+    
+    /* Columns */
+    int *pid;
+    int *ppid;
+    int *name;                      /* Offset into strings */
+    int *state;                     /* Offset into strings */
+    int *threads;
+    int *priority;
+    unsigned long long *cpu_ms;
+    unsigned long long *cpu_delta_ms;
+    unsigned int *cpu_permille;     /* Share of all CPUs over the interval, 0.1% steps */
+    unsigned long long *mem_kb;
+    
+    /* Thread table, rows of a process consecutive */
+    int thread_count;
+    int *thread_pid;
+    int *thread_tid;
+    int *thread_name;               /* Offset into strings */
+    int *thread_state;              /* Offset into strings */
+    int *thread_priority;
+    unsigned long long *thread_cpu_ms;
+    
+    /* Rows ordered by pid, for lookups against the next snapshot */
+    int *by_pid;
+    
+    /* Interned strings */
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+    int *intern;                    /* Open addressing: string offset + 1, 0 = empty */
+    int intern_size;
+} ProcSnapshot;
+
+enum { PROC_SORT_CPU, PROC_SORT_MEM, PROC_SORT_PID, PROC_SORT_THREADS, PROC_SORT_NAME };
+
+typedef struct {
+    int sort;
+    int limit;                      /* Top-N, 0 = every match */
+    unsigned int min_cpu_permille;
+    unsigned long long min_mem_kb;
+    char name[64];                  /* Substring filter on the name */
+} ProcQuery;
+
+ProcSnapshot* procs_acquire(int max_age_ms);
+void procs_release(ProcSnapshot *snap);
+
+const char* proc_name(const ProcSnapshot *snap, int row);
+const char* proc_state(const ProcSnapshot *snap, int row);
+const char* thread_name(const ProcSnapshot *snap, int row);
+const char* thread_state(const ProcSnapshot *snap, int row);
+
+/* Defaults: by CPU, every row. Parse sort=, top=, name=, min_cpu= (%), min_mem= (KB) */
+void proc_query_init(ProcQuery *query);
+void proc_query_parse(ProcQuery *query, const char *params);
+
+/* Fill rows (snap->count entries) with the matching rows in order, returns how many */
+int proc_select(const ProcSnapshot *snap, const ProcQuery *query, int *rows);
+
+int proc_render_text(const ProcSnapshot *snap, const int *rows, int count, char *out, size_t size);
+void proc_write_text_escaped(JsonWriter *w, const ProcSnapshot *snap, const int *rows, int count);
+void proc_write_json(JsonWriter *w, const ProcSnapshot *snap, const int *rows, int count);
+
+/* Run a query (the /procs parameters) against snap and write it as JSON; -1 if out of memory */
+int procs_write_query_json(JsonWriter *w, const ProcSnapshot *snap, const char *params);
+
+/* Query the current snapshot straight into JSON; returns a malloc'd body or NULL */
+char* procs_query_json(const char *params, int max_age_ms, size_t *len);
+
+/* Every process as the text table, escaped for use inside a JSON string */
+int procs_write_list(JsonWriter *w);
+
+/* Section renderers for the qnx_commands tables, returning length or -1 */
+int procs_render_list(char *out, size_t size);
+int procs_render_hogs(char *out, size_t size);
+int procs_render_threads(char *out, size_t size);
+
+#endif
@@ -0,0 +1,734 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "metrics_remote.h"
+#include "metrics_writer.h"
+#include "metrics_time.h"
+#include "metrics_stats.h"
+
+#define REMOTE_DEFAULT_INTERVAL_MS 15000
+#define REMOTE_DEFAULT_BATCH_SAMPLES 2000
+#define REMOTE_DEFAULT_BATCH_WAIT_MS 5000
+#define REMOTE_DEFAULT_QUEUE_BYTES (8 * 1024 * 1024)
+#define REMOTE_QUEUE_ENTRIES 4096
+#define REMOTE_MAX_SERIES_LABELS 32
+#define REMOTE_CONNECT_TIMEOUT_MS 5000
+#define REMOTE_IO_TIMEOUT 10
+#define REMOTE_BACKOFF_MIN_MS 500
+#define REMOTE_BACKOFF_MAX_MS 30000
+#define SNAPPY_BLOCK 65536
+#define SNAPPY_HASH_BITS 14
+
+/* One scrape, encoded as repeated WriteRequest.timeseries fields */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    int samples;
+    unsigned long long queued_ms;
+} RemoteEntry;
+
+typedef struct {
+    RemoteConfig config;
+    CachedBody* (*scrape)(int max_age_ms);
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    RemoteEntry entries[REMOTE_QUEUE_ENTRIES];     /* Ring, oldest at head */
+    int head;
+    int count;
+    unsigned long long head_seq;                    /* Sequence number of entries[head] */
+    size_t bytes;
+    int samples;
+} RemoteQueue;
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} PbLabel;
+
+static RemoteQueue remote;
+static StatsFamily *stat_remote_samples;
+static StatsFamily *stat_remote_requests;
+static StatsFamily *stat_remote_bytes;
+static StatsFamily *stat_remote_queue;
+
+static void sleep_ms(int ms) {
+    struct timespec delay;
+    
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&delay, NULL);
+}
+
+void remote_config_init(RemoteConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->interval_ms = REMOTE_DEFAULT_INTERVAL_MS;
+    config->batch_samples = REMOTE_DEFAULT_BATCH_SAMPLES;
+    config->batch_wait_ms = REMOTE_DEFAULT_BATCH_WAIT_MS;
+    config->queue_bytes = REMOTE_DEFAULT_QUEUE_BYTES;
+}
+
+int remote_parse_url(RemoteConfig *config, const char *url) {
+    const char *host, *host_end, *path;
+    size_t host_len;
+    
+    if (strncmp(url, "http://", 7) != 0) return -1;
+    host = url + 7;
+    path = strchr(host, '/');
+    if (!path) path = host + strlen(host);
+    host_end = memchr(host, ':', (size_t)(path - host));
+    if (!host_end) host_end = path;
+    
+    host_len = (size_t)(host_end - host);
+    if (host_len == 0 || host_len >= sizeof(config->host)) return -1;
+    memcpy(config->host, host, host_len);
+    config->host[host_len] = '\0';
+    
+    if (host_end < path) {
+        size_t port_len = (size_t)(path - host_end - 1);
+        if (port_len == 0 || port_len >= sizeof(config->port)) return -1;
+        memcpy(config->port, host_end + 1, port_len);
+        config->port[port_len] = '\0';
+    } else {
+        snprintf(config->port, sizeof(config->port), "80");
+    }
+    snprintf(config->path, sizeof(config->path), "%s", *path ? path : "/");
+    return 0;
+}
+
+int remote_add_label(RemoteConfig *config, const char *pair) {
+    const char *eq = strchr(pair, '=');
+    size_t name_len;
+    
+    if (!eq || eq == pair || config->num_labels == REMOTE_MAX_LABELS) return -1;
+    name_len = (size_t)(eq - pair);
+    if (name_len >= sizeof(config->label_names[0]) || strlen(eq + 1) >= sizeof(config->label_values[0])) return -1;
+    memcpy(config->label_names[config->num_labels], pair, name_len);
+    config->label_names[config->num_labels][name_len] = '\0';
+    snprintf(config->label_values[config->num_labels], sizeof(config->label_values[0]), "%s", eq + 1);
+    config->num_labels++;
+    return 0;
+}
+
+/*
+ * Snappy compressor (block format). Input is split into 64 KB blocks so
+ * every back reference fits a two-byte offset; matches of four bytes or
+ * more are found through a small hash table of recent positions.
+ */
+
+size_t snappy_max_length(size_t len) {
+    return 32 + len + len / 6;
+}
+
+static unsigned char* snappy_varint(unsigned char *op, size_t value) {
+    while (value >= 0x80) {
+        *op++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *op++ = (unsigned char)value;
+    return op;
+}
+
+static unsigned char* snappy_literal(unsigned char *op, const unsigned char *literal, size_t len) {
+    size_t n = len - 1;
+    
+    if (n < 60) {
+        *op++ = (unsigned char)(n << 2);
+    } else if (n < 0x100) {
+        *op++ = 60 << 2;
+        *op++ = (unsigned char)n;
+    } else if (n < 0x10000) {
+        *op++ = 61 << 2;
+        *op++ = (unsigned char)n;
+        *op++ = (unsigned char)(n >> 8);
+    } else {
+        *op++ = 62 << 2;
+        *op++ = (unsigned char)n;
+        *op++ = (unsigned char)(n >> 8);
+        *op++ = (unsigned char)(n >> 16);
+    }
+    memcpy(op, literal, len);
+    return op + len;
+}
+
+/* Copies with a two-byte offset, at most 64 bytes each */
+static unsigned char* snappy_copy(unsigned char *op, size_t offset, size_t len) {
+    while (len > 0) {
+        size_t n = len > 64 ? 64 : len;
+        
+        *op++ = (unsigned char)(((n - 1) << 2) | 2);
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        len -= n;
+    }
+    return op;
+}
+
+static unsigned int load32(const unsigned char *p) {
+    unsigned int v;
+    
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+size_t snappy_compress(const unsigned char *in, size_t len, unsigned char *out) {
+    unsigned short table[1 << SNAPPY_HASH_BITS];
+    unsigned char *op = snappy_varint(out, len);
+    size_t block;
+    
+    for (block = 0; block < len; block += SNAPPY_BLOCK) {
+        const unsigned char *base = in + block;
+        size_t block_len = len - block < SNAPPY_BLOCK ? len - block : SNAPPY_BLOCK;
+        size_t ip = 0, literal = 0;
+        
+        memset(table, 0, sizeof(table));
+        while (ip + 4 <= block_len) {
+            unsigned int v = load32(base + ip);
+            unsigned int h = (v * 0x1e35a7bdU) >> (32 - SNAPPY_HASH_BITS);
+            size_t candidate = table[h];
+            
+            table[h] = (unsigned short)ip;
+            if (candidate < ip && load32(base + candidate) == v) {
+                size_t match = 4;
+                
+                while (ip + match < block_len && base[candidate + match] == base[ip + match]) match++;
+                if (ip > literal) op = snappy_literal(op, base + literal, ip - literal);
+                op = snappy_copy(op, ip - candidate, match);
+                ip += match;
+                literal = ip;
+            } else {
+                ip++;
+            }
+        }
+        if (literal < block_len) op = snappy_literal(op, base + literal, block_len - literal);
+    }
+    return (size_t)(op - out);
+}
+
+/* Protobuf encoding of prometheus.WriteRequest */
+
+static size_t varint_size(unsigned long long value) {
+    size_t n = 1;
+    
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static void pb_varint(JsonWriter *pb, unsigned long long value) {
+    unsigned char bytes[10];
+    size_t n = 0;
+    
+    while (value >= 0x80) {
+        bytes[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (unsigned char)value;
+    writer_write(pb, (const char*)bytes, n);
+}
+
+/* Length-delimited field */
+static void pb_bytes(JsonWriter *pb, int field, const char *data, size_t len) {
+    pb_varint(pb, (unsigned long long)(field << 3 | 2));
+    pb_varint(pb, len);
+    writer_write(pb, data, len);
+}
+
+static size_t label_size(const PbLabel *label) {
+    return 2 + varint_size(label->name_len) + label->name_len + varint_size(label->value_len) + label->value_len;
+}
+
+/* TimeSeries{labels, Sample{value, timestamp}} as a WriteRequest.timeseries field */
+static void pb_series(JsonWriter *pb, const PbLabel *labels, int count, double value, long long timestamp_ms) {
+    unsigned char fixed[8];
+    unsigned long long bits;
+    size_t sample_size = 1 + 8 + 1 + varint_size((unsigned long long)timestamp_ms);
+    size_t series_size = 1 + varint_size(sample_size) + sample_size;
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        size_t size = label_size(&labels[i]);
+        series_size += 1 + varint_size(size) + size;
+    }
+    
+    pb_varint(pb, 1 << 3 | 2);
+    pb_varint(pb, series_size);
+    for (i = 0; i < count; i++) {
+        pb_varint(pb, 1 << 3 | 2);
+        pb_varint(pb, label_size(&labels[i]));
+        pb_bytes(pb, 1, labels[i].name, labels[i].name_len);
+        pb_bytes(pb, 2, labels[i].value, labels[i].value_len);
+    }
+    
+    pb_varint(pb, 2 << 3 | 2);
+    pb_varint(pb, sample_size);
+    memcpy(&bits, &value, sizeof(bits));
+    for (i = 0; i < 8; i++) fixed[i] = (unsigned char)(bits >> (8 * i));
+    pb_varint(pb, 1 << 3 | 1);
+    writer_write(pb, (const char*)fixed, 8);
+    pb_varint(pb, 2 << 3 | 0);
+    pb_varint(pb, (unsigned long long)timestamp_ms);
+}
+
+static int label_compare(const PbLabel *a, const PbLabel *b) {
+    size_t n = a->name_len < b->name_len ? a->name_len : b->name_len;
+    int c = memcmp(a->name, b->name, n);
+    
+    if (c) return c;
+    return a->name_len < b->name_len ? -1 : a->name_len > b->name_len;
+}
+
+static int label_present(const PbLabel *labels, int count, const char *name) {
+    size_t len = strlen(name);
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        if (labels[i].name_len == len && memcmp(labels[i].name, name, len) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Parse one exposition line, name{label="value",...} value [timestamp].
+ * Label values are unescaped in place. Returns the label count (with
+ * __name__), or -1 for lines to skip.
+ */
+static int parse_sample(char *line, PbLabel *labels, int max, double *value) {
+    char *p = line, *end;
+    int count = 0;
+    
+    labels[0].name = "__name__";
+    labels[0].name_len = 8;
+    labels[0].value = p;
+    while (*p && *p != '{' && *p != ' ') p++;
+    labels[0].value_len = (size_t)(p - line);
+    if (labels[0].value_len == 0) return -1;
+    count = 1;
+    
+    if (*p == '{') {
+        p++;
+        while (*p && *p != '}') {
+            char *name = p, *out;
+            
+            while (*p && *p != '=') p++;
+            if (*p != '=' || p[1] != '"' || count == max) return -1;
+            labels[count].name = name;
+            labels[count].name_len = (size_t)(p - name);
+            p += 2;
+            labels[count].value = out = p;
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                    *out++ = *p == 'n' ? '\n' : *p;
+                    p++;
+                } else {
+                    *out++ = *p++;
+                }
+            }
+            if (*p != '"') return -1;
+            labels[count].value_len = (size_t)(out - labels[count].value);
+            count++;
+            p++;
+            if (*p == ',') p++;
+        }
+        if (*p != '}') return -1;
+        p++;
+    }
+    
+    while (*p == ' ') p++;
+    *value = strtod(p, &end);
+    if (end == p) return -1;
+    return count;
+}
+
+/* Encode every sample of an exposition body; returns the sample count or -1 */
+static int encode_scrape(const char *text, size_t len, long long timestamp_ms, JsonWriter *pb) {
+    const RemoteConfig *config = &remote.config;
+    PbLabel labels[REMOTE_MAX_SERIES_LABELS + REMOTE_MAX_LABELS];
+    char *copy = malloc(len + 1);
+    char *line, *next;
+    int samples = 0;
+    
+    if (!copy) return -1;
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    
+    for (line = copy; *line; line = next) {
+        double value;
+        int count, i, j;
+        
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        else next = line + strlen(line);
+        if (*line == '#' || *line == '\0') continue;
+        
+        count = parse_sample(line, labels, REMOTE_MAX_SERIES_LABELS, &value);
+        if (count < 0) continue;
+        
+        /* External labels never override the series' own */
+        for (i = 0; i < config->num_labels; i++) {
+            if (label_present(labels, count, config->label_names[i])) continue;
+            labels[count].name = config->label_names[i];
+            labels[count].name_len = strlen(config->label_names[i]);
+            labels[count].value = config->label_values[i];
+            labels[count].value_len = strlen(config->label_values[i]);
+            count++;
+        }
+        
+        /* Remote write requires labels sorted by name */
+        for (i = 1; i < count; i++) {
+            PbLabel key = labels[i];
+            for (j = i - 1; j >= 0 && label_compare(&labels[j], &key) > 0; j--) labels[j + 1] = labels[j];
+            labels[j + 1] = key;
+        }
+        
+        pb_series(pb, labels, count, value, timestamp_ms);
+        samples++;
+    }
+    
+    free(copy);
+    return pb->failed ? -1 : samples;
+}
+
+/* Drop the oldest entry; called with the lock held */
+static void queue_pop(RemoteQueue *q) {
+    RemoteEntry *entry = &q->entries[q->head];
+    
+    q->bytes -= entry->len;
+    q->samples -= entry->samples;
+    free(entry->data);
+    entry->data = NULL;
+    q->head = (q->head + 1) % REMOTE_QUEUE_ENTRIES;
+    q->count--;
+    q->head_seq++;
+}
+
+static void* remote_sampler_thread(void *arg) {
+    RemoteQueue *q = arg;
+    unsigned long last_generation = 0;
+    
+    for (;;) {
+        unsigned long long started = monotonic_ms();
+        /* Under one interval old, so the body pushed last time has to be rebuilt */
+        CachedBody *body = q->scrape(q->config.interval_ms / 2);
+        JsonWriter pb;
+        unsigned char *data = NULL;
+        size_t len = 0;
+        long long elapsed;
+        int samples = -1;
+        
+        /* Samples carry the time the body was built, and a body already pushed is not pushed again */
+        if (body && body->generation != last_generation) {
+            writer_init_memory(&pb, 0);
+            samples = encode_scrape(body->data, body->len, body->built_wall_ms, &pb);
+            data = (unsigned char*)writer_finish(&pb, &len);
+            last_generation = body->generation;
+        }
+        body_release(body);
+        
+        if (samples > 0 && data) {
+            pthread_mutex_lock(&q->lock);
+            /* Bounded: make room by dropping the oldest scrapes */
+            while (q->count > 0 && (q->count == REMOTE_QUEUE_ENTRIES || q->bytes + len > q->config.queue_bytes)) {
+                stats_add(stat_remote_samples, "dropped", q->entries[q->head].samples);
+                queue_pop(q);
+            }
+            if (len <= q->config.queue_bytes) {
+                RemoteEntry *entry = &q->entries[(q->head + q->count) % REMOTE_QUEUE_ENTRIES];
+                
+                entry->data = data;
+                entry->len = len;
+                entry->samples = samples;
+                entry->queued_ms = monotonic_ms();
+                q->count++;
+                q->bytes += len;
+                q->samples += samples;
+                data = NULL;
+                stats_add(stat_remote_samples, "queued", samples);
+                pthread_cond_signal(&q->ready);
+            }
+            stats_set(stat_remote_queue, NULL, q->samples);
+            pthread_mutex_unlock(&q->lock);
+        }
+        free(data);
+        
+        elapsed = (long long)(monotonic_ms() - started);
+        if (elapsed < q->config.interval_ms) sleep_ms((int)(q->config.interval_ms - elapsed));
+    }
+    return NULL;
+}
+
+static int remote_connect(const RemoteConfig *config) {
+    struct addrinfo hints, *res, *ai;
+    struct timeval timeout = {REMOTE_IO_TIMEOUT, 0};
+    int fd = -1, flag = 1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config->host, config->port, &hints, &res) != 0) return -1;
+    
+    for (ai = res; ai; ai = ai->ai_next) {
+        struct pollfd pfd;
+        int err = 0, flags;
+        socklen_t err_len = sizeof(err);
+        
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        
+        /* Connect with a deadline, then go back to blocking I/O with timeouts */
+        flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) err = errno;
+        if (!err) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, REMOTE_CONNECT_TIMEOUT_MS) != 1) err = ETIMEDOUT;
+            else getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        }
+        if (!err) {
+            fcntl(fd, F_SETFL, flags);
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+    
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, 0);
+        
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * POST one compressed WriteRequest. Returns the HTTP status, or -1 when
+ * the connection failed. *fd is kept open for the next request unless the
+ * receiver asked to close or the response could not be delimited.
+ */
+static int remote_post(int *fd, const unsigned char *body, size_t len, int *retry_after) {
+    const RemoteConfig *config = &remote.config;
+    char head[1024];
+    size_t head_len = 0, content_length = 0;
+    char *end = NULL, *line, *next;
+    int hlen, status, keep = 1, has_length = 0;
+    
+    if (*fd < 0) *fd = remote_connect(config);
+    if (*fd < 0) return -1;
+    
+    hlen = snprintf(head, sizeof(head),
+        "POST %s HTTP/1.1\r\n"
+        "Host: %s:%s\r\n"
+        "User-Agent: qnx-metrics-exporter\r\n"
+        "Content-Type: application/x-protobuf\r\n"
+        "Content-Encoding: snappy\r\n"
+        "X-Prometheus-Remote-Write-Version: 0.1.0\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        config->path, config->host, config->port, len);
+    if (write_all(*fd, head, (size_t)hlen) != 0 || write_all(*fd, body, len) != 0) goto failed;
+    
+    /* Response head */
+    while (!end) {
+        ssize_t n;
+        
+        if (head_len == sizeof(head) - 1) goto failed;
+        n = recv(*fd, head + head_len, sizeof(head) - 1 - head_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) goto failed;
+        head_len += (size_t)n;
+        head[head_len] = '\0';
+        end = strstr(head, "\r\n\r\n");
+    }
+    if (sscanf(head, "HTTP/1.%*d %d", &status) != 1) goto failed;
+    
+    *retry_after = 0;
+    for (line = strstr(head, "\r\n") + 2; line < end; line = next) {
+        char *line_end = strstr(line, "\r\n");
+        
+        next = line_end + 2;
+        *line_end = '\0';
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtoul(line + 15, NULL, 10);
+            has_length = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close")) {
+            keep = 0;
+        } else if (strncasecmp(line, "Retry-After:", 12) == 0) {
+            *retry_after = atoi(line + 12);
+        }
+    }
+    
+    /* Discard the body so the connection can carry the next request */
+    if (!has_length && status != 204 && status != 304) keep = 0;
+    if (keep) {
+        size_t have = head_len - (size_t)(end + 4 - head);
+        
+        while (have < content_length) {
+            char discard[1024];
+            ssize_t n = recv(*fd, discard, content_length - have < sizeof(discard) ? content_length - have : sizeof(discard), 0);
+            
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                keep = 0;
+                break;
+            }
+            have += (size_t)n;
+        }
+    }
+    if (!keep) {
+        close(*fd);
+        *fd = -1;
+    }
+    return status;
+
+failed:
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static void* remote_sender_thread(void *arg) {
+    RemoteQueue *q = arg;
+    unsigned char *compressed = NULL;
+    size_t compressed_cap = 0;
+    JsonWriter batch;
+    int backoff = REMOTE_BACKOFF_MIN_MS;
+    unsigned int seed = (unsigned int)time(NULL);
+    int fd = -1;
+    
+    writer_init_memory(&batch, 0);
+    for (;;) {
+        unsigned long long last_seq;
+        int samples = 0, status, retry_after = 0, i;
+        size_t len;
+        
+        /* Wait for a full batch, or for the oldest scrape to have waited long enough */
+        pthread_mutex_lock(&q->lock);
+        for (;;) {
+            struct timespec deadline;
+            unsigned long long waited;
+            
+            if (q->count > 0) {
+                waited = monotonic_ms() - q->entries[q->head].queued_ms;
+                if (q->samples >= q->config.batch_samples || waited >= (unsigned long long)q->config.batch_wait_ms) break;
+            }
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&q->ready, &q->lock, &deadline);
+        }
+        
+        /* Whole scrapes, up to batch_samples (but at least one scrape) */
+        writer_reset(&batch);
+        for (i = 0; i < q->count; i++) {
+            RemoteEntry *entry = &q->entries[(q->head + i) % REMOTE_QUEUE_ENTRIES];
+            
+            if (i > 0 && samples + entry->samples > q->config.batch_samples) break;
+            writer_write(&batch, (const char*)entry->data, entry->len);
+            samples += entry->samples;
+        }
+        last_seq = q->head_seq + (unsigned long long)i;
+        pthread_mutex_unlock(&q->lock);
+        if (batch.failed) {
+            sleep_ms(REMOTE_BACKOFF_MIN_MS);
+            continue;
+        }
+        
+        if (snappy_max_length(batch.len) > compressed_cap) {
+            unsigned char *grown = realloc(compressed, snappy_max_length(batch.len));
+            if (!grown) {
+                sleep_ms(REMOTE_BACKOFF_MIN_MS);
+                continue;
+            }
+            compressed = grown;
+            compressed_cap = snappy_max_length(batch.len);
+        }
+        len = snappy_compress((const unsigned char*)batch.buf, batch.len, compressed);
+        
+        status = remote_post(&fd, compressed, len, &retry_after);
+        if (status >= 200 && status < 300) {
+            stats_add(stat_remote_requests, "ok", 1);
+            stats_add(stat_remote_samples, "sent", samples);
+            stats_add(stat_remote_bytes, NULL, (long long)len);
+            backoff = REMOTE_BACKOFF_MIN_MS;
+        } else if (status >= 400 && status < 500 && status != 429) {
+            /* The receiver will never take this batch */
+            fprintf(stderr, "remote write: %s:%s rejected %d samples with status %d\n",
+                    q->config.host, q->config.port, samples, status);
+            stats_add(stat_remote_requests, "rejected", 1);
+            stats_add(stat_remote_samples, "rejected", samples);
+            backoff = REMOTE_BACKOFF_MIN_MS;
+        } else {
+            /* Connection failure, 5xx or 429: keep the batch and back off with jitter */
+            int delay = retry_after > 0 ? retry_after * 1000 : backoff;
+            
+            if (delay > REMOTE_BACKOFF_MAX_MS) delay = REMOTE_BACKOFF_MAX_MS;
+            delay = delay / 2 + (int)(rand_r(&seed) % (unsigned int)(delay / 2 + 1));
+            stats_add(stat_remote_requests, "retry", 1);
+            backoff = backoff * 2 > REMOTE_BACKOFF_MAX_MS ? REMOTE_BACKOFF_MAX_MS : backoff * 2;
+            sleep_ms(delay);
+            continue;
+        }
+        
+        /* Entries the sampler dropped while we were sending are already gone */
+        pthread_mutex_lock(&q->lock);
+        while (q->count > 0 && q->head_seq < last_seq) queue_pop(q);
+        stats_set(stat_remote_queue, NULL, q->samples);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+int remote_write_start(const RemoteConfig *config, CachedBody* (*scrape)(int max_age_ms)) {
+    pthread_t thread;
+    
+    memset(&remote, 0, sizeof(remote));
+    remote.config = *config;
+    remote.scrape = scrape;
+    if (pthread_mutex_init(&remote.lock, NULL) != 0 || pthread_cond_init(&remote.ready, NULL) != 0) return -1;
+    
+    stat_remote_samples = stats_family(STATS_COUNTER, "qnx_exporter_remote_samples_total",
+        "Remote-write samples queued, sent, dropped from a full queue or rejected by the receiver", "result", 4);
+    stat_remote_requests = stats_family(STATS_COUNTER, "qnx_exporter_remote_requests_total",
+        "Remote-write requests by outcome", "result", 3);
+    stat_remote_bytes = stats_family(STATS_COUNTER, "qnx_exporter_remote_sent_bytes_total",
+        "Compressed remote-write bytes accepted by the receiver", NULL, 0);
+    stat_remote_queue = stats_family(STATS_GAUGE, "qnx_exporter_remote_queue_samples",
+        "Samples waiting to be sent", NULL, 0);
+    
+    if (pthread_create(&thread, NULL, remote_sampler_thread, &remote) != 0) return -1;
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, remote_sender_thread, &remote) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
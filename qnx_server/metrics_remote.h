@@ -0,0 +1,57 @@
+#ifndef METRICS_REMOTE_H
+#define METRICS_REMOTE_H
+
+#include <stddef.h>
+
+#include "metrics_cache.h"
+
+/*
+ * Prometheus remote-write push.
+ *
+ * A sampler thread takes the current Prometheus text body every interval
+ * and encodes each sample line as a protobuf TimeSeries: labels sorted,
+ * external labels added, the sample time as its timestamp. The encoded
+ * scrape is appended to a bounded in-memory queue; when the queue is full
+ * the oldest scrape is dropped.
+ *
+ * A sender thread ships the queue as snappy-compressed WriteRequests over
+ * HTTP/1.1, reusing one connection. A batch goes out once it holds
+ * batch_samples samples or its oldest scrape has waited batch_wait_ms.
+ * Connection errors, 5xx and 429 are retried with exponential backoff
+ * (honouring Retry-After); any other 4xx drops the batch, as Prometheus
+ * does. Only http:// endpoints are supported; put a TLS proxy in front
+ * for https.
+ */
+
+#define REMOTE_MAX_LABELS 8
+
+typedef struct {
+    char host[128];
+    char port[8];
+    char path[256];
+    int interval_ms;
+    int batch_samples;
+    int batch_wait_ms;
+    size_t queue_bytes;
+    int num_labels;
+    char label_names[REMOTE_MAX_LABELS][64];
+    char label_values[REMOTE_MAX_LABELS][128];
+} RemoteConfig;
+
+/* Defaults, without an endpoint */
+void remote_config_init(RemoteConfig *config);
+
+/* http://host[:port]/path; returns -1 for anything else */
+int remote_parse_url(RemoteConfig *config, const char *url);
+
+/* External label given as name=value; returns -1 if malformed or too many */
+int remote_add_label(RemoteConfig *config, const char *pair);
+
+/* Push bodies returned by scrape() (released after encoding) until exit */
+int remote_write_start(const RemoteConfig *config, CachedBody* (*scrape)(int max_age_ms));
+
+/* Snappy block format, as remote-write expects; out needs snappy_max_length(len) bytes */
+size_t snappy_max_length(size_t len);
+size_t snappy_compress(const unsigned char *in, size_t len, unsigned char *out);
+
+#endif
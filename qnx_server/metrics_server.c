@@ -1,10 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <sys/select.h>      /* Added for fd_set, FD_ZERO, FD_SET, FD_ISSET, select */
-#include <sys/time.h>        /* Added for struct timeval */
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -13,16 +13,40 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <openssl/sha.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
+#include <zlib.h>
+
+#include "metrics_collect.h"
+#include "metrics_event.h"
+#include "metrics_exec.h"
+#include "metrics_procs.h"
+#include "metrics_cbor.h"
+#include "metrics_stats.h"
+#include "metrics_listen.h"
+#include "metrics_bus.h"
+#include "metrics_log.h"
+#include "metrics_budget.h"
+#include "metrics_time.h"
 
 #define PORT 9090
 #define BUFFER_SIZE 65536
 #define OUTPUT_BUFFER_SIZE 131072
 #define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 #define REFRESH_INTERVAL 2
+#define MAX_SECTIONS 32
+#define KEYFRAME_INTERVAL 30
+#define DEFAULT_DEFLATE_LEVEL 6
+#define MAX_DEFLATE_CHANNELS 8
+#define DEFAULT_SECTION_WORKERS 4
+#define DEFAULT_COMMAND_TIMEOUT_MS 3000
+#define SECTION_BACKOFF_MAX 300
+#define PROCS_MAX_AGE_MS 1000
+#define CBOR_BUFFER_SIZE 65536
+#define CBOR_BUFFER_MAX (4 * 1024 * 1024)
 
 volatile sig_atomic_t running = 1;
 
@@ -38,47 +62,85 @@ typedef struct {
     const char *command;
     const char *description;
     int enabled;
+    int (*native)(char *output, size_t output_size);  /* In-process collector, command is the fallback */
+    int ttl;            /* Seconds a result is reused by both views, 0 = every snapshot */
 } SystemCommand;
 
+/* Set by -n to always run the shell commands */
+int native_disabled = 0;
+
+/* Sections are collected in parallel on this pool (-j), commands killed after -T ms */
+ExecPool *section_pool;
+int section_workers = DEFAULT_SECTION_WORKERS;
+int command_timeout_ms = DEFAULT_COMMAND_TIMEOUT_MS;
+
+/* Self-instrumentation, served at /internal/metrics; created in server_stats_init() */
+StatsFamily *stat_command_seconds;
+StatsFamily *stat_command_timeouts;
+StatsFamily *stat_snapshot_seconds;
+StatsFamily *stat_snapshot_bytes;
+StatsFamily *stat_frames_sent;
+StatsFamily *stat_bytes_sent;
+StatsFamily *stat_frames_dropped;
+StatsFamily *stat_client_bytes;
+StatsFamily *stat_send_queue;
+StatsFamily *stat_connections;
+StatsFamily *stat_accepted;
+StatsFamily *stat_rejected;
+StatsFamily *stat_slow_clients;
+StatsFamily *stat_ws_frames;
+StatsFamily *stat_ws_closes;
+
+/* permessage-deflate settings: -z level (0 = off), -w window bits, -Z */
+int deflate_level = DEFAULT_DEFLATE_LEVEL;
+int deflate_window_bits = 15;
+int deflate_context_takeover = 1;
+
+/* Server-side permessage-deflate parameters agreed with a client */
+typedef struct {
+    int window_bits;
+    int takeover;
+} DeflateParams;
+
 /* QNX-specific commands for comprehensive system monitoring */
 SystemCommand qnx_commands[] = {
     /* Process and CPU information */
-    {"PROCESS_LIST", "pidin -F \"%N %a %b %J %B %H %I %10L %50n\"", "Process List (PID, Args, PGrp, State, Blocked, Threads, FDs, CPU, Name)", 1},
-    {"CPU_HOGS", "hogs -i 1 -% 0.1 2>/dev/null || pidin times", "CPU Usage by Process", 1},
-    {"THREAD_INFO", "pidin -F \"%N %I %J %l %H %55h\"", "Thread Information", 1},
+    {"PROCESS_LIST", "pidin -F \"%N %a %b %J %B %H %I %10L %50n\"", "Process List (PID, Args, PGrp, State, Blocked, Threads, FDs, CPU, Name)", 1, procs_render_list, REFRESH_INTERVAL},
+    {"CPU_HOGS", "hogs -i 1 -% 0.1 2>/dev/null || pidin times", "CPU Usage by Process", 1, procs_render_hogs, REFRESH_INTERVAL},
+    {"THREAD_INFO", "pidin -F \"%N %I %J %l %H %55h\"", "Thread Information", 1, procs_render_threads, REFRESH_INTERVAL},
     
     /* Memory information */
-    {"MEMORY_OVERVIEW", "pidin info | head -20", "System Memory Overview", 1},
-    {"MEMORY_DETAILED", "showmem -P 2>/dev/null || pidin mem", "Detailed Memory Usage", 1},
-    {"SYSPAGE_MEM", "pidin syspage=asinfo 2>/dev/null", "System Page Memory Info", 0},
+    {"MEMORY_OVERVIEW", "pidin info | head -20", "System Memory Overview", 1, native_memory_overview, REFRESH_INTERVAL},
+    {"MEMORY_DETAILED", "showmem -P 2>/dev/null || pidin mem", "Detailed Memory Usage", 1, native_memory_detailed, 4},
+    {"SYSPAGE_MEM", "pidin syspage=asinfo 2>/dev/null", "System Page Memory Info", 0, NULL, 300},
     
     /* System information */
-    {"SYSTEM_INFO", "pidin syspage=system 2>/dev/null || uname -a", "System Information", 1},
-    {"HARDWARE_INFO", "pidin syspage=hwinfo 2>/dev/null", "Hardware Information", 0},
-    {"CPU_INFO", "pidin syspage=cpuinfo 2>/dev/null", "CPU Information", 1},
+    {"SYSTEM_INFO", "pidin syspage=system 2>/dev/null || uname -a", "System Information", 1, native_system_info, REFRESH_INTERVAL},
+    {"HARDWARE_INFO", "pidin syspage=hwinfo 2>/dev/null", "Hardware Information", 0, NULL, 300},
+    {"CPU_INFO", "pidin syspage=cpuinfo 2>/dev/null", "CPU Information", 1, NULL, 300},
     
     /* Network information */
-    {"NETWORK_STATS", "netstat -i 2>/dev/null", "Network Interface Statistics", 1},
-    {"NETWORK_CONN", "netstat -an 2>/dev/null | head -30", "Network Connections", 0},
+    {"NETWORK_STATS", "netstat -i 2>/dev/null", "Network Interface Statistics", 1, native_network_stats, REFRESH_INTERVAL},
+    {"NETWORK_CONN", "netstat -an 2>/dev/null | head -30", "Network Connections", 0, NULL, 6},
     
     /* I/O and device information */
-    {"DISK_USAGE", "df -h 2>/dev/null || df", "Disk Usage", 1},
-    {"MOUNT_INFO", "mount 2>/dev/null", "Mounted Filesystems", 0},
+    {"DISK_USAGE", "df -h 2>/dev/null || df", "Disk Usage", 1, native_disk_usage, 30},
+    {"MOUNT_INFO", "mount 2>/dev/null", "Mounted Filesystems", 0, NULL, 60},
     
     /* Resource usage */
-    {"FILE_DESCRIPTORS", "pidin -F \"%N %I %55o\" | head -50", "Open File Descriptors", 0},
-    {"TIMERS", "pidin timers 2>/dev/null | head -30", "Active Timers", 0},
-    {"CHANNELS", "pidin channels 2>/dev/null | head -30", "IPC Channels", 0},
+    {"FILE_DESCRIPTORS", "pidin -F \"%N %I %55o\" | head -50", "Open File Descriptors", 0, NULL, 10},
+    {"TIMERS", "pidin timers 2>/dev/null | head -30", "Active Timers", 0, NULL, 10},
+    {"CHANNELS", "pidin channels 2>/dev/null | head -30", "IPC Channels", 0, NULL, 10},
     
     /* Interrupt and IRQ info */
-    {"INTERRUPTS", "pidin irqs 2>/dev/null", "Interrupt Information", 0},
+    {"INTERRUPTS", "pidin irqs 2>/dev/null", "Interrupt Information", 0, NULL, 60},
     
     /* QNX specific */
-    {"PULSE_INFO", "pidin pulses 2>/dev/null | head -30", "Pulse Information", 0},
-    {"SIN_INFO", "sin info 2>/dev/null", "System Information Node", 0},
-    {"USE_INFO", "use -i 1 2>/dev/null || pidin -F \"%N %L\"", "Resource Usage", 0},
+    {"PULSE_INFO", "pidin pulses 2>/dev/null | head -30", "Pulse Information", 0, NULL, 10},
+    {"SIN_INFO", "sin info 2>/dev/null", "System Information Node", 0, NULL, 60},
+    {"USE_INFO", "use -i 1 2>/dev/null || pidin -F \"%N %L\"", "Resource Usage", 0, NULL, 30},
     
-    {NULL, NULL, NULL, 0}
+    {NULL, NULL, NULL, 0, NULL, 0}
 };
 
 /* Base64 encode function */
@@ -105,18 +167,22 @@ char* base64_encode(const unsigned char* input, int length) {
     return output;
 }
 
-/* WebSocket handshake */
-int websocket_handshake(int client_socket, char* request) {
-    char *key_start = strstr(request, "Sec-WebSocket-Key: ");
+/*
+ * Build the WebSocket handshake response, returns its length or 0.
+ * extensions holds optional, already terminated header lines.
+ */
+int websocket_handshake(const char* request, const char *extensions, char *response, size_t response_size) {
+    const char *key_start = strstr(request, "Sec-WebSocket-Key: ");
     if (!key_start) return 0;
     
     key_start += 19;
-    char *key_end = strstr(key_start, "\r\n");
+    const char *key_end = strstr(key_start, "\r\n");
     if (!key_end) return 0;
     
     int key_len = key_end - key_start;
     char key[256];
-    strncpy(key, key_start, key_len);
+    if (key_len <= 0 || key_len >= (int)sizeof(key)) return 0;
+    memcpy(key, key_start, key_len);
     key[key_len] = '\0';
     
     char accept_key[512];
@@ -128,25 +194,126 @@ int websocket_handshake(int client_socket, char* request) {
     char *accept_base64 = base64_encode(hash, SHA_DIGEST_LENGTH);
     if (!accept_base64) return 0;
     
-    char response[1024];
-    snprintf(response, sizeof(response),
+    int len = snprintf(response, response_size,
         "HTTP/1.1 101 Switching Protocols\r\n"
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %s\r\n\r\n",
-        accept_base64);
+        "Sec-WebSocket-Accept: %s\r\n"
+        "%s\r\n",
+        accept_base64, extensions ? extensions : "");
     
-    send(client_socket, response, strlen(response), 0);
     free(accept_base64);
-    return 1;
+    return (len > 0 && (size_t)len < response_size) ? len : 0;
+}
+
+/* Copy the token between p and end into out without surrounding blanks or quotes */
+void extension_token(const char *p, const char *end, char *out, size_t size) {
+    size_t len;
+    
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '"')) p++;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '"')) end--;
+    len = (size_t)(end - p);
+    if (len >= size) len = size - 1;
+    memcpy(out, p, len);
+    out[len] = '\0';
+}
+
+/*
+ * permessage-deflate (RFC 7692) negotiation. Takes the first offer in
+ * Sec-WebSocket-Extensions whose parameters we can honour and returns 1 with
+ * the agreed server-side parameters, or 0 to stay uncompressed.
+ */
+int websocket_negotiate_deflate(const char *request, DeflateParams *params) {
+    const char *p = strstr(request, "Sec-WebSocket-Extensions:");
+    const char *end;
+    
+    if (deflate_level <= 0 || !p) return 0;
+    p += 25;
+    end = strstr(p, "\r\n");
+    if (!end) return 0;
+    
+    while (p < end) {
+        const char *offer_end = memchr(p, ',', (size_t)(end - p));
+        DeflateParams offer;
+        int index = 0, ok = 1;
+        
+        if (!offer_end) offer_end = end;
+        offer.window_bits = deflate_window_bits;
+        offer.takeover = deflate_context_takeover;
+        
+        while (p < offer_end) {
+            const char *token_end = memchr(p, ';', (size_t)(offer_end - p));
+            const char *eq;
+            char name[64], value[16];
+            
+            if (!token_end) token_end = offer_end;
+            eq = memchr(p, '=', (size_t)(token_end - p));
+            extension_token(p, eq ? eq : token_end, name, sizeof(name));
+            extension_token(eq ? eq + 1 : token_end, token_end, value, sizeof(value));
+            p = token_end + 1;
+            
+            if (index++ == 0) {
+                if (strcmp(name, "permessage-deflate") != 0) ok = 0;
+            } else if (strcmp(name, "server_no_context_takeover") == 0) {
+                offer.takeover = 0;
+            } else if (strcmp(name, "server_max_window_bits") == 0) {
+                int bits = atoi(value);
+                /* zlib cannot produce a raw stream for a 256 byte window */
+                if (bits < 9 || bits > 15) ok = 0;
+                else if (bits < offer.window_bits) offer.window_bits = bits;
+            } else if (strcmp(name, "client_no_context_takeover") != 0 &&
+                       strcmp(name, "client_max_window_bits") != 0) {
+                ok = 0;
+            }
+        }
+        
+        if (ok && index > 0) {
+            *params = offer;
+            return 1;
+        }
+        p = offer_end + 1;
+    }
+    return 0;
+}
+
+/* Nonzero when Sec-WebSocket-Protocol lists protocol */
+int websocket_offers_protocol(const char *request, const char *protocol) {
+    const char *p = strstr(request, "Sec-WebSocket-Protocol:");
+    const char *end;
+    
+    if (!p) return 0;
+    p += 23;
+    end = strstr(p, "\r\n");
+    if (!end) return 0;
+    
+    while (p < end) {
+        const char *token_end = memchr(p, ',', (size_t)(end - p));
+        char token[64];
+        
+        if (!token_end) token_end = end;
+        extension_token(p, token_end, token, sizeof(token));
+        if (strcmp(token, protocol) == 0) return 1;
+        p = token_end + 1;
+    }
+    return 0;
 }
 
-/* Send WebSocket frame */
-int send_websocket_frame(int socket, const char* data, size_t len) {
-    unsigned char frame[14];
+/* Extension header line confirming the agreed parameters */
+void websocket_deflate_response(const DeflateParams *params, char *out, size_t size) {
+    char bits[48] = "";
+    
+    if (params->window_bits < 15) {
+        snprintf(bits, sizeof(bits), "; server_max_window_bits=%d", params->window_bits);
+    }
+    snprintf(out, size, "Sec-WebSocket-Extensions: permessage-deflate%s%s\r\n",
+             params->takeover ? "" : "; server_no_context_takeover", bits);
+}
+
+/* Encode a server-to-client WebSocket frame header, returns header length */
+size_t websocket_frame_header(unsigned char *frame, unsigned char first_byte, size_t len) {
     size_t frame_len = 0;
     
-    frame[0] = 0x81; /* FIN bit + text frame */
+    frame[0] = first_byte;
     
     if (len <= 125) {
         frame[1] = (unsigned char)len;
@@ -164,37 +331,157 @@ int send_websocket_frame(int socket, const char* data, size_t len) {
         frame_len = 10;
     }
     
-    if (send(socket, frame, frame_len, 0) < 0) return -1;
-    if (send(socket, data, len, 0) < 0) return -1;
+    return frame_len;
+}
+
+/*
+ * Section result cache, one entry per qnx_commands row and shared by both
+ * views. A section is only run again once its ttl has passed; a section
+ * that failed (no output, or killed on timeout) is retried with exponential
+ * backoff, serving its last good output meanwhile.
+ */
+typedef struct {
+    pthread_mutex_t lock;   /* Held while the section refreshes */
+    char *text;
+    int len;
+    long long next_refresh;
+    int failures;
+} SectionCache;
+
+SectionCache *section_cache;
+
+int section_cache_init(void) {
+    int count = 0, i;
+    
+    while (qnx_commands[count].name) count++;
+    section_cache = calloc((size_t)count, sizeof(SectionCache));
+    if (!section_cache) return -1;
+    for (i = 0; i < count; i++) pthread_mutex_init(&section_cache[i].lock, NULL);
     return 0;
 }
 
-/* Execute a command and capture output */
-int execute_command(const char *cmd, char *output, size_t output_size) {
-    FILE *fp;
-    size_t total_read = 0;
-    char buffer[4096];
+/* Run one section: native collector first, shell command as fallback */
+int run_section(const SystemCommand *cmd, char *output, size_t output_size, int *timed_out) {
+    *timed_out = 0;
+    if (cmd->native && !native_disabled) {
+        int len = cmd->native(output, output_size);
+        if (len >= 0) return len;
+    }
+    return exec_command(cmd->command, output, output_size, command_timeout_ms, timed_out);
+}
+
+enum { STREAM_BEGIN, STREAM_SECTION, STREAM_END };
+
+/*
+ * Hands each part of a snapshot to emit() as soon as it is ready (?stream=1):
+ * the header before the sections run, each section when its job finishes,
+ * the footer at the end. Sections served unchanged from the cache are only
+ * emitted when the layout differs from the previous snapshot's.
+ */
+typedef struct SectionStream SectionStream;
+struct SectionStream {
+    void (*emit)(SectionStream *stream, int type, int index, const char *text, size_t len);
+    void *ctx;
+    unsigned long generation;
+    int count;          /* In: sections of the previous snapshot, 0 if none; out: of this one */
+    int all;            /* Emit every section, not only the refreshed ones */
+};
+
+/* One section collected on the worker pool */
+typedef struct {
+    const SystemCommand *cmd;
+    SectionStream *stream;
+    int index;          /* Position in the snapshot, 0 being the header */
+    char *output;
+    int len;
+    int refreshed;      /* Ran this time rather than served from cache */
+    int failed;
+    int timed_out;
+    long elapsed_ms;
+} SectionJob;
+
+/* The section as it appears in a snapshot; its output is left out if it does not fit */
+size_t section_render(const SectionJob *job, char *out, size_t size) {
+    size_t len = (size_t)snprintf(out, size,
+        "----------------------------------------------------------------------\n"
+        " %s\n"
+        " %s\n"
+        "----------------------------------------------------------------------\n",
+        job->cmd->name,
+        job->cmd->description);
     
-    fp = popen(cmd, "r");
-    if (fp == NULL) {
-        snprintf(output, output_size, "[Command failed: %s]\n", cmd);
-        return -1;
+    if (len >= size) return size - 1;
+    if (job->len >= 0) {
+        size_t section_len = strlen(job->output);
+        if (len + section_len < size - 100) {
+            len += (size_t)snprintf(out + len, size - len, "%s\n", job->output);
+        }
     }
+    len += (size_t)snprintf(out + len, size - len, "\n");
+    return len < size ? len : size - 1;
+}
+
+/* Refresh the section if its ttl expired, then copy the cached text out */
+void section_job_run(void *arg) {
+    SectionJob *job = arg;
+    SectionCache *cache = &section_cache[job->cmd - qnx_commands];
+    long long start;
     
-    output[0] = '\0';
+    pthread_mutex_lock(&cache->lock);
+    start = monotonic_ms();
+    job->refreshed = job->failed = job->timed_out = 0;
     
-    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-        size_t len = strlen(buffer);
-        if (total_read + len < output_size - 1) {
-            strcat(output, buffer);
-            total_read += len;
+    if (!cache->text || start >= cache->next_refresh) {
+        int len = run_section(job->cmd, job->output, BUFFER_SIZE, &job->timed_out);
+        long long ttl_ms = (long long)job->cmd->ttl * 1000;
+        
+        job->refreshed = 1;
+        job->elapsed_ms = (long)(monotonic_ms() - start);
+        job->failed = len <= 0 || job->timed_out;
+        stats_observe(stat_command_seconds, job->cmd->name, job->elapsed_ms / 1000.0);
+        if (job->timed_out) stats_add(stat_command_timeouts, job->cmd->name, 1);
+        
+        if (job->failed) {
+            long long backoff = (long long)(job->cmd->ttl > REFRESH_INTERVAL ? job->cmd->ttl : REFRESH_INTERVAL) * 1000;
+            
+            if (cache->failures < 16) cache->failures++;
+            backoff <<= cache->failures - 1 < 8 ? cache->failures - 1 : 8;
+            if (backoff > SECTION_BACKOFF_MAX * 1000LL) backoff = SECTION_BACKOFF_MAX * 1000LL;
+            cache->next_refresh = start + backoff;
         } else {
-            break;
+            cache->failures = 0;
+            cache->next_refresh = start + ttl_ms;
+        }
+        
+        /* Keep the last good output of a failing section */
+        if (len >= 0 && (!job->failed || !cache->text)) {
+            char *text = realloc(cache->text, (size_t)len + 1);
+            
+            if (text) {
+                memcpy(text, job->output, (size_t)len + 1);
+                cache->text = text;
+                cache->len = len;
+            }
         }
     }
     
-    pclose(fp);
-    return (int)total_read;
+    if (cache->text) {
+        memcpy(job->output, cache->text, (size_t)cache->len + 1);
+        job->len = cache->len;
+    } else {
+        job->len = -1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    
+    if (job->stream && (job->refreshed || job->stream->all)) {
+        size_t size = (size_t)(job->len > 0 ? job->len : 0) + 512;
+        char *block = malloc(size);
+        
+        if (block) {
+            job->stream->emit(job->stream, STREAM_SECTION, job->index, block, section_render(job, block, size));
+            free(block);
+        }
+    }
 }
 
 /* Get current timestamp */
@@ -204,452 +491,2626 @@ void get_timestamp(char *buffer, size_t size) {
     strftime(buffer, size, "%Y-%m-%d %H:%M:%S", tm_info);
 }
 
-/* Collect all QNX system metrics */
-int collect_qnx_metrics(char *output, size_t output_size, int view_mode) {
-    char section_output[BUFFER_SIZE];
+/*
+ * Collect all QNX system metrics. If sections is given it receives the start
+ * offset of the header, each command section and the footer, followed by the
+ * total length; *section_count is the number of sections.
+ *
+ * The enabled sections run concurrently on section_pool, so a snapshot takes
+ * as long as its slowest section; the output is assembled in table order
+ * and the footer reports how long each section took. With a stream, each
+ * part is also emitted as soon as it is ready, in completion order.
+ */
+int collect_qnx_metrics(char *output, size_t output_size, int view_mode,
+                        size_t *sections, int *section_count, SectionStream *stream) {
+    SectionJob jobs[MAX_SECTIONS];
+    ExecJob exec_jobs[MAX_SECTIONS];
+    char *buffers;
     char timestamp[64];
-    size_t total_len = 0;
+    char timings[2048];
+    size_t total_len = 0, timings_len = 0, line_len = 0, footer_start;
+    long long start;
+    long elapsed_ms;
+    int job_count = 0, refreshed = 0, listed = 0, shed = 0;
+    int shedding = budget_shedding();
+    int count = 0;
     int i;
     
-    get_timestamp(timestamp, sizeof(timestamp));
+    for (i = 0; qnx_commands[i].name != NULL && job_count < MAX_SECTIONS - 2; i++) {
+        /* In full view mode (1), show all commands */
+        /* In standard view mode (0), show only enabled commands */
+        if (view_mode == 1 || qnx_commands[i].enabled) {
+            /* Over the CPU budget even at the longest interval: the full-view extras wait */
+            if (!qnx_commands[i].enabled && shedding) {
+                shed++;
+                continue;
+            }
+            jobs[job_count].cmd = &qnx_commands[i];
+            jobs[job_count].stream = stream;
+            jobs[job_count].index = job_count + 1;
+            job_count++;
+        }
+    }
     
-    /* Header */
+    buffers = malloc((size_t)(job_count > 0 ? job_count : 1) * BUFFER_SIZE);
+    if (!buffers) {
+        perror("malloc");
+        return -1;
+    }
+    
+    /* Header, ahead of the sections so a stream can show it right away */
+    get_timestamp(timestamp, sizeof(timestamp));
+    if (sections) sections[count++] = 0;
     total_len += snprintf(output + total_len, output_size - total_len,
         "======================================================================\n"
         "                  QNX NEUTRINO SYSTEM MONITOR\n"
         "                  Timestamp: %s\n"
         "======================================================================\n\n",
         timestamp);
+    if (stream) {
+        stream->all = stream->count != job_count + 2;
+        stream->count = job_count + 2;
+        stream->emit(stream, STREAM_BEGIN, 0, output, total_len);
+    }
     
-    /* Execute enabled commands based on view mode */
-    for (i = 0; qnx_commands[i].name != NULL; i++) {
-        /* In full view mode (1), show all commands */
-        /* In standard view mode (0), show only enabled commands */
-        if (view_mode == 1 || qnx_commands[i].enabled) {
-            total_len += snprintf(output + total_len, output_size - total_len,
-                "----------------------------------------------------------------------\n"
-                " %s\n"
-                " %s\n"
-                "----------------------------------------------------------------------\n",
-                qnx_commands[i].name,
-                qnx_commands[i].description);
-            
-            if (execute_command(qnx_commands[i].command, section_output, sizeof(section_output)) >= 0) {
-                size_t section_len = strlen(section_output);
-                if (total_len + section_len < output_size - 100) {
-                    total_len += snprintf(output + total_len, output_size - total_len, "%s\n", section_output);
-                }
-            }
-            
-            total_len += snprintf(output + total_len, output_size - total_len, "\n");
-            
-            if (total_len >= output_size - 1000) break;
+    start = monotonic_ms();
+    for (i = 0; i < job_count; i++) {
+        jobs[i].output = buffers + (size_t)i * BUFFER_SIZE;
+        jobs[i].output[0] = '\0';
+        exec_jobs[i].run = section_job_run;
+        exec_jobs[i].arg = &jobs[i];
+    }
+    exec_pool_run(section_pool, exec_jobs, job_count);
+    elapsed_ms = (long)(monotonic_ms() - start);
+    for (i = 0; i < job_count; i++) refreshed += jobs[i].refreshed;
+    
+    /* Assemble the sections in table order */
+    for (i = 0; i < job_count; i++) {
+        if (sections) sections[count++] = total_len;
+        total_len += section_render(&jobs[i], output + total_len, output_size - total_len);
+        
+        if (total_len >= output_size - 4000) break;
+    }
+    
+    /* Timings of the sections refreshed this time, wrapped to the banner width */
+    timings_len = snprintf(timings, sizeof(timings), " Collected in %ld ms, %d of %d sections refreshed%s",
+                           elapsed_ms, refreshed, job_count, refreshed ? " (ms):" : "");
+    for (i = 0; i < job_count && timings_len < sizeof(timings) - 80; i++) {
+        const char *separator;
+        char item[64];
+        int item_len;
+        
+        if (!jobs[i].refreshed) continue;
+        item_len = snprintf(item, sizeof(item), "%.31s %ld%s", jobs[i].cmd->name, jobs[i].elapsed_ms,
+                            jobs[i].timed_out ? " (timeout)" : jobs[i].failed ? " (failed)" : "");
+        
+        if (listed == 0 || line_len + 2 + (size_t)item_len > 70) {
+            separator = listed == 0 ? "\n " : ",\n ";
+            line_len = 1;
+        } else {
+            separator = ", ";
+            line_len += 2;
         }
+        timings_len += snprintf(timings + timings_len, sizeof(timings) - timings_len, "%s%s", separator, item);
+        line_len += (size_t)item_len;
+        listed++;
+    }
+    if (shed > 0) {
+        snprintf(timings + timings_len, sizeof(timings) - timings_len,
+                 "\n %d optional section(s) paused to stay within the CPU budget", shed);
     }
     
     /* Footer */
+    footer_start = total_len;
+    if (sections) sections[count++] = total_len;
     total_len += snprintf(output + total_len, output_size - total_len,
         "======================================================================\n"
-        "                    Refresh every %d seconds\n"
+        "%s\n"
+        "                    Refresh every %.1f seconds\n"
         "======================================================================\n",
-        REFRESH_INTERVAL);
+        timings,
+        budget_interval_ms(REFRESH_INTERVAL * 1000) / 1000.0);
+    free(buffers);
     
+    if (total_len >= output_size) total_len = output_size - 1;
+    if (stream) stream->emit(stream, STREAM_END, stream->count - 1, output + footer_start, total_len - footer_start);
+    if (sections) {
+        sections[count] = total_len;
+        *section_count = count;
+    }
     return (int)total_len;
 }
 
-/* Continuous top monitoring mode */
-int run_top_continuous(int client_socket) {
-    int pipefd[2];
-    pid_t pid;
-    char buffer[BUFFER_SIZE];
+/*
+ * Shared samplers
+ *
+ * One collector thread per view mode builds a single snapshot per tick and
+ * publishes it as immutable, refcounted frames. Every subscribed socket
+ * sends the same bytes, so collection cost does not grow with viewers.
+ *
+ * Besides the full text frame each tick publishes a delta stream for
+ * clients that asked for it (?delta=1): a JSON keyframe carrying every
+ * section, and a JSON delta carrying only the lines that changed since the
+ * previous generation. Every KEYFRAME_INTERVAL ticks no delta is built, so
+ * all delta clients resynchronize on a keyframe.
+ *
+ * Clients that negotiated permessage-deflate share a compression channel per
+ * stream and parameter set. The sampler compresses each generation once per
+ * channel, so compression cost does not grow with viewers either.
+ *
+ * Clients of the section stream (?stream=1) get each part of a generation
+ * as its own message while it is collected: {"type":"begin","gen":N,"s":0,
+ * "count":C,"text":header}, then {"type":"section",...,"s":i,"text":...} as
+ * sections finish, then {"type":"end",...} with the footer. A section
+ * served unchanged from the cache is not sent again unless the layout
+ * changed ("all" generations). The messages wait in a ring that each
+ * client reads at its own pace; a client that lost its place gets the
+ * next keyframe or delta instead, as on the delta stream.
+ */
+
+enum { FRAME_RAW, FRAME_TEXT, FRAME_KEY, FRAME_DELTA, FRAME_BINARY, FRAME_SECTION };
+
+#define FRAME_DEFLATE_RESET 0x1     /* Compressed without referencing earlier messages */
+#define FRAME_STREAM_BEGIN 0x4      /* Section stream: first message of a generation */
+#define FRAME_STREAM_END 0x8        /* Section stream: last message of a generation */
+#define FRAME_STREAM_ALL 0x10       /* Section stream: this generation sends every section */
+
+#define STREAM_RING_SIZE 128
+
+/* Pre-encoded WebSocket frame shared by all subscribers */
+typedef struct {
+    int refcount;
+    int kind;
+    int flags;
+    unsigned long generation;
+    unsigned long base_generation;  /* Delta frames: generation they apply to */
+    unsigned long seq;              /* Compressed frames: position in the channel stream */
+    time_t created;
+    size_t header_len;
+    size_t len;
+    unsigned char data[];
+} MetricsFrame;
+
+/* Frames published for one generation */
+typedef struct {
+    MetricsFrame *text;
+    MetricsFrame *key;
+    MetricsFrame *delta;
+    MetricsFrame *binary;           /* CBOR snapshot, only while binary clients subscribe */
+    MetricsFrame *deflated[MAX_DEFLATE_CHANNELS];
+} SamplerFrames;
+
+/*
+ * Shared deflate stream. With context takeover each message may reference
+ * the previous ones, so clients must receive every message of the channel;
+ * reset asks the sampler to compress the next one from a clean state so
+ * joining or lagging clients can pick the stream up again.
+ */
+typedef struct {
+    int in_use;             /* Freed again when the last member leaves */
+    int delta;              /* Compresses the delta stream instead of text frames */
+    DeflateParams params;
+    int members;
+    int reset;
+    unsigned long claim;    /* Bumped each time the slot is taken for a parameter set */
+    int active;             /* zs initialised; only touched by the sampler thread */
+    unsigned long active_claim;
+    int active_delta;       /* delta and params zs was set up with */
+    DeflateParams active_params;
+    unsigned long seq;
+    z_stream zs;
+} DeflateChannel;
+
+typedef struct {
+    int view_mode;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SamplerFrames latest;
+    unsigned long generation;
+    int subscribers;
+    int binary_subscribers;
+    int stream_subscribers;
+    MetricsFrame *stream_ring[STREAM_RING_SIZE];   /* Message seq s lives in stream_ring[s % STREAM_RING_SIZE] */
+    unsigned long stream_next_seq;                  /* Seq of the next message, starting at 1 */
+    unsigned long stream_begin_seq;                 /* Begin of the latest generation, 0 if none */
+    DeflateChannel channels[MAX_DEFLATE_CHANNELS];
+    pthread_t thread;
+} MetricsSampler;
+
+/* Growable text buffer used to build JSON frames */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+/* Index 0 = standard view, 1 = full view */
+MetricsSampler samplers[2];
+
+/* Frame holding raw bytes (HTTP responses) */
+MetricsFrame* frame_create_raw(const void *data, size_t len) {
+    MetricsFrame *frame = malloc(sizeof(MetricsFrame) + len);
     
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        return -1;
-    }
+    if (!frame) return NULL;
     
-    pid = fork();
-    if (pid == -1) {
-        perror("fork");
-        close(pipefd[0]);
-        close(pipefd[1]);
-        return -1;
+    memset(frame, 0, sizeof(MetricsFrame));
+    frame->refcount = 1;
+    frame->kind = FRAME_RAW;
+    frame->created = time(NULL);
+    frame->len = len;
+    memcpy(frame->data, data, len);
+    return frame;
+}
+
+/* Frame holding a complete HTTP response; the connection closes after it */
+MetricsFrame* frame_create_http(int code, const char *status, const char *content_type,
+                                const char *body, size_t body_len) {
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "\r\n",
+        code, status, content_type, body_len);
+    MetricsFrame *frame = malloc(sizeof(MetricsFrame) + (size_t)header_len + body_len);
+    
+    if (!frame) return NULL;
+    
+    memset(frame, 0, sizeof(MetricsFrame));
+    frame->refcount = 1;
+    frame->kind = FRAME_RAW;
+    frame->created = time(NULL);
+    frame->len = (size_t)header_len + body_len;
+    memcpy(frame->data, header, (size_t)header_len);
+    memcpy(frame->data + header_len, body, body_len);
+    return frame;
+}
+
+/* Frame holding one WebSocket message with the given first header byte */
+MetricsFrame* frame_create_message(unsigned char first_byte, const void *payload, size_t payload_len,
+                                   unsigned long generation) {
+    unsigned char header[14];
+    size_t header_len = websocket_frame_header(header, first_byte, payload_len);
+    MetricsFrame *frame = malloc(sizeof(MetricsFrame) + header_len + payload_len);
+    
+    if (!frame) return NULL;
+    
+    memset(frame, 0, sizeof(MetricsFrame));
+    frame->refcount = 1;
+    frame->kind = FRAME_TEXT;
+    frame->generation = generation;
+    frame->created = time(NULL);
+    frame->header_len = header_len;
+    frame->len = header_len + payload_len;
+    memcpy(frame->data, header, header_len);
+    memcpy(frame->data + header_len, payload, payload_len);
+    return frame;
+}
+
+/* Frame holding one WebSocket text message */
+MetricsFrame* frame_create(const char *text, size_t text_len, unsigned long generation) {
+    return frame_create_message(0x81, text, text_len, generation);
+}
+
+MetricsFrame* frame_retain(MetricsFrame *frame) {
+    if (frame) __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void frame_release(MetricsFrame *frame) {
+    if (frame && __atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(frame);
     }
+}
+
+void frames_release(SamplerFrames *frames) {
+    int i;
     
-    if (pid == 0) {
-        /* Child process: run top in batch mode */
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
-        dup2(pipefd[1], STDERR_FILENO);
-        close(pipefd[1]);
-        
-        /* QNX top command - try different options */
-        execlp("top", "top", "-b", "-d", "1", NULL);
-        
-        /* Fallback to hogs if top doesn't work */
-        execlp("hogs", "hogs", "-i", "1", NULL);
+    frame_release(frames->text);
+    frame_release(frames->key);
+    frame_release(frames->delta);
+    frame_release(frames->binary);
+    for (i = 0; i < MAX_DEFLATE_CHANNELS; i++) frame_release(frames->deflated[i]);
+    memset(frames, 0, sizeof(*frames));
+}
+
+int sb_reserve(StrBuf *sb, size_t extra) {
+    if (sb->len + extra + 1 > sb->cap) {
+        size_t cap = sb->cap ? sb->cap : 4096;
+        char *data;
         
-        /* Last fallback - pidin in a loop would need a script */
-        perror("execlp failed");
-        _exit(1);
+        while (cap < sb->len + extra + 1) cap *= 2;
+        data = realloc(sb->data, cap);
+        if (!data) return -1;
+        sb->data = data;
+        sb->cap = cap;
     }
+    return 0;
+}
+
+void sb_append(StrBuf *sb, const char *text, size_t len) {
+    if (sb_reserve(sb, len) < 0) return;
+    memcpy(sb->data + sb->len, text, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_appendf(StrBuf *sb, const char *fmt, ...) {
+    va_list ap;
+    int n;
     
-    /* Parent process */
-    close(pipefd[1]);
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || sb_reserve(sb, (size_t)n) < 0) return;
     
-    /* Set non-blocking read */
-    int flags = fcntl(pipefd[0], F_GETFL, 0);
-    fcntl(pipefd[0], F_SETFL, flags | O_NONBLOCK);
+    va_start(ap, fmt);
+    vsnprintf(sb->data + sb->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    sb->len += (size_t)n;
+}
+
+/* Append text as a quoted JSON string */
+void sb_append_json(StrBuf *sb, const char *text, size_t len) {
+    size_t i, start = 0;
     
-    while (running) {
-        fd_set read_fds;
-        struct timeval tv;
-        int ret;
-        int bytes_read;
-        int status;
+    sb_append(sb, "\"", 1);
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        const char *esc = NULL;
+        char hex[8];
         
-        FD_ZERO(&read_fds);
-        FD_SET(pipefd[0], &read_fds);
-        
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+        if (c == '"') esc = "\\\"";
+        else if (c == '\\') esc = "\\\\";
+        else if (c == '\n') esc = "\\n";
+        else if (c == '\t') esc = "\\t";
+        else if (c == '\r') esc = "\\r";
+        else if (c < 0x20) {
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            esc = hex;
+        }
+        if (esc) {
+            sb_append(sb, text + start, i - start);
+            sb_append(sb, esc, strlen(esc));
+            start = i + 1;
+        }
+    }
+    sb_append(sb, text + start, len - start);
+    sb_append(sb, "\"", 1);
+}
+
+/* Keyframe: {"type":"key","gen":N,"sections":["...",...]} */
+MetricsFrame* build_keyframe(StrBuf *sb, const char *text, const size_t *sections, int count,
+                             unsigned long generation) {
+    MetricsFrame *frame;
+    int i;
+    
+    sb->len = 0;
+    sb_appendf(sb, "{\"type\":\"key\",\"gen\":%lu,\"sections\":[", generation);
+    for (i = 0; i < count; i++) {
+        if (i) sb_append(sb, ",", 1);
+        sb_append_json(sb, text + sections[i], sections[i + 1] - sections[i]);
+    }
+    sb_append(sb, "]}", 2);
+    if (!sb->data) return NULL;
+    frame = frame_create(sb->data, sb->len, generation);
+    if (frame) frame->kind = FRAME_KEY;
+    return frame;
+}
+
+/* Length of the line starting at p, without its newline */
+size_t line_length(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    return nl ? (size_t)(nl - p) : (size_t)(end - p);
+}
+
+/*
+ * Delta: {"type":"delta","base":B,"gen":N,"count":S,"changes":[{"s":i,"n":lines,"l":[[idx,"text"],...]},...]}
+ * Sections are split on '\n'; "n" is the new line count of a changed section
+ * and "l" lists every line that differs from the base. Returns NULL when the
+ * layout changed or the delta would not be smaller than the keyframe.
+ */
+MetricsFrame* build_delta(StrBuf *sb, const char *text, const size_t *sections, int count,
+                          const char *prev, const size_t *prev_sections, int prev_count,
+                          unsigned long generation, size_t keyframe_len) {
+    int changes = 0;
+    int i;
+    MetricsFrame *frame;
+    
+    if (count != prev_count) return NULL;
+    
+    sb->len = 0;
+    sb_appendf(sb, "{\"type\":\"delta\",\"base\":%lu,\"gen\":%lu,\"count\":%d,\"changes\":[",
+               generation - 1, generation, count);
+    
+    for (i = 0; i < count; i++) {
+        const char *p = text + sections[i], *end = text + sections[i + 1];
+        const char *q = prev + prev_sections[i], *prev_end = prev + prev_sections[i + 1];
+        int line = 0, lines_changed = 0;
         
-        ret = select(pipefd[0] + 1, &read_fds, NULL, NULL, &tv);
+        if (end - p == prev_end - q && memcmp(p, q, (size_t)(end - p)) == 0) continue;
         
-        if (ret > 0 && FD_ISSET(pipefd[0], &read_fds)) {
-            bytes_read = read(pipefd[0], buffer, BUFFER_SIZE - 1);
-            if (bytes_read <= 0) {
-                if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
-                    break;
-                }
-                continue;
-            }
+        sb_appendf(sb, "%s{\"s\":%d,\"l\":[", changes ? "," : "", i);
+        for (;;) {
+            size_t len = line_length(p, end);
+            int old_exists = q <= prev_end;
+            size_t old_len = old_exists ? line_length(q, prev_end) : 0;
             
-            buffer[bytes_read] = '\0';
-            if (send_websocket_frame(client_socket, buffer, bytes_read) < 0) {
-                break;
+            if (!old_exists || len != old_len || memcmp(p, q, len) != 0) {
+                sb_appendf(sb, "%s[%d,", lines_changed ? "," : "", line);
+                sb_append_json(sb, p, len);
+                sb_append(sb, "]", 1);
+                lines_changed++;
             }
-        } else if (ret < 0 && errno != EINTR) {
-            break;
-        }
-        
-        /* Check if child is still running */
-        if (waitpid(pid, &status, WNOHANG) != 0) {
-            break;
+            
+            line++;
+            if (old_exists) q += old_len + 1;
+            if (p + len >= end) break;
+            p += len + 1;
         }
+        sb_appendf(sb, "],\"n\":%d}", line);
+        changes++;
     }
+    sb_append(sb, "]}", 2);
     
-    close(pipefd[0]);
-    kill(pid, SIGTERM);
-    waitpid(pid, NULL, 0);
-    
-    return 0;
+    if (!sb->data || sb->len >= keyframe_len) return NULL;
+    frame = frame_create(sb->data, sb->len, generation);
+    if (frame) {
+        frame->kind = FRAME_DELTA;
+        frame->base_generation = generation - 1;
+    }
+    return frame;
 }
 
-/* Thread function to handle client */
-void* handle_client(void* arg) {
-    int client_socket = *(int*)arg;
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    int is_metrics, is_top, is_full, is_root;
-    
-    free(arg);
+/*
+ * Compress one message on a channel into an RSV1 frame. The trailing
+ * 00 00 ff ff of the sync flush is stripped as RFC 7692 requires.
+ */
+MetricsFrame* deflate_frame(DeflateChannel *channel, const MetricsFrame *src, int reset,
+                            unsigned char **buf, size_t *cap) {
+    z_stream *zs = &channel->zs;
+    size_t out_len = 0;
+    MetricsFrame *frame;
     
-    bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
+    if (reset || !channel->active_params.takeover) deflateReset(zs);
     
-    if (bytes_read <= 0) {
-        close(client_socket);
-        return NULL;
-    }
+    zs->next_in = (Bytef*)(src->data + src->header_len);
+    zs->avail_in = (uInt)(src->len - src->header_len);
+    do {
+        int rc;
+        
+        if (*cap - out_len < 64) {
+            size_t new_cap = *cap ? *cap * 2 : 65536;
+            unsigned char *data = realloc(*buf, new_cap);
+            if (!data) return NULL;
+            *buf = data;
+            *cap = new_cap;
+        }
+        zs->next_out = *buf + out_len;
+        zs->avail_out = (uInt)(*cap - out_len);
+        rc = deflate(zs, Z_SYNC_FLUSH);
+        out_len = *cap - zs->avail_out;
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return NULL;
+    } while (zs->avail_out == 0);
     
-    buffer[bytes_read] = '\0';
-    printf("Received request:\n%s\n", buffer);
+    if (out_len >= 4 && memcmp(*buf + out_len - 4, "\x00\x00\xff\xff", 4) == 0) out_len -= 4;
     
-    /* Route handling */
-    is_metrics = (strstr(buffer, "GET /metrics") != NULL);
-    is_top = (strstr(buffer, "GET /top") != NULL);
-    is_full = (strstr(buffer, "GET /full") != NULL);
-    is_root = (strstr(buffer, "GET / ") != NULL) || (strstr(buffer, "GET / HTTP") != NULL);
+    frame = frame_create_message(0xC1, *buf, out_len, src->generation);
+    if (!frame) return NULL;
+    frame->kind = src->kind;
+    frame->base_generation = src->base_generation;
+    frame->seq = ++channel->seq;
+    if (reset || !channel->active_params.takeover) frame->flags |= FRAME_DEFLATE_RESET;
+    return frame;
+}
+
+void sampler_channel_reset(MetricsSampler *sampler, int index);
+
+/* Compress this generation once for every channel that has members */
+void sampler_deflate(MetricsSampler *sampler, SamplerFrames *frames, unsigned char **buf, size_t *cap) {
+    int i;
     
-    if (!is_metrics && !is_top && !is_full && !is_root) {
-        const char* error_msg = "HTTP/1.1 404 Not Found\r\n\r\n";
-        send(client_socket, error_msg, strlen(error_msg), 0);
-        close(client_socket);
-        return NULL;
+    for (i = 0; i < MAX_DEFLATE_CHANNELS; i++) {
+        DeflateChannel *channel = &sampler->channels[i];
+        MetricsFrame *src;
+        DeflateParams params;
+        unsigned long claim;
+        int members, reset, delta;
+        
+        pthread_mutex_lock(&sampler->lock);
+        members = channel->members;
+        reset = channel->reset;
+        channel->reset = 0;
+        claim = channel->claim;
+        delta = channel->delta;
+        params = channel->params;
+        pthread_mutex_unlock(&sampler->lock);
+        
+        /* The slot was freed and taken for another parameter set since zs was set up */
+        if (channel->active && channel->active_claim != claim) {
+            deflateEnd(&channel->zs);
+            channel->active = 0;
+        }
+        if (members == 0) {
+            if (channel->active) {
+                deflateEnd(&channel->zs);
+                channel->active = 0;
+            }
+            continue;
+        }
+        
+        if (!channel->active) {
+            memset(&channel->zs, 0, sizeof(z_stream));
+            if (deflateInit2(&channel->zs, deflate_level, Z_DEFLATED, -params.window_bits,
+                             8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                continue;
+            }
+            channel->active = 1;
+            channel->active_claim = claim;
+            channel->active_delta = delta;
+            channel->active_params = params;
+            reset = 1;
+        }
+        
+        src = channel->active_delta ? (frames->delta ? frames->delta : frames->key) : frames->text;
+        if (!src) continue;
+        
+        frames->deflated[i] = deflate_frame(channel, src, reset, buf, cap);
+        if (!frames->deflated[i]) sampler_channel_reset(sampler, i);
     }
+}
+
+void loops_notify(void);
+
+/* Publish one part of the generation being collected to the section stream; runs on section workers */
+void sampler_stream_emit(SectionStream *stream, int type, int index, const char *text, size_t len) {
+    static const char *types[] = {"begin", "section", "end"};
+    MetricsSampler *sampler = stream->ctx;
+    StrBuf sb = {NULL, 0, 0};
+    MetricsFrame *frame, *old;
+    unsigned long seq;
     
-    /* Check if this is a WebSocket upgrade request */
-    if (strstr(buffer, "Upgrade: websocket") == NULL) {
-        /* Serve HTML page */
-        const char* html_page = 
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/html\r\n"
-            "Connection: close\r\n\r\n"
-            "<!DOCTYPE html>\n"
-            "<html>\n"
-            "<head>\n"
-            "    <title>QNX System Monitor</title>\n"
-            "    <meta charset='UTF-8'>\n"
-            "    <style>\n"
-            "        * { margin: 0; padding: 0; box-sizing: border-box; }\n"
-            "        body {\n"
-            "            background: linear-gradient(135deg, #1a1a2e 0%, #16213e 100%);\n"
-            "            color: #00ff88;\n"
-            "            font-family: 'Courier New', monospace;\n"
-            "            min-height: 100vh;\n"
-            "            padding: 20px;\n"
-            "        }\n"
-            "        .header {\n"
-            "            text-align: center;\n"
-            "            padding: 20px;\n"
-            "            border-bottom: 2px solid #00ff88;\n"
-            "            margin-bottom: 20px;\n"
-            "        }\n"
-            "        h1 { color: #00ffff; text-shadow: 0 0 10px #00ffff; }\n"
-            "        .nav {\n"
-            "            display: flex;\n"
-            "            justify-content: center;\n"
-            "            gap: 20px;\n"
-            "            margin: 20px 0;\n"
-            "            flex-wrap: wrap;\n"
-            "        }\n"
-            "        .nav button {\n"
-            "            background: #0a3d62;\n"
-            "            color: #00ff88;\n"
-            "            border: 1px solid #00ff88;\n"
-            "            padding: 10px 25px;\n"
-            "            font-family: 'Courier New', monospace;\n"
-            "            font-size: 14px;\n"
-            "            cursor: pointer;\n"
-            "            transition: all 0.3s;\n"
-            "        }\n"
-            "        .nav button:hover, .nav button.active {\n"
-            "            background: #00ff88;\n"
-            "            color: #1a1a2e;\n"
-            "        }\n"
-            "        .status {\n"
-            "            text-align: center;\n"
-            "            padding: 10px;\n"
-            "            margin-bottom: 10px;\n"
-            "        }\n"
-            "        .status.connected { color: #00ff88; }\n"
-            "        .status.disconnected { color: #ff4444; }\n"
-            "        .status.connecting { color: #ffff00; }\n"
-            "        #output {\n"
-            "            background: rgba(0, 0, 0, 0.7);\n"
-            "            border: 1px solid #00ff88;\n"
-            "            border-radius: 5px;\n"
-            "            padding: 15px;\n"
-            "            white-space: pre;\n"
-            "            overflow-x: auto;\n"
-            "            font-size: 12px;\n"
-            "            line-height: 1.4;\n"
-            "            min-height: 500px;\n"
-            "            max-height: 80vh;\n"
-            "            overflow-y: auto;\n"
-            "        }\n"
-            "        .legend {\n"
-            "            margin-top: 20px;\n"
-            "            padding: 15px;\n"
-            "            background: rgba(0, 0, 0, 0.5);\n"
-            "            border: 1px solid #444;\n"
-            "            border-radius: 5px;\n"
-            "        }\n"
-            "        .legend h3 { color: #00ffff; margin-bottom: 10px; }\n"
-            "    </style>\n"
-            "</head>\n"
-            "<body>\n"
-            "    <div class='header'>\n"
-            "        <h1>QNX NEUTRINO SYSTEM MONITOR</h1>\n"
-            "        <p>Real-time system metrics via WebSocket</p>\n"
-            "    </div>\n"
-            "    \n"
-            "    <div class='nav'>\n"
-            "        <button onclick=\"connect('/metrics')\" id='btn-metrics'>Standard Metrics</button>\n"
-            "        <button onclick=\"connect('/full')\" id='btn-full'>Full Metrics</button>\n"
-            "        <button onclick=\"connect('/top')\" id='btn-top'>Live Top</button>\n"
-            "        <button onclick=\"disconnect()\" id='btn-disconnect'>Stop</button>\n"
-            "    </div>\n"
-            "    \n"
-            "    <div class='status' id='status'>Click a button to start monitoring</div>\n"
-            "    <pre id='output'>Waiting for connection...</pre>\n"
-            "    \n"
-            "    <div class='legend'>\n"
-            "        <h3>Available Endpoints</h3>\n"
-            "        <p>/metrics - Standard system overview</p>\n"
-            "        <p>/full - Extended metrics (all data)</p>\n"
-            "        <p>/top - Continuous top output</p>\n"
-            "    </div>\n"
-            "    \n"
-            "    <script>\n"
-            "        var ws = null;\n"
-            "        var currentEndpoint = '';\n"
-            "        \n"
-            "        function updateStatus(text, className) {\n"
-            "            var status = document.getElementById('status');\n"
-            "            status.textContent = text;\n"
-            "            status.className = 'status ' + className;\n"
-            "        }\n"
-            "        \n"
-            "        function setActiveButton(endpoint) {\n"
-            "            var buttons = document.querySelectorAll('.nav button');\n"
-            "            for (var i = 0; i < buttons.length; i++) {\n"
-            "                buttons[i].classList.remove('active');\n"
-            "            }\n"
-            "            if (endpoint === '/metrics') document.getElementById('btn-metrics').classList.add('active');\n"
-            "            else if (endpoint === '/full') document.getElementById('btn-full').classList.add('active');\n"
-            "            else if (endpoint === '/top') document.getElementById('btn-top').classList.add('active');\n"
-            "        }\n"
-            "        \n"
-            "        function connect(endpoint) {\n"
-            "            if (ws) ws.close();\n"
-            "            \n"
-            "            currentEndpoint = endpoint;\n"
-            "            setActiveButton(endpoint);\n"
-            "            updateStatus('Connecting to ' + endpoint + '...', 'connecting');\n"
-            "            document.getElementById('output').textContent = 'Connecting...';\n"
-            "            \n"
-            "            ws = new WebSocket('ws://' + window.location.host + endpoint);\n"
-            "            \n"
-            "            ws.onopen = function() {\n"
-            "                updateStatus('Connected to ' + endpoint, 'connected');\n"
-            "            };\n"
-            "            \n"
-            "            ws.onmessage = function(event) {\n"
-            "                document.getElementById('output').textContent = event.data;\n"
-            "            };\n"
-            "            \n"
-            "            ws.onerror = function(error) {\n"
-            "                updateStatus('Connection error', 'disconnected');\n"
-            "            };\n"
-            "            \n"
-            "            ws.onclose = function() {\n"
-            "                updateStatus('Disconnected', 'disconnected');\n"
-            "                setActiveButton('');\n"
-            "            };\n"
-            "        }\n"
-            "        \n"
-            "        function disconnect() {\n"
-            "            if (ws) {\n"
-            "                ws.close();\n"
-            "                ws = null;\n"
-            "            }\n"
-            "            setActiveButton('');\n"
-            "            updateStatus('Disconnected', 'disconnected');\n"
-            "            document.getElementById('output').textContent = 'Click a button to start';\n"
-            "        }\n"
-            "    </script>\n"
-            "</body>\n"
-            "</html>";
-        
-        send(client_socket, html_page, strlen(html_page), 0);
-        close(client_socket);
-        return NULL;
-    }
+    sb_appendf(&sb, "{\"type\":\"%s\",\"gen\":%lu,\"s\":%d,", types[type], stream->generation, index);
+    if (type == STREAM_BEGIN) sb_appendf(&sb, "\"count\":%d,", stream->count);
+    sb_append(&sb, "\"text\":", 7);
+    sb_append_json(&sb, text, len);
+    sb_append(&sb, "}", 1);
+    frame = sb.data ? frame_create(sb.data, sb.len, stream->generation) : NULL;
+    free(sb.data);
+    if (!frame) return;
+    frame->kind = FRAME_SECTION;
+    if (type == STREAM_BEGIN) frame->flags |= FRAME_STREAM_BEGIN | (stream->all ? FRAME_STREAM_ALL : 0);
+    if (type == STREAM_END) frame->flags |= FRAME_STREAM_END;
     
-    /* Perform WebSocket handshake */
-    if (!websocket_handshake(client_socket, buffer)) {
-        printf("WebSocket handshake failed\n");
-        close(client_socket);
-        return NULL;
-    }
+    pthread_mutex_lock(&sampler->lock);
+    seq = sampler->stream_next_seq++;
+    frame->seq = seq;
+    if (type == STREAM_BEGIN) sampler->stream_begin_seq = seq;
+    old = sampler->stream_ring[seq % STREAM_RING_SIZE];
+    sampler->stream_ring[seq % STREAM_RING_SIZE] = frame;
+    pthread_mutex_unlock(&sampler->lock);
     
-    printf("WebSocket client connected, handshake complete\n");
+    frame_release(old);
+    loops_notify();
+}
+
+/* Collector thread: sample while anyone is subscribed, idle otherwise */
+void* sampler_thread(void *arg) {
+    MetricsSampler *sampler = arg;
+    char *output = malloc(OUTPUT_BUFFER_SIZE);
+    char *prev = malloc(OUTPUT_BUFFER_SIZE);
+    size_t sections[MAX_SECTIONS + 1], prev_sections[MAX_SECTIONS + 1];
+    int count = 0, prev_count = 0;
+    unsigned long prev_generation = 0;
+    SectionStream stream = {sampler_stream_emit, arg, 0, 0, 0};
+    StrBuf sb = {NULL, 0, 0};
+    unsigned char *zbuf = NULL;
+    size_t zcap = 0;
+    size_t cbor_cap = CBOR_BUFFER_SIZE;
+    unsigned char *cbor_buf = malloc(cbor_cap);
+    int i;
     
-    /* Handle /top endpoint with continuous streaming */
-    if (is_top) {
-        printf("Starting continuous top monitoring\n");
-        run_top_continuous(client_socket);
-        close(client_socket);
-        printf("Top monitoring client disconnected\n");
+    if (!output || !prev || !cbor_buf) {
+        perror("malloc");
+        free(output);
+        free(prev);
+        free(cbor_buf);
         return NULL;
     }
     
-    /* Handle /metrics or /full with periodic polling */
-    {
-        int view_mode = is_full ? 1 : 0;
-        char *output = malloc(OUTPUT_BUFFER_SIZE);
+    while (running) {
+        SamplerFrames frames, old;
+        unsigned long generation;
+        int published = 0, binary, streaming;
+        struct timespec deadline;
+        long long started;
+        int len, interval_ms;
         
-        if (!output) {
-            perror("malloc");
-            close(client_socket);
-            return NULL;
+        pthread_mutex_lock(&sampler->lock);
+        while (running && sampler->subscribers == 0) {
+            /* Nobody kept up with the stream while idle: the next generation sends everything */
+            stream.count = 0;
+            pthread_cond_wait(&sampler->cond, &sampler->lock);
         }
+        binary = sampler->binary_subscribers > 0;
+        streaming = sampler->stream_subscribers > 0;
+        pthread_mutex_unlock(&sampler->lock);
+        if (!running) break;
         
-        printf("Starting %s metrics monitoring\n", is_full ? "full" : "standard");
+        generation = sampler->generation + 1;
+        stream.generation = generation;
+        if (!streaming) stream.count = 0;
+        started = monotonic_ms();
+        len = collect_qnx_metrics(output, OUTPUT_BUFFER_SIZE, sampler->view_mode, sections, &count,
+                                  streaming ? &stream : NULL);
+        if (len < 0) len = 0;
+        stats_observe(stat_snapshot_seconds, sampler->view_mode ? "full" : "metrics",
+                      (monotonic_ms() - started) / 1000.0);
+        stats_set(stat_snapshot_bytes, sampler->view_mode ? "full" : "metrics", len);
+        
+        memset(&frames, 0, sizeof(frames));
+        frames.text = frame_create(output, (size_t)len, generation);
+        frames.key = build_keyframe(&sb, output, sections, count, generation);
+        if (frames.key && prev_generation == generation - 1 && generation % KEYFRAME_INTERVAL != 0) {
+            frames.delta = build_delta(&sb, output, sections, count, prev, prev_sections, prev_count,
+                                       generation, frames.key->len);
+        }
+        sampler_deflate(sampler, &frames, &zbuf, &zcap);
         
-        while (running) {
-            collect_qnx_metrics(output, OUTPUT_BUFFER_SIZE, view_mode);
+        /* Binary clients get the structured snapshot; the buffer only grows when it overflows */
+        while (binary) {
+            CborWriter writer;
+            unsigned char *grown;
+            int cbor_len;
             
-            if (send_websocket_frame(client_socket, output, strlen(output)) < 0) {
-                printf("Failed to send data, client disconnected\n");
+            cbor_init(&writer, cbor_buf, cbor_cap);
+            cbor_len = cbor_encode_snapshot(&writer, generation, sampler->view_mode);
+            if (cbor_len >= 0) {
+                frames.binary = frame_create_message(0x82, cbor_buf, (size_t)cbor_len, generation);
+                if (frames.binary) frames.binary->kind = FRAME_BINARY;
                 break;
             }
-            
-            sleep(REFRESH_INTERVAL);
+            if (cbor_cap >= CBOR_BUFFER_MAX || !(grown = realloc(cbor_buf, cbor_cap * 2))) break;
+            cbor_buf = grown;
+            cbor_cap *= 2;
         }
         
-        free(output);
+        /* Keep this snapshot as the base for the next delta */
+        memcpy(prev, output, (size_t)len);
+        memcpy(prev_sections, sections, sizeof(size_t) * (count + 1));
+        prev_count = count;
+        prev_generation = generation;
+        
+        pthread_mutex_lock(&sampler->lock);
+        memset(&old, 0, sizeof(old));
+        if (frames.text && frames.key) {
+            old = sampler->latest;
+            sampler->latest = frames;
+            sampler->generation = generation;
+            pthread_cond_broadcast(&sampler->cond);
+            published = 1;
+        } else {
+            frames_release(&frames);
+        }
+        pthread_mutex_unlock(&sampler->lock);
+        
+        if (published) loops_notify();
+        
+        pthread_mutex_lock(&sampler->lock);
+        
+        /* Sleep until the next tick, later while over the CPU budget; shutdown wakes us through the cond */
+        budget_update();
+        interval_ms = budget_interval_ms(REFRESH_INTERVAL * 1000);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_ms / 1000;
+        deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (running && pthread_cond_timedwait(&sampler->cond, &sampler->lock, &deadline) != ETIMEDOUT) {
+        }
+        pthread_mutex_unlock(&sampler->lock);
+        
+        frames_release(&old);
     }
     
-    close(client_socket);
-    printf("Metrics client disconnected\n");
-    
+    for (i = 0; i < MAX_DEFLATE_CHANNELS; i++) {
+        if (sampler->channels[i].active) deflateEnd(&sampler->channels[i].zs);
+    }
+    free(cbor_buf);
+    free(zbuf);
+    free(sb.data);
+    free(prev);
+    free(output);
     return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    int port = PORT;
-    int server_socket;
-    int opt = 1;
-    struct sockaddr_in server_addr;
-    int i;
+int sampler_start(MetricsSampler *sampler, int view_mode) {
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->view_mode = view_mode;
+    sampler->stream_next_seq = 1;
+    pthread_mutex_init(&sampler->lock, NULL);
+    pthread_cond_init(&sampler->cond, NULL);
+    
+    if (pthread_create(&sampler->thread, NULL, sampler_thread, sampler) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+void sampler_stop(MetricsSampler *sampler) {
+    int i;
+    
+    pthread_mutex_lock(&sampler->lock);
+    pthread_cond_broadcast(&sampler->cond);
+    pthread_mutex_unlock(&sampler->lock);
+    pthread_join(sampler->thread, NULL);
+    frames_release(&sampler->latest);
+    for (i = 0; i < STREAM_RING_SIZE; i++) frame_release(sampler->stream_ring[i]);
+}
+
+/* Returns where a section stream client starts reading: the latest generation's begin */
+unsigned long sampler_subscribe(MetricsSampler *sampler, int binary, int stream) {
+    unsigned long seq;
+    
+    pthread_mutex_lock(&sampler->lock);
+    sampler->subscribers++;
+    if (binary) sampler->binary_subscribers++;
+    if (stream) sampler->stream_subscribers++;
+    seq = sampler->stream_begin_seq ? sampler->stream_begin_seq : sampler->stream_next_seq;
+    pthread_cond_broadcast(&sampler->cond);
+    pthread_mutex_unlock(&sampler->lock);
+    return seq;
+}
+
+void sampler_unsubscribe(MetricsSampler *sampler, int binary, int stream) {
+    pthread_mutex_lock(&sampler->lock);
+    sampler->subscribers--;
+    if (binary) sampler->binary_subscribers--;
+    if (stream) sampler->stream_subscribers--;
+    pthread_mutex_unlock(&sampler->lock);
+}
+
+/*
+ * Retain the section stream message at *seq and advance past it; NULL once
+ * caught up. If the ring already dropped it, *seq moves to the oldest one
+ * kept and *lost is set.
+ */
+MetricsFrame* sampler_stream_next(MetricsSampler *sampler, unsigned long *seq, int *lost) {
+    MetricsFrame *frame = NULL;
+    unsigned long oldest;
+    
+    pthread_mutex_lock(&sampler->lock);
+    oldest = sampler->stream_next_seq > STREAM_RING_SIZE ? sampler->stream_next_seq - STREAM_RING_SIZE : 1;
+    if (*seq < oldest) {
+        *seq = oldest;
+        *lost = 1;
+    }
+    if (*seq < sampler->stream_next_seq) frame = frame_retain(sampler->stream_ring[(*seq)++ % STREAM_RING_SIZE]);
+    pthread_mutex_unlock(&sampler->lock);
+    return frame;
+}
+
+/* Join the compression channel for a stream and parameter set, returns its index or -1 */
+int sampler_channel_join(MetricsSampler *sampler, int delta, const DeflateParams *params) {
+    int i, found = -1;
+    
+    pthread_mutex_lock(&sampler->lock);
+    for (i = 0; i < MAX_DEFLATE_CHANNELS; i++) {
+        DeflateChannel *channel = &sampler->channels[i];
+        
+        if (!channel->in_use) {
+            if (found < 0) found = i;
+        } else if (channel->delta == delta && channel->params.window_bits == params->window_bits &&
+                   channel->params.takeover == params->takeover) {
+            found = i;
+            break;
+        }
+    }
+    if (found >= 0) {
+        DeflateChannel *channel = &sampler->channels[found];
+        
+        if (!channel->in_use) channel->claim++;
+        channel->in_use = 1;
+        channel->delta = delta;
+        channel->params = *params;
+        channel->members++;
+        channel->reset = 1;     /* New member needs a message it can decode on its own */
+    }
+    pthread_mutex_unlock(&sampler->lock);
+    return found;
+}
+
+void sampler_channel_leave(MetricsSampler *sampler, int index) {
+    DeflateChannel *channel = &sampler->channels[index];
+    
+    pthread_mutex_lock(&sampler->lock);
+    /* Free the slot for any parameter set; the sampler drops its stream when it sees the claim change */
+    if (--channel->members == 0) {
+        channel->in_use = 0;
+        channel->delta = 0;
+        memset(&channel->params, 0, sizeof(channel->params));
+    }
+    pthread_mutex_unlock(&sampler->lock);
+}
+
+/* Ask for the next message on a channel to be compressed from a clean state */
+void sampler_channel_reset(MetricsSampler *sampler, int index) {
+    pthread_mutex_lock(&sampler->lock);
+    sampler->channels[index].reset = 1;
+    pthread_mutex_unlock(&sampler->lock);
+}
+
+/*
+ * Shared top producer
+ *
+ * One supervised top (or hogs) child serves every /top subscriber. Its
+ * output is cut into chunks at the pauses between screens and kept in a
+ * ring of refcounted frames; each subscriber reads the ring at its own
+ * position. The child only runs while someone is subscribed and is
+ * restarted with backoff when it exits.
+ */
+
+#define TOP_RING_SIZE 64
+#define TOP_BURST_GAP_MS 250
+#define TOP_RESTART_MAX 30
+
+#define FRAME_SCREEN_START 0x2      /* Top chunk that begins a screen */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    MetricsFrame *ring[TOP_RING_SIZE];  /* Chunk seq s lives in ring[s % TOP_RING_SIZE] */
+    unsigned long next_seq;             /* Seq of the next chunk, starting at 1 */
+    unsigned long screen_seq;           /* First chunk of the last complete screen, 0 if none */
+    int subscribers;
+    pthread_t thread;
+} TopProducer;
+
+TopProducer top_producer;
+
+/* Fork a top child writing into a pipe, returns its pid or -1 */
+pid_t top_spawn(int *fd) {
+    int pipefd[2];
+    pid_t pid;
+    
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    
+    if (pid == 0) {
+        /* Child process: run top in batch mode */
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[1]);
+        
+        /* QNX top command - try different options */
+        execlp("top", "top", "-b", "-d", "1", NULL);
+        
+        /* Fallback to hogs if top doesn't work */
+        execlp("hogs", "hogs", "-i", "1", NULL);
+        
+        perror("execlp failed");
+        _exit(1);
+    }
+    
+    close(pipefd[1]);
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    *fd = pipefd[0];
+    return pid;
+}
+
+void top_kill(pid_t pid) {
+    kill(pid, SIGTERM);
+    if (waitpid(pid, NULL, WNOHANG) == 0) {
+        usleep(100000);
+        if (waitpid(pid, NULL, WNOHANG) == 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+    }
+}
+
+/* Append a chunk to the ring, returns its seq */
+unsigned long top_publish(TopProducer *top, const char *data, size_t len, int screen_start) {
+    MetricsFrame *frame = frame_create(data, len, 0);
+    MetricsFrame *old;
+    unsigned long seq;
+    
+    if (!frame) return 0;
+    if (screen_start) frame->flags |= FRAME_SCREEN_START;
+    
+    pthread_mutex_lock(&top->lock);
+    seq = top->next_seq++;
+    frame->seq = seq;
+    old = top->ring[seq % TOP_RING_SIZE];
+    top->ring[seq % TOP_RING_SIZE] = frame;
+    pthread_mutex_unlock(&top->lock);
+    
+    frame_release(old);
+    loops_notify();
+    return seq;
+}
+
+void top_screen_complete(TopProducer *top, unsigned long seq) {
+    pthread_mutex_lock(&top->lock);
+    if (seq) top->screen_seq = seq;
+    pthread_mutex_unlock(&top->lock);
+}
+
+/* Drop buffered output so later subscribers never see stale screens */
+void top_clear(TopProducer *top) {
+    MetricsFrame *old[TOP_RING_SIZE];
+    int i;
+    
+    pthread_mutex_lock(&top->lock);
+    memcpy(old, top->ring, sizeof(old));
+    memset(top->ring, 0, sizeof(top->ring));
+    top->screen_seq = 0;
+    pthread_mutex_unlock(&top->lock);
+    
+    for (i = 0; i < TOP_RING_SIZE; i++) frame_release(old[i]);
+}
+
+/* Producer thread: run top while anyone is subscribed and feed the ring */
+void* top_thread(void *arg) {
+    TopProducer *top = arg;
+    char *burst = malloc(BUFFER_SIZE);
+    int backoff = 1;
+    
+    if (!burst) {
+        perror("malloc");
+        return NULL;
+    }
+    
+    while (running) {
+        size_t burst_len = 0;
+        unsigned long screen = 0;
+        int screen_start = 1;
+        int idle = 0;
+        time_t started;
+        pid_t pid;
+        int fd = -1;
+        
+        pthread_mutex_lock(&top->lock);
+        while (running && top->subscribers == 0) {
+            pthread_cond_wait(&top->cond, &top->lock);
+        }
+        pthread_mutex_unlock(&top->lock);
+        if (!running) break;
+        
+        pid = top_spawn(&fd);
+        started = time(NULL);
+        if (pid > 0) log_message(LOG_INFO, "Started shared top producer (pid %d)", (int)pid);
+        
+        while (pid > 0 && running) {
+            struct pollfd pfd;
+            int ready, pause = 0, eof = 0;
+            
+            pthread_mutex_lock(&top->lock);
+            idle = top->subscribers == 0;
+            pthread_mutex_unlock(&top->lock);
+            if (idle) break;
+            
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            ready = poll(&pfd, 1, burst_len > 0 ? TOP_BURST_GAP_MS : 1000);
+            if (ready < 0 && errno == EINTR) continue;
+            
+            if (ready == 0) {
+                pause = 1;
+            } else {
+                ssize_t n = ready > 0 ? read(fd, burst + burst_len, BUFFER_SIZE - burst_len) : -1;
+                
+                if (n > 0) burst_len += (size_t)n;
+                else if (n == 0 || errno != EINTR) eof = 1;
+            }
+            
+            /* A pause or EOF ends the screen; a full buffer only ends the chunk */
+            if (burst_len > 0 && (pause || eof || burst_len == BUFFER_SIZE)) {
+                unsigned long seq = top_publish(top, burst, burst_len, screen_start);
+                
+                if (screen_start) screen = seq;
+                screen_start = pause || eof;
+                if (screen_start) top_screen_complete(top, screen);
+                burst_len = 0;
+            }
+            if (eof) break;
+        }
+        
+        if (pid > 0) {
+            close(fd);
+            top_kill(pid);
+        }
+        
+        if (!running) break;
+        if (idle) {
+            log_message(LOG_INFO, "Stopped shared top producer, no subscribers");
+            top_clear(top);
+            backoff = 1;
+            continue;
+        }
+        
+        /* The child died or could not start: retry, backing off if it keeps failing */
+        if (time(NULL) - started >= TOP_RESTART_MAX) backoff = 1;
+        log_message(LOG_ERROR, "top exited, restarting in %d seconds", backoff);
+        {
+            struct timespec deadline;
+            
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += backoff;
+            pthread_mutex_lock(&top->lock);
+            while (running && pthread_cond_timedwait(&top->cond, &top->lock, &deadline) != ETIMEDOUT) {
+            }
+            pthread_mutex_unlock(&top->lock);
+        }
+        backoff = backoff * 2 > TOP_RESTART_MAX ? TOP_RESTART_MAX : backoff * 2;
+    }
+    
+    free(burst);
+    return NULL;
+}
+
+int top_start(TopProducer *top) {
+    memset(top, 0, sizeof(*top));
+    top->next_seq = 1;
+    pthread_mutex_init(&top->lock, NULL);
+    pthread_cond_init(&top->cond, NULL);
+    
+    if (pthread_create(&top->thread, NULL, top_thread, top) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+void top_stop(TopProducer *top) {
+    pthread_mutex_lock(&top->lock);
+    pthread_cond_broadcast(&top->cond);
+    pthread_mutex_unlock(&top->lock);
+    pthread_join(top->thread, NULL);
+    top_clear(top);
+}
+
+void top_subscribe(TopProducer *top) {
+    pthread_mutex_lock(&top->lock);
+    top->subscribers++;
+    pthread_cond_broadcast(&top->cond);
+    pthread_mutex_unlock(&top->lock);
+}
+
+void top_unsubscribe(TopProducer *top) {
+    pthread_mutex_lock(&top->lock);
+    top->subscribers--;
+    pthread_mutex_unlock(&top->lock);
+}
+
+/* Web interface served on plain HTTP requests */
+const char html_page[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/html\r\n"
+    "Connection: close\r\n\r\n"
+    "<!DOCTYPE html>\n"
+    "<html>\n"
+    "<head>\n"
+    "    <title>QNX System Monitor</title>\n"
+    "    <meta charset='UTF-8'>\n"
+    "    <style>\n"
+    "        * { margin: 0; padding: 0; box-sizing: border-box; }\n"
+    "        body {\n"
+    "            background: linear-gradient(135deg, #1a1a2e 0%, #16213e 100%);\n"
+    "            color: #00ff88;\n"
+    "            font-family: 'Courier New', monospace;\n"
+    "            min-height: 100vh;\n"
+    "            padding: 20px;\n"
+    "        }\n"
+    "        .header {\n"
+    "            text-align: center;\n"
+    "            padding: 20px;\n"
+    "            border-bottom: 2px solid #00ff88;\n"
+    "            margin-bottom: 20px;\n"
+    "        }\n"
+    "        h1 { color: #00ffff; text-shadow: 0 0 10px #00ffff; }\n"
+    "        .nav {\n"
+    "            display: flex;\n"
+    "            justify-content: center;\n"
+    "            gap: 20px;\n"
+    "            margin: 20px 0;\n"
+    "            flex-wrap: wrap;\n"
+    "        }\n"
+    "        .nav button {\n"
+    "            background: #0a3d62;\n"
+    "            color: #00ff88;\n"
+    "            border: 1px solid #00ff88;\n"
+    "            padding: 10px 25px;\n"
+    "            font-family: 'Courier New', monospace;\n"
+    "            font-size: 14px;\n"
+    "            cursor: pointer;\n"
+    "            transition: all 0.3s;\n"
+    "        }\n"
+    "        .nav button:hover, .nav button.active {\n"
+    "            background: #00ff88;\n"
+    "            color: #1a1a2e;\n"
+    "        }\n"
+    "        .status {\n"
+    "            text-align: center;\n"
+    "            padding: 10px;\n"
+    "            margin-bottom: 10px;\n"
+    "        }\n"
+    "        .status.connected { color: #00ff88; }\n"
+    "        .status.disconnected { color: #ff4444; }\n"
+    "        .status.connecting { color: #ffff00; }\n"
+    "        #output {\n"
+    "            background: rgba(0, 0, 0, 0.7);\n"
+    "            border: 1px solid #00ff88;\n"
+    "            border-radius: 5px;\n"
+    "            padding: 15px;\n"
+    "            white-space: pre;\n"
+    "            overflow-x: auto;\n"
+    "            font-size: 12px;\n"
+    "            line-height: 1.4;\n"
+    "            min-height: 500px;\n"
+    "            max-height: 80vh;\n"
+    "            overflow-y: auto;\n"
+    "        }\n"
+    "        .legend {\n"
+    "            margin-top: 20px;\n"
+    "            padding: 15px;\n"
+    "            background: rgba(0, 0, 0, 0.5);\n"
+    "            border: 1px solid #444;\n"
+    "            border-radius: 5px;\n"
+    "        }\n"
+    "        .legend h3 { color: #00ffff; margin-bottom: 10px; }\n"
+    "    </style>\n"
+    "</head>\n"
+    "<body>\n"
+    "    <div class='header'>\n"
+    "        <h1>QNX NEUTRINO SYSTEM MONITOR</h1>\n"
+    "        <p>Real-time system metrics via WebSocket</p>\n"
+    "    </div>\n"
+    "    \n"
+    "    <div class='nav'>\n"
+    "        <button onclick=\"connect('/metrics')\" id='btn-metrics'>Standard Metrics</button>\n"
+    "        <button onclick=\"connect('/full')\" id='btn-full'>Full Metrics</button>\n"
+    "        <button onclick=\"connect('/top')\" id='btn-top'>Live Top</button>\n"
+    "        <button onclick=\"disconnect()\" id='btn-disconnect'>Stop</button>\n"
+    "    </div>\n"
+    "    \n"
+    "    <div class='status' id='status'>Click a button to start monitoring</div>\n"
+    "    <pre id='output'>Waiting for connection...</pre>\n"
+    "    \n"
+    "    <div class='legend'>\n"
+    "        <h3>Available Endpoints</h3>\n"
+    "        <p>/metrics - Standard system overview</p>\n"
+    "        <p>/full - Extended metrics (all data)</p>\n"
+    "        <p>/top - Continuous top output</p>\n"
+    "    </div>\n"
+    "    \n"
+    "    <script>\n"
+    "        var ws = null;\n"
+    "        var currentEndpoint = '';\n"
+    "        var sections = null;\n"
+    "        var generation = 0;\n"
+    "        \n"
+    "        /* Apply a keyframe, delta or section from the ?stream=1 stream; false if out of sync */\n"
+    "        function applyFrame(data) {\n"
+    "            var frame = JSON.parse(data);\n"
+    "            if (frame.type === 'key') {\n"
+    "                sections = frame.sections;\n"
+    "            } else if (frame.type === 'begin' || frame.type === 'section' || frame.type === 'end') {\n"
+    "                /* Show each section as soon as it arrives; the generation is complete at its end */\n"
+    "                if (!sections) sections = [];\n"
+    "                if (frame.type === 'begin') sections.length = frame.count;\n"
+    "                sections[frame.s] = frame.text;\n"
+    "                document.getElementById('output').textContent = sections.join('');\n"
+    "                if (frame.type !== 'end') return true;\n"
+    "            } else {\n"
+    "                if (!sections || frame.base !== generation || frame.count !== sections.length) return false;\n"
+    "                for (var i = 0; i < frame.changes.length; i++) {\n"
+    "                    var change = frame.changes[i];\n"
+    "                    var lines = sections[change.s].split('\\n');\n"
+    "                    lines.length = change.n;\n"
+    "                    for (var j = 0; j < change.l.length; j++) lines[change.l[j][0]] = change.l[j][1];\n"
+    "                    sections[change.s] = lines.join('\\n');\n"
+    "                }\n"
+    "            }\n"
+    "            generation = frame.gen;\n"
+    "            document.getElementById('output').textContent = sections.join('');\n"
+    "            return true;\n"
+    "        }\n"
+    "        \n"
+    "        function updateStatus(text, className) {\n"
+    "            var status = document.getElementById('status');\n"
+    "            status.textContent = text;\n"
+    "            status.className = 'status ' + className;\n"
+    "        }\n"
+    "        \n"
+    "        function setActiveButton(endpoint) {\n"
+    "            var buttons = document.querySelectorAll('.nav button');\n"
+    "            for (var i = 0; i < buttons.length; i++) {\n"
+    "                buttons[i].classList.remove('active');\n"
+    "            }\n"
+    "            if (endpoint === '/metrics') document.getElementById('btn-metrics').classList.add('active');\n"
+    "            else if (endpoint === '/full') document.getElementById('btn-full').classList.add('active');\n"
+    "            else if (endpoint === '/top') document.getElementById('btn-top').classList.add('active');\n"
+    "        }\n"
+    "        \n"
+    "        function connect(endpoint) {\n"
+    "            if (ws) ws.close();\n"
+    "            \n"
+    "            currentEndpoint = endpoint;\n"
+    "            setActiveButton(endpoint);\n"
+    "            updateStatus('Connecting to ' + endpoint + '...', 'connecting');\n"
+    "            document.getElementById('output').textContent = 'Connecting...';\n"
+    "            \n"
+    "            sections = null;\n"
+    "            var delta = endpoint !== '/top';\n"
+    "            ws = new WebSocket('ws://' + window.location.host + endpoint + (delta ? '?stream=1' : ''));\n"
+    "            \n"
+    "            ws.onopen = function() {\n"
+    "                updateStatus('Connected to ' + endpoint, 'connected');\n"
+    "            };\n"
+    "            \n"
+    "            ws.onmessage = function(event) {\n"
+    "                if (!delta) {\n"
+    "                    document.getElementById('output').textContent = event.data;\n"
+    "                } else if (!applyFrame(event.data)) {\n"
+    "                    connect(endpoint);\n"
+    "                }\n"
+    "            };\n"
+    "            \n"
+    "            ws.onerror = function(error) {\n"
+    "                updateStatus('Connection error', 'disconnected');\n"
+    "            };\n"
+    "            \n"
+    "            ws.onclose = function() {\n"
+    "                updateStatus('Disconnected', 'disconnected');\n"
+    "                setActiveButton('');\n"
+    "            };\n"
+    "        }\n"
+    "        \n"
+    "        function disconnect() {\n"
+    "            if (ws) {\n"
+    "                ws.close();\n"
+    "                ws = null;\n"
+    "            }\n"
+    "            setActiveButton('');\n"
+    "            updateStatus('Disconnected', 'disconnected');\n"
+    "            document.getElementById('output').textContent = 'Click a button to start';\n"
+    "        }\n"
+    "    </script>\n"
+    "</body>\n"
+    "</html>";
+
+/*
+ * Retain the latest frames into *frames. Returns 0, or -1 if there are none
+ * younger than max_age seconds (max_age < 0: any age).
+ */
+int sampler_latest(MetricsSampler *sampler, int max_age, SamplerFrames *frames) {
+    int found = 0;
+    int i;
+    
+    pthread_mutex_lock(&sampler->lock);
+    if (sampler->latest.text && (max_age < 0 || time(NULL) - sampler->latest.text->created <= max_age)) {
+        frames->text = frame_retain(sampler->latest.text);
+        frames->key = frame_retain(sampler->latest.key);
+        frames->delta = frame_retain(sampler->latest.delta);
+        frames->binary = frame_retain(sampler->latest.binary);
+        for (i = 0; i < MAX_DEFLATE_CHANNELS; i++) {
+            frames->deflated[i] = frame_retain(sampler->latest.deflated[i]);
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&sampler->lock);
+    return found ? 0 : -1;
+}
+
+/*
+ * Event-driven connection core
+ *
+ * A fixed set of loop threads (one by default, up to one per core) owns all
+ * sockets. Each loop multiplexes request reads, WebSocket upgrades, frame
+ * writes and idle timeouts through the metrics_event backend,
+ * so there is no thread or stack buffer per client.
+ */
+
+#define MAX_LOOPS 64
+#define MAX_EVENTS 128
+#define ACCEPT_BATCH 64
+#define REQUEST_MAX 8192
+#define SEND_QUEUE_MAX 8
+#define REQUEST_TIMEOUT 10
+#define SEND_TIMEOUT 30
+#define DEFAULT_MAX_CONNECTIONS 256
+#define WS_CLIENT_FRAME_MAX 4096    /* Larger client frames are refused with 1009 */
+#define WS_FRAGMENT_SIZE 16384      /* Messages with more payload go out in fragments of this size */
+#define WS_PING_INTERVAL 30         /* Seconds of client silence before a ping */
+#define WS_PONG_TIMEOUT 10          /* Seconds the client has to answer it */
+#define WS_CONTROL_MAX 2
+
+/* Close status codes (RFC 6455 section 7.4.1) */
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_TOO_BIG 1009
+
+enum { HANDLE_LISTENER, HANDLE_UNIX_LISTENER, HANDLE_WAKEUP, HANDLE_CLIENT };
+enum { CONN_READ_REQUEST, CONN_HTTP, CONN_WEBSOCKET };
+enum { ENDPOINT_ROOT, ENDPOINT_METRICS, ENDPOINT_FULL, ENDPOINT_TOP };
+
+/* Label for per-endpoint statistics; plain HTTP responses count as "http" */
+const char *endpoint_names[] = {"http", "metrics", "full", "top"};
+const char *endpoint_paths[] = {"/", "/metrics", "/full", "/top"};
+
+typedef struct Connection Connection;
+
+/* What a ready event refers to */
+typedef struct {
+    int type;
+    Connection *conn;
+} EventHandle;
+
+struct Connection {
+    int fd;
+    int state;
+    int endpoint;
+    int closed;
+    int close_after_write;
+    int delta;          /* Subscribed to the delta stream */
+    int stream;         /* Subscribed to the section stream, which falls back on the delta stream */
+    int binary;         /* Negotiated CBOR_PROTOCOL: CBOR snapshots instead of text */
+    int interest;
+    EventHandle handle;
+    char *request;      /* The request, then partial frames from the client once upgraded */
+    size_t request_len;
+    /* Outgoing frames, written in order; queue[queue_head] is partially sent */
+    MetricsFrame *queue[SEND_QUEUE_MAX];
+    int queue_head;
+    int queue_count;
+    size_t queue_offset;        /* Fragmented messages: payload bytes sent */
+    size_t fragment_sent;       /* Fragmented messages: header bytes of the current fragment sent */
+    /* Pongs and the close frame, sent between fragments of queue[queue_head] */
+    MetricsFrame *control[WS_CONTROL_MAX];
+    int control_count;
+    size_t control_offset;
+    int closing;                /* Close frame queued: no more data, disconnect once it is sent */
+    int message_open;           /* Client is in the middle of a fragmented message */
+    time_t last_heard;
+    time_t ping_sent;           /* Outstanding idle ping, 0 if none */
+    time_t last_progress;
+    unsigned long last_generation;
+    unsigned long long bytes_sent;
+    long long opened_us;        /* WebSocket handshake answered, for the access log */
+    /* permessage-deflate: shared channel, -1 when uncompressed */
+    int deflate_channel;
+    int deflate_takeover;
+    int deflate_synced;         /* Has every channel message up to deflate_seq */
+    unsigned long deflate_seq;
+    /* /top: next ring chunk to send; resync waits for a screen start */
+    unsigned long top_seq;
+    int top_resync;
+    /* Section stream: next ring message, and the generation being received (0: waiting for a begin) */
+    unsigned long stream_seq;
+    unsigned long stream_generation;
+    Connection *prev;
+    Connection *next;
+};
+
+typedef struct {
+    EventLoop *ev;
+    int wake_pipe[2];
+    int listen_fd;              /* Own SO_REUSEPORT socket, or the shared one */
+    EventHandle listener_handle;
+    EventHandle unix_handle;
+    EventHandle wakeup_handle;
+    Connection *connections;
+    Connection *dead;
+    char *read_buffer;
+    pthread_t thread;
+} ServerLoop;
+
+/* One TCP socket per loop when the kernel balances them, otherwise one shared */
+int listen_sockets[MAX_LOOPS];
+int num_listen_sockets = 0;
+int unix_socket = -1;
+const char *unix_path = NULL;
+int num_loops = 1;
+int max_connections = DEFAULT_MAX_CONNECTIONS;
+int active_connections = 0;
+ServerLoop loops[MAX_LOOPS];
+MetricsFrame *html_frame;
+MetricsFrame *not_found_frame;
+MetricsFrame *busy_frame;
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Wake every loop so it picks up newly published frames */
+void loops_notify(void) {
+    int i;
+    
+    for (i = 0; i < num_loops; i++) {
+        int fd = __atomic_load_n(&loops[i].wake_pipe[1], __ATOMIC_ACQUIRE);
+        
+        if (fd >= 0) {
+            ssize_t ignored = write(fd, "x", 1);
+            (void)ignored;  /* Pipe full means a wakeup is already pending */
+        }
+    }
+}
+
+void conn_update_interest(ServerLoop *loop, Connection *conn) {
+    int interest = EV_READ | (conn->queue_count > 0 || conn->control_count > 0 ? EV_WRITE : 0);
+    
+    if (conn->closed || interest == conn->interest) return;
+    if (ev_modify(loop->ev, conn->fd, interest, &conn->handle) == 0) {
+        conn->interest = interest;
+    }
+}
+
+void conn_close(ServerLoop *loop, Connection *conn) {
+    if (conn->closed) return;
+    conn->closed = 1;
+    
+    ev_remove(loop->ev, conn->fd);
+    close(conn->fd);
+    
+    if (conn->state == CONN_WEBSOCKET) {
+        stats_add(stat_connections, endpoint_names[conn->endpoint], -1);
+        stats_observe(stat_client_bytes, endpoint_names[conn->endpoint], (double)conn->bytes_sent);
+        /* A stream is logged once it ends, with everything it sent */
+        log_access("GET", endpoint_paths[conn->endpoint], 101, conn->bytes_sent,
+                   (unsigned long long)(monotonic_us() - conn->opened_us));
+    }
+    if (conn->state == CONN_WEBSOCKET && conn->endpoint == ENDPOINT_TOP) {
+        top_unsubscribe(&top_producer);
+        log_message(LOG_DEBUG, "Top monitoring client disconnected");
+    }
+    if (conn->state == CONN_WEBSOCKET &&
+        (conn->endpoint == ENDPOINT_METRICS || conn->endpoint == ENDPOINT_FULL)) {
+        sampler_unsubscribe(&samplers[conn->endpoint == ENDPOINT_FULL ? 1 : 0], conn->binary, conn->stream);
+        log_message(LOG_DEBUG, "Metrics client disconnected");
+    }
+    if (conn->deflate_channel >= 0) {
+        sampler_channel_leave(&samplers[conn->endpoint == ENDPOINT_FULL ? 1 : 0], conn->deflate_channel);
+        conn->deflate_channel = -1;
+    }
+    
+    stats_add(stat_send_queue, NULL, -conn->queue_count);
+    while (conn->queue_count > 0) {
+        frame_release(conn->queue[conn->queue_head]);
+        conn->queue_head = (conn->queue_head + 1) % SEND_QUEUE_MAX;
+        conn->queue_count--;
+    }
+    while (conn->control_count > 0) frame_release(conn->control[--conn->control_count]);
+    free(conn->request);
+    conn->request = NULL;
+    
+    /* Unlink now, free after the current event batch */
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    conn->next = loop->dead;
+    loop->dead = conn;
+    
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Queue a retained frame for sending. A droppable frame arriving at a full
+ * queue replaces the newest frame not yet started, so slow consumers skip
+ * ahead instead of growing memory. Returns -1 if the frame was dropped.
+ */
+int conn_push(Connection *conn, MetricsFrame *frame, int droppable) {
+    /* Nothing may follow a close frame */
+    if (conn->closing) {
+        frame_release(frame);
+        return -1;
+    }
+    if (conn->queue_count == SEND_QUEUE_MAX) {
+        int tail = (conn->queue_head + conn->queue_count - 1) % SEND_QUEUE_MAX;
+        
+        stats_add(stat_frames_dropped, endpoint_names[conn->endpoint], 1);
+        if (!droppable || conn->queue_count < 2) {
+            frame_release(frame);
+            return -1;
+        }
+        frame_release(conn->queue[tail]);
+        conn->queue[tail] = frame;
+        return 0;
+    }
+    
+    conn->queue[(conn->queue_head + conn->queue_count) % SEND_QUEUE_MAX] = frame;
+    conn->queue_count++;
+    stats_add(stat_send_queue, NULL, 1);
+    return 0;
+}
+
+/* Messages with more payload than WS_FRAGMENT_SIZE are written as several frames */
+int frame_fragmented(const MetricsFrame *frame) {
+    return frame->kind != FRAME_RAW && frame->len - frame->header_len > WS_FRAGMENT_SIZE;
+}
+
+/* Between two frames on the wire, where a control frame may go */
+int conn_at_boundary(const Connection *conn) {
+    if (conn->queue_count == 0) return 1;
+    if (conn->fragment_sent > 0) return 0;
+    return conn->queue_offset == 0 || frame_fragmented(conn->queue[conn->queue_head]);
+}
+
+/*
+ * Write what is left of the current fragment of a fragmented message. The
+ * first fragment keeps the message's opcode and RSV1, the others are
+ * continuations and the last one has FIN set.
+ */
+ssize_t conn_send_fragment(Connection *conn, const MetricsFrame *frame) {
+    const unsigned char *payload = frame->data + frame->header_len;
+    size_t payload_len = frame->len - frame->header_len;
+    size_t start = conn->queue_offset - conn->queue_offset % WS_FRAGMENT_SIZE;
+    size_t chunk = payload_len - start < WS_FRAGMENT_SIZE ? payload_len - start : WS_FRAGMENT_SIZE;
+    unsigned char header[14];
+    unsigned char first = start == 0 ? frame->data[0] & 0x7F : 0x00;
+    size_t header_len, header_left;
+    struct iovec iov[2];
+    int iovcnt = 0;
+    ssize_t n;
+    
+    if (start + chunk == payload_len) first |= 0x80;
+    header_len = websocket_frame_header(header, first, chunk);
+    header_left = header_len - conn->fragment_sent;
+    if (header_left > 0) {
+        iov[iovcnt].iov_base = header + conn->fragment_sent;
+        iov[iovcnt++].iov_len = header_left;
+    }
+    iov[iovcnt].iov_base = (void*)(payload + conn->queue_offset);
+    iov[iovcnt++].iov_len = start + chunk - conn->queue_offset;
+    
+    n = writev(conn->fd, iov, iovcnt);
+    if (n <= 0) return n;
+    if ((size_t)n < header_left) {
+        conn->fragment_sent += (size_t)n;
+        return n;
+    }
+    conn->fragment_sent = header_len;
+    conn->queue_offset += (size_t)n - header_left;
+    if (conn->queue_offset == start + chunk) conn->fragment_sent = 0;
+    return n;
+}
+
+/* Write as much queued data as the socket accepts; control frames go first at each frame boundary */
+void conn_flush(ServerLoop *loop, Connection *conn) {
+    while (!conn->closed && (conn->queue_count > 0 || conn->control_count > 0)) {
+        int control = conn->control_count > 0 && conn_at_boundary(conn);
+        MetricsFrame *frame = control ? conn->control[0] : conn->queue[conn->queue_head];
+        int fragmented = !control && frame_fragmented(frame);
+        ssize_t n;
+        
+        if (control) {
+            n = send(conn->fd, frame->data + conn->control_offset, frame->len - conn->control_offset, 0);
+        } else if (fragmented) {
+            n = conn_send_fragment(conn, frame);
+        } else {
+            n = send(conn->fd, frame->data + conn->queue_offset, frame->len - conn->queue_offset, 0);
+        }
+        
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_message(LOG_DEBUG, "Failed to send data, client disconnected");
+            conn_close(loop, conn);
+            return;
+        }
+        
+        conn->last_progress = time(NULL);
+        conn->bytes_sent += (unsigned long long)n;
+        stats_add(stat_bytes_sent, endpoint_names[conn->endpoint], n);
+        
+        if (control) {
+            conn->control_offset += (size_t)n;
+            if (conn->control_offset < frame->len) continue;
+            conn->control_offset = 0;
+            conn->control_count--;
+            memmove(conn->control, conn->control + 1, sizeof(MetricsFrame*) * (size_t)conn->control_count);
+            stats_add(stat_frames_sent, endpoint_names[conn->endpoint], 1);
+            /* Our close frame is out: the handshake is done from this side */
+            if ((frame->data[0] & 0x0F) == 0x8) {
+                frame_release(frame);
+                conn_close(loop, conn);
+                return;
+            }
+            frame_release(frame);
+            continue;
+        }
+        
+        if (!fragmented) conn->queue_offset += (size_t)n;
+        if (fragmented ? conn->queue_offset == frame->len - frame->header_len && conn->fragment_sent == 0
+                       : conn->queue_offset == frame->len) {
+            stats_add(stat_frames_sent, endpoint_names[conn->endpoint], 1);
+            stats_add(stat_send_queue, NULL, -1);
+            frame_release(frame);
+            conn->queue_head = (conn->queue_head + 1) % SEND_QUEUE_MAX;
+            conn->queue_count--;
+            conn->queue_offset = 0;
+        }
+    }
+    
+    if (conn->closed) return;
+    if (conn->queue_count == 0 && conn->close_after_write) {
+        conn_close(loop, conn);
+        return;
+    }
+    conn_update_interest(loop, conn);
+}
+
+/*
+ * Queue a control frame for the next frame boundary. A queued frame of the
+ * same opcode that has not started is replaced (only the latest ping needs
+ * a pong), and a full control queue gives up its newest entry.
+ */
+void conn_send_control(ServerLoop *loop, Connection *conn, int opcode, const void *payload, size_t len) {
+    MetricsFrame *frame;
+    int last = conn->control_count - 1;
+    
+    if (conn->closed || conn->closing) return;
+    frame = frame_create_message((unsigned char)(0x80 | opcode), payload, len, 0);
+    if (!frame) return;
+    
+    if (conn->control_count == WS_CONTROL_MAX ||
+        (last >= 0 && (conn->control[last]->data[0] & 0x0F) == opcode && (last > 0 || conn->control_offset == 0))) {
+        if ((conn->control[last]->data[0] & 0x0F) == 0x9) conn->ping_sent = 0;
+        frame_release(conn->control[last]);
+        conn->control[last] = frame;
+    } else {
+        conn->control[conn->control_count++] = frame;
+    }
+    if (opcode == 0x8) conn->closing = 1;
+    conn_flush(loop, conn);
+}
+
+/* Start the close handshake; the connection is dropped once the close frame is sent */
+void ws_close(ServerLoop *loop, Connection *conn, int code, const char *reason) {
+    unsigned char payload[2];
+    
+    if (conn->closed || conn->closing) return;
+    payload[0] = (unsigned char)(code >> 8);
+    payload[1] = (unsigned char)(code & 0xFF);
+    stats_add(stat_ws_closes, reason, 1);
+    conn_send_control(loop, conn, 0x8, payload, sizeof(payload));
+}
+
+/*
+ * Queue the frame for this generation. Delta clients get the delta when it
+ * applies to the last frame they were sent and there is room for it;
+ * otherwise they get the keyframe, which may replace a queued frame.
+ *
+ * Compressing clients get their channel's copy when it carries the same
+ * message. With context takeover a client that missed a channel message, or
+ * is about to lose one to a full queue, gets plain frames until the channel
+ * emits a reset point it can decode on its own.
+ */
+void conn_push_snapshot(ServerLoop *loop, Connection *conn, SamplerFrames *frames) {
+    int full = conn->queue_count == SEND_QUEUE_MAX;
+    MetricsFrame *wanted, *frame;
+    
+    /* Already has it, or the section stream is delivering a newer generation */
+    if (conn->last_generation >= frames->text->generation || conn->stream_generation != 0) return;
+    
+    /* Binary clients skip generations sampled before they subscribed */
+    if (conn->binary) {
+        if (!frames->binary) return;
+        conn_push(conn, frame_retain(frames->binary), 1);
+        conn->last_generation = frames->text->generation;
+        conn_flush(loop, conn);
+        return;
+    }
+    
+    if (!conn->delta) {
+        wanted = frames->text;
+    } else if (frames->delta && conn->last_generation == frames->delta->base_generation && !full) {
+        wanted = frames->delta;
+    } else {
+        wanted = frames->key;
+    }
+    frame = wanted;
+    
+    if (conn->deflate_channel >= 0) {
+        MetricsFrame *deflated = frames->deflated[conn->deflate_channel];
+        
+        if (full) conn->deflate_synced = 0;
+        if (deflated && deflated->kind == wanted->kind &&
+            ((deflated->flags & FRAME_DEFLATE_RESET) ||
+             (conn->deflate_synced && deflated->seq == conn->deflate_seq + 1))) {
+            frame = deflated;
+            conn->deflate_synced = 1;
+            conn->deflate_seq = deflated->seq;
+        } else if (conn->deflate_takeover) {
+            conn->deflate_synced = 0;
+            sampler_channel_reset(&samplers[conn->endpoint == ENDPOINT_FULL ? 1 : 0], conn->deflate_channel);
+        }
+    }
+    
+    conn_push(conn, frame_retain(frame), wanted != frames->delta);
+    conn->last_generation = frames->text->generation;
+    conn_flush(loop, conn);
+}
+
+/*
+ * Queue new top chunks for a subscriber. One that fell off the ring or has
+ * no queue room for what is pending skips to the last complete screen, or
+ * when even that does not fit, waits for the next screen to start.
+ */
+void conn_push_top(ServerLoop *loop, Connection *conn) {
+    TopProducer *top = &top_producer;
+    MetricsFrame *pending[SEND_QUEUE_MAX];
+    unsigned long room = (unsigned long)(SEND_QUEUE_MAX - conn->queue_count);
+    unsigned long oldest;
+    int count = 0, i;
+    
+    pthread_mutex_lock(&top->lock);
+    oldest = top->next_seq > TOP_RING_SIZE ? top->next_seq - TOP_RING_SIZE : 1;
+    if (conn->top_seq < oldest || top->next_seq - conn->top_seq > room) {
+        if (top->screen_seq >= oldest && top->screen_seq > conn->top_seq &&
+            top->next_seq - top->screen_seq <= room) {
+            conn->top_seq = top->screen_seq;
+            conn->top_resync = 0;
+        } else {
+            conn->top_seq = top->next_seq;
+            conn->top_resync = 1;
+        }
+    }
+    while (conn->top_seq < top->next_seq) {
+        MetricsFrame *frame = top->ring[conn->top_seq++ % TOP_RING_SIZE];
+        
+        if (!frame || (conn->top_resync && !(frame->flags & FRAME_SCREEN_START))) continue;
+        conn->top_resync = 0;
+        pending[count++] = frame_retain(frame);
+    }
+    pthread_mutex_unlock(&top->lock);
+    
+    for (i = 0; i < count; i++) conn_push(conn, pending[i], 0);
+    if (count > 0) conn_flush(loop, conn);
+}
+
+/*
+ * Queue section stream messages while the send queue has room; the rest
+ * waits in the ring until the socket drains. A client joins a generation
+ * at its begin message when it has the previous one, or at any generation
+ * that sends every section. One that lost its place skips the rest of the
+ * generation and catches up through the next keyframe or delta.
+ */
+void conn_push_stream(ServerLoop *loop, Connection *conn) {
+    MetricsSampler *sampler = &samplers[conn->endpoint == ENDPOINT_FULL ? 1 : 0];
+    
+    while (!conn->closed && !conn->closing) {
+        MetricsFrame *frame;
+        int lost = 0;
+        
+        if (conn->queue_count == SEND_QUEUE_MAX) {
+            conn_flush(loop, conn);
+            if (conn->closed || conn->queue_count == SEND_QUEUE_MAX) return;
+        }
+        
+        frame = sampler_stream_next(sampler, &conn->stream_seq, &lost);
+        if (lost) conn->stream_generation = 0;
+        if (!frame) break;
+        
+        if ((frame->flags & FRAME_STREAM_BEGIN) &&
+            (frame->generation == conn->last_generation + 1 || (frame->flags & FRAME_STREAM_ALL))) {
+            conn->stream_generation = frame->generation;
+        }
+        if (frame->generation != conn->stream_generation) {
+            frame_release(frame);
+            continue;
+        }
+        if (frame->flags & FRAME_STREAM_END) {
+            conn->last_generation = frame->generation;
+            conn->stream_generation = 0;
+        }
+        conn_push(conn, frame, 0);
+    }
+    conn_flush(loop, conn);
+}
+
+/* Access log line for a plain HTTP response, from the method and target on the request line */
+void log_response(const char *request, int status, size_t bytes, long long start_us) {
+    char method[8], path[96];
+    size_t method_len, path_len;
+    const char *target;
+    
+    if (!log_enabled(status >= 500 ? LOG_ERROR : LOG_INFO)) return;
+    method_len = strcspn(request, " \r\n");
+    if (method_len >= sizeof(method)) method_len = sizeof(method) - 1;
+    memcpy(method, request, method_len);
+    method[method_len] = '\0';
+    
+    target = request + strcspn(request, " \r\n");
+    if (*target == ' ') target++;
+    path_len = strcspn(target, " ?\r\n");
+    if (path_len >= sizeof(path)) path_len = sizeof(path) - 1;
+    memcpy(path, target, path_len);
+    path[path_len] = '\0';
+    
+    log_access(method, path, status, bytes, (unsigned long long)(monotonic_us() - start_us));
+}
+
+/* Route a complete request and queue the response */
+void handle_request(ServerLoop *loop, Connection *conn) {
+    char *request = conn->request;
+    int is_metrics, is_top, is_full, is_root;
+    char response[1024];
+    char extensions[192] = "";
+    int response_len;
+    MetricsFrame *frame;
+    SamplerFrames frames;
+    DeflateParams params;
+    size_t line_len = strcspn(request, "\r\n");
+    char line_end = request[line_len];
+    long long start_us = monotonic_us();
+    
+    /* Route handling */
+    is_metrics = (strstr(request, "GET /metrics") != NULL);
+    is_top = (strstr(request, "GET /top") != NULL);
+    is_full = (strstr(request, "GET /full") != NULL);
+    is_root = (strstr(request, "GET / ") != NULL) || (strstr(request, "GET / HTTP") != NULL);
+    
+    conn->state = CONN_HTTP;
+    
+    /* Exporter self-instrumentation in Prometheus text format */
+    if (strncmp(request, "GET /internal/metrics", 21) == 0) {
+        size_t body_len = 0;
+        char *body = stats_render(&body_len);
+        
+        if (body) {
+            frame = frame_create_http(200, "OK", "text/plain; version=0.0.4; charset=utf-8", body, body_len);
+            free(body);
+        } else {
+            frame = frame_create_http(500, "Error", "text/plain", "", 0);
+        }
+        if (frame) {
+            log_response(request, body ? 200 : 500, frame->len, start_us);
+            conn_push(conn, frame, 0);
+        }
+        conn->close_after_write = 1;
+        conn_flush(loop, conn);
+        return;
+    }
+    
+    /* Process table as JSON: /procs?sort=cpu|mem|pid|threads|name&top=N&name=&min_cpu=&min_mem= */
+    if (strncmp(request, "GET /procs", 10) == 0) {
+        const char *params = memchr(request, '?', line_len);
+        size_t body_len = 0;
+        char *body = procs_query_json(params ? params + 1 : "", PROCS_MAX_AGE_MS, &body_len);
+        
+        if (body) {
+            frame = frame_create_http(200, "OK", "application/json", body, body_len);
+            free(body);
+        } else {
+            const char *err = "{\"error\": \"process table unavailable\"}";
+            frame = frame_create_http(503, "Service Unavailable", "application/json", err, strlen(err));
+        }
+        if (frame) {
+            log_response(request, body ? 200 : 503, frame->len, start_us);
+            conn_push(conn, frame, 0);
+        }
+        conn->close_after_write = 1;
+        conn_flush(loop, conn);
+        return;
+    }
+    
+    if (!is_metrics && !is_top && !is_full && !is_root) {
+        log_response(request, 404, not_found_frame->len, start_us);
+        conn_push(conn, frame_retain(not_found_frame), 0);
+        conn->close_after_write = 1;
+        conn_flush(loop, conn);
+        return;
+    }
+    
+    /* Plain HTTP request: serve the HTML page */
+    if (strstr(request, "Upgrade: websocket") == NULL) {
+        log_response(request, 200, html_frame->len, start_us);
+        conn_push(conn, frame_retain(html_frame), 0);
+        conn->close_after_write = 1;
+        conn_flush(loop, conn);
+        return;
+    }
+    
+    /* ?delta=1 on the request line selects the keyframe + delta stream, ?stream=1 the section stream */
+    request[line_len] = '\0';
+    conn->delta = strstr(request, "delta=1") != NULL;
+    conn->stream = !is_top && strstr(request, "stream=1") != NULL;
+    request[line_len] = line_end;
+    conn->endpoint = is_top ? ENDPOINT_TOP : is_full ? ENDPOINT_FULL : ENDPOINT_METRICS;
+    
+    /* /metrics and /full may switch to CBOR snapshots, which are sent uncompressed */
+    if (!is_top && websocket_offers_protocol(request, CBOR_PROTOCOL)) {
+        conn->binary = 1;
+        conn->stream = 0;
+        snprintf(extensions, sizeof(extensions), "Sec-WebSocket-Protocol: %s\r\n", CBOR_PROTOCOL);
+    }
+    if (conn->stream) conn->delta = 1;
+    
+    /* Sampler streams may be compressed; /top output and the section stream stay uncompressed */
+    if (!is_top && !conn->binary && !conn->stream && websocket_negotiate_deflate(request, &params)) {
+        conn->deflate_channel = sampler_channel_join(&samplers[is_full ? 1 : 0], conn->delta, &params);
+        if (conn->deflate_channel >= 0) {
+            conn->deflate_takeover = params.takeover;
+            websocket_deflate_response(&params, extensions, sizeof(extensions));
+        }
+    }
+    
+    /* Perform WebSocket handshake */
+    response_len = websocket_handshake(request, extensions, response, sizeof(response));
+    frame = response_len > 0 ? frame_create_raw(response, (size_t)response_len) : NULL;
+    if (!frame) {
+        log_response(request, 400, 0, start_us);
+        conn_close(loop, conn);
+        return;
+    }
+    conn_push(conn, frame, 0);
+    conn->opened_us = start_us;
+    conn->last_heard = time(NULL);
+    
+    log_message(LOG_DEBUG, "WebSocket client connected, handshake complete%s",
+                conn->deflate_channel >= 0 ? " (permessage-deflate)" : "");
+    
+    free(conn->request);
+    conn->request = NULL;
+    
+    if (is_top) {
+        /* Handle /top endpoint with continuous streaming */
+        log_message(LOG_DEBUG, "Starting continuous top monitoring");
+        conn->state = CONN_WEBSOCKET;
+        stats_add(stat_connections, endpoint_names[conn->endpoint], 1);
+        top_subscribe(&top_producer);
+        conn_push_top(loop, conn);
+    } else {
+        /* Handle /metrics or /full by subscribing to the shared sampler */
+        MetricsSampler *sampler = &samplers[is_full ? 1 : 0];
+        
+        log_message(LOG_DEBUG, "Starting %s metrics monitoring%s", is_full ? "full" : "standard",
+                    conn->binary ? " (" CBOR_PROTOCOL ")" : conn->stream ? " (section stream)" :
+                    conn->delta ? " (delta frames)" : "");
+        conn->state = CONN_WEBSOCKET;
+        stats_add(stat_connections, endpoint_names[conn->endpoint], 1);
+        conn->stream_seq = sampler_subscribe(sampler, conn->binary, conn->stream);
+        
+        if (sampler_latest(sampler, 2 * budget_interval_ms(REFRESH_INTERVAL * 1000) / 1000, &frames) == 0) {
+            conn_push_snapshot(loop, conn, &frames);
+            frames_release(&frames);
+        }
+        if (conn->stream) conn_push_stream(loop, conn);
+    }
+    
+    conn_flush(loop, conn);
+}
+
+/* Status codes a peer may send in a close frame (RFC 6455 section 7.4) */
+int ws_close_code_valid(int code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+/*
+ * Handle one client frame at data. Returns the bytes it took, 0 while it is
+ * incomplete, or -1 once the connection is closing. Text and binary
+ * messages carry nothing the server acts on and are only validated.
+ */
+long ws_frame(ServerLoop *loop, Connection *conn, unsigned char *data, size_t avail) {
+    static const char *opcode_names[] = {"continuation", "text", "binary", "", "", "", "", "",
+                                         "close", "ping", "pong"};
+    unsigned long long len;
+    unsigned char *mask, *payload;
+    int fin, rsv, opcode;
+    size_t header = 2, i;
+    
+    if (avail < 2) return 0;
+    fin = data[0] & 0x80;
+    rsv = data[0] & 0x70;
+    opcode = data[0] & 0x0F;
+    len = data[1] & 0x7F;
+    if (len == 126) {
+        if (avail < 4) return 0;
+        len = ((unsigned long long)data[2] << 8) | data[3];
+        header = 4;
+    } else if (len == 127) {
+        if (avail < 10) return 0;
+        len = 0;
+        for (i = 0; i < 8; i++) len = (len << 8) | data[2 + i];
+        header = 10;
+    }
+    
+    /* Client frames are always masked */
+    if (!(data[1] & 0x80)) {
+        ws_close(loop, conn, WS_CLOSE_PROTOCOL, "protocol");
+        return -1;
+    }
+    if (len > WS_CLIENT_FRAME_MAX) {
+        ws_close(loop, conn, WS_CLOSE_TOO_BIG, "too_big");
+        return -1;
+    }
+    if (avail < header + 4 + len) return 0;
+    
+    mask = data + header;
+    payload = mask + 4;
+    for (i = 0; i < len; i++) payload[i] ^= mask[i & 3];
+    
+    if (opcode & 0x8) {
+        /* Control frames are never fragmented and carry at most 125 bytes */
+        if (opcode > 0xA || !fin || rsv || len > 125) {
+            ws_close(loop, conn, WS_CLOSE_PROTOCOL, "protocol");
+            return -1;
+        }
+    } else {
+        /*
+         * A continuation only inside a message and a new message only
+         * outside one; RSV1 marks a compressed message once deflate is on
+         */
+        if (opcode > 0x2 || (opcode == 0) != conn->message_open ||
+            (rsv & ~(opcode != 0 && conn->deflate_channel >= 0 ? 0x40 : 0))) {
+            ws_close(loop, conn, WS_CLOSE_PROTOCOL, "protocol");
+            return -1;
+        }
+        conn->message_open = !fin;
+    }
+    
+    /* Any frame shows the client is alive */
+    conn->ping_sent = 0;
+    stats_add(stat_ws_frames, opcode_names[opcode], 1);
+    
+    if (opcode == 0x8) {
+        int code = len >= 2 ? (payload[0] << 8) | payload[1] : WS_CLOSE_NORMAL;
+        
+        /* Answer with the same code, then hang up */
+        if (len == 1 || (len >= 2 && !ws_close_code_valid(code))) {
+            ws_close(loop, conn, WS_CLOSE_PROTOCOL, "protocol");
+        } else {
+            ws_close(loop, conn, code, "client");
+        }
+        return -1;
+    }
+    if (opcode == 0x9) conn_send_control(loop, conn, 0xA, payload, (size_t)len);
+    return (long)(header + 4 + len);
+}
+
+/* Read client frames on an upgraded connection */
+void ws_read(ServerLoop *loop, Connection *conn) {
+    size_t offset = 0;
+    ssize_t n;
+    
+    if (!conn->request) {
+        conn->request = malloc(REQUEST_MAX + 1);
+        conn->request_len = 0;
+        if (!conn->request) {
+            conn_close(loop, conn);
+            return;
+        }
+    }
+    
+    n = recv(conn->fd, conn->request + conn->request_len, REQUEST_MAX - conn->request_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        conn_close(loop, conn);
+        return;
+    }
+    conn->request_len += (size_t)n;
+    conn->last_heard = time(NULL);
+    
+    while (!conn->closed && !conn->closing) {
+        long used = ws_frame(loop, conn, (unsigned char*)conn->request + offset, conn->request_len - offset);
+        
+        if (used <= 0) break;
+        offset += (size_t)used;
+    }
+    if (conn->closed) return;
+    
+    /* Once closing, whatever else the client sends is dropped */
+    if (conn->closing) offset = conn->request_len;
+    memmove(conn->request, conn->request + offset, conn->request_len - offset);
+    conn->request_len -= offset;
+}
+
+void conn_read(ServerLoop *loop, Connection *conn) {
+    ssize_t n;
+    
+    if (conn->state == CONN_WEBSOCKET) {
+        ws_read(loop, conn);
+        return;
+    }
+    if (conn->state != CONN_READ_REQUEST) {
+        /* Nothing is expected from the client; only watch for disconnects */
+        n = recv(conn->fd, loop->read_buffer, BUFFER_SIZE, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn_close(loop, conn);
+        }
+        return;
+    }
+    
+    if (!conn->request) {
+        conn->request = malloc(REQUEST_MAX + 1);
+        if (!conn->request) {
+            conn_close(loop, conn);
+            return;
+        }
+    }
+    
+    n = recv(conn->fd, conn->request + conn->request_len, REQUEST_MAX - conn->request_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        conn_close(loop, conn);
+        return;
+    }
+    
+    conn->request_len += (size_t)n;
+    conn->request[conn->request_len] = '\0';
+    conn->last_progress = time(NULL);
+    
+    if (strstr(conn->request, "\r\n\r\n") != NULL) {
+        handle_request(loop, conn);
+    } else if (conn->request_len == REQUEST_MAX) {
+        /* Request headers too large */
+        conn_close(loop, conn);
+    }
+}
+
+void loop_accept(ServerLoop *loop, int listen_fd) {
+    int i;
+    
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        Connection *conn;
+        int client_socket;
+        
+        client_socket = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
+        if (client_socket == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && running) perror("accept");
+            return;
+        }
+        
+        stats_add(stat_accepted, NULL, 1);
+        if (__atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED) > max_connections) {
+            /* Over the connection limit: best-effort 503 and close */
+            stats_add(stat_rejected, NULL, 1);
+            ssize_t ignored = send(client_socket, busy_frame->data, busy_frame->len, 0);
+            (void)ignored;
+            close(client_socket);
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        
+        if (log_enabled(LOG_DEBUG) && client_addr.ss_family == AF_INET) {
+            struct sockaddr_in *peer = (struct sockaddr_in*)&client_addr;
+            char address[INET_ADDRSTRLEN];
+            
+            inet_ntop(AF_INET, &peer->sin_addr, address, sizeof(address));
+            log_message(LOG_DEBUG, "New connection from %s:%d", address, ntohs(peer->sin_port));
+        } else if (log_enabled(LOG_DEBUG)) {
+            log_message(LOG_DEBUG, "New connection on %s", unix_path);
+        }
+        
+        conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            close(client_socket);
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        set_nonblocking(client_socket);
+        conn->fd = client_socket;
+        conn->state = CONN_READ_REQUEST;
+        conn->deflate_channel = -1;
+        conn->last_progress = time(NULL);
+        conn->interest = EV_READ;
+        conn->handle.type = HANDLE_CLIENT;
+        conn->handle.conn = conn;
+        
+        if (ev_add(loop->ev, client_socket, EV_READ, &conn->handle) < 0) {
+            perror("ev_add");
+            close(client_socket);
+            free(conn);
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        
+        conn->next = loop->connections;
+        if (loop->connections) loop->connections->prev = conn;
+        loop->connections = conn;
+    }
+}
+
+/* Hand the latest sampler frames and top chunks to this loop's subscribers */
+void loop_wakeup(ServerLoop *loop) {
+    char drain[64];
+    Connection *conn, *next;
+    int view;
+    
+    while (read(loop->wake_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+    
+    for (view = 0; view < 2; view++) {
+        SamplerFrames frames;
+        int endpoint = view ? ENDPOINT_FULL : ENDPOINT_METRICS;
+        int latest = sampler_latest(&samplers[view], -1, &frames) == 0;
+        
+        for (conn = loop->connections; conn; conn = next) {
+            next = conn->next;
+            if (conn->state != CONN_WEBSOCKET || conn->endpoint != endpoint) continue;
+            /* Stream first, so a client that just completed a generation is not sent it again */
+            if (conn->stream) conn_push_stream(loop, conn);
+            if (latest && !conn->closed) conn_push_snapshot(loop, conn, &frames);
+        }
+        if (latest) frames_release(&frames);
+    }
+    
+    for (conn = loop->connections; conn; conn = next) {
+        next = conn->next;
+        if (conn->state == CONN_WEBSOCKET && conn->endpoint == ENDPOINT_TOP) {
+            conn_push_top(loop, conn);
+        }
+    }
+}
+
+/* Drop clients that never finished their request, stopped reading or stopped answering pings */
+void loop_timeouts(ServerLoop *loop) {
+    time_t now = time(NULL);
+    Connection *conn, *next;
+    
+    for (conn = loop->connections; conn; conn = next) {
+        next = conn->next;
+        if (conn->state == CONN_READ_REQUEST && now - conn->last_progress > REQUEST_TIMEOUT) {
+            conn_close(loop, conn);
+        } else if (conn->queue_count > 0 && now - conn->last_progress > SEND_TIMEOUT) {
+            log_message(LOG_INFO, "Dropping slow client");
+            stats_add(stat_slow_clients, NULL, 1);
+            conn_close(loop, conn);
+        } else if (conn->state == CONN_WEBSOCKET && !conn->closing) {
+            if (conn->ping_sent && now - conn->ping_sent > WS_PONG_TIMEOUT) {
+                log_message(LOG_INFO, "Dropping client that did not answer a ping");
+                stats_add(stat_ws_closes, "timeout", 1);
+                conn_close(loop, conn);
+            } else if (!conn->ping_sent && now - conn->last_heard >= WS_PING_INTERVAL) {
+                conn->ping_sent = now;
+                conn_send_control(loop, conn, 0x9, "", 0);
+            }
+        }
+    }
+}
+
+void* loop_thread(void *arg) {
+    ServerLoop *loop = arg;
+    EventResult events[MAX_EVENTS];
+    Connection *client, *next;
+    time_t last_sweep = time(NULL);
+    
+    while (running) {
+        int n = ev_wait(loop->ev, events, MAX_EVENTS, 1000);
+        int i;
+        
+        if (n < 0) {
+            perror("ev_wait");
+            break;
+        }
+        
+        for (i = 0; i < n; i++) {
+            EventHandle *handle = events[i].ptr;
+            Connection *conn = handle->conn;
+            
+            switch (handle->type) {
+            case HANDLE_LISTENER:
+                loop_accept(loop, loop->listen_fd);
+                break;
+            case HANDLE_UNIX_LISTENER:
+                loop_accept(loop, unix_socket);
+                break;
+            case HANDLE_WAKEUP:
+                loop_wakeup(loop);
+                break;
+            case HANDLE_CLIENT:
+                if (conn->closed) break;
+                if (events[i].events & EV_WRITE) {
+                    conn_flush(loop, conn);
+                    /* Room again: take what waited in the section stream */
+                    if (!conn->closed && conn->stream) conn_push_stream(loop, conn);
+                }
+                if (!conn->closed && (events[i].events & EV_READ)) conn_read(loop, conn);
+                break;
+            }
+        }
+        
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            loop_timeouts(loop);
+        }
+        
+        while (loop->dead) {
+            Connection *conn = loop->dead;
+            loop->dead = conn->next;
+            free(conn);
+        }
+    }
+    
+    /* Say goodbye where the socket takes it right away */
+    for (client = loop->connections; client; client = next) {
+        next = client->next;
+        if (client->state == CONN_WEBSOCKET) ws_close(loop, client, WS_CLOSE_GOING_AWAY, "shutdown");
+    }
+    while (loop->connections) conn_close(loop, loop->connections);
+    while (loop->dead) {
+        Connection *conn = loop->dead;
+        loop->dead = conn->next;
+        free(conn);
+    }
+    return NULL;
+}
+
+int loop_init(ServerLoop *loop, int listen_fd) {
+    memset(loop, 0, sizeof(*loop));
+    loop->wake_pipe[0] = loop->wake_pipe[1] = -1;
+    loop->listen_fd = listen_fd;
+    
+    loop->ev = ev_create();
+    loop->read_buffer = malloc(BUFFER_SIZE);
+    if (!loop->ev || !loop->read_buffer || pipe(loop->wake_pipe) == -1) {
+        perror("loop_init");
+        return -1;
+    }
+    set_nonblocking(loop->wake_pipe[0]);
+    set_nonblocking(loop->wake_pipe[1]);
+    
+    loop->listener_handle.type = HANDLE_LISTENER;
+    loop->unix_handle.type = HANDLE_UNIX_LISTENER;
+    loop->wakeup_handle.type = HANDLE_WAKEUP;
+    if (ev_add(loop->ev, listen_fd, EV_READ, &loop->listener_handle) < 0 ||
+        ev_add(loop->ev, loop->wake_pipe[0], EV_READ, &loop->wakeup_handle) < 0 ||
+        (unix_socket >= 0 && ev_add(loop->ev, unix_socket, EV_READ, &loop->unix_handle) < 0)) {
+        perror("ev_add");
+        return -1;
+    }
+    return 0;
+}
+
+void close_listeners(void) {
+    int i;
+    
+    for (i = 0; i < num_listen_sockets; i++) close(listen_sockets[i]);
+    num_listen_sockets = 0;
+    if (unix_socket >= 0) {
+        close(unix_socket);
+        unlink(unix_path);
+        unix_socket = -1;
+    }
+}
+
+void loop_destroy(ServerLoop *loop) {
+    int read_fd = __atomic_exchange_n(&loop->wake_pipe[0], -1, __ATOMIC_ACQ_REL);
+    int write_fd = __atomic_exchange_n(&loop->wake_pipe[1], -1, __ATOMIC_ACQ_REL);
+    
+    ev_destroy(loop->ev);
+    free(loop->read_buffer);
+    if (read_fd >= 0) close(read_fd);
+    if (write_fd >= 0) close(write_fd);
+}
+
+long long stats_active_connections(void) {
+    return __atomic_load_n(&active_connections, __ATOMIC_RELAXED);
+}
+
+/* Create the /internal/metrics families; must run before any thread starts */
+void server_stats_init(void) {
+    stat_command_seconds = stats_histogram("qnx_exporter_command_duration_seconds",
+        "Time to refresh a qnx_commands section", "command", MAX_SECTIONS,
+        stats_seconds_buckets, stats_seconds_buckets_count);
+    stat_command_timeouts = stats_family(STATS_COUNTER, "qnx_exporter_command_timeouts_total",
+        "Section commands killed for exceeding -T", "command", MAX_SECTIONS);
+    stat_snapshot_seconds = stats_histogram("qnx_exporter_snapshot_build_seconds",
+        "Time to collect one snapshot", "view", 2, stats_seconds_buckets, stats_seconds_buckets_count);
+    stat_snapshot_bytes = stats_family(STATS_GAUGE, "qnx_exporter_snapshot_bytes",
+        "Size of the latest text snapshot", "view", 2);
+    stat_frames_sent = stats_family(STATS_COUNTER, "qnx_exporter_frames_sent_total",
+        "Frames and HTTP responses written to clients", "endpoint", 4);
+    stat_bytes_sent = stats_family(STATS_COUNTER, "qnx_exporter_bytes_sent_total",
+        "Bytes written to clients", "endpoint", 4);
+    stat_frames_dropped = stats_family(STATS_COUNTER, "qnx_exporter_frames_dropped_total",
+        "Frames dropped or replaced because a client's send queue was full", "endpoint", 4);
+    stat_client_bytes = stats_histogram("qnx_exporter_client_sent_bytes",
+        "Bytes sent to each WebSocket client over its lifetime", "endpoint", 4,
+        stats_bytes_buckets, stats_bytes_buckets_count);
+    stat_send_queue = stats_family(STATS_GAUGE, "qnx_exporter_send_queue_frames",
+        "Frames waiting in client send queues", NULL, 0);
+    stat_connections = stats_family(STATS_GAUGE, "qnx_exporter_websocket_clients",
+        "Connected WebSocket clients", "endpoint", 4);
+    stat_accepted = stats_family(STATS_COUNTER, "qnx_exporter_connections_accepted_total",
+        "Connections accepted", NULL, 0);
+    stat_rejected = stats_family(STATS_COUNTER, "qnx_exporter_connections_rejected_total",
+        "Connections refused over the -c limit", NULL, 0);
+    stat_slow_clients = stats_family(STATS_COUNTER, "qnx_exporter_slow_clients_total",
+        "Clients dropped for not reading", NULL, 0);
+    stat_ws_frames = stats_family(STATS_COUNTER, "qnx_exporter_websocket_frames_received_total",
+        "Frames received from WebSocket clients", "opcode", 6);
+    stat_ws_closes = stats_family(STATS_COUNTER, "qnx_exporter_websocket_closes_total",
+        "WebSocket connections ended by a close handshake, a protocol error, an unanswered ping or shutdown",
+        "reason", 5);
+    stats_gauge_func("qnx_exporter_connections", "Open connections", stats_active_connections);
+}
+
+int main(int argc, char *argv[]) {
+    int port = PORT;
+    int backlog = LISTEN_DEFAULT_BACKLOG;
+    int balanced;
+    const char *bus_name = NULL;
+    int bus_publisher = 0;
+    int log_level = LOG_INFO;
+    int log_sample = 1;
+    double cpu_budget = 0;
+    int i;
+    const char *not_found = "HTTP/1.1 404 Not Found\r\n\r\n";
+    const char *busy =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: 2\r\n"
+        "Connection: close\r\n\r\n";
     
     /* Parse command line arguments */
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
             port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            native_disabled = 1;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            num_loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            max_connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            bus_name = argv[++i];
+            bus_publisher = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            bus_name = argv[++i];
+            bus_publisher = 0;
+        } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            log_level = log_parse_level(argv[++i]);
+            if (log_level < 0) {
+                fprintf(stderr, "Unknown log level: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            log_sample = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            cpu_budget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+            deflate_level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            deflate_window_bits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-Z") == 0) {
+            deflate_context_takeover = 0;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            section_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            command_timeout_ms = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             printf("QNX System Monitor WebSocket Server\n\n");
             printf("Usage: %s [options]\n\n", argv[0]);
             printf("Options:\n");
             printf("  -p PORT    Listen on specified port (default: %d)\n", PORT);
+            printf("  -t N       Event loop threads, 0 = one per core (default: 1)\n");
+            printf("  -c N       Maximum concurrent connections (default: %d)\n", DEFAULT_MAX_CONNECTIONS);
+            printf("  -b N       Listen backlog of each socket (default: %d)\n", LISTEN_DEFAULT_BACKLOG);
+            printf("  -u PATH    Also listen on a Unix socket, for local clients and proxies\n");
+            printf("  -z LEVEL   permessage-deflate level 1-9, 0 = off (default: %d)\n", DEFAULT_DEFLATE_LEVEL);
+            printf("  -w BITS    permessage-deflate window bits 9-15 (default: 15)\n");
+            printf("  -Z         Disable deflate context takeover\n");
+            printf("  -j N       Sections collected in parallel, 0 = sequential (default: %d)\n", DEFAULT_SECTION_WORKERS);
+            printf("  -T MS      Kill section commands after MS milliseconds, 0 = never (default: %d)\n",
+                   DEFAULT_COMMAND_TIMEOUT_MS);
+            printf("  -n         Run shell commands instead of native collectors\n");
+            printf("  -P NAME    Collect for every exporter on the node: publish to shared memory NAME\n");
+            printf("  -s NAME    Read system data from the exporter publishing to NAME\n");
+            printf("  -v LEVEL   Log level: off, error, info (every request), debug (connections) (default: info)\n");
+            printf("  -S N       Log 1 in N requests below 500 (default: 1, every request)\n");
+            printf("  -B PERCENT CPU budget in percent of one core: refresh less often, then pause\n"
+                   "             full-view extras while over it (default: 0, no budget)\n");
             printf("  -h         Show this help message\n\n");
             printf("Endpoints:\n");
             printf("  /          Web interface\n");
             printf("  /metrics   Standard system metrics (WebSocket)\n");
             printf("  /full      Extended metrics (WebSocket)\n");
+            printf("             ?delta=1: keyframes and deltas; ?stream=1: each section as soon as it is collected\n");
             printf("  /top       Continuous top output (WebSocket)\n");
             return 0;
         }
     }
     
+    if (num_loops <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_loops = cores > 0 ? (int)cores : 1;
+    }
+    if (num_loops > MAX_LOOPS) num_loops = MAX_LOOPS;
+    if (max_connections <= 0) max_connections = DEFAULT_MAX_CONNECTIONS;
+    if (backlog < 1) backlog = 1;
+    if (deflate_level > 9) deflate_level = 9;
+    if (deflate_window_bits < 9) deflate_window_bits = 9;
+    if (deflate_window_bits > 15) deflate_window_bits = 15;
+    
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
     
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("socket");
-        return 1;
+    /* With several loops and a balancing kernel each loop accepts on its own socket */
+    balanced = num_loops > 1 && listen_balanced();
+    for (i = 0; i < (balanced ? num_loops : 1); i++) {
+        listen_sockets[i] = listen_tcp(port, backlog, balanced);
+        if (listen_sockets[i] == -1) {
+            close_listeners();
+            return 1;
+        }
+        set_nonblocking(listen_sockets[i]);
+        num_listen_sockets++;
+    }
+    if (unix_path) {
+        unix_socket = listen_unix(unix_path, backlog);
+        if (unix_socket == -1) {
+            close_listeners();
+            return 1;
+        }
+        set_nonblocking(unix_socket);
     }
     
-    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    html_frame = frame_create_raw(html_page, strlen(html_page));
+    not_found_frame = frame_create_raw(not_found, strlen(not_found));
+    busy_frame = frame_create_raw(busy, strlen(busy));
+    if (!html_frame || !not_found_frame || !busy_frame) {
+        perror("malloc");
+        close_listeners();
+        return 1;
+    }
     
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    for (i = 0; i < num_loops; i++) {
+        if (loop_init(&loops[i], listen_sockets[balanced ? i : 0]) < 0) {
+            close_listeners();
+            return 1;
+        }
+    }
     
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("bind");
-        close(server_socket);
+    server_stats_init();
+    budget_init(cpu_budget, REFRESH_INTERVAL * 1000);
+    if (log_start(log_level, log_sample) != 0) {
+        close_listeners();
+        return 1;
+    }
+    if (bus_name && ((bus_publisher && bus_publish_start(bus_name, BUS_DEFAULT_INTERVAL_MS) != 0) ||
+                     bus_attach(bus_name) != 0)) {
+        close_listeners();
+        return 1;
+    }
+    section_pool = exec_pool_create(section_workers);
+    if (!section_pool || section_cache_init() < 0) {
+        perror("exec_pool_create");
+        close_listeners();
         return 1;
     }
     
-    if (listen(server_socket, 10) == -1) {
-        perror("listen");
-        close(server_socket);
+    if (sampler_start(&samplers[0], 0) < 0 || sampler_start(&samplers[1], 1) < 0 ||
+        top_start(&top_producer) < 0) {
+        close_listeners();
         return 1;
     }
     
@@ -660,42 +3121,47 @@ int main(int argc, char *argv[]) {
     printf("  Metrics WS:     ws://localhost:%d/metrics\n", port);
     printf("  Full Metrics:   ws://localhost:%d/full\n", port);
     printf("  Live Top:       ws://localhost:%d/top\n", port);
+    printf("  Internal:       http://localhost:%d/internal/metrics\n", port);
+    printf("  Collectors:     %s\n", native_disabled ? "shell commands" : collect_backend_name());
+    printf("  Sections:       %d workers, %d ms command timeout\n", section_workers > 0 ? section_workers : 0,
+           command_timeout_ms);
+    printf("  Event loops:    %d (%s), max %d connections\n", num_loops, ev_backend_name(), max_connections);
+    printf("  Listening:      %d TCP socket(s)%s, backlog %d\n", num_listen_sockets,
+           balanced ? " (SO_REUSEPORT)" : "", backlog);
+    if (unix_path) printf("  Unix socket:    %s\n", unix_path);
+    if (bus_name) printf("  Snapshot bus:   %s %s\n", bus_publisher ? "publishing to" : "reading from", bus_name);
+    printf("  Log:            %s", log_level_name(log_level));
+    if (log_sample > 1) printf(", 1 in %d requests", log_sample);
+    printf("\n");
+    if (cpu_budget > 0) printf("  CPU budget:     %g%% of one core\n", cpu_budget);
+    if (deflate_level > 0) {
+        printf("  Compression:    permessage-deflate level %d, %d bit window%s\n", deflate_level,
+               deflate_window_bits, deflate_context_takeover ? "" : ", no context takeover");
+    } else {
+        printf("  Compression:    off\n");
+    }
     printf("======================================================\n");
     
-    while (running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_socket;
-        int *client_sock_ptr;
-        pthread_t thread;
-        
-        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket == -1) {
-            if (running) perror("accept");
-            continue;
-        }
-        
-        printf("New connection from %s:%d\n", 
-               inet_ntoa(client_addr.sin_addr), 
-               ntohs(client_addr.sin_port));
-        
-        client_sock_ptr = malloc(sizeof(int));
-        if (!client_sock_ptr) {
-            close(client_socket);
-            continue;
-        }
-        *client_sock_ptr = client_socket;
-        
-        if (pthread_create(&thread, NULL, handle_client, client_sock_ptr) != 0) {
+    for (i = 0; i < num_loops; i++) {
+        if (pthread_create(&loops[i].thread, NULL, loop_thread, &loops[i]) != 0) {
             perror("pthread_create");
-            free(client_sock_ptr);
-            close(client_socket);
-            continue;
+            running = 0;
+            num_loops = i;
+            break;
         }
-        pthread_detach(thread);
     }
     
-    close(server_socket);
+    for (i = 0; i < num_loops; i++) pthread_join(loops[i].thread, NULL);
+    
+    close_listeners();
+    /* The producers and section workers wake the loops; stop them before the wake pipes go */
+    sampler_stop(&samplers[0]);
+    sampler_stop(&samplers[1]);
+    top_stop(&top_producer);
+    bus_publish_stop();
+    exec_pool_destroy(section_pool);
+    for (i = 0; i < num_loops; i++) loop_destroy(&loops[i]);
+    log_stop();
     printf("\nServer shut down\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "metrics_stats.h"
+#include "metrics_writer.h"
+
+#define STATS_MAX_GAUGE_FUNCS 16
+
+const double stats_seconds_buckets[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+const int stats_seconds_buckets_count = sizeof(stats_seconds_buckets) / sizeof(stats_seconds_buckets[0]);
+const double stats_bytes_buckets[] = {1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+const int stats_bytes_buckets_count = sizeof(stats_bytes_buckets) / sizeof(stats_bytes_buckets[0]);
+
+typedef struct {
+    const char *label;          /* NULL until claimed */
+    long long value;            /* Counter or gauge */
+    unsigned long long buckets[STATS_MAX_BUCKETS + 1];     /* Per bucket, last is +Inf */
+    unsigned long long sum_micros;
+} StatsSlot;
+
+struct StatsFamily {
+    int type;
+    const char *name;
+    const char *help;
+    const char *label_name;
+    const double *bounds;
+    int bounds_count;
+    int slots_count;
+    StatsSlot *slots;           /* slots_count + 1, the last collects "other" */
+    StatsFamily *next;
+};
+
+typedef struct {
+    const char *name;
+    const char *help;
+    long long (*read)(void);
+} GaugeFunc;
+
+/* Only modified at startup */
+static StatsFamily *families = NULL;
+static StatsFamily **families_tail = &families;
+static GaugeFunc gauge_funcs[STATS_MAX_GAUGE_FUNCS];
+static int gauge_funcs_count = 0;
+
+StatsFamily* stats_family(int type, const char *name, const char *help, const char *label, int slots) {
+    StatsFamily *family = calloc(1, sizeof(StatsFamily));
+    
+    if (!family) return NULL;
+    family->type = type;
+    family->name = name;
+    family->help = help;
+    family->label_name = label;
+    family->slots_count = label ? (slots > 0 ? slots : 1) : 1;
+    family->slots = calloc((size_t)family->slots_count + 1, sizeof(StatsSlot));
+    if (!family->slots) {
+        free(family);
+        return NULL;
+    }
+    
+    *families_tail = family;
+    families_tail = &family->next;
+    return family;
+}
+
+StatsFamily* stats_histogram(const char *name, const char *help, const char *label, int slots,
+                             const double *bounds, int bounds_count) {
+    StatsFamily *family = stats_family(STATS_HISTOGRAM, name, help, label, slots);
+    
+    if (!family) return NULL;
+    family->bounds = bounds;
+    family->bounds_count = bounds_count < STATS_MAX_BUCKETS ? bounds_count : STATS_MAX_BUCKETS;
+    return family;
+}
+
+void stats_gauge_func(const char *name, const char *help, long long (*read)(void)) {
+    if (gauge_funcs_count == STATS_MAX_GAUGE_FUNCS) return;
+    gauge_funcs[gauge_funcs_count].name = name;
+    gauge_funcs[gauge_funcs_count].help = help;
+    gauge_funcs[gauge_funcs_count].read = read;
+    gauge_funcs_count++;
+}
+
+/* Slot for a label value, claiming a free one on first use */
+static StatsSlot* stats_slot(StatsFamily *family, const char *label) {
+    int i;
+    
+    if (!family->label_name) return &family->slots[0];
+    if (!label) label = "";
+    
+    for (i = 0; i < family->slots_count; i++) {
+        StatsSlot *slot = &family->slots[i];
+        const char *current = __atomic_load_n(&slot->label, __ATOMIC_ACQUIRE);
+        
+        if (!current) {
+            const char *expected = NULL;
+            if (__atomic_compare_exchange_n(&slot->label, &expected, label, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return slot;
+            }
+            current = expected;
+        }
+        if (current == label || strcmp(current, label) == 0) return slot;
+    }
+    return &family->slots[family->slots_count];
+}
+
+void stats_add(StatsFamily *family, const char *label, long long delta) {
+    if (!family) return;
+    __atomic_add_fetch(&stats_slot(family, label)->value, delta, __ATOMIC_RELAXED);
+}
+
+void stats_set(StatsFamily *family, const char *label, long long value) {
+    if (!family) return;
+    __atomic_store_n(&stats_slot(family, label)->value, value, __ATOMIC_RELAXED);
+}
+
+void stats_observe(StatsFamily *family, const char *label, double value) {
+    StatsSlot *slot;
+    int i = 0;
+    
+    if (!family || family->type != STATS_HISTOGRAM) return;
+    if (value < 0) value = 0;
+    slot = stats_slot(family, label);
+    while (i < family->bounds_count && value > family->bounds[i]) i++;
+    __atomic_add_fetch(&slot->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->sum_micros, (unsigned long long)(value * 1e6 + 0.5), __ATOMIC_RELAXED);
+}
+
+/* {label="value" plus an optional extra pair, or nothing for unlabelled series */
+static void render_labels(JsonWriter *w, const StatsFamily *family, const char *label, const char *le) {
+    const char *p;
+    
+    if (!family->label_name && !le) return;
+    writer_printf(w, "{");
+    if (family->label_name) {
+        writer_printf(w, "%s=\"", family->label_name);
+        for (p = label; *p; p++) {
+            if (*p == '"' || *p == '\\') writer_printf(w, "\\%c", *p);
+            else if (*p == '\n') writer_printf(w, "\\n");
+            else writer_printf(w, "%c", *p);
+        }
+        writer_printf(w, "\"%s", le ? "," : "");
+    }
+    if (le) writer_printf(w, "le=\"%s\"", le);
+    writer_printf(w, "}");
+}
+
+static void render_slot(JsonWriter *w, const StatsFamily *family, const StatsSlot *slot, const char *label) {
+    unsigned long long total = 0;
+    char le[32];
+    int i;
+    
+    if (family->type != STATS_HISTOGRAM) {
+        writer_printf(w, "%s", family->name);
+        render_labels(w, family, label, NULL);
+        writer_printf(w, " %lld\n", __atomic_load_n(&slot->value, __ATOMIC_RELAXED));
+        return;
+    }
+    
+    /* Buckets are read one by one, so count is taken from their total */
+    for (i = 0; i <= family->bounds_count; i++) {
+        total += __atomic_load_n(&slot->buckets[i], __ATOMIC_RELAXED);
+        if (i < family->bounds_count) snprintf(le, sizeof(le), "%g", family->bounds[i]);
+        else snprintf(le, sizeof(le), "+Inf");
+        writer_printf(w, "%s_bucket", family->name);
+        render_labels(w, family, label, le);
+        writer_printf(w, " %llu\n", total);
+    }
+    writer_printf(w, "%s_sum", family->name);
+    render_labels(w, family, label, NULL);
+    writer_printf(w, " %.6f\n", (double)__atomic_load_n(&slot->sum_micros, __ATOMIC_RELAXED) / 1e6);
+    writer_printf(w, "%s_count", family->name);
+    render_labels(w, family, label, NULL);
+    writer_printf(w, " %llu\n", total);
+}
+
+static int slot_used(const StatsFamily *family, const StatsSlot *slot) {
+    int i;
+    
+    if (slot->value != 0) return 1;
+    if (family->type == STATS_HISTOGRAM) {
+        for (i = 0; i <= family->bounds_count; i++) {
+            if (slot->buckets[i]) return 1;
+        }
+    }
+    return 0;
+}
+
+static void render_allocator(JsonWriter *w) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+#else
+    struct mallinfo info = mallinfo();
+#endif
+
+    writer_printf(w, "# HELP qnx_exporter_heap_arena_bytes Bytes the allocator obtained from the system\n");
+    writer_printf(w, "# TYPE qnx_exporter_heap_arena_bytes gauge\n");
+    writer_printf(w, "qnx_exporter_heap_arena_bytes %llu\n",
+                  (unsigned long long)info.arena + (unsigned long long)info.hblkhd);
+    writer_printf(w, "# HELP qnx_exporter_heap_in_use_bytes Bytes in allocated blocks\n");
+    writer_printf(w, "# TYPE qnx_exporter_heap_in_use_bytes gauge\n");
+    writer_printf(w, "qnx_exporter_heap_in_use_bytes %llu\n",
+                  (unsigned long long)info.uordblks + (unsigned long long)info.hblkhd);
+}
+
+char* stats_render(size_t *len) {
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    StatsFamily *family;
+    JsonWriter w;
+    int i;
+    
+    writer_init_memory(&w, 16384);
+    for (family = families; family; family = family->next) {
+        writer_printf(&w, "# HELP %s %s\n", family->name, family->help);
+        writer_printf(&w, "# TYPE %s %s\n", family->name, types[family->type]);
+        if (!family->label_name) {
+            render_slot(&w, family, &family->slots[0], NULL);
+            continue;
+        }
+        for (i = 0; i < family->slots_count; i++) {
+            const char *label = __atomic_load_n(&family->slots[i].label, __ATOMIC_ACQUIRE);
+            if (!label) break;
+            render_slot(&w, family, &family->slots[i], label);
+        }
+        if (slot_used(family, &family->slots[family->slots_count])) {
+            render_slot(&w, family, &family->slots[family->slots_count], "other");
+        }
+    }
+    
+    for (i = 0; i < gauge_funcs_count; i++) {
+        writer_printf(&w, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauge_funcs[i].name,
+                      gauge_funcs[i].help, gauge_funcs[i].name, gauge_funcs[i].name, gauge_funcs[i].read());
+    }
+    render_allocator(&w);
+    return writer_finish(&w, len);
+}
@@ -0,0 +1,48 @@
+#ifndef METRICS_STATS_H
+#define METRICS_STATS_H
+
+#include <stddef.h>
+
+/*
+ * Self-instrumentation.
+ *
+ * Counters, gauges and histograms about the exporter itself, rendered in
+ * Prometheus text format. Families are created at startup, before any
+ * worker thread runs; after that every update is a relaxed atomic add, so
+ * measuring never takes a lock on the hot path.
+ *
+ * A family has at most one label. Each label value gets a slot the first
+ * time it is used, claimed with a compare-and-swap; label values must stay
+ * valid for the life of the process (string literals, table entries).
+ * Values past the last slot are counted under label value "other".
+ */
+
+enum { STATS_COUNTER, STATS_GAUGE, STATS_HISTOGRAM };
+
+#define STATS_MAX_BUCKETS 16
+
+typedef struct StatsFamily StatsFamily;
+
+/* Bucket bounds for latencies in seconds and sizes in bytes */
+extern const double stats_seconds_buckets[];
+extern const int stats_seconds_buckets_count;
+extern const double stats_bytes_buckets[];
+extern const int stats_bytes_buckets_count;
+
+/* label is the label name, or NULL for a single unlabelled series */
+StatsFamily* stats_family(int type, const char *name, const char *help, const char *label, int slots);
+StatsFamily* stats_histogram(const char *name, const char *help, const char *label, int slots,
+                             const double *bounds, int bounds_count);
+
+/* Gauge read when rendered */
+void stats_gauge_func(const char *name, const char *help, long long (*read)(void));
+
+/* All of these accept a NULL family */
+void stats_add(StatsFamily *family, const char *label, long long delta);
+void stats_set(StatsFamily *family, const char *label, long long value);
+void stats_observe(StatsFamily *family, const char *label, double value);
+
+/* Render every family, with allocator gauges; returns a malloc'd body or NULL */
+char* stats_render(size_t *len);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef METRICS_TIME_H
+#define METRICS_TIME_H
+
+/*
+ * Clocks shared by every module.
+ *
+ * Intervals, deadlines and ages use the monotonic clock, which starts at
+ * boot and never jumps; wall_ms() is only for timestamps that leave the
+ * process (samples pushed or stored).
+ */
+
+long long monotonic_ms(void);
+long long monotonic_us(void);
+
+/* Unix time in milliseconds */
+long long wall_ms(void);
+
+#endif
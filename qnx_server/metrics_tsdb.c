@@ -0,0 +1,784 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "metrics_tsdb.h"
+#include "metrics_writer.h"
+#include "metrics_time.h"
+#include "metrics_stats.h"
+
+#define TSDB_CHUNK_BYTES 240
+#define TSDB_KEY_MAX 192
+#define TSDB_MIN_CHUNKS 64
+#define TSDB_MIN_SERIES 16
+#define TSDB_SAMPLE_BITS_MAX 113    /* 36-bit timestamp plus 77-bit value, the worst cases */
+#define TSDB_NO_WINDOW 0xff
+#define TSDB_DEFAULT_RANGE_MS 3600000LL
+#define TSDB_DEFAULT_POINTS 300     /* Points per series when no step is given */
+#define TSDB_MAX_POINTS 11000       /* Same limit as Prometheus */
+
+enum { TSDB_AGG_AVG, TSDB_AGG_MIN, TSDB_AGG_MAX, TSDB_AGG_LAST };
+enum { TSDB_APPENDED, TSDB_OUT_OF_ORDER, TSDB_DROPPED };
+
+typedef struct {
+    int series;                     /* Owning series, -1 when free */
+    int next;                       /* Next newer chunk of the series, -1 at its tail */
+    long long first_ms;
+    long long last_ms;
+    long long last_delta;
+    unsigned long long last_bits;   /* Previous value as IEEE 754 bits */
+    unsigned char leading;          /* XOR window of the previous value, TSDB_NO_WINDOW before one */
+    unsigned char trailing;
+    unsigned short count;
+    unsigned short bits;            /* Bits written to data */
+    unsigned char data[TSDB_CHUNK_BYTES];
+} TsdbChunk;
+
+typedef struct {
+    char key[TSDB_KEY_MAX];         /* name{labels} exactly as exposed, "" when unused */
+    unsigned int hash;
+    int next;                       /* Hash chain, or free list when unused */
+    int head;                       /* Oldest chunk */
+    int tail;                       /* Newest chunk */
+} TsdbSeries;
+
+typedef struct {
+    pthread_mutex_t lock;
+    TsdbChunk *chunks;              /* NULL when history is off */
+    int num_chunks;
+    int cursor;                     /* Next chunk handed out; the oldest once the ring is full */
+    TsdbSeries *series;
+    int num_series;
+    int used_series;
+    int free_series;
+    int *buckets;
+    unsigned int bucket_mask;
+    int interval_ms;
+    CachedBody* (*scrape)(int max_age_ms);
+} Tsdb;
+
+typedef struct {
+    const TsdbChunk *chunk;
+    int index;
+    unsigned int pos;
+    long long t;
+    long long delta;
+    unsigned long long bits;
+    int leading;
+    int trailing;
+} TsdbIter;
+
+typedef struct {
+    char metric[128];
+    long long start_ms;
+    long long end_ms;
+    long long step_ms;
+    int agg;
+} TsdbQuery;
+
+static Tsdb tsdb;
+static StatsFamily *stat_tsdb_samples;
+static StatsFamily *stat_tsdb_reused;
+static StatsFamily *stat_tsdb_series_reclaimed;
+
+static unsigned int key_hash(const char *key, size_t len) {
+    unsigned int hash = 2166136261u;
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Bit packing, most significant bit first */
+static void put_bits(TsdbChunk *c, unsigned long long value, int n) {
+    while (n > 0) {
+        int room = 8 - (c->bits & 7);
+        int take = n < room ? n : room;
+        unsigned int piece = (unsigned int)(value >> (n - take)) & ((1u << take) - 1);
+        
+        c->data[c->bits >> 3] |= (unsigned char)(piece << (room - take));
+        c->bits += take;
+        n -= take;
+    }
+}
+
+static unsigned long long get_bits(const TsdbChunk *c, unsigned int *pos, int n) {
+    unsigned long long value = 0;
+    
+    while (n > 0) {
+        int room = 8 - (*pos & 7);
+        int take = n < room ? n : room;
+        unsigned int byte = c->data[*pos >> 3];
+        
+        value = (value << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+        *pos += take;
+        n -= take;
+    }
+    return value;
+}
+
+/* Append one sample; returns -1 when it belongs in a new chunk */
+static int chunk_append(TsdbChunk *c, long long t, double v) {
+    unsigned long long bits, xor;
+    
+    memcpy(&bits, &v, sizeof(bits));
+    if (c->count == 0) {
+        c->first_ms = t;
+        c->last_ms = t;
+        put_bits(c, bits, 64);
+        c->last_bits = bits;
+        c->count = 1;
+        return 0;
+    }
+    if (c->count == 0xffff || c->bits + TSDB_SAMPLE_BITS_MAX > TSDB_CHUNK_BYTES * 8) return -1;
+    
+    /* Timestamp: the first delta verbatim, then delta-of-delta in 1 to 36 bits */
+    if (c->count == 1) {
+        long long delta = t - c->last_ms;
+        
+        if (delta > 0x7fffffffLL) return -1;
+        put_bits(c, (unsigned long long)delta, 32);
+        c->last_delta = delta;
+    } else {
+        long long delta = t - c->last_ms;
+        long long dod = delta - c->last_delta;
+        
+        if (dod == 0) {
+            put_bits(c, 0, 1);
+        } else if (dod >= -63 && dod <= 64) {
+            put_bits(c, 2, 2);
+            put_bits(c, (unsigned long long)(dod + 63), 7);
+        } else if (dod >= -255 && dod <= 256) {
+            put_bits(c, 6, 3);
+            put_bits(c, (unsigned long long)(dod + 255), 9);
+        } else if (dod >= -2047 && dod <= 2048) {
+            put_bits(c, 14, 4);
+            put_bits(c, (unsigned long long)(dod + 2047), 12);
+        } else if (dod >= -0x7fffffffLL && dod <= 0x7fffffffLL) {
+            put_bits(c, 15, 4);
+            put_bits(c, (unsigned long long)(unsigned int)(int)dod, 32);
+        } else {
+            return -1;
+        }
+        c->last_delta = delta;
+    }
+    c->last_ms = t;
+    
+    /* Value: XOR with the previous one; unchanged values cost one bit */
+    xor = bits ^ c->last_bits;
+    if (xor == 0) {
+        put_bits(c, 0, 1);
+    } else {
+        int leading = __builtin_clzll(xor);
+        int trailing = __builtin_ctzll(xor);
+        
+        if (leading > 31) leading = 31;
+        if (c->leading != TSDB_NO_WINDOW && leading >= c->leading && trailing >= c->trailing) {
+            /* Fits the previous window: reuse it */
+            put_bits(c, 2, 2);
+            put_bits(c, xor >> c->trailing, 64 - c->leading - c->trailing);
+        } else {
+            int significant = 64 - leading - trailing;
+            
+            put_bits(c, 3, 2);
+            put_bits(c, (unsigned long long)leading, 5);
+            put_bits(c, (unsigned long long)(significant & 63), 6);
+            put_bits(c, xor >> trailing, significant);
+            c->leading = (unsigned char)leading;
+            c->trailing = (unsigned char)trailing;
+        }
+    }
+    c->last_bits = bits;
+    c->count++;
+    return 0;
+}
+
+static void iter_init(TsdbIter *it, const TsdbChunk *c) {
+    memset(it, 0, sizeof(*it));
+    it->chunk = c;
+}
+
+static int iter_next(TsdbIter *it, long long *t, double *v) {
+    const TsdbChunk *c = it->chunk;
+    
+    if (it->index >= c->count) return 0;
+    if (it->index == 0) {
+        it->t = c->first_ms;
+        it->bits = get_bits(c, &it->pos, 64);
+    } else {
+        if (it->index == 1) {
+            it->delta = (long long)get_bits(c, &it->pos, 32);
+        } else if (get_bits(c, &it->pos, 1)) {
+            if (!get_bits(c, &it->pos, 1)) {
+                it->delta += (long long)get_bits(c, &it->pos, 7) - 63;
+            } else if (!get_bits(c, &it->pos, 1)) {
+                it->delta += (long long)get_bits(c, &it->pos, 9) - 255;
+            } else if (!get_bits(c, &it->pos, 1)) {
+                it->delta += (long long)get_bits(c, &it->pos, 12) - 2047;
+            } else {
+                it->delta += (int)(unsigned int)get_bits(c, &it->pos, 32);
+            }
+        }
+        it->t += it->delta;
+        
+        if (get_bits(c, &it->pos, 1)) {
+            int significant;
+            
+            if (get_bits(c, &it->pos, 1)) {
+                it->leading = (int)get_bits(c, &it->pos, 5);
+                significant = (int)get_bits(c, &it->pos, 6);
+                if (significant == 0) significant = 64;
+                it->trailing = 64 - it->leading - significant;
+            } else {
+                significant = 64 - it->leading - it->trailing;
+            }
+            it->bits ^= get_bits(c, &it->pos, significant) << it->trailing;
+        }
+    }
+    it->index++;
+    *t = it->t;
+    memcpy(v, &it->bits, sizeof(*v));
+    return 1;
+}
+
+/* Series table; all of these are called with the lock held */
+static int series_find(const char *key, size_t len, unsigned int hash) {
+    int i;
+    
+    for (i = tsdb.buckets[hash & tsdb.bucket_mask]; i >= 0; i = tsdb.series[i].next) {
+        TsdbSeries *s = &tsdb.series[i];
+        if (s->hash == hash && strncmp(s->key, key, len) == 0 && s->key[len] == '\0') return i;
+    }
+    return -1;
+}
+
+static int series_create(const char *key, size_t len, unsigned int hash) {
+    int i = tsdb.free_series;
+    TsdbSeries *s;
+    
+    if (i < 0) return -1;
+    s = &tsdb.series[i];
+    tsdb.free_series = s->next;
+    memcpy(s->key, key, len);
+    s->key[len] = '\0';
+    s->hash = hash;
+    s->head = -1;
+    s->tail = -1;
+    s->next = tsdb.buckets[hash & tsdb.bucket_mask];
+    tsdb.buckets[hash & tsdb.bucket_mask] = i;
+    tsdb.used_series++;
+    return i;
+}
+
+static void series_free(int i) {
+    TsdbSeries *s = &tsdb.series[i];
+    int *link = &tsdb.buckets[s->hash & tsdb.bucket_mask];
+    
+    while (*link != i) link = &tsdb.series[*link].next;
+    *link = s->next;
+    s->key[0] = '\0';
+    s->next = tsdb.free_series;
+    tsdb.free_series = i;
+    tsdb.used_series--;
+}
+
+/* Release a series and all of its chunks, for a slot in a full table */
+static void series_reclaim(int i) {
+    int c;
+    
+    for (c = tsdb.series[i].head; c >= 0; c = tsdb.chunks[c].next) tsdb.chunks[c].series = -1;
+    tsdb.series[i].head = -1;
+    tsdb.series[i].tail = -1;
+    series_free(i);
+}
+
+/* The series that has gone longest without a sample, if it missed the scrape at t */
+static int series_stalest(long long t) {
+    long long oldest = t;
+    int stalest = -1;
+    int i;
+    
+    for (i = 0; i < tsdb.num_series; i++) {
+        TsdbSeries *s = &tsdb.series[i];
+        if (s->tail >= 0 && tsdb.chunks[s->tail].last_ms < oldest) {
+            oldest = tsdb.chunks[s->tail].last_ms;
+            stalest = i;
+        }
+    }
+    return stalest;
+}
+
+/* Hand out the next chunk of the ring to owner, reusing the oldest one when full */
+static int chunk_take(int owner) {
+    int i = tsdb.cursor;
+    TsdbChunk *c = &tsdb.chunks[i];
+    
+    tsdb.cursor = (tsdb.cursor + 1) % tsdb.num_chunks;
+    if (c->series >= 0) {
+        /* Chunks are handed out in time order, so this is its series' oldest */
+        TsdbSeries *s = &tsdb.series[c->series];
+        
+        s->head = c->next;
+        if (s->head < 0) {
+            s->tail = -1;
+            if (c->series != owner) series_free(c->series);
+        }
+        stats_add(stat_tsdb_reused, NULL, 1);
+    }
+    
+    memset(c, 0, sizeof(*c));
+    c->series = owner;
+    c->next = -1;
+    c->leading = TSDB_NO_WINDOW;
+    return i;
+}
+
+static int tsdb_append(const char *key, size_t len, long long t, double v) {
+    unsigned int hash = key_hash(key, len);
+    int i = series_find(key, len, hash);
+    TsdbSeries *s;
+    int chunk;
+    
+    if (i < 0) {
+        /* Table full: a series gone from the exposition (an exited process) makes room */
+        if (tsdb.free_series < 0) {
+            int stale = series_stalest(t);
+            if (stale < 0) return TSDB_DROPPED;
+            series_reclaim(stale);
+            stats_add(stat_tsdb_series_reclaimed, NULL, 1);
+        }
+        i = series_create(key, len, hash);
+        if (i < 0) return TSDB_DROPPED;
+    }
+    s = &tsdb.series[i];
+    if (s->tail >= 0) {
+        TsdbChunk *c = &tsdb.chunks[s->tail];
+        
+        if (t <= c->last_ms) return TSDB_OUT_OF_ORDER;
+        if (chunk_append(c, t, v) == 0) return TSDB_APPENDED;
+    }
+    
+    chunk = chunk_take(i);
+    if (s->tail >= 0) tsdb.chunks[s->tail].next = chunk;
+    else s->head = chunk;
+    s->tail = chunk;
+    chunk_append(&tsdb.chunks[chunk], t, v);
+    return TSDB_APPENDED;
+}
+
+/* Append every sample line of a Prometheus text body, all stamped t */
+static void tsdb_ingest(const char *text, size_t len, long long t) {
+    const char *line = text, *end = text + len;
+    long counts[3] = {0, 0, 0};
+    
+    pthread_mutex_lock(&tsdb.lock);
+    while (line < end) {
+        const char *eol = memchr(line, '\n', (size_t)(end - line));
+        const char *p = line;
+        char *value_end;
+        double value;
+        
+        if (!eol) eol = end;
+        if (*line == '#' || line == eol) {
+            line = eol + 1;
+            continue;
+        }
+        
+        /* The series key runs to the end of the name or the closing brace */
+        while (p < eol && *p != '{' && *p != ' ') p++;
+        if (p < eol && *p == '{') {
+            int quoted = 0;
+            
+            for (p++; p < eol; p++) {
+                if (quoted) {
+                    if (*p == '\\') p++;
+                    else if (*p == '"') quoted = 0;
+                } else if (*p == '"') {
+                    quoted = 1;
+                } else if (*p == '}') {
+                    break;
+                }
+            }
+            if (p >= eol) {
+                line = eol + 1;
+                continue;
+            }
+            p++;
+        }
+        
+        if (p - line >= TSDB_KEY_MAX) {
+            counts[TSDB_DROPPED]++;
+        } else {
+            const char *q = p;
+            
+            while (q < eol && *q == ' ') q++;
+            value = strtod(q, &value_end);
+            if (value_end != q && value_end <= eol) counts[tsdb_append(line, (size_t)(p - line), t, value)]++;
+        }
+        line = eol + 1;
+    }
+    pthread_mutex_unlock(&tsdb.lock);
+    
+    stats_add(stat_tsdb_samples, "appended", counts[TSDB_APPENDED]);
+    stats_add(stat_tsdb_samples, "out_of_order", counts[TSDB_OUT_OF_ORDER]);
+    stats_add(stat_tsdb_samples, "dropped", counts[TSDB_DROPPED]);
+}
+
+static void* tsdb_sampler_thread(void *arg) {
+    unsigned long last_generation = 0;
+    
+    (void)arg;
+    for (;;) {
+        unsigned long long started = monotonic_ms();
+        CachedBody *body = tsdb.scrape(tsdb.interval_ms / 2);
+        long long elapsed;
+        
+        /*
+         * Stamp with the tick nearest to when the body was built, so a steady
+         * interval encodes as zero delta-of-delta; a body already ingested is
+         * skipped rather than stored twice.
+         */
+        if (body && body->generation != last_generation) {
+            long long tick = (body->built_wall_ms + tsdb.interval_ms / 2) / tsdb.interval_ms * tsdb.interval_ms;
+            tsdb_ingest(body->data, body->len, tick);
+            last_generation = body->generation;
+        }
+        body_release(body);
+        
+        elapsed = (long long)(monotonic_ms() - started);
+        if (elapsed < tsdb.interval_ms) {
+            struct timespec delay;
+            long long wait = tsdb.interval_ms - elapsed;
+            
+            delay.tv_sec = (time_t)(wait / 1000);
+            delay.tv_nsec = (long)(wait % 1000) * 1000000L;
+            nanosleep(&delay, NULL);
+        }
+    }
+    return NULL;
+}
+
+static long long tsdb_series_count(void) {
+    long long count;
+    
+    pthread_mutex_lock(&tsdb.lock);
+    count = tsdb.used_series;
+    pthread_mutex_unlock(&tsdb.lock);
+    return count;
+}
+
+/* How far back the oldest kept sample goes */
+static long long tsdb_retention_seconds(void) {
+    long long oldest = 0;
+    int i;
+    
+    pthread_mutex_lock(&tsdb.lock);
+    for (i = 0; i < tsdb.num_chunks; i++) {
+        if (tsdb.chunks[i].series >= 0 && (oldest == 0 || tsdb.chunks[i].first_ms < oldest)) {
+            oldest = tsdb.chunks[i].first_ms;
+        }
+    }
+    pthread_mutex_unlock(&tsdb.lock);
+    return oldest ? (wall_ms() - oldest) / 1000 : 0;
+}
+
+int tsdb_start(size_t memory_bytes, int interval_ms, CachedBody* (*scrape)(int max_age_ms)) {
+    StatsFamily *stat_memory;
+    pthread_t thread;
+    size_t series_bytes;
+    int buckets = 1;
+    int i;
+    
+    if (pthread_mutex_init(&tsdb.lock, NULL) != 0) return -1;
+    
+    /* An eighth of the budget for the series table and its hash, the rest for chunks */
+    tsdb.num_series = (int)(memory_bytes / 8 / (sizeof(TsdbSeries) + 2 * sizeof(int)));
+    if (tsdb.num_series < TSDB_MIN_SERIES) tsdb.num_series = TSDB_MIN_SERIES;
+    while (buckets < tsdb.num_series) buckets <<= 1;
+    series_bytes = (size_t)tsdb.num_series * sizeof(TsdbSeries) + (size_t)buckets * sizeof(int);
+    tsdb.num_chunks = memory_bytes > series_bytes ? (int)((memory_bytes - series_bytes) / sizeof(TsdbChunk)) : 0;
+    if (tsdb.num_chunks < TSDB_MIN_CHUNKS) tsdb.num_chunks = TSDB_MIN_CHUNKS;
+    
+    tsdb.series = malloc((size_t)tsdb.num_series * sizeof(TsdbSeries));
+    tsdb.buckets = malloc((size_t)buckets * sizeof(int));
+    tsdb.chunks = malloc((size_t)tsdb.num_chunks * sizeof(TsdbChunk));
+    if (!tsdb.series || !tsdb.buckets || !tsdb.chunks) {
+        free(tsdb.series);
+        free(tsdb.buckets);
+        free(tsdb.chunks);
+        tsdb.chunks = NULL;
+        return -1;
+    }
+    tsdb.bucket_mask = (unsigned int)buckets - 1;
+    for (i = 0; i < buckets; i++) tsdb.buckets[i] = -1;
+    for (i = 0; i < tsdb.num_series; i++) {
+        tsdb.series[i].key[0] = '\0';
+        tsdb.series[i].next = i + 1 < tsdb.num_series ? i + 1 : -1;
+    }
+    tsdb.free_series = 0;
+    for (i = 0; i < tsdb.num_chunks; i++) tsdb.chunks[i].series = -1;
+    tsdb.interval_ms = interval_ms;
+    tsdb.scrape = scrape;
+    
+    stat_tsdb_samples = stats_family(STATS_COUNTER, "qnx_exporter_tsdb_samples_total",
+        "History samples appended, or skipped as out of order or for a full series table", "result", 3);
+    stat_tsdb_reused = stats_family(STATS_COUNTER, "qnx_exporter_tsdb_chunks_reused_total",
+        "History chunks overwritten once the ring was full", NULL, 0);
+    stat_tsdb_series_reclaimed = stats_family(STATS_COUNTER, "qnx_exporter_tsdb_series_reclaimed_total",
+        "Stale series dropped to make room in a full series table", NULL, 0);
+    stat_memory = stats_family(STATS_GAUGE, "qnx_exporter_tsdb_memory_bytes",
+        "Memory allocated for history", NULL, 0);
+    stats_set(stat_memory, NULL, (long long)(series_bytes + (size_t)tsdb.num_chunks * sizeof(TsdbChunk)));
+    stats_gauge_func("qnx_exporter_tsdb_series", "Series with history", tsdb_series_count);
+    stats_gauge_func("qnx_exporter_tsdb_retention_seconds", "Age of the oldest sample kept", tsdb_retention_seconds);
+    
+    if (pthread_create(&thread, NULL, tsdb_sampler_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+static void url_decode(char *out, size_t size, const char *in, size_t len) {
+    size_t i, j = 0;
+    
+    for (i = 0; i < len && j < size - 1; i++) {
+        if (in[i] == '%' && i + 2 < len) {
+            char hex[3] = {in[i + 1], in[i + 2], '\0'};
+            out[j++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            out[j++] = in[i] == '+' ? ' ' : in[i];
+        }
+    }
+    out[j] = '\0';
+}
+
+/* Seconds, possibly fractional, into ms; -1 unless the whole value is a sane number */
+static int parse_seconds(const char *value, long long *ms) {
+    char *end;
+    double seconds = strtod(value, &end);
+    
+    /* The range check also turns away nan and inf, and keeps the ms in range */
+    if (end == value || *end != '\0' || !(seconds >= -1e12 && seconds <= 1e12)) return -1;
+    *ms = (long long)(seconds * 1000.0);
+    return 0;
+}
+
+/* Negative means relative to now */
+static int parse_time(const char *value, long long now, long long *ms) {
+    if (parse_seconds(value, ms) != 0) return -1;
+    if (*ms < 0) *ms += now;
+    return 0;
+}
+
+/* Returns NULL, or the error message for a 400 */
+static const char* query_parse(TsdbQuery *query, const char *params) {
+    const char *p = params;
+    long long now = wall_ms();
+    char start[32] = "", end[32] = "", step[32] = "";
+    
+    memset(query, 0, sizeof(*query));
+    query->agg = TSDB_AGG_AVG;
+    while (p && *p && *p != ' ' && *p != '#' && *p != '\r' && *p != '\n') {
+        size_t key_len = strcspn(p, "=& #\r\n");
+        char key[16], value[128];
+        
+        url_decode(key, sizeof(key), p, key_len);
+        p += key_len;
+        value[0] = '\0';
+        if (*p == '=') {
+            size_t value_len = strcspn(++p, "& #\r\n");
+            url_decode(value, sizeof(value), p, value_len);
+            p += value_len;
+        }
+        if (*p == '&') p++;
+        
+        if (strcmp(key, "metric") == 0) {
+            snprintf(query->metric, sizeof(query->metric), "%s", value);
+        } else if (strcmp(key, "start") == 0) {
+            snprintf(start, sizeof(start), "%s", value);
+        } else if (strcmp(key, "end") == 0) {
+            snprintf(end, sizeof(end), "%s", value);
+        } else if (strcmp(key, "step") == 0) {
+            snprintf(step, sizeof(step), "%s", value);
+        } else if (strcmp(key, "agg") == 0) {
+            if (strcmp(value, "avg") == 0) query->agg = TSDB_AGG_AVG;
+            else if (strcmp(value, "min") == 0) query->agg = TSDB_AGG_MIN;
+            else if (strcmp(value, "max") == 0) query->agg = TSDB_AGG_MAX;
+            else if (strcmp(value, "last") == 0) query->agg = TSDB_AGG_LAST;
+            else return "agg must be avg, min, max or last";
+        }
+    }
+    
+    if (query->metric[0] == '\0') return "metric is required";
+    query->end_ms = now;
+    if (end[0] && parse_time(end, now, &query->end_ms) != 0) return "start/end must be a number of seconds";
+    query->start_ms = query->end_ms - TSDB_DEFAULT_RANGE_MS;
+    if (start[0] && parse_time(start, now, &query->start_ms) != 0) {
+        return "start/end must be a number of seconds";
+    }
+    if (query->start_ms > query->end_ms) return "start is after end";
+    if (step[0]) {
+        if (parse_seconds(step, &query->step_ms) != 0) return "step must be a number of seconds";
+        if (query->step_ms <= 0) return "step must be positive";
+    } else {
+        query->step_ms = (query->end_ms - query->start_ms) / TSDB_DEFAULT_POINTS;
+        if (query->step_ms < tsdb.interval_ms) query->step_ms = tsdb.interval_ms;
+    }
+    if ((query->end_ms - query->start_ms) / query->step_ms + 1 > TSDB_MAX_POINTS) {
+        return "too many points per series; raise step";
+    }
+    return NULL;
+}
+
+/* The series' labels as a JSON object; exposition escapes are valid JSON escapes */
+static void out_labels(JsonWriter *out, const char *key) {
+    const char *p = key;
+    
+    while (*p && *p != '{') p++;
+    writer_printf(out, "{\"__name__\":\"%.*s\"", (int)(p - key), key);
+    if (*p == '{') p++;
+    while (*p && *p != '}') {
+        const char *name = p;
+        
+        while (*p && *p != '=') p++;
+        if (p[0] != '=' || p[1] != '"') break;
+        writer_printf(out, ",\"%.*s\":\"", (int)(p - name), name);
+        for (p += 2; *p && *p != '"'; p++) {
+            if (*p == '\\' && p[1]) {
+                writer_printf(out, "%c%c", p[0], p[1]);
+                p++;
+            } else if ((unsigned char)*p < 0x20) {
+                writer_printf(out, "\\u%04x", (unsigned char)*p);
+            } else {
+                writer_printf(out, "%c", *p);
+            }
+        }
+        writer_printf(out, "\"");
+        if (*p == '"') p++;
+        if (*p == ',') p++;
+    }
+    writer_printf(out, "}");
+}
+
+static void out_point(JsonWriter *out, int first, long long t, double v) {
+    writer_printf(out, "%s[%lld.%03lld,", first ? "" : ",", t / 1000, t % 1000);
+    if (v != v) writer_printf(out, "\"NaN\"]");
+    else if (v > 1.7976931348623157e308) writer_printf(out, "\"+Inf\"]");
+    else if (v < -1.7976931348623157e308) writer_printf(out, "\"-Inf\"]");
+    else writer_printf(out, "\"%.15g\"]", v);
+}
+
+/*
+ * Downsample one series straight from the ring, under tsdb.lock: the
+ * point at start + k*step aggregates the samples in (t - step, t].
+ * Returns the number of points written.
+ */
+static int out_series(JsonWriter *out, const TsdbQuery *query, const TsdbSeries *series) {
+    long long point = -1, t;
+    double acc = 0, v;
+    int n = 0, points = 0;
+    int c;
+    
+    for (c = series->head; c >= 0; c = tsdb.chunks[c].next) {
+        const TsdbChunk *chunk = &tsdb.chunks[c];
+        TsdbIter it;
+        
+        if (chunk->last_ms <= query->start_ms - query->step_ms || chunk->first_ms > query->end_ms) continue;
+        iter_init(&it, chunk);
+        while (iter_next(&it, &t, &v)) {
+            long long k;
+            
+            if (t <= query->start_ms - query->step_ms || t > query->end_ms) continue;
+            k = (t - query->start_ms + query->step_ms - 1) / query->step_ms;
+            if (k != point && n > 0) {
+                out_point(out, points++ == 0, query->start_ms + point * query->step_ms,
+                          query->agg == TSDB_AGG_AVG ? acc / n : acc);
+                n = 0;
+            }
+            point = k;
+            if (n == 0 || query->agg == TSDB_AGG_LAST) acc = v;
+            else if (query->agg == TSDB_AGG_AVG) acc += v;
+            else if (query->agg == TSDB_AGG_MIN && v < acc) acc = v;
+            else if (query->agg == TSDB_AGG_MAX && v > acc) acc = v;
+            n++;
+        }
+    }
+    if (n > 0) {
+        out_point(out, points++ == 0, query->start_ms + point * query->step_ms,
+                  query->agg == TSDB_AGG_AVG ? acc / n : acc);
+    }
+    return points;
+}
+
+static char* error_json(const char *type, const char *message, size_t *len) {
+    char *body = malloc(256);
+    
+    if (body) {
+        *len = (size_t)snprintf(body, 256, "{\"status\":\"error\",\"errorType\":\"%s\",\"error\":\"%s\"}",
+                                type, message);
+    }
+    return body;
+}
+
+char* tsdb_query_json(const char *params, int *status, size_t *len) {
+    TsdbQuery query;
+    JsonWriter out;
+    int results = 0;
+    size_t metric_len;
+    const char *error;
+    char *body;
+    int i;
+    
+    if (!tsdb.chunks) {
+        *status = 503;
+        return error_json("unavailable", "history is disabled", len);
+    }
+    error = query_parse(&query, params);
+    if (error) {
+        *status = 400;
+        return error_json("bad_data", error, len);
+    }
+    metric_len = strlen(query.metric);
+    
+    writer_init_memory(&out, 4096);
+    writer_printf(&out, "{\"status\":\"success\",\"data\":{\"resultType\":\"matrix\",\"result\":[");
+    
+    /*
+     * Decode each series from the ring into the response, taking the lock
+     * per series: no copy of the chunks, so a query costs only its output,
+     * and the sampler waits at most for one series.
+     */
+    for (i = 0; i < tsdb.num_series && !out.failed; i++) {
+        TsdbSeries *s = &tsdb.series[i];
+        size_t mark = out.len;
+        
+        pthread_mutex_lock(&tsdb.lock);
+        if (s->head < 0 || strncmp(s->key, query.metric, metric_len) != 0 ||
+            (s->key[metric_len] != '{' && s->key[metric_len] != '\0')) {
+            pthread_mutex_unlock(&tsdb.lock);
+            continue;
+        }
+        writer_printf(&out, "%s{\"metric\":", results ? "," : "");
+        out_labels(&out, s->key);
+        writer_printf(&out, ",\"values\":[");
+        if (out_series(&out, &query, s) == 0) {
+            /* Nothing in range: leave the series out, as Prometheus does */
+            out.len = mark;
+        } else {
+            writer_printf(&out, "]}");
+            results++;
+        }
+        pthread_mutex_unlock(&tsdb.lock);
+    }
+    writer_printf(&out, "]}}");
+    
+    body = writer_finish(&out, len);
+    if (body) *status = 200;
+    return body;
+}
@@ -0,0 +1,42 @@
+#ifndef METRICS_TSDB_H
+#define METRICS_TSDB_H
+
+#include <stddef.h>
+
+#include "metrics_cache.h"
+
+/*
+ * On-device history.
+ *
+ * A sampler thread takes the Prometheus text body every interval and
+ * appends each sample to its series, Gorilla style: timestamps as
+ * delta-of-deltas, values XORed with the previous one, bit-packed into
+ * fixed-size chunks. Samples are stamped with the tick they belong to, so
+ * a steady interval costs one bit per timestamp.
+ *
+ * All memory is allocated once at start: a series table and a pool of
+ * chunks sized from the configured budget. The pool is one ring shared by
+ * every series; when it is full the oldest chunk is reused, so the most
+ * recent history of all series is kept and memory never grows. A series
+ * whose last chunk is reused disappears. When the series table is full, a
+ * new series takes the slot of the one that has gone longest without a
+ * sample (an exited process), or is dropped if every series is current.
+ *
+ * tsdb_query_json() answers /api/range in the shape of Prometheus'
+ * query_range, downsampled to one point per step on the server.
+ */
+
+#define TSDB_DEFAULT_MEMORY (1024 * 1024)
+#define TSDB_DEFAULT_INTERVAL_MS 10000
+
+/* Allocate memory_bytes of history and sample every interval_ms until exit */
+int tsdb_start(size_t memory_bytes, int interval_ms, CachedBody* (*scrape)(int max_age_ms));
+
+/*
+ * metric= (required), start=, end= (Unix seconds, negative = relative to
+ * now), step= (seconds), agg=avg|min|max|last. Returns a malloc'd JSON
+ * body with *status set to the HTTP status, or NULL when out of memory.
+ */
+char* tsdb_query_json(const char *params, int *status, size_t *len);
+
+#endif
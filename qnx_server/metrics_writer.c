@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "metrics_writer.h"
+
+#define WRITER_MIN_SIZE 4096
+
+static int force_scalar = 0;
+
+/* Two-character escapes for control characters, 0 where \u00XX is needed */
+static const char short_escapes[32] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 'b', 't', 'n', 0, 'f', 'r', 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+void writer_init_memory(JsonWriter *w, size_t initial) {
+    memset(w, 0, sizeof(*w));
+    w->cap = initial > 0 ? initial : WRITER_MIN_SIZE;
+    w->buf = malloc(w->cap);
+    if (!w->buf) w->failed = 1;
+}
+
+void writer_init_sink(JsonWriter *w, char *buf, size_t size, WriterSink sink, void *ctx) {
+    memset(w, 0, sizeof(*w));
+    w->buf = buf;
+    w->cap = size;
+    w->sink = sink;
+    w->ctx = ctx;
+}
+
+int writer_flush(JsonWriter *w) {
+    if (w->failed) return -1;
+    if (!w->sink || w->len == 0) return 0;
+    if (w->sink(w->ctx, w->buf, w->len) != 0) {
+        w->failed = 1;
+        return -1;
+    }
+    w->flushed += w->len;
+    w->len = 0;
+    return 0;
+}
+
+/* Make room for n bytes; a sink writer may offer less, down to its whole buffer */
+static size_t writer_reserve(JsonWriter *w, size_t n) {
+    size_t cap;
+    char *buf;
+    
+    if (w->failed) return 0;
+    if (w->cap - w->len >= n) return w->cap - w->len;
+    if (w->sink) return writer_flush(w) == 0 ? w->cap - w->len : 0;
+    
+    cap = w->cap * 2 > w->len + n + 1 ? w->cap * 2 : w->len + n + 1;
+    buf = realloc(w->buf, cap);
+    if (!buf) {
+        w->failed = 1;
+        return 0;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return w->cap - w->len;
+}
+
+void writer_write(JsonWriter *w, const char *data, size_t len) {
+    while (len > 0) {
+        size_t room = writer_reserve(w, len);
+        size_t n = len < room ? len : room;
+        
+        if (room == 0) return;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void writer_printf(JsonWriter *w, const char *format, ...) {
+    va_list args;
+    size_t room;
+    int n;
+    
+    if (w->failed) return;
+    room = w->cap - w->len;
+    va_start(args, format);
+    n = vsnprintf(w->buf + w->len, room, format, args);
+    va_end(args);
+    if (n < 0) {
+        w->failed = 1;
+        return;
+    }
+    if ((size_t)n < room) {
+        w->len += (size_t)n;
+        return;
+    }
+    
+    /* Did not fit: make room and format again */
+    room = writer_reserve(w, (size_t)n + 1);
+    if (room > (size_t)n) {
+        va_start(args, format);
+        vsnprintf(w->buf + w->len, room, format, args);
+        va_end(args);
+        w->len += (size_t)n;
+    } else if (!w->failed) {
+        /* Larger than a sink writer's whole buffer */
+        char *tmp = malloc((size_t)n + 1);
+        
+        if (!tmp) {
+            w->failed = 1;
+            return;
+        }
+        va_start(args, format);
+        vsnprintf(tmp, (size_t)n + 1, format, args);
+        va_end(args);
+        writer_write(w, tmp, (size_t)n);
+        free(tmp);
+    }
+}
+
+size_t json_escape_span_scalar(const char *text, size_t len) {
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x20 || c == '"' || c == '\\') break;
+    }
+    return i;
+}
+
+size_t json_escape_span(const char *text, size_t len) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(text + i));
+        /* max(v, 0x1f) == 0x1f is an unsigned v <= 0x1f */
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                   _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+        int mask = _mm_movemask_epi8(hit);
+        
+        if (mask) return i + (size_t)__builtin_ctz((unsigned int)mask);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)text + i);
+        uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)), vcltq_u8(v, space));
+        /* Narrow to 4 bits per byte so the block fits one 64-bit mask */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        
+        if (mask) return i + (size_t)(__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    return i + json_escape_span_scalar(text + i, len - i);
+}
+
+void writer_force_scalar(int on) {
+    force_scalar = on;
+}
+
+void writer_escaped(JsonWriter *w, const char *text, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    
+    while (len > 0) {
+        size_t run = force_scalar ? json_escape_span_scalar(text, len) : json_escape_span(text, len);
+        unsigned char c;
+        char escape[6] = {'\\', 'u', '0', '0', 0, 0};
+        
+        if (run > 0) {
+            writer_write(w, text, run);
+            text += run;
+            len -= run;
+            if (len == 0) break;
+        }
+        
+        c = (unsigned char)*text++;
+        len--;
+        if (c == '"' || c == '\\') {
+            escape[1] = (char)c;
+            writer_write(w, escape, 2);
+        } else if (short_escapes[c]) {
+            escape[1] = short_escapes[c];
+            writer_write(w, escape, 2);
+        } else {
+            escape[4] = hex[c >> 4];
+            escape[5] = hex[c & 15];
+            writer_write(w, escape, 6);
+        }
+    }
+}
+
+void writer_string(JsonWriter *w, const char *text) {
+    writer_write(w, "\"", 1);
+    if (text) writer_escaped(w, text, strlen(text));
+    writer_write(w, "\"", 1);
+}
+
+void writer_reset(JsonWriter *w) {
+    w->len = 0;
+    w->failed = w->buf == NULL;
+}
+
+char* writer_finish(JsonWriter *w, size_t *len) {
+    if (!w->sink && !w->failed && writer_reserve(w, 1) > 0) {
+        w->buf[w->len] = '\0';
+        *len = w->len;
+        return w->buf;
+    }
+    if (!w->sink) free(w->buf);
+    w->buf = NULL;
+    return NULL;
+}
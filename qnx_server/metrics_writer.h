@@ -0,0 +1,68 @@
+#ifndef METRICS_WRITER_H
+#define METRICS_WRITER_H
+
+#include <stddef.h>
+
+/*
+ * Streaming JSON writer.
+ *
+ * Output is formatted and escaped straight into the writer's buffer. A
+ * writer either grows that buffer (the whole document is the result) or
+ * owns a small fixed one and hands it to a sink each time it fills, so a
+ * document of any size goes to a socket through a few KB of memory.
+ *
+ * A memory writer is also the growable output buffer for the other
+ * encoders (Prometheus text, range query JSON, remote-write protobuf),
+ * which only use the unescaped writes.
+ *
+ * Escaping scans 16 bytes at a time for the characters JSON needs escaped
+ * (quote, backslash, control characters) with SSE2 or NEON where the
+ * compiler targets them, a byte at a time otherwise, and copies the runs
+ * in between with memcpy.
+ */
+
+/* Receives each full buffer; non-zero fails the writer */
+typedef int (*WriterSink)(void *ctx, const char *data, size_t len);
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    WriterSink sink;        /* NULL: buf grows instead */
+    void *ctx;
+    size_t flushed;         /* Bytes handed to the sink so far */
+    int failed;             /* Out of memory or the sink failed; later writes are dropped */
+} JsonWriter;
+
+/* Growing writer; take the result with writer_finish() */
+void writer_init_memory(JsonWriter *w, size_t initial);
+
+/* Writer over a caller-owned buffer that is flushed to sink when full */
+void writer_init_sink(JsonWriter *w, char *buf, size_t size, WriterSink sink, void *ctx);
+
+void writer_write(JsonWriter *w, const char *data, size_t len);
+void writer_printf(JsonWriter *w, const char *format, ...);
+
+/* len bytes of text, escaped, without the quotes */
+void writer_escaped(JsonWriter *w, const char *text, size_t len);
+
+/* A quoted, escaped string */
+void writer_string(JsonWriter *w, const char *text);
+
+/* Hand any buffered output to the sink; returns 0, or -1 if the writer failed */
+int writer_flush(JsonWriter *w);
+
+/* Memory writer: the NUL-terminated document (caller frees) or NULL if it failed */
+char* writer_finish(JsonWriter *w, size_t *len);
+
+/* Memory writer: start a new document in the same buffer, clearing a failure */
+void writer_reset(JsonWriter *w);
+
+/* Bytes at the start of text that need no escaping */
+size_t json_escape_span(const char *text, size_t len);
+size_t json_escape_span_scalar(const char *text, size_t len);
+
+/* Make writers use the scalar scan, for benchmarks */
+void writer_force_scalar(int on);
+
+#endif